@@ -0,0 +1,202 @@
+#include "avr_batch.h"
+
+#include "esp_timer.h"
+#include "metrics.h"
+
+static const char *TAG_AVR_BATCH = "avr_batch";
+
+static portMUX_TYPE batchLock = portMUX_INITIALIZER_UNLOCKED;
+static batch_status_t batchStatus = {.state = BATCH_IDLE};
+static volatile int batchStopRequested = 0;
+
+// Only one run at a time, so the image can live here rather than on the stack
+static cached_image_t batchImage;
+
+static void batchSetState(batch_state_t state)
+{
+    portENTER_CRITICAL(&batchLock);
+    batchStatus.state = state;
+    portEXIT_CRITICAL(&batchLock);
+}
+
+static void batchRecord(esp_err_t ret, uint32_t ms)
+{
+    portENTER_CRITICAL(&batchLock);
+    if (ret == ESP_OK)
+    {
+        batchStatus.passed++;
+        batchStatus.last_ms = ms;
+        batchStatus.min_ms = batchStatus.passed == 1 ? ms : MIN(batchStatus.min_ms, ms);
+        batchStatus.max_ms = MAX(batchStatus.max_ms, ms);
+        batchStatus.total_ms += ms;
+    }
+    else
+    {
+        batchStatus.failed++;
+    }
+    portEXIT_CRITICAL(&batchLock);
+}
+
+// Probe until the client's presence is as wanted, returns 0 if stopped meanwhile
+static int batchWaitFor(const avr_protocol_t *protocol, int present)
+{
+    while (!batchStopRequested)
+    {
+        if (probeTarget(protocol) == present)
+        {
+            return 1;
+        }
+        vTaskDelay(BATCH_PROBE_INTERVAL_MS / portTICK_PERIOD_MS);
+    }
+    return 0;
+}
+
+static esp_err_t batchFlashBoard(const avr_protocol_t *protocol)
+{
+    esp_err_t ret = writeImage(protocol, &batchImage.source);
+    if (ret == ESP_OK)
+    {
+        ret = verifyImage(protocol, &batchImage.source);
+    }
+    endSession(protocol);
+    return ret;
+}
+
+static void batchTask(void *parameter)
+{
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    int board = 0;
+
+    while (batchStatus.passed < batchStatus.target)
+    {
+        batchSetState(BATCH_WAITING);
+        if (!batchWaitFor(protocol, 1))
+        {
+            break;
+        }
+
+        batchSetState(BATCH_FLASHING);
+        board++;
+        const int64_t start = esp_timer_get_time();
+        const esp_err_t ret = batchFlashBoard(protocol);
+        const uint32_t ms = (esp_timer_get_time() - start) / 1000;
+        batchRecord(ret, ms);
+
+        if (ret == ESP_OK)
+        {
+            logI(TAG_AVR_BATCH, "Board %d passed in %u ms (%d/%d)", board, ms, batchStatus.passed, batchStatus.target);
+        }
+        else
+        {
+            logE(TAG_AVR_BATCH, "Board %d failed: %d", board, ret);
+        }
+
+        if (batchStatus.passed == batchStatus.target)
+        {
+            break;
+        }
+
+        // Don't flash the same board again
+        batchSetState(BATCH_REMOVING);
+        if (!batchWaitFor(protocol, 0))
+        {
+            break;
+        }
+    }
+
+    imageCacheClose(&batchImage);
+
+    portENTER_CRITICAL(&batchLock);
+    batchStatus.state = BATCH_IDLE;
+    batchStatus.ended_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&batchLock);
+
+    logI(TAG_AVR_BATCH, "Batch finished: %d passed, %d failed, %u boards/hour",
+         batchStatus.passed, batchStatus.failed, batchBoardsPerHour(&batchStatus));
+    metricsTaskExit();
+    vTaskDelete(NULL);
+}
+
+esp_err_t batchStart(const char *filepath, int target)
+{
+    esp_err_t ret;
+
+    portENTER_CRITICAL(&batchLock);
+    if (batchStatus.state != BATCH_IDLE)
+    {
+        portEXIT_CRITICAL(&batchLock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Claim the run while the image is decoded
+    batchStatus.state = BATCH_WAITING;
+    portEXIT_CRITICAL(&batchLock);
+
+    ret = imageCacheOpen(&batchImage, filepath);
+    if (ret != ESP_OK)
+    {
+        batchSetState(BATCH_IDLE);
+        return ret;
+    }
+
+    portENTER_CRITICAL(&batchLock);
+    memset(&batchStatus, 0, sizeof(batchStatus));
+    batchStatus.state = BATCH_WAITING;
+    strlcpy(batchStatus.path, filepath, sizeof(batchStatus.path));
+    batchStatus.target = target;
+    batchStatus.started_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&batchLock);
+    batchStopRequested = 0;
+
+    logI(TAG_AVR_BATCH, "Batch of %d boards with %s", target, filepath);
+    if (xTaskCreate(&batchTask, "Batch Flash", FLASH_TASK_STACK_SIZE, NULL, 1, NULL) != pdPASS)
+    {
+        imageCacheClose(&batchImage);
+        batchSetState(BATCH_IDLE);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void batchStop(void)
+{
+    batchStopRequested = 1;
+}
+
+int batchRunning(void)
+{
+    return batchStatus.state != BATCH_IDLE;
+}
+
+void batchGetStatus(batch_status_t *status)
+{
+    portENTER_CRITICAL(&batchLock);
+    *status = batchStatus;
+    portEXIT_CRITICAL(&batchLock);
+}
+
+uint32_t batchBoardsPerHour(const batch_status_t *status)
+{
+    const int64_t end = status->ended_us ? status->ended_us : esp_timer_get_time();
+    const int64_t elapsed = end - status->started_us;
+
+    if (status->started_us == 0 || elapsed <= 0)
+    {
+        return 0;
+    }
+    return (int64_t)status->passed * 3600 * 1000000 / elapsed;
+}
+
+const char *batchStateName(batch_state_t state)
+{
+    switch (state)
+    {
+    case BATCH_WAITING:
+        return "waiting for board";
+    case BATCH_FLASHING:
+        return "flashing";
+    case BATCH_REMOVING:
+        return "waiting for removal";
+    default:
+        return "idle";
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef _AVR_BATCH_H
+#define _AVR_BATCH_H
+
+#include "image_cache.h"
+
+// Time between probes while waiting for a board to be attached or removed
+#define BATCH_PROBE_INTERVAL_MS 250
+
+typedef enum
+{
+    BATCH_IDLE,
+    // Probing for the next board
+    BATCH_WAITING,
+    BATCH_FLASHING,
+    // Probing until the board just flashed is detached
+    BATCH_REMOVING,
+} batch_state_t;
+
+/**
+ * @brief Progress of a batch run, kept after it ends until the next one
+ */
+typedef struct
+{
+    batch_state_t state;
+    char path[IMAGE_CACHE_PATH_MAX];
+
+    // Boards wanted, flashed and verified, and failed
+    int target;
+    int passed;
+    int failed;
+
+    // Flash and verify time per board
+    uint32_t last_ms;
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t total_ms;
+
+    // esp_timer time the run started and ended, ended is 0 while running
+    int64_t started_us;
+    int64_t ended_us;
+} batch_status_t;
+
+/**
+ * @brief Start flashing one image onto board after board
+ *
+ * The image stays decoded in RAM for the whole run. Boards are detected by
+ * probing the bootloader, each one is flashed and verified as soon as it
+ * answers, then the run waits for it to be detached before looking for the
+ * next. The run ends once target boards passed or batchStop() is called.
+ *
+ * @param filepath the image file
+ * @param target number of boards to flash
+ *
+ * @return ESP_OK - started, ESP_ERR_INVALID_STATE - a run is in progress,
+ *         see imageCacheOpen() for the rest
+ */
+esp_err_t batchStart(const char *filepath, int target);
+
+//Stop the batch run after the board in progress, if any
+void batchStop(void);
+
+//Whether a batch run is in progress, the client MCU is busy meanwhile
+int batchRunning(void);
+
+//Copy the progress of the current or last batch run
+void batchGetStatus(batch_status_t *status);
+
+//Throughput of a batch run so far, in boards per hour
+uint32_t batchBoardsPerHour(const batch_status_t *status);
+
+//Name of a batch state, for reports
+const char *batchStateName(batch_state_t state);
+
+#endif
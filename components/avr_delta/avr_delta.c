@@ -0,0 +1,464 @@
+#include "avr_delta.h"
+
+static const char *TAG_AVR_DELTA = "avr_delta";
+
+typedef struct
+{
+    char path[FILE_META_PATH_MAX];
+    uint64_t hash;
+} delta_flashed_t;
+
+/**
+ * @brief Image source handing out only the blocks which differ from the base
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    avr_image_t image;
+    FILE *base;
+    long base_length;
+
+    // Blocks of the image, and those which changed, in the current pass
+    int blocks;
+    int changed;
+
+    uint8_t old[BLOCK_SIZE];
+} delta_image_t;
+
+static char deltaFlashedPath[FILE_META_PATH_MAX];
+static char deltaBasePath[FILE_META_PATH_MAX];
+
+// Set from a patched image until it is flashed, the base copy is in use meanwhile
+static volatile int deltaPending = 0;
+
+// Image the pending patch was applied against, the client MCU has to still hold it
+static delta_flashed_t deltaPendingBase;
+
+// The base is flattened through these, they are too large for the stack
+static cached_image_t deltaBaseImage;
+static delta_image_t deltaImage;
+
+static uint32_t readLE32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Look up the image the client MCU holds, it must not have changed since
+static esp_err_t deltaGetFlashed(delta_flashed_t *flashed)
+{
+    file_meta_t meta;
+
+    FILE *f = fopen(deltaFlashedPath, "r");
+    if (!f)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const int ok = fread(flashed, sizeof(*flashed), 1, f) == 1;
+    fclose(f);
+
+    if (!ok || fileMetaGet(flashed->path, &meta) != ESP_OK || meta.hash != flashed->hash)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Write the image last flashed to the base copy, as a flat image
+ *
+ * Lets the copy ops read any part of it, which an image source can't do.
+ */
+static esp_err_t deltaLoadBase(delta_patch_t *patch)
+{
+    delta_flashed_t flashed;
+    uint32_t address, length = 0;
+    const uint8_t *block;
+    uint64_t hash = FILE_META_HASH_INIT;
+    esp_err_t ret;
+
+    ret = deltaGetFlashed(&flashed);
+    if (ret != ESP_OK)
+    {
+        logE(TAG_AVR_DELTA, "%s", "No record of the image on the client MCU");
+        return ESP_ERR_NOT_FOUND;
+    }
+    ret = imageCacheOpen(&deltaBaseImage, flashed.path);
+    if (ret != ESP_OK)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    patch->base = fopen(deltaBasePath, "w+");
+    if (!patch->base)
+    {
+        imageCacheClose(&deltaBaseImage);
+        return ESP_FAIL;
+    }
+
+    memset(patch->buf, 0xFF, BLOCK_SIZE);
+    while (ret == ESP_OK && (ret = deltaBaseImage.source.nextBlock(&deltaBaseImage.source, &address, &block)) == ESP_OK)
+    {
+        // Gaps between blocks read as erased flash
+        while (ret == ESP_OK && length < address)
+        {
+            ret = fwrite(patch->buf, 1, BLOCK_SIZE, patch->base) == BLOCK_SIZE ? ESP_OK : ESP_FAIL;
+            hash = fileMetaHash(hash, patch->buf, BLOCK_SIZE);
+            length += BLOCK_SIZE;
+        }
+        if (ret == ESP_OK && fwrite(block, 1, BLOCK_SIZE, patch->base) != BLOCK_SIZE)
+        {
+            ret = ESP_FAIL;
+        }
+        hash = fileMetaHash(hash, block, BLOCK_SIZE);
+        length += BLOCK_SIZE;
+    }
+    imageCacheClose(&deltaBaseImage);
+
+    if (ret != ESP_ERR_NOT_FOUND)
+    {
+        logE(TAG_AVR_DELTA, "Failed to read %s", flashed.path);
+        return ESP_FAIL;
+    }
+    if (length != patch->header.base_length || hash != patch->header.base_hash)
+    {
+        logE(TAG_AVR_DELTA, "Patch not made against %s", flashed.path);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    deltaPendingBase = flashed;
+    logI(TAG_AVR_DELTA, "Patching %s, %u bytes", flashed.path, length);
+    return ESP_OK;
+}
+
+static esp_err_t deltaOutput(delta_patch_t *patch, const uint8_t *data, size_t length)
+{
+    if (patch->written + length > patch->header.length)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (fwrite(data, 1, length, patch->out) != length)
+    {
+        return ESP_FAIL;
+    }
+    fileDigestUpdate(&patch->digest, data, length);
+    patch->written += length;
+    return ESP_OK;
+}
+
+static esp_err_t deltaCopy(delta_patch_t *patch, uint32_t offset, uint32_t length)
+{
+    esp_err_t ret = ESP_OK;
+
+    if (offset > patch->header.base_length || length > patch->header.base_length - offset ||
+        fseek(patch->base, offset, SEEK_SET) != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (ret == ESP_OK && length > 0)
+    {
+        const size_t count = MIN(length, sizeof(patch->buf));
+        if (fread(patch->buf, 1, count, patch->base) != count)
+        {
+            return ESP_FAIL;
+        }
+        ret = deltaOutput(patch, patch->buf, count);
+        length -= count;
+    }
+    return ret;
+}
+
+// Gather up to need bytes of header or arguments, returns the bytes taken
+static size_t deltaGather(delta_patch_t *patch, const uint8_t *data, size_t length, size_t need)
+{
+    const size_t count = MIN(length, need - patch->gathered);
+    memcpy(&patch->args[patch->gathered], data, count);
+    patch->gathered += count;
+    return count;
+}
+
+// The header or op arguments are all there
+static esp_err_t deltaGathered(delta_patch_t *patch)
+{
+    switch (patch->state)
+    {
+    case DELTA_HEADER:
+        memcpy(&patch->header, patch->args, sizeof(patch->header));
+        if (patch->header.magic != DELTA_MAGIC || patch->header.version != DELTA_VERSION ||
+            patch->header.length > FLASH_SIZE_MAX)
+        {
+            logE(TAG_AVR_DELTA, "%s", "Not a patch");
+            return ESP_ERR_INVALID_ARG;
+        }
+        patch->state = DELTA_OP;
+        return deltaLoadBase(patch);
+
+    case DELTA_COPY_ARGS:
+        patch->state = DELTA_OP;
+        return deltaCopy(patch, readLE32(patch->args), readLE32(&patch->args[4]));
+
+    case DELTA_INSERT_ARGS:
+        patch->insert_left = readLE32(patch->args);
+        patch->state = patch->insert_left ? DELTA_INSERT : DELTA_OP;
+        return ESP_OK;
+
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+}
+
+void deltaInit(const char *base_path)
+{
+    snprintf(deltaFlashedPath, sizeof(deltaFlashedPath), "%s/%s", base_path, DELTA_FLASHED);
+    snprintf(deltaBasePath, sizeof(deltaBasePath), "%s/%s", base_path, DELTA_BASE);
+}
+
+void deltaRecordFlashed(const char *filepath)
+{
+    delta_flashed_t flashed = {0};
+    file_meta_t meta;
+
+    if (fileMetaGet(filepath, &meta) != ESP_OK)
+    {
+        deltaForgetFlashed();
+        return;
+    }
+    strlcpy(flashed.path, filepath, sizeof(flashed.path));
+    flashed.hash = meta.hash;
+
+    FILE *f = fopen(deltaFlashedPath, "w");
+    if (!f)
+    {
+        logE(TAG_AVR_DELTA, "Failed to write %s", deltaFlashedPath);
+        return;
+    }
+    fwrite(&flashed, sizeof(flashed), 1, f);
+    fclose(f);
+}
+
+void deltaForgetFlashed(void)
+{
+    unlink(deltaFlashedPath);
+}
+
+esp_err_t deltaPatchBegin(delta_patch_t *patch, const char *filepath)
+{
+    if (deltaPending)
+    {
+        logE(TAG_AVR_DELTA, "%s", "The last patch isn't flashed yet");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(patch, 0, sizeof(*patch));
+    patch->state = DELTA_HEADER;
+    strlcpy(patch->path, filepath, sizeof(patch->path));
+    patch->out = fopen(filepath, "w");
+    if (!patch->out)
+    {
+        return ESP_FAIL;
+    }
+    fileDigestStart(&patch->digest);
+    return ESP_OK;
+}
+
+esp_err_t deltaPatchWrite(delta_patch_t *patch, const uint8_t *data, size_t length)
+{
+    esp_err_t ret = ESP_OK;
+    size_t count;
+
+    while (ret == ESP_OK && length > 0)
+    {
+        switch (patch->state)
+        {
+        case DELTA_OP:
+            count = 1;
+            patch->gathered = 0;
+            if (*data == DELTA_OP_COPY)
+            {
+                patch->state = DELTA_COPY_ARGS;
+            }
+            else if (*data == DELTA_OP_INSERT)
+            {
+                patch->state = DELTA_INSERT_ARGS;
+            }
+            else
+            {
+                ret = ESP_ERR_INVALID_ARG;
+            }
+            break;
+
+        case DELTA_INSERT:
+            count = MIN(length, patch->insert_left);
+            ret = deltaOutput(patch, data, count);
+            patch->insert_left -= count;
+            if (!patch->insert_left)
+            {
+                patch->state = DELTA_OP;
+            }
+            break;
+
+        default:
+        {
+            const size_t need = patch->state == DELTA_HEADER ? sizeof(delta_header_t) : patch->state == DELTA_COPY_ARGS ? 8 : 4;
+            count = deltaGather(patch, data, length, need);
+            if (patch->gathered == need)
+            {
+                ret = deltaGathered(patch);
+            }
+            break;
+        }
+        }
+
+        data += count;
+        length -= count;
+    }
+    return ret;
+}
+
+esp_err_t deltaPatchEnd(delta_patch_t *patch, uint64_t *hash, uint8_t sha256[FILE_META_SHA256_LEN])
+{
+    esp_err_t ret = ESP_OK;
+
+    if (patch->state != DELTA_OP || patch->written != patch->header.length)
+    {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    else if (patch->digest.hash != patch->header.hash)
+    {
+        ret = ESP_ERR_INVALID_CRC;
+    }
+
+    if (fclose(patch->out) != 0 && ret == ESP_OK)
+    {
+        ret = ESP_FAIL;
+    }
+    patch->out = NULL;
+    if (patch->base)
+    {
+        fclose(patch->base);
+        patch->base = NULL;
+    }
+
+    if (ret != ESP_OK)
+    {
+        deltaPatchAbort(patch);
+        return ret;
+    }
+
+    *hash = patch->digest.hash;
+    fileDigestFinish(&patch->digest, sha256);
+    fileDigestFree(&patch->digest);
+    deltaPending = 1;
+    logI(TAG_AVR_DELTA, "Patched image intact, %u bytes", patch->written);
+    return ESP_OK;
+}
+
+void deltaPatchAbort(delta_patch_t *patch)
+{
+    if (patch->out)
+    {
+        fclose(patch->out);
+        patch->out = NULL;
+    }
+    if (patch->base)
+    {
+        fclose(patch->base);
+        patch->base = NULL;
+    }
+    fileDigestFree(&patch->digest);
+    unlink(patch->path);
+    unlink(deltaBasePath);
+}
+
+static esp_err_t deltaImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    delta_image_t *delta = (delta_image_t *)source;
+    esp_err_t ret;
+
+    while ((ret = delta->image.source.nextBlock(&delta->image.source, address, block)) == ESP_OK)
+    {
+        delta->blocks++;
+
+        // Past the base the flash holds whatever was there before it
+        if (*address + BLOCK_SIZE > delta->base_length || fseek(delta->base, *address, SEEK_SET) != 0 ||
+            fread(delta->old, 1, BLOCK_SIZE, delta->base) != BLOCK_SIZE || memcmp(delta->old, *block, BLOCK_SIZE) != 0)
+        {
+            delta->changed++;
+            return ESP_OK;
+        }
+    }
+    return ret;
+}
+
+static esp_err_t deltaImageRewind(avr_image_source_t *source)
+{
+    delta_image_t *delta = (delta_image_t *)source;
+
+    delta->blocks = 0;
+    delta->changed = 0;
+    return delta->image.source.rewind(&delta->image.source);
+}
+
+esp_err_t deltaFlash(const char *filepath)
+{
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    delta_image_t *delta = &deltaImage;
+    delta_flashed_t flashed;
+    esp_err_t ret;
+
+    delta->source.nextBlock = deltaImageNextBlock;
+    delta->source.rewind = deltaImageRewind;
+    delta->blocks = 0;
+    delta->changed = 0;
+    delta->base = fopen(deltaBasePath, "r");
+    if (!delta->base)
+    {
+        deltaPending = 0;
+        return -EIMAGE_FAIL;
+    }
+    fseek(delta->base, 0, SEEK_END);
+
+    // Other jobs may have flashed the client MCU since the patch was applied,
+    // then none of its blocks can be taken to hold the base
+    const int on_base = deltaGetFlashed(&flashed) == ESP_OK && flashed.hash == deltaPendingBase.hash &&
+                        strcmp(flashed.path, deltaPendingBase.path) == 0;
+    if (!on_base)
+    {
+        logW(TAG_AVR_DELTA, "Client MCU no longer holds %s, writing the whole image", deltaPendingBase.path);
+    }
+
+    // Writing erases the whole flash first, nothing of the base is left to skip
+    delta->base_length = protocol->chip_erase || !on_base ? 0 : ftell(delta->base);
+
+    if (imageOpen(&delta->image, filepath) != ESP_OK)
+    {
+        fclose(delta->base);
+        unlink(deltaBasePath);
+        deltaPending = 0;
+        return -EIMAGE_FAIL;
+    }
+
+    ret = writeImage(protocol, &delta->source);
+    if (ret == ESP_OK)
+    {
+        logI(TAG_AVR_DELTA, "Wrote %d of %d blocks", delta->changed, delta->blocks);
+        ret = verifyImage(protocol, &delta->source);
+    }
+    endSession(protocol);
+
+    imageClose(&delta->image);
+    fclose(delta->base);
+    unlink(deltaBasePath);
+    deltaPending = 0;
+
+    if (ret == ESP_OK)
+    {
+        deltaRecordFlashed(filepath);
+    }
+    else
+    {
+        // Part of the image may have been written
+        deltaForgetFlashed();
+    }
+    return ret;
+}
@@ -0,0 +1,137 @@
+#ifndef _AVR_DELTA_H
+#define _AVR_DELTA_H
+
+#include "image_cache.h"
+#include "file_meta.h"
+
+// Record of the image last flashed onto the client MCU, the base of patches
+#define DELTA_FLASHED ".flashed"
+
+// Flat copy of the base image while a patch is applied and flashed
+#define DELTA_BASE ".delta-base"
+
+// "AVRD"
+#define DELTA_MAGIC 0x44525641
+#define DELTA_VERSION 1
+
+// Copy bytes of the base: offset, length
+#define DELTA_OP_COPY 'C'
+// Insert new bytes: length, followed by the bytes
+#define DELTA_OP_INSERT 'I'
+
+/**
+ * @brief Header of a patch, followed by its ops
+ *
+ * A patch turns one flat image into another. A flat image is the flash
+ * content from address 0 on, gaps filled with 0xFF, up to the end of the
+ * last BLOCK_SIZE block holding data, i.e. what a .hex flashes as a .bin.
+ * The ops produce the new image front to back, with their arguments as
+ * little endian uint32_t. Hashes are 64-bit FNV-1a, see fileMetaHash().
+ */
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+
+    uint32_t base_length;
+    uint64_t base_hash;
+
+    uint32_t length;
+    uint64_t hash;
+} delta_header_t;
+
+typedef enum
+{
+    DELTA_HEADER,
+    DELTA_OP,
+    DELTA_COPY_ARGS,
+    DELTA_INSERT_ARGS,
+    DELTA_INSERT,
+} delta_state_t;
+
+/**
+ * @brief Patch being applied, as its bytes come in
+ */
+typedef struct
+{
+    delta_state_t state;
+    delta_header_t header;
+
+    // Header or op arguments gathered so far
+    uint8_t args[sizeof(delta_header_t)];
+    size_t gathered;
+
+    // Bytes of the current insert still to come
+    uint32_t insert_left;
+
+    FILE *base;
+    FILE *out;
+    char path[FILE_META_PATH_MAX];
+
+    // New image written so far, and its hashes
+    uint32_t written;
+    file_digest_t digest;
+
+    uint8_t buf[BLOCK_SIZE];
+} delta_patch_t;
+
+//Set the storage the records and the base copy are kept in, e.g. "/spiffs"
+void deltaInit(const char *base_path);
+
+//Record the image just flashed and verified as what the client MCU holds
+void deltaRecordFlashed(const char *filepath);
+
+//Forget what the client MCU holds, it was written by other means
+void deltaForgetFlashed(void);
+
+/**
+ * @brief Start applying a patch against the image last flashed
+ *
+ * @param patch the patch to set up
+ * @param filepath the new image, a flat .bin
+ *
+ * @return ESP_OK - success, ESP_FAIL - failed to create the file
+ */
+esp_err_t deltaPatchBegin(delta_patch_t *patch, const char *filepath);
+
+/**
+ * @brief Apply the next bytes of the patch
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - no base image, or not the
+ *         one the patch was made against, ESP_ERR_INVALID_ARG - malformed patch,
+ *         ESP_FAIL - storage error
+ */
+esp_err_t deltaPatchWrite(delta_patch_t *patch, const uint8_t *data, size_t length);
+
+/**
+ * @brief Finish the patch, checking the new image is complete and intact
+ *
+ * The base copy is kept for deltaFlash(), the new image is removed on failure.
+ *
+ * @param patch the patch
+ * @param hash set to the content hash of the new image
+ * @param sha256 set to the SHA-256 digest of the new image
+ *
+ * @return ESP_OK - success, ESP_ERR_INVALID_SIZE - truncated, ESP_ERR_INVALID_CRC - hash mismatch
+ */
+esp_err_t deltaPatchEnd(delta_patch_t *patch, uint64_t *hash, uint8_t sha256[FILE_META_SHA256_LEN]);
+
+//Give up on a patch, removing the new image
+void deltaPatchAbort(delta_patch_t *patch);
+
+/**
+ * @brief Flash the blocks of a patched image which differ from the base
+ *
+ * Only the changed blocks are written and verified, or all of them when the
+ * client MCU was flashed with something else since the patch was applied.
+ * On success the image is recorded as flashed, and the base copy removed
+ * either way.
+ *
+ * @param filepath the new image, from deltaPatchEnd()
+ *
+ * @return ESP_OK - success, -E*_FAIL - failed
+ */
+esp_err_t deltaFlash(const char *filepath);
+
+#endif
@@ -1,303 +1,782 @@
 #include "avr_flash.h"
+#include "esp_timer.h"
+#include "metrics.h"
 
 //Functions for custom adjustments
 
 static const char *TAG_AVR_FLASH = "avr_flash";
 
-void incrementLoadAddress(char *loadAddress)
+// STK500v1 (optiboot) pages are 128 bytes on the ATmega328P
+#define STK500V1_BLOCK_SIZE 128
+
+// STK500v2 flags the address as a flash word address with bit 31
+#define STK500V2_ADDRESS_FLAG 0x80000000
+
+// Response frame around a STK500v2 CMD_READ_FLASH_ISP: cmd, status, data, status
+#define STK500V2_READ_OVERHEAD 3
+
+// AVR109 acknowledges commands with a carriage return
+#define AVR109_ACK '\r'
+
+// Length of the AVR109 programmer id, "CATERIN" for Caterina
+#define AVR109_ID_LEN 7
+
+// 'S' requests sent while the bootloader starts up, and the wait for each answer
+#define AVR109_SYNC_TRIES 5
+#define AVR109_SYNC_MS 200
+
+/* STK500v1 policy */
+
+// Extended address byte (bits 16-23 of the word address) the bootloader holds
+static uint8_t stk500v1ExtAddress = 0;
+
+static int stk500v1Sync(void)
+{
+    // RAMPZ is cleared by the reset
+    stk500v1ExtAddress = 0;
+    return getSync();
+}
+
+static int stk500v1EnterProgMode(void)
+{
+    return setProgParams() && setExtProgParams() && enterProgMode();
+}
+
+static int stk500v1LeaveProgMode(void)
 {
-    loadAddress[1] += 0x40;
-    if (loadAddress[1] == 0)
+    return extProgMode();
+}
+
+// STK_UNIVERSAL carrying the "load extended address" (0x4D) instruction,
+// needed to reach beyond the first 128 KB of flash
+static int stk500v1LoadExtAddress(uint8_t ext)
+{
+    const char cmd[] = {0x56, 0x4d, 0x00, ext, 0x00, 0x20};
+    uint8_t resp[3];
+
+    sendData(TAG_AVR_FLASH, cmd, sizeof(cmd));
+    if (receiveData(resp, sizeof(resp), MAX_DELAY_MS) != sizeof(resp))
     {
-        loadAddress[0] += 0x1;
+        logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
+        return 0;
     }
+    // SYNC, result of the instruction, OK
+    return resp[0] == SYNC && resp[2] == OK;
 }
 
-int loadAddress(char adrHi, char adrLo)
+static int stk500v1LoadAddress(uint32_t address)
 {
-    char params[] = {adrHi, adrLo};
+    const uint8_t ext = (address >> 16) & 0xff;
+    if (ext != stk500v1ExtAddress)
+    {
+        if (!stk500v1LoadExtAddress(ext))
+        {
+            logE(TAG_AVR_FLASH, "Failed to load extended address 0x%02X", ext);
+            return 0;
+        }
+        stk500v1ExtAddress = ext;
+    }
+
+    char params[] = {address & 0xff, (address >> 8) & 0xff};
     return execParam(0x55, params, sizeof(params));
 }
 
-int compare(uint8_t page[], uint8_t block[], int offset)
+static int stk500v1CheckResponse(void)
 {
-    int c = 0;
-    char temp[BLOCK_SIZE + 2];
-
-    temp[0] = SYNC;
-    temp[BLOCK_SIZE + 1] = OK;
-
-    while (c < BLOCK_SIZE)
+    uint8_t resp[2];
+    if (receiveData(resp, sizeof(resp), MAX_DELAY_MS) != sizeof(resp))
     {
-        temp[c + 1] = page[offset + c];
-        c++;
+        logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
+        return 0;
+    }
+    if (resp[0] != SYNC || resp[1] != OK)
+    {
+        logE(TAG_AVR_FLASH, "%s", "Sync Failure");
+        return 0;
     }
+    return 1;
+}
 
-    if (!memcmp(temp, block, BLOCK_SIZE + 2))
+static int stk500v1WriteBlock(const uint8_t *data)
+{
+    const char head[] = {0x64, (STK500V1_BLOCK_SIZE >> 8), (STK500V1_BLOCK_SIZE & 0xff), 0x46};
+    const char tail[] = {0x20};
+
+    sendData(TAG_AVR_FLASH, head, sizeof(head));
+    sendData(TAG_AVR_FLASH, (const char *)data, STK500V1_BLOCK_SIZE);
+    sendData(TAG_AVR_FLASH, tail, sizeof(tail));
+
+    return stk500v1CheckResponse();
+}
+
+static int stk500v1ReadBlock(uint8_t *data)
+{
+    const char cmd[] = {0x74, (STK500V1_BLOCK_SIZE >> 8), (STK500V1_BLOCK_SIZE & 0xff), 0x46, 0x20};
+    uint8_t sync;
+
+    sendData(TAG_AVR_FLASH, cmd, sizeof(cmd));
+
+    // Response is SYNC, the block, OK; read the block straight into place
+    if (receiveData(&sync, 1, MAX_DELAY_MS) != 1 || sync != SYNC)
     {
-        logI(TAG_AVR_FLASH, "%s", "Verification Success");
-        return 1;
+        logE(TAG_AVR_FLASH, "%s", "Sync Failure");
+        return 0;
     }
-    else
+    if (receiveData(data, STK500V1_BLOCK_SIZE, MAX_DELAY_MS) != STK500V1_BLOCK_SIZE)
     {
-        logI(TAG_AVR_FLASH, "%s", "Verification Failure");
+        logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
         return 0;
     }
+    uint8_t ok;
+    return receiveData(&ok, 1, MAX_DELAY_MS) == 1 && ok == OK;
 }
 
-int stk500v2FlashPage(uint32_t address, char *data)
+const avr_protocol_t stk500v1Protocol = {
+    .name = "stk500v1",
+    .block_size = STK500V1_BLOCK_SIZE,
+    .address_shift = 1,
+    .sync = stk500v1Sync,
+    // Leaves the extended address alone, the bootloader still holds it
+    .keepalive = getSync,
+    .enterProgMode = stk500v1EnterProgMode,
+    .leaveProgMode = stk500v1LeaveProgMode,
+    .loadAddress = stk500v1LoadAddress,
+    .writeBlock = stk500v1WriteBlock,
+    .readBlock = stk500v1ReadBlock,
+};
+
+/* STK500v2 policy */
+
+static int stk500v2WordLoadAddress(uint32_t address)
 {
-    char head[] = {0x13, (BLOCK_SIZE>>8), (BLOCK_SIZE & 0xff), 0xc1, 0x0a, 0x40, 0x4c, 0x20, 0x00, 0x00};
-    //const char tail[] = {0x20};
+    return stk500v2LoadAddress(STK500V2_ADDRESS_FLAG | address);
+}
+
+static int stk500v2WriteBlock(const uint8_t *data)
+{
+    const char head[] = {0x13, (BLOCK_SIZE >> 8), (BLOCK_SIZE & 0xff), 0xc1, 0x0a, 0x40, 0x4c, 0x20, 0x00, 0x00};
 
-    if (stk500v2LoadAddress(address))
+    if (sendSTK500v2MessageWithData(head, sizeof(head), (const char *)data, BLOCK_SIZE))
     {
-        //ESP_LOG_BUFFER_HEXDUMP(TAG_AVR_FLASH, data, BLOCK_SIZE, ESP_LOG_DEBUG);
-        if (sendSTK500v2MessageWithData(head, sizeof(head), data, BLOCK_SIZE))
+        // Wait for a response
+        char resp[2];
+        uint16_t size = sizeof(resp);
+        if (getSTK500v2Response(resp, &size) && (resp[0] == 0x13) && (resp[1] == 0x00))
         {
-            // Wait for a response
-            char resp2[2];
-            uint16_t size2 = 2;
-            if (getSTK500v2Response(resp2, &size2))
-            {
-                // Got response
-                if ((resp2[0] == 0x13) && (resp2[1] == 0x00))
-                {
-                    logI(TAG_AVR_FLASH, "%s", "Page written");
-                    return 1;
-                }
-            }
+            logD(TAG_AVR_FLASH, "%s", "Page written");
+            return 1;
         }
     }
-
     return 0;
 }
 
-int flashPage(char *address, char *data)
+// Only used with the UART held, so one will do
+static char stk500v2ReadResp[BLOCK_SIZE + STK500V2_READ_OVERHEAD];
+
+static int stk500v2ReadBlock(uint8_t *data)
 {
-    const char head[] = {0x64, 0x00, 0x80, 0x46};
-    const char tail[] = {0x20};
+    const char head[] = {0x14, (BLOCK_SIZE >> 8), (BLOCK_SIZE & 0xff), 0x20};
+    char *resp = stk500v2ReadResp;
+    uint16_t size = sizeof(stk500v2ReadResp);
 
-    loadAddress(address[1], address[0]);
-    sendData(TAG_AVR_FLASH, head, sizeof(head));
-    sendData(TAG_AVR_FLASH, data, BLOCK_SIZE);
-    sendData(TAG_AVR_FLASH, tail, sizeof(tail));
+    if (sendSTK500v2Message(head, sizeof(head)) && getSTK500v2Response(resp, &size))
+    {
+        if ((resp[0] == 0x14) && (resp[1] == 0x00) && (size == sizeof(stk500v2ReadResp)))
+        {
+            memcpy(data, &resp[2], BLOCK_SIZE);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    //ESP_LOG_BUFFER_HEXDUMP(TAG_AVR_FLASH, data, BLOCK_SIZE, ESP_LOG_DEBUG);
+const avr_protocol_t stk500v2Protocol = {
+    .name = "stk500v2",
+    .block_size = BLOCK_SIZE,
+    .address_shift = 1,
+    .sync = stk500v2GetSync,
+    .enterProgMode = stk500v2EnterProgrammingMode,
+    .leaveProgMode = stk500v2LeaveProgrammingMode,
+    .loadAddress = stk500v2WordLoadAddress,
+    .writeBlock = stk500v2WriteBlock,
+    .readBlock = stk500v2ReadBlock,
+};
+
+/* AVR109 policy (Caterina, ATmega32U4)
+ *
+ * Pages move in block mode ('B'/'g') with the block size the bootloader
+ * reports, and the address auto-increments, so it is only loaded again
+ * when the image skips ahead */
+
+// Largest block the bootloader takes, at most BLOCK_SIZE
+static int avr109BlockSize = 0;
+
+// Word address the bootloader will use next, UINT32_MAX if unknown
+static uint32_t avr109Next = UINT32_MAX;
+
+static int avr109Ack(void)
+{
+    uint8_t resp;
+    if (receiveData(&resp, 1, MAX_DELAY_MS) != 1)
+    {
+        logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
+        return 0;
+    }
+    return resp == AVR109_ACK;
+}
+
+static int avr109Sync(void)
+{
+    const char cmd[] = {'S'};
+    uint8_t id[AVR109_ID_LEN + 1] = {0};
 
-    int length = waitForSerialData(MIN_DELAY_MS, MAX_DELAY_MS);
-    if (length > 0)
+    avr109Next = UINT32_MAX;
+    for (int tries = 0; tries < AVR109_SYNC_TRIES; tries++)
     {
-        uint8_t data[length];
-        const int rxBytes = uart_read_bytes(UART_NUM_1, data, length, 1000 / portTICK_RATE_MS);
-        if (rxBytes > 0)
+        if (tries)
         {
-            if (data[0] == SYNC && data[1] == OK)
-            {
-                logI(TAG_AVR_FLASH, "%s", "Sync Success");
-                return 1;
-            }
-            else
-            {
-                logE(TAG_AVR_FLASH, "%s", "Sync Failure");
-                return 0;
-            }
+            metricsCount(METRIC_SYNC_RETRIES, 1);
+        }
+        uart_flush_input(UART_NUM_1);
+        sendData(TAG_AVR_FLASH, cmd, sizeof(cmd));
+        if (receiveData(id, AVR109_ID_LEN, AVR109_SYNC_MS) == AVR109_ID_LEN)
+        {
+            logI(TAG_AVR_FLASH, "Programmer id: %s", (char *)id);
+            return 1;
         }
     }
+    return 0;
+}
+
+static int avr109EnterProgMode(void)
+{
+    const char block[] = {'b'};
+    const char enter[] = {'P'};
+    uint8_t resp[3];
+
+    // 'Y' and the block size, big endian
+    sendData(TAG_AVR_FLASH, block, sizeof(block));
+    if (receiveData(resp, sizeof(resp), MAX_DELAY_MS) != sizeof(resp) || resp[0] != 'Y')
+    {
+        logE(TAG_AVR_FLASH, "%s", "Bootloader has no block mode");
+        return 0;
+    }
+    avr109BlockSize = MIN((resp[1] << 8 | resp[2]) & ~1, BLOCK_SIZE);
+    while (avr109BlockSize && BLOCK_SIZE % avr109BlockSize)
+    {
+        // Blocks are split evenly, so take the largest size that does
+        avr109BlockSize -= 2;
+    }
+    if (!avr109BlockSize)
+    {
+        return 0;
+    }
+    logI(TAG_AVR_FLASH, "Block size: %d", avr109BlockSize);
+
+    sendData(TAG_AVR_FLASH, enter, sizeof(enter));
+    return avr109Ack();
+}
+
+static int avr109LeaveProgMode(void)
+{
+    const char leave[] = {'L'};
+    const char quit[] = {'E'};
+
+    sendData(TAG_AVR_FLASH, leave, sizeof(leave));
+    const int left = avr109Ack();
+
+    // Start the sketch right away rather than after the bootloader's timeout
+    sendData(TAG_AVR_FLASH, quit, sizeof(quit));
+    return avr109Ack() && left;
+}
+
+static int avr109LoadAddress(uint32_t address)
+{
+    if (address == avr109Next)
+    {
+        return 1;
+    }
+
+    if (address > 0xffff)
+    {
+        const char cmd[] = {'H', (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff};
+        sendData(TAG_AVR_FLASH, cmd, sizeof(cmd));
+    }
     else
     {
-        logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
+        const char cmd[] = {'A', (address >> 8) & 0xff, address & 0xff};
+        sendData(TAG_AVR_FLASH, cmd, sizeof(cmd));
     }
+    if (!avr109Ack())
+    {
+        avr109Next = UINT32_MAX;
+        return 0;
+    }
+    avr109Next = address;
+    return 1;
+}
 
-    return 0;
+static int avr109WriteBlock(const uint8_t *data)
+{
+    const char head[] = {'B', avr109BlockSize >> 8, avr109BlockSize & 0xff, 'F'};
+
+    // Not where auto-increment leaves it, should a write fail
+    const uint32_t next = avr109Next;
+    avr109Next = UINT32_MAX;
+
+    for (int offset = 0; offset < BLOCK_SIZE; offset += avr109BlockSize)
+    {
+        sendData(TAG_AVR_FLASH, head, sizeof(head));
+        sendData(TAG_AVR_FLASH, (const char *)&data[offset], avr109BlockSize);
+        if (!avr109Ack())
+        {
+            return 0;
+        }
+    }
+    avr109Next = next + BLOCK_SIZE / 2;
+    return 1;
 }
 
-esp_err_t stk500v2WriteTask(uint8_t page[], int block_count)
+static int avr109ReadBlock(uint8_t *data)
 {
-    int page_start = 0, page_index = 0;
+    const char head[] = {'g', avr109BlockSize >> 8, avr109BlockSize & 0xff, 'F'};
 
-    char block[BLOCK_SIZE];
-    uint32_t loadAddress = 0x80000000;
+    const uint32_t next = avr109Next;
+    avr109Next = UINT32_MAX;
 
-    resetMCU();
-    if (stk500v2GetSync())
+    for (int offset = 0; offset < BLOCK_SIZE; offset += avr109BlockSize)
     {
-        if (stk500v2EnterProgrammingMode())
+        sendData(TAG_AVR_FLASH, head, sizeof(head));
+        if (receiveData(&data[offset], avr109BlockSize, MAX_DELAY_MS) != avr109BlockSize)
         {
-            while (block_count != 0)
-            {
-                logD(TAG_AVR_FLASH, "\nBlocks left: %d", block_count);
-                memset(block, '\0', BLOCK_SIZE);
-                int block_index = 0;
-
-                while (page_index < page_start + BLOCK_SIZE)
-                {
-                    block[block_index] = page[page_index];
-                    block_index++;
-                    page_index++;
-                }
-
-                if (!stk500v2FlashPage(loadAddress, block))
-                {
-                    return -EFLASH_FAIL;
-                }
-
-                page_start += BLOCK_SIZE;
-                block_count--;
-                // BLOCK_SIZE is in bytes, address is in words
-                loadAddress += BLOCK_SIZE/2;
-            }
+            logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
+            return 0;
         }
-        else
+    }
+    avr109Next = next + BLOCK_SIZE / 2;
+    return 1;
+}
+
+const avr_protocol_t avr109Protocol = {
+    .name = "avr109",
+    .block_size = BLOCK_SIZE,
+    .address_shift = 1,
+    .sync = avr109Sync,
+    .enterProgMode = avr109EnterProgMode,
+    .leaveProgMode = avr109LeaveProgMode,
+    .loadAddress = avr109LoadAddress,
+    .writeBlock = avr109WriteBlock,
+    .readBlock = avr109ReadBlock,
+};
+
+/* ISP policy, programming over SPI without a bootloader */
+
+_Static_assert(BLOCK_SIZE % CONFIG_ISP_PAGE_SIZE == 0, "ISP page size must divide BLOCK_SIZE");
+
+// Word address loaded for the next page operation
+static uint32_t ispAddress = 0;
+
+// The flash is only erased once the first page is written, so reading it is harmless
+static int ispErased = 0;
+
+static int ispEnterProgMode(void)
+{
+    uint8_t signature[3];
+
+    ispErased = 0;
+    if (!ispReadSignature(signature))
+    {
+        return 0;
+    }
+    logI(TAG_AVR_FLASH, "Signature: %02X %02X %02X", signature[0], signature[1], signature[2]);
+
+    // All 0x00 or 0xFF is the bus, not an AVR
+    const int none = (signature[0] == signature[1] && signature[1] == signature[2] &&
+                      (signature[0] == 0x00 || signature[0] == 0xff));
+    return !none;
+}
+
+static int ispLeaveProgMode(void)
+{
+    ispDisable();
+    return 1;
+}
+
+static int ispLoadAddress(uint32_t address)
+{
+    ispAddress = address;
+    return 1;
+}
+
+static int ispWriteBlock(const uint8_t *data)
+{
+    if (!ispErased)
+    {
+        if (!ispChipErase())
         {
-            return -EPROGMODE_FAIL;
+            return 0;
         }
+        ispErased = 1;
+    }
+    return ispWriteFlashPage(ispAddress, data);
+}
+
+static int ispReadBlock(uint8_t *data)
+{
+    return ispReadFlash(ispAddress, data, CONFIG_ISP_PAGE_SIZE);
+}
+
+const avr_protocol_t ispProtocol = {
+    .name = "isp",
+    .block_size = CONFIG_ISP_PAGE_SIZE,
+    .address_shift = 1,
+    .chip_erase = 1,
+    .sync = ispEnable,
+    .enterProgMode = ispEnterProgMode,
+    .leaveProgMode = ispLeaveProgMode,
+    .loadAddress = ispLoadAddress,
+    .writeBlock = ispWriteBlock,
+    .readBlock = ispReadBlock,
+};
+
+/* UPDI policy, tinyAVR 0/1/2 and megaAVR 0-series without a bootloader */
+
+_Static_assert(BLOCK_SIZE % CONFIG_UPDI_PAGE_SIZE == 0, "UPDI page size must divide BLOCK_SIZE");
+
+// Data space address of the next page operation
+static uint32_t updiAddress = 0;
+
+static int updiProtocolEnterProgMode(void)
+{
+    uint8_t signature[3];
+
+    if (!updiEnterProgMode() || !updiReadSignature(signature))
+    {
+        return 0;
+    }
+    logI(TAG_AVR_FLASH, "Signature: %02X %02X %02X", signature[0], signature[1], signature[2]);
+    return 1;
+}
+
+static int updiLeaveProgMode(void)
+{
+    updiDisable();
+    return 1;
+}
+
+static int updiLoadAddress(uint32_t address)
+{
+    updiAddress = CONFIG_UPDI_FLASH_BASE + address;
+    return 1;
+}
+
+static int updiWriteBlock(const uint8_t *data)
+{
+    return updiWritePage(updiAddress, data);
+}
+
+static int updiReadBlock(uint8_t *data)
+{
+    return updiRead(updiAddress, data, CONFIG_UPDI_PAGE_SIZE);
+}
+
+const avr_protocol_t updiProtocol = {
+    .name = "updi",
+    .block_size = CONFIG_UPDI_PAGE_SIZE,
+    .address_shift = 0,
+    .sync = updiEnable,
+    .enterProgMode = updiProtocolEnterProgMode,
+    .leaveProgMode = updiLeaveProgMode,
+    .loadAddress = updiLoadAddress,
+    .writeBlock = updiWriteBlock,
+    .readBlock = updiReadBlock,
+};
+
+/* Image held in memory */
+
+static esp_err_t memoryImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    avr_memory_image_t *image = (avr_memory_image_t *)source;
+
+    if (image->offset >= image->length)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *address = image->offset;
+    if (image->offset + BLOCK_SIZE <= image->length)
+    {
+        *block = &image->data[image->offset];
     }
     else
     {
-        return -ESYNC_FAIL;
+        // Pad the last partial block
+        const size_t remaining = image->length - image->offset;
+        memcpy(image->tail, &image->data[image->offset], remaining);
+        memset(&image->tail[remaining], 0xff, BLOCK_SIZE - remaining);
+        *block = image->tail;
     }
+    image->offset += BLOCK_SIZE;
 
     return ESP_OK;
 }
 
-esp_err_t writeTask(uint8_t page[], int block_count)
+static esp_err_t memoryImageRewind(avr_image_source_t *source)
+{
+    ((avr_memory_image_t *)source)->offset = 0;
+    return ESP_OK;
+}
+
+avr_image_source_t *memoryImageInit(avr_memory_image_t *image, const uint8_t *data, size_t length)
 {
-    int page_start = 0, page_index = 0;
+    image->source.nextBlock = memoryImageNextBlock;
+    image->source.rewind = memoryImageRewind;
+    image->data = data;
+    image->length = length;
+    image->offset = 0;
+    return &image->source;
+}
+
+/* Protocol independent core, calling the protocol through its policy */
 
-    char block[BLOCK_SIZE];
-    char loadAddress[2] = {0x00, 0x00};
+// Block read back by verifyPages(), only used with the UART held
+static uint8_t verifyReadback[BLOCK_SIZE];
 
-    setupDevice();
+// Result the session ends with, the job counter of the first phase which failed
+static metric_counter_t sessionResult = METRIC_JOBS_OK;
 
-    while (block_count != 0)
+// Record the duration of a phase, and its failure
+static void sessionPhaseEnd(metric_histogram_t phase, metric_counter_t failure, int64_t started, esp_err_t ret)
+{
+    metricsObserve(phase, esp_timer_get_time() - started);
+    if (ret != ESP_OK && sessionResult == METRIC_JOBS_OK)
     {
-        logD(TAG_AVR_FLASH, "Blocks left: %d \n", block_count);
-        memset(block, '\0', BLOCK_SIZE);
-        int block_index = 0;
+        sessionResult = failure;
+    }
+}
 
-        while (page_index < page_start + BLOCK_SIZE)
+static esp_err_t syncBlocks(const avr_protocol_t *protocol)
+{
+    resetMCU();
+    if (!protocol->sync())
+    {
+        return -ESYNC_FAIL;
+    }
+    if (!protocol->enterProgMode())
+    {
+        return -EPROGMODE_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t startBlocks(const avr_protocol_t *protocol)
+{
+    // Held until endSession(), nothing else may talk to the bootloader meanwhile
+    takeUART();
+    uart_set_baudrate(UART_NUM_1, UART_BAUD_RATE);
+    uart_flush_input(UART_NUM_1);
+
+    sessionResult = METRIC_JOBS_OK;
+    const int64_t started = esp_timer_get_time();
+    const esp_err_t ret = syncBlocks(protocol);
+    sessionPhaseEnd(METRIC_PHASE_SYNC, METRIC_JOBS_SYNC_FAILED, started, ret);
+    return ret;
+}
+
+static esp_err_t writePages(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    uint32_t address;
+    const uint8_t *block;
+    int count = 0;
+    esp_err_t ret;
+    const int64_t started = esp_timer_get_time();
+
+    while ((ret = image->nextBlock(image, &address, &block)) == ESP_OK)
+    {
+        if (address + BLOCK_SIZE > FLASH_SIZE_MAX)
         {
-            block[block_index] = page[page_index];
-            block_index++;
-            page_index++;
+            logE(TAG_AVR_FLASH, "Image does not fit in flash, block at 0x%05X", address);
+            return -EIMAGE_FAIL;
         }
 
-        if (!flashPage(loadAddress, block))
+        logD(TAG_AVR_FLASH, "Writing block at 0x%05X", address);
+        for (int offset = 0; offset < BLOCK_SIZE; offset += protocol->block_size)
         {
-            return ESP_FAIL;
+            if (!protocol->loadAddress((address + offset) >> protocol->address_shift))
+            {
+                logE(TAG_AVR_FLASH, "%s", "Failed to load address for write");
+                return -ELOAD_ADDR_FAIL;
+            }
+            const int64_t page_started = esp_timer_get_time();
+            const int written = protocol->writeBlock(&block[offset]);
+            metricsObserve(METRIC_PAGE_WRITE, esp_timer_get_time() - page_started);
+            if (!written)
+            {
+                logE(TAG_AVR_FLASH, "%s", "Failed to write page");
+                return -EFLASH_FAIL;
+            }
+            if (!count && !offset)
+            {
+                metricsMarkBoot(METRIC_BOOT_FIRST_PAGE);
+            }
         }
+        count++;
+    }
 
-        page_start += BLOCK_SIZE;
-        block_count--;
-
-        incrementLoadAddress(loadAddress);
+    if (ret != ESP_ERR_NOT_FOUND)
+    {
+        logE(TAG_AVR_FLASH, "%s", "Failed to read image");
+        return -EIMAGE_FAIL;
     }
 
+    const int64_t elapsed = esp_timer_get_time() - started;
+    const int pages = count * (BLOCK_SIZE / protocol->block_size);
+    logI(TAG_AVR_FLASH, "Blocks written: %d, %d pages/s", count, elapsed > 0 ? (int)(pages * 1000000LL / elapsed) : 0);
     return ESP_OK;
 }
 
-esp_err_t stk500v2ReadTask(uint8_t page[], int block_count)
+static esp_err_t writeSessionBlocks(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    const int64_t started = esp_timer_get_time();
+    const esp_err_t ret = writePages(protocol, image);
+    sessionPhaseEnd(METRIC_PHASE_WRITE, METRIC_JOBS_WRITE_FAILED, started, ret);
+    return ret;
+}
+
+static esp_err_t writeBlocks(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    const esp_err_t ret = startBlocks(protocol);
+    return ret == ESP_OK ? writeSessionBlocks(protocol, image) : ret;
+}
+
+static esp_err_t verifyPages(const avr_protocol_t *protocol, avr_image_source_t *image)
 {
-    const char head[] = {0x14, (BLOCK_SIZE >> 8), (BLOCK_SIZE & 0Xff), 0x20};
-    uint32_t readAddress = 0x80000000;
+    uint32_t address;
+    const uint8_t *block;
+    uint8_t *readback = verifyReadback;
+    esp_err_t ret;
 
-    int offset = 0;
-    char block[BLOCK_SIZE+3];  // Include space for the surrounding response message
+    if (image->rewind(image) != ESP_OK)
+    {
+        return -EIMAGE_FAIL;
+    }
 
-    while (block_count != 0)
+    while ((ret = image->nextBlock(image, &address, &block)) == ESP_OK)
     {
-        logD(TAG_AVR_FLASH, "Blocks left: %d \n", block_count);
-        if (stk500v2LoadAddress(readAddress))
+        logD(TAG_AVR_FLASH, "Reading block at 0x%05X", address);
+        for (int offset = 0; offset < BLOCK_SIZE; offset += protocol->block_size)
         {
-            if (sendSTK500v2Message(head, sizeof(head)))
+            if (!protocol->loadAddress((address + offset) >> protocol->address_shift))
             {
-                memset(block, '\0', BLOCK_SIZE+3);
-                uint16_t size = BLOCK_SIZE+3;
-                if (getSTK500v2Response(block, &size))
-                {
-                    if (block[0] == 0x14)
-                    {
-                        logI(TAG_AVR_FLASH, "%s", "Read Success");
-                        if (memcmp(&page[offset], &block[2], BLOCK_SIZE))
-                        {
-                            return -EVERIFY_FAIL;
-                        }
-
-                        offset += BLOCK_SIZE;
-                    }
-                }
-                else
-                {
-                    logE(TAG_AVR_FLASH, "%s", "Failed to read page");
-                    return -EREAD_FAIL;
-                }
+                logE(TAG_AVR_FLASH, "%s", "Failed to load address for read");
+                return -ELOAD_ADDR_FAIL;
+            }
+            const int64_t page_started = esp_timer_get_time();
+            const int read = protocol->readBlock(readback);
+            metricsObserve(METRIC_PAGE_READ, esp_timer_get_time() - page_started);
+            if (!read)
+            {
+                logE(TAG_AVR_FLASH, "%s", "Failed to read page");
+                return -EREAD_FAIL;
+            }
+            if (memcmp(&block[offset], readback, protocol->block_size))
+            {
+                logE(TAG_AVR_FLASH, "Verification Failure at 0x%05X", address + offset);
+                return -EVERIFY_FAIL;
             }
         }
-        else
-        {
-            logE(TAG_AVR_FLASH, "%s", "Failed to load address for read");
-            return -ELOAD_ADDR_FAIL;
-        }
+    }
 
-        // BLOCK_SIZE is in bytes, address is in words
-        readAddress += BLOCK_SIZE/2;
-        block_count--;
+    if (ret != ESP_ERR_NOT_FOUND)
+    {
+        logE(TAG_AVR_FLASH, "%s", "Failed to read image");
+        return -EIMAGE_FAIL;
     }
 
-    stk500v2LeaveProgrammingMode();
+    logI(TAG_AVR_FLASH, "%s", "Verification Success");
     return ESP_OK;
 }
 
-esp_err_t readTask(uint8_t page[], int block_count)
+static esp_err_t verifyBlocks(const avr_protocol_t *protocol, avr_image_source_t *image)
 {
-    const char head[] = {0x74, 0x00, 0x80, 0x46};
-    const char tail[] = {0x20};
-    char readAddress[2] = {0x00, 0x00};
+    const int64_t started = esp_timer_get_time();
+    const esp_err_t ret = verifyPages(protocol, image);
+    sessionPhaseEnd(METRIC_PHASE_VERIFY, METRIC_JOBS_VERIFY_FAILED, started, ret);
+    return ret;
+}
+
+esp_err_t writeImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    return writeBlocks(protocol, image);
+}
 
-    int offset = 0;
+esp_err_t startSession(const avr_protocol_t *protocol)
+{
+    return startBlocks(protocol);
+}
 
-    while (block_count != 0)
+esp_err_t writeSessionImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    return writeSessionBlocks(protocol, image);
+}
+
+esp_err_t readSessionBlock(const avr_protocol_t *protocol, uint32_t address, uint8_t *block)
+{
+    if (address % BLOCK_SIZE || address + BLOCK_SIZE > FLASH_SIZE_MAX)
     {
-        logD(TAG_AVR_FLASH, "Blocks left: %d \n", block_count);
-        loadAddress(readAddress[1], readAddress[0]);
-        sendData(TAG_AVR_FLASH, head, sizeof(head));
-        sendData(TAG_AVR_FLASH, tail, sizeof(tail));
+        return -EIMAGE_FAIL;
+    }
 
-        int length = waitForSerialData(MIN_DELAY_MS, MAX_DELAY_MS);
-        if (length > 0)
+    for (int offset = 0; offset < BLOCK_SIZE; offset += protocol->block_size)
+    {
+        if (!protocol->loadAddress((address + offset) >> protocol->address_shift))
         {
-            uint8_t data[length];
-            const int rxBytes = uart_read_bytes(UART_NUM_1, data, length, 1000 / portTICK_RATE_MS);
-            if (rxBytes > 0)
-            {
-                if (data[0] == SYNC && data[BLOCK_SIZE + 1] == OK)
-                {
-                    logI(TAG_AVR_FLASH, "%s", "Sync Success");
-                    if (!compare(page, data, offset))
-                    {
-                        return ESP_FAIL;
-                    }
-
-                    offset += BLOCK_SIZE;
-                }
-                else
-                {
-                    logE(TAG_AVR_FLASH, "%s", "Sync Failure");
-                    return ESP_FAIL;
-                }
-            }
+            logE(TAG_AVR_FLASH, "%s", "Failed to load address for read");
+            return -ELOAD_ADDR_FAIL;
         }
-        else
+        const int64_t page_started = esp_timer_get_time();
+        const int read = protocol->readBlock(&block[offset]);
+        metricsObserve(METRIC_PAGE_READ, esp_timer_get_time() - page_started);
+        if (!read)
         {
-            logE(TAG_AVR_FLASH, "%s", "Serial Timeout");
-            return ESP_FAIL;
+            logE(TAG_AVR_FLASH, "Failed to read page at 0x%05X", address + offset);
+            return -EREAD_FAIL;
         }
-
-        incrementLoadAddress(readAddress);
-        block_count--;
     }
-
     return ESP_OK;
 }
 
+int keepSession(const avr_protocol_t *protocol)
+{
+    return protocol->keepalive ? protocol->keepalive() : protocol->sync();
+}
+
+esp_err_t verifyImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    return verifyBlocks(protocol, image);
+}
+
+void endSession(const avr_protocol_t *protocol)
+{
+    protocol->leaveProgMode();
+    resetMCU();
+    metricsCount(sessionResult, 1);
+    giveUART();
+}
+
+int probeTarget(const avr_protocol_t *protocol)
+{
+    takeUART();
+    uart_set_baudrate(UART_NUM_1, UART_BAUD_RATE);
+    uart_flush_input(UART_NUM_1);
+
+    resetMCU();
+    const int present = protocol->sync();
+    if (present)
+    {
+        // Don't leave the client held in reset, or the bus claimed, between probes
+        protocol->leaveProgMode();
+    }
+    giveUART();
+    return present;
+}
@@ -1,7 +1,10 @@
 #ifndef _AVR_FLASH_H
 #define _AVR_FLASH_H
 
+#include "sdkconfig.h"
 #include "avr_pro_mode.h"
+#include "avr_isp.h"
+#include "avr_updi.h"
 
 // Error codes from the flashing
 #define EFLASH_FAIL 100
@@ -10,47 +13,201 @@
 #define EREAD_FAIL  103
 #define EVERIFY_FAIL    104
 #define ELOAD_ADDR_FAIL 105
+#define EIMAGE_FAIL 106
 
-//Increment the memory address for the next write operation
-void incrementLoadAddress(char *loadAddress);
+// Largest flash we can address, the ATmega2560 has 256 KB
+#define FLASH_SIZE_MAX (256 * 1024)
 
-//Send the client MCU the memory address, to be written
-int loadAddress(char addressHigh, char addressLow);
+// Stack of a task running flashing sessions. The page buffers of a session are
+// static, it holds the UART, so what is left is the image source and logging
+#define FLASH_TASK_STACK_SIZE 4096
 
-//Compare the client's memory after flashing, with the 'page' of data for verification purposes
-int compare(uint8_t page[], uint8_t block[], int offset);
+/**
+ * @brief Bootloader protocol policy
+ *
+ * Everything that differs between the bootloader protocols lives in this
+ * table: framing of a page write/read, the unit addresses are counted in and
+ * how responses are validated. The write/verify loops are written once against
+ * it, so adding a protocol means adding one of these.
+ *
+ * All the operations return 1 on success and 0 on failure.
+ */
+typedef struct
+{
+    const char *name;
+
+    // Bytes moved per page write/read, must divide BLOCK_SIZE
+    int block_size;
+
+    // Shift converting a byte address into the protocol's address unit
+    int address_shift;
+
+    // Writing starts with erasing the whole flash, so no block of an image
+    // may be left out on the grounds the target holds it already
+    int chip_erase;
+
+    // Get in sync with the bootloader, after the reset
+    int (*sync)(void);
+
+    // Check the bootloader still answers, in a session, without a reset in
+    // between. Optional, sync() is used when there is none
+    int (*keepalive)(void);
+
+    // Set the device parameters and enter programming mode
+    int (*enterProgMode)(void);
+
+    // Leave programming mode
+    int (*leaveProgMode)(void);
+
+    // Load the address, in protocol units, for the next page operation
+    int (*loadAddress)(uint32_t address);
+
+    // Write block_size bytes at the loaded address
+    int (*writeBlock)(const uint8_t *data);
+
+    // Read block_size bytes from the loaded address
+    int (*readBlock)(uint8_t *data);
+} avr_protocol_t;
+
+extern const avr_protocol_t stk500v1Protocol;
+extern const avr_protocol_t stk500v2Protocol;
+extern const avr_protocol_t avr109Protocol;
+extern const avr_protocol_t ispProtocol;
+extern const avr_protocol_t updiProtocol;
+
+// Protocol selected in menuconfig
+#if CONFIG_AVR_PROTOCOL_STK500V2
+#define AVR_DEFAULT_PROTOCOL (&stk500v2Protocol)
+#elif CONFIG_AVR_PROTOCOL_AVR109
+#define AVR_DEFAULT_PROTOCOL (&avr109Protocol)
+#elif CONFIG_AVR_PROTOCOL_ISP
+#define AVR_DEFAULT_PROTOCOL (&ispProtocol)
+#elif CONFIG_AVR_PROTOCOL_UPDI
+#define AVR_DEFAULT_PROTOCOL (&updiProtocol)
+#else
+#define AVR_DEFAULT_PROTOCOL (&stk500v1Protocol)
+#endif
+
+/**
+ * @brief Source of the image to be written
+ *
+ * Hands out the image one BLOCK_SIZE aligned block at a time, in ascending
+ * address order, so the image never has to be held in RAM as a whole.
+ * Blocks without any data are skipped, bytes of a block not covered by the
+ * image read as 0xFF.
+ */
+typedef struct avr_image_source
+{
+    /**
+     * @brief Get the next block of the image
+     *
+     * @param source the image source
+     * @param address set to the byte address of the block in the target flash
+     * @param block set to the BLOCK_SIZE bytes of the block, valid until the next call
+     *
+     * @return ESP_OK - got a block, ESP_ERR_NOT_FOUND - end of image, other - failed
+     */
+    esp_err_t (*nextBlock)(struct avr_image_source *source, uint32_t *address, const uint8_t **block);
 
-//UART write the flash memory address of the client MCU with the data 
-int flashPage(char *address, char *data);
-int stk500v2FlashPage(uint32_t address, char *data);
+    // Start again from the first block, for verification
+    esp_err_t (*rewind)(struct avr_image_source *source);
+} avr_image_source_t;
+
+/**
+ * @brief Image held in memory
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    uint8_t tail[BLOCK_SIZE];
+} avr_memory_image_t;
+
+/**
+ * @brief Set up an image source over a buffer mapped at flash address 0
+ *
+ * @param image the source to set up
+ * @param data the image
+ * @param length size of the image in bytes
+ *
+ * @return the image source
+ */
+avr_image_source_t *memoryImageInit(avr_memory_image_t *image, const uint8_t *data, size_t length);
 
 /**
  * @brief Write the code into the flash memory of the client MCU
- * 
- * The 'page' of data, parsed from the .hex file, is written into the 
- * flash memory of the client, block-by-block 
- * 
- * @param page data parsed from the .hex file
- * @param block_count Total no. of blocks in page (sets of 128 bytes each)
- *   
- * @return ESP_OK - success, ESP_FAIL - failed
+ *
+ * Resets the client, gets in sync, enters programming mode and writes the
+ * image into flash block-by-block, as the image source hands it out.
+ * Starts a session holding the UART, end it with endSession() even when
+ * this fails
+ *
+ * @param protocol bootloader protocol to use
+ * @param image the image to be written
+ *
+ * @return ESP_OK - success, -E*_FAIL - failed
+ */
+esp_err_t writeImage(const avr_protocol_t *protocol, avr_image_source_t *image);
+
+/**
+ * @brief Start a session for writing an image which isn't at hand yet
+ *
+ * Resets the client, gets in sync and enters programming mode, the first
+ * half of writeImage(), so the bootloader handshake can overlap with
+ * receiving the image. Holds the UART, end it with endSession() even when
+ * this fails
+ *
+ * @param protocol bootloader protocol to use
+ *
+ * @return ESP_OK - success, -E*_FAIL - failed
  */
-esp_err_t writeTask(uint8_t page[], int block_count);
+esp_err_t startSession(const avr_protocol_t *protocol);
 
-esp_err_t stk500v2WriteTask(uint8_t page[], int block_count);
+/**
+ * @brief Write the code into the flash memory of the client MCU, in a session
+ * started with startSession()
+ *
+ * @param protocol bootloader protocol to use
+ * @param image the image to be written
+ *
+ * @return ESP_OK - success, -E*_FAIL - failed
+ */
+esp_err_t writeSessionImage(const avr_protocol_t *protocol, avr_image_source_t *image);
+
+/**
+ * @brief Read a block of the flash memory of the client MCU, in a session
+ * started with startSession()
+ *
+ * @param protocol bootloader protocol to use
+ * @param address byte address of the block, BLOCK_SIZE aligned
+ * @param block To store the BLOCK_SIZE bytes read
+ *
+ * @return ESP_OK - success, -E*_FAIL - failed
+ */
+esp_err_t readSessionBlock(const avr_protocol_t *protocol, uint32_t address, uint8_t *block);
+
+//Keep the bootloader of a started session from timing out while waiting for the image, returns 1 if it answered
+int keepSession(const avr_protocol_t *protocol);
 
 /**
  * @brief Read the flash memory of the client MCU, for verification
- * 
- * It reads the flash memory of the client block-by-block and 
- * checks it with the 'page' of data intended to be written
- * 
- * @param page data parsed from the .hex file
- * @param block_count Total no. of blocks in page (sets of 128 bytes each)
- *   
- * @return ESP_OK - success, ESP_FAIL - failed
- */
-esp_err_t readTask(uint8_t page[], int block_count);
-esp_err_t stk500v2ReadTask(uint8_t page[], int block_count);
+ *
+ * It reads the flash memory of the client block-by-block and
+ * checks it against the image intended to be written
+ *
+ * @param protocol bootloader protocol to use
+ * @param image the image that was written, rewound before the check
+ *
+ * @return ESP_OK - success, -E*_FAIL - failed
+ */
+esp_err_t verifyImage(const avr_protocol_t *protocol, avr_image_source_t *image);
+
+//Leave programming mode and reset the client MCU, so it runs the new code. Counts the session by its result in the metrics
+void endSession(const avr_protocol_t *protocol);
+
+//Reset the client MCU and check its bootloader answers, then let it go again. Returns 1 if a client is attached
+int probeTarget(const avr_protocol_t *protocol);
 
 #endif
@@ -0,0 +1,340 @@
+#include "avr_isp.h"
+
+static const char *TAG_AVR_ISP = "avr_isp";
+
+#define ISP_HOST SPI2_HOST
+
+// Serial programming instructions, from the ATmega datasheets
+#define ISP_PROGRAMMING_ENABLE 0xac
+#define ISP_CHIP_ERASE 0x80
+#define ISP_POLL_RDY_BSY 0xf0
+#define ISP_LOAD_EXT_ADDRESS 0x4d
+#define ISP_LOAD_PAGE_LOW 0x40
+#define ISP_LOAD_PAGE_HIGH 0x48
+#define ISP_WRITE_PAGE 0x4c
+#define ISP_READ_LOW 0x20
+#define ISP_READ_HIGH 0x28
+#define ISP_LOAD_EEPROM_PAGE 0xc1
+#define ISP_WRITE_EEPROM_PAGE 0xc2
+#define ISP_READ_EEPROM 0xa0
+#define ISP_READ_SIGNATURE 0x30
+
+// Read and write instructions of each isp_fuse_t
+static const uint8_t ispFuseRead[][2] = {{0x50, 0x00}, {0x58, 0x08}, {0x50, 0x08}, {0x58, 0x00}};
+static const uint8_t ispFuseWrite[] = {0xa0, 0xa8, 0xa4, 0xe0};
+
+static spi_device_handle_t ispDevice = NULL;
+
+// Extended address byte the client holds, -1 until one is loaded
+static int ispExtAddress = -1;
+
+// Instructions are queued back to back and sent in one transfer
+WORD_ALIGNED_ATTR static uint8_t ispTx[ISP_TRANSFER_MAX];
+WORD_ALIGNED_ATTR static uint8_t ispRx[ISP_TRANSFER_MAX];
+
+// Send the first count bytes of ispTx, the answer lands in ispRx
+static int ispTransfer(int count)
+{
+    spi_transaction_t t = {
+        .length = count * 8,
+        .tx_buffer = ispTx,
+        .rx_buffer = ispRx,
+    };
+    return spi_device_polling_transmit(ispDevice, &t) == ESP_OK;
+}
+
+// Queue an instruction at the given slot of ispTx
+static void ispQueue(int slot, uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    uint8_t *tx = &ispTx[4 * slot];
+    tx[0] = a;
+    tx[1] = b;
+    tx[2] = c;
+    tx[3] = d;
+}
+
+// Send a single instruction, returns the byte it reads back or -1
+static int ispCommand(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    ispQueue(0, a, b, c, d);
+    return ispTransfer(4) ? ispRx[3] : -1;
+}
+
+// Poll RDY/BSY until the client is done writing or erasing
+static int ispWaitReady(void)
+{
+    const TickType_t start = xTaskGetTickCount();
+    int status;
+
+    do
+    {
+        status = ispCommand(ISP_POLL_RDY_BSY, 0x00, 0x00, 0x00);
+        if (status >= 0 && !(status & 0x01))
+        {
+            return 1;
+        }
+    } while (xTaskGetTickCount() - start <= ISP_BUSY_TIMEOUT_MS / portTICK_PERIOD_MS + 1);
+
+    logE(TAG_AVR_ISP, "%s", "Client MCU stays busy");
+    return 0;
+}
+
+// In step when the client echoes the second byte back as the third
+static int ispProgrammingEnable(void)
+{
+    ispQueue(0, ISP_PROGRAMMING_ENABLE, 0x53, 0x00, 0x00);
+    return ispTransfer(4) && ispRx[2] == 0x53;
+}
+
+static int ispLoadExtAddress(uint32_t word_address)
+{
+    const int ext = (word_address >> 16) & 0xff;
+
+    if (ext != ispExtAddress)
+    {
+        if (ispCommand(ISP_LOAD_EXT_ADDRESS, 0x00, ext, 0x00) < 0)
+        {
+            return 0;
+        }
+        ispExtAddress = ext;
+    }
+    return 1;
+}
+
+static int ispBusOpen(int clock_hz)
+{
+    const spi_bus_config_t bus = {
+        .mosi_io_num = CONFIG_ISP_MOSI_GPIO,
+        .miso_io_num = CONFIG_ISP_MISO_GPIO,
+        .sclk_io_num = CONFIG_ISP_SCK_GPIO,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = ISP_TRANSFER_MAX,
+    };
+    const spi_device_interface_config_t device = {
+        .mode = 0,
+        .clock_speed_hz = clock_hz,
+        .spics_io_num = -1,
+        .queue_size = 1,
+    };
+
+    if (spi_bus_initialize(ISP_HOST, &bus, SPI_DMA_CH_AUTO) != ESP_OK)
+    {
+        return 0;
+    }
+    if (spi_bus_add_device(ISP_HOST, &device, &ispDevice) != ESP_OK)
+    {
+        spi_bus_free(ISP_HOST);
+        return 0;
+    }
+    return 1;
+}
+
+// Free the bus and leave the pins to the sketch, which may use them
+static void ispBusClose(void)
+{
+    if (!ispDevice)
+    {
+        return;
+    }
+    spi_bus_remove_device(ispDevice);
+    spi_bus_free(ISP_HOST);
+    ispDevice = NULL;
+
+    gpio_reset_pin(CONFIG_ISP_MOSI_GPIO);
+    gpio_reset_pin(CONFIG_ISP_MISO_GPIO);
+    gpio_reset_pin(CONFIG_ISP_SCK_GPIO);
+}
+
+int ispEnable(void)
+{
+    const int clocks[] = {CONFIG_ISP_CLOCK_HZ, ISP_SLOW_CLOCK_HZ};
+
+    if (ispDevice)
+    {
+        return ispProgrammingEnable();
+    }
+
+    for (int c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++)
+    {
+        if (!ispBusOpen(clocks[c]))
+        {
+            logE(TAG_AVR_ISP, "%s", "Failed to set up SPI");
+            return 0;
+        }
+
+        // SCK idles low, so the client may be held in reset
+        gpio_set_level(RESET_PIN, LOW);
+        for (int i = 0; i < ISP_ENABLE_TRIES; i++)
+        {
+            vTaskDelay(20 / portTICK_PERIOD_MS + 1);
+            if (ispProgrammingEnable())
+            {
+                ispExtAddress = -1;
+                logI(TAG_AVR_ISP, "Serial programming at %d Hz", clocks[c]);
+                return 1;
+            }
+
+            // Out of step, a positive reset pulse starts over
+            gpio_set_level(RESET_PIN, HIGH);
+            vTaskDelay(1 / portTICK_PERIOD_MS);
+            gpio_set_level(RESET_PIN, LOW);
+        }
+        ispBusClose();
+    }
+
+    gpio_set_level(RESET_PIN, HIGH);
+    logE(TAG_AVR_ISP, "%s", "No answer to Programming Enable");
+    return 0;
+}
+
+void ispDisable(void)
+{
+    ispBusClose();
+    gpio_set_level(RESET_PIN, HIGH);
+}
+
+int ispReadSignature(uint8_t signature[3])
+{
+    for (int i = 0; i < 3; i++)
+    {
+        const int value = ispCommand(ISP_READ_SIGNATURE, 0x00, i, 0x00);
+        if (value < 0)
+        {
+            return 0;
+        }
+        signature[i] = value;
+    }
+    return 1;
+}
+
+int ispChipErase(void)
+{
+    logI(TAG_AVR_ISP, "%s", "Erasing chip");
+    return ispCommand(ISP_PROGRAMMING_ENABLE, ISP_CHIP_ERASE, 0x00, 0x00) >= 0 && ispWaitReady();
+}
+
+int ispWriteFlashPage(uint32_t word_address, const uint8_t *data)
+{
+    const int words = CONFIG_ISP_PAGE_SIZE / 2;
+    int erased = 1;
+
+    for (int i = 0; i < CONFIG_ISP_PAGE_SIZE; i++)
+    {
+        erased &= (data[i] == 0xff);
+    }
+    if (erased)
+    {
+        // Nothing to program on an erased page
+        return 1;
+    }
+
+    if (!ispLoadExtAddress(word_address))
+    {
+        return 0;
+    }
+    for (int i = 0; i < words; i++)
+    {
+        const uint16_t word = word_address + i;
+        ispQueue(2 * i, ISP_LOAD_PAGE_LOW, word >> 8, word & 0xff, data[2 * i]);
+        ispQueue(2 * i + 1, ISP_LOAD_PAGE_HIGH, word >> 8, word & 0xff, data[2 * i + 1]);
+    }
+    if (!ispTransfer(4 * CONFIG_ISP_PAGE_SIZE))
+    {
+        return 0;
+    }
+
+    return ispCommand(ISP_WRITE_PAGE, (word_address >> 8) & 0xff, word_address & 0xff, 0x00) >= 0 && ispWaitReady();
+}
+
+int ispReadFlash(uint32_t word_address, uint8_t *data, int size)
+{
+    if (size > BLOCK_SIZE || !ispLoadExtAddress(word_address))
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < size; i++)
+    {
+        const uint16_t word = word_address + i / 2;
+        ispQueue(i, (i & 1) ? ISP_READ_HIGH : ISP_READ_LOW, word >> 8, word & 0xff, 0x00);
+    }
+    if (!ispTransfer(4 * size))
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < size; i++)
+    {
+        data[i] = ispRx[4 * i + 3];
+    }
+    return 1;
+}
+
+int ispWriteEeprom(uint32_t address, const uint8_t *data, int size)
+{
+    while (size > 0)
+    {
+        const uint32_t page = address & ~(CONFIG_ISP_EEPROM_PAGE_SIZE - 1);
+        const int count = MIN(size, page + CONFIG_ISP_EEPROM_PAGE_SIZE - address);
+
+        for (int i = 0; i < count; i++)
+        {
+            ispQueue(i, ISP_LOAD_EEPROM_PAGE, 0x00, (address + i) & (CONFIG_ISP_EEPROM_PAGE_SIZE - 1), data[i]);
+        }
+        if (!ispTransfer(4 * count) ||
+            ispCommand(ISP_WRITE_EEPROM_PAGE, (page >> 8) & 0xff, page & 0xff, 0x00) < 0 || !ispWaitReady())
+        {
+            logE(TAG_AVR_ISP, "Failed to write EEPROM at 0x%04X", page);
+            return 0;
+        }
+
+        address += count;
+        data += count;
+        size -= count;
+    }
+    return 1;
+}
+
+int ispReadEeprom(uint32_t address, uint8_t *data, int size)
+{
+    while (size > 0)
+    {
+        const int count = MIN(size, ISP_TRANSFER_MAX / 4);
+
+        for (int i = 0; i < count; i++)
+        {
+            ispQueue(i, ISP_READ_EEPROM, ((address + i) >> 8) & 0xff, (address + i) & 0xff, 0x00);
+        }
+        if (!ispTransfer(4 * count))
+        {
+            return 0;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            data[i] = ispRx[4 * i + 3];
+        }
+
+        address += count;
+        data += count;
+        size -= count;
+    }
+    return 1;
+}
+
+int ispReadFuse(isp_fuse_t fuse, uint8_t *value)
+{
+    const int read = ispCommand(ispFuseRead[fuse][0], ispFuseRead[fuse][1], 0x00, 0x00);
+    if (read < 0)
+    {
+        return 0;
+    }
+    *value = read;
+    return 1;
+}
+
+int ispWriteFuse(isp_fuse_t fuse, uint8_t value)
+{
+    logI(TAG_AVR_ISP, "Writing fuse %d: 0x%02X", fuse, value);
+    return ispCommand(ISP_PROGRAMMING_ENABLE, ispFuseWrite[fuse], 0x00, value) >= 0 && ispWaitReady();
+}
@@ -0,0 +1,93 @@
+#ifndef _AVR_ISP_H
+#define _AVR_ISP_H
+
+#include "avr_pro_mode.h"
+#include "esp_attr.h"
+#include "driver/spi_master.h"
+
+// SPI clock to fall back to, a quarter of the 1 MHz a factory fresh AVR runs at, with margin
+#define ISP_SLOW_CLOCK_HZ 125000
+
+// Programming Enable instructions sent before giving up on a clock
+#define ISP_ENABLE_TRIES 4
+
+// Longest a write or erase may keep the client MCU busy, chip erase takes ~10 ms
+#define ISP_BUSY_TIMEOUT_MS 50
+
+// Largest transfer: a Load Program Memory Page instruction per byte of a block
+#define ISP_TRANSFER_MAX (4 * BLOCK_SIZE)
+
+// Fuse and lock bytes
+typedef enum
+{
+    ISP_FUSE_LOW,
+    ISP_FUSE_HIGH,
+    ISP_FUSE_EXTENDED,
+    ISP_FUSE_LOCK,
+} isp_fuse_t;
+
+/**
+ * @brief Hold the client MCU in reset and enter serial programming
+ *
+ * The SPI bus is set up here, and freed again by ispDisable(), so the pins
+ * are only driven while programming. When already enabled, checks the
+ * client still answers.
+ *
+ * @return 1 - in serial programming mode, 0 - no answer at either clock
+ */
+int ispEnable(void);
+
+//Leave serial programming, releasing the reset and the SPI pins
+void ispDisable(void);
+
+//Read the 3 signature bytes, returns 1 on success
+int ispReadSignature(uint8_t signature[3]);
+
+//Erase the flash and EEPROM (unless EESAVE is programmed), returns 1 on success
+int ispChipErase(void);
+
+/**
+ * @brief Write a page of flash, the page must have been erased
+ *
+ * The whole page is loaded in one SPI transfer, then written, and the
+ * client polled until it is done.
+ *
+ * @param word_address word address of the page
+ * @param data the page, CONFIG_ISP_PAGE_SIZE bytes
+ *
+ * @return 1 - success, 0 - failed
+ */
+int ispWriteFlashPage(uint32_t word_address, const uint8_t *data);
+
+/**
+ * @brief Read flash, in one SPI transfer
+ *
+ * @param word_address word address to read from
+ * @param data To store the bytes read
+ * @param size no. of bytes to read, even and at most BLOCK_SIZE
+ *
+ * @return 1 - success, 0 - failed
+ */
+int ispReadFlash(uint32_t word_address, uint8_t *data, int size);
+
+/**
+ * @brief Write EEPROM a page at a time, only the bytes given are changed
+ *
+ * @param address byte address to write to
+ * @param data the bytes to write
+ * @param size no. of bytes to write
+ *
+ * @return 1 - success, 0 - failed
+ */
+int ispWriteEeprom(uint32_t address, const uint8_t *data, int size);
+
+//Read size bytes of EEPROM from address, returns 1 on success
+int ispReadEeprom(uint32_t address, uint8_t *data, int size);
+
+//Read a fuse or the lock byte, returns 1 on success
+int ispReadFuse(isp_fuse_t fuse, uint8_t *value);
+
+//Write a fuse or the lock byte, returns 1 on success
+int ispWriteFuse(isp_fuse_t fuse, uint8_t value);
+
+#endif
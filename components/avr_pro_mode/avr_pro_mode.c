@@ -6,14 +6,18 @@
  */
 
 #include "avr_pro_mode.h"
+#include "metrics.h"
 
 static const char *TAG_AVR_PRO = "avr_pro_mode";
 
+// Held by whoever talks to the client MCU: a flashing session, or the serial bridge
+static SemaphoreHandle_t uartLock = NULL;
+
 //Functions for custom adjustments
 void initUART(void)
 {
     const uart_config_t uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = UART_BAUD_RATE,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
@@ -21,10 +25,21 @@ void initUART(void)
     uart_param_config(UART_NUM_1, &uart_config);
     uart_set_pin(UART_NUM_1, TXD_PIN, RXD_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
     uart_driver_install(UART_NUM_1, RX_BUF_SIZE * 2, 0, 0, NULL, 0);
+    uartLock = xSemaphoreCreateRecursiveMutex();
 
     logI(TAG_AVR_PRO, "%s", "UART initialized");
 }
 
+void takeUART(void)
+{
+    xSemaphoreTakeRecursive(uartLock, portMAX_DELAY);
+}
+
+void giveUART(void)
+{
+    xSemaphoreGiveRecursive(uartLock);
+}
+
 void initGPIO(void)
 {
     gpio_set_direction(RESET_PIN, GPIO_MODE_OUTPUT);
@@ -89,13 +104,10 @@ void resetMCU(void)
     logI(TAG_AVR_PRO, "%s", "Reset Procedure finished");
 }
 
-void setupDevice(void)
+int setupDevice(void)
 {
     resetMCU();
-    getSync();
-    setProgParams();
-    setExtProgParams();
-    enterProgMode();
+    return getSync() && setProgParams() && setExtProgParams() && enterProgMode();
 }
 
 void endConn(void)
@@ -117,6 +129,10 @@ int stk500v2GetSync(void)
     int tries = 0;
     while (tries++ < 5)
     {
+        if (tries > 1)
+        {
+            metricsCount(METRIC_SYNC_RETRIES, 1);
+        }
         // Clear any previous data from the receive buffer first
         uart_flush(UART_NUM_1);
         if (sendSTK500v2Message(b, 1))
@@ -249,7 +265,7 @@ int execCmd(char cmd)
 static uint8_t gMsgSequenceNumber = 0;
 const int kSTK500v2MessageHeaderSize = 5;
 
-int sendSTK500v2MessageWithData(char* msg, uint16_t msg_count, char* data, uint16_t data_count)
+int sendSTK500v2MessageWithData(const char* msg, uint16_t msg_count, const char* data, uint16_t data_count)
 {
     char header[kSTK500v2MessageHeaderSize];
     header[0] = 0x1b;
@@ -301,7 +317,7 @@ int sendSTK500v2MessageWithData(char* msg, uint16_t msg_count, char* data, uint1
     return 0;
 }
 
-int sendSTK500v2Message(char* msg, uint16_t count)
+int sendSTK500v2Message(const char* msg, uint16_t count)
 {
     return sendSTK500v2MessageWithData(msg, count, NULL, 0);
 }
@@ -318,7 +334,7 @@ int getSTK500v2Response(char* respBuffer, uint16_t* bufferSize)
     {
         // Read in the header
         char header[kSTK500v2MessageHeaderSize];
-        int rxBytes = uart_read_bytes(UART_NUM_1, header, kSTK500v2MessageHeaderSize, 1000 / portTICK_RATE_MS);
+        int rxBytes = receiveData((uint8_t *)header, kSTK500v2MessageHeaderSize, 1000);
         // Check the constant values in the header
         if ((rxBytes == kSTK500v2MessageHeaderSize) && (header[0] == 0x1b) && (header[4] == 0x0e))
         {
@@ -333,10 +349,10 @@ int getSTK500v2Response(char* respBuffer, uint16_t* bufferSize)
                 if (size <= *bufferSize)
                 {
                     // Read that many bytes in
-                    *bufferSize = uart_read_bytes(UART_NUM_1, respBuffer, size, 1000 / portTICK_RATE_MS);
+                    *bufferSize = receiveData((uint8_t *)respBuffer, size, 1000);
                     // Now the checksum
                     uint8_t msgChecksum;
-                    uart_read_bytes(UART_NUM_1, &msgChecksum, 1, 1000 / portTICK_RATE_MS);
+                    receiveData(&msgChecksum, 1, 1000);
                     uint8_t calculatedChecksum = 0x00;
                     for (int i = 0; i < kSTK500v2MessageHeaderSize; i++)
                     {
@@ -353,6 +369,7 @@ int getSTK500v2Response(char* respBuffer, uint16_t* bufferSize)
                     }
                     else
                     {
+                        metricsCount(METRIC_STK500V2_CHECKSUM_ERRORS, 1);
                         logE(TAG_AVR_PRO, "Message checksum failed.  Expected 0x%02X, got 0x%02X", calculatedChecksum, msgChecksum);
                     }
                 }
@@ -363,6 +380,7 @@ int getSTK500v2Response(char* respBuffer, uint16_t* bufferSize)
             }
             else
             {
+                metricsCount(METRIC_STK500V2_SEQUENCE_ERRORS, 1);
                 logE(TAG_AVR_PRO, "Incorrect sequence number.  Expected %d, got %d", (uint8_t)(gMsgSequenceNumber-1), header[1]);
             }
         }
@@ -378,6 +396,11 @@ int getSTK500v2Response(char* respBuffer, uint16_t* bufferSize)
 int execParam(char cmd, char *params, int count)
 {
     char bytes[32];
+    if (count > sizeof(bytes) - 2)
+    {
+        logE(TAG_AVR_PRO, "Too many parameters: %d", count);
+        return 0;
+    }
     bytes[0] = cmd;
 
     int i = 0;
@@ -398,9 +421,13 @@ int sendBytes(char *bytes, int count)
 
     if (length > 0)
     {
-        uint8_t data[length];
-        const int rxBytes = uart_read_bytes(UART_NUM_1, data, length, 1000 / portTICK_RATE_MS);
-        if (rxBytes > 0)
+        uint8_t data[STK500V1_RESP_MAX];
+        const int rxBytes = receiveData(data, MIN(length, sizeof(data)), 1000);
+        if (length > sizeof(data))
+        {
+            uart_flush_input(UART_NUM_1);
+        }
+        if (rxBytes >= 2)
         {
             if (data[0] == SYNC && data[1] == OK)
             {
@@ -424,10 +451,10 @@ int sendBytes(char *bytes, int count)
 int waitForSerialData(int dataCount, int timeout)
 {
     int timer = 0;
-    int length = 0;
+    size_t length = 0;
     while (timer < timeout)
     {
-        uart_get_buffered_data_len(UART_NUM_1, (size_t *)&length);
+        uart_get_buffered_data_len(UART_NUM_1, &length);
         if (length >= dataCount)
         {
             return length;
@@ -441,7 +468,20 @@ int waitForSerialData(int dataCount, int timeout)
 int sendData(const char *logName, const char *data, const int count)
 {
     const int txBytes = uart_write_bytes(UART_NUM_1, data, count);
+    if (txBytes > 0)
+    {
+        metricsCount(METRIC_UART_TX_BYTES, txBytes);
+    }
     //ESP_LOG_BUFFER_HEXDUMP(logName, data, count, ESP_LOG_DEBUG);
     return txBytes;
 }
 
+int receiveData(uint8_t *data, int count, int timeout)
+{
+    const int rxBytes = uart_read_bytes(UART_NUM_1, data, count, timeout / portTICK_PERIOD_MS);
+    if (rxBytes > 0)
+    {
+        metricsCount(METRIC_UART_RX_BYTES, rxBytes);
+    }
+    return rxBytes;
+}
@@ -14,6 +14,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 
 #include "driver/uart.h"
 #include "driver/gpio.h"
@@ -35,6 +36,9 @@
 #define RXD_PIN (GPIO_NUM_44)
 //#define RESET_PIN (GPIO_NUM_16) // test Arduino Mega
 #define RESET_PIN (GPIO_NUM_2)
+// Baud rate of the bootloader
+#define UART_BAUD_RATE 115200
+
 #define HIGH 1
 #define LOW 0
 
@@ -44,8 +48,12 @@
 #define MIN_DELAY_MS 2
 #define MAX_DELAY_MS 1000
 
+// Bytes of a STK500v1 answer sendBytes() looks at, anything after is dropped
+#define STK500V1_RESP_MAX 16
+
 //#define PAGE_SIZE_MAX 24 * 1024
 #define PAGE_SIZE_MAX 100 * 1024
+// Largest block moved in a single page write/read by any protocol
 #define BLOCK_SIZE 256
 
 static const int RX_BUF_SIZE = 1024;
@@ -53,6 +61,11 @@ static const int RX_BUF_SIZE = 1024;
 //Initialize UART functionalities
 void initUART(void);
 
+//Take the UART to the client MCU, waiting for whoever holds it, and give it back.
+//Recursive, so a flashing session can hold it across the calls it makes
+void takeUART(void);
+void giveUART(void);
+
 //Initialize GPIO functionalities
 void initGPIO(void);
 
@@ -62,8 +75,8 @@ void initSPIFFS(void);
 //Reset the client MCU
 void resetMCU(void);
 
-//Setup the client MCU for flashing
-void setupDevice(void);
+//Setup the client MCU for flashing, returns 1 once it is in programming mode
+int setupDevice(void);
 
 //End the connection with client MCU
 void endConn(void);
@@ -91,8 +104,8 @@ int execCmd(char cmd);
 int execParam(char cmd, char *params, int count);
 
 //Send a STK500v2 message
-int sendSTK500v2Message(char* msg, uint16_t count);
-int sendSTK500v2MessageWithData(char* msg, uint16_t msg_count, char* data, uint16_t data_count);
+int sendSTK500v2Message(const char* msg, uint16_t count);
+int sendSTK500v2MessageWithData(const char* msg, uint16_t msg_count, const char* data, uint16_t data_count);
 int getSTK500v2Response(char* respBuffer, uint16_t* bufferSize);
 int stk500v2LoadAddress(uint32_t addr);
 int stk500v2LeaveProgrammingMode(void);
@@ -107,4 +120,7 @@ int waitForSerialData(int dataCount, int timeout);
 //UART send data byte-by-byte to client MCU
 int sendData(const char *logName, const char *data, int count);
 
+//UART read exactly count bytes from the client MCU, returns the no. of bytes read
+int receiveData(uint8_t *data, int count, int timeout);
+
 #endif
@@ -0,0 +1,310 @@
+#include "avr_updi.h"
+
+static const char *TAG_AVR_UPDI = "avr_updi";
+
+// UPDI instructions, each sent after a SYNCH character
+#define UPDI_SYNCH 0x55
+#define UPDI_ACK 0x40
+#define UPDI_LDS_16 0x04
+#define UPDI_STS_16 0x44
+#define UPDI_LD_PTR_INC 0x24
+#define UPDI_ST_PTR_16 0x69
+#define UPDI_ST_PTR_INC_16 0x65
+#define UPDI_LDCS 0x80
+#define UPDI_STCS 0xc0
+#define UPDI_REPEAT 0xa0
+#define UPDI_KEY 0xe0
+
+// Control/status registers
+#define UPDI_CS_STATUSA 0x00
+#define UPDI_CS_CTRLA 0x02
+#define UPDI_CS_CTRLB 0x03
+#define UPDI_ASI_KEY_STATUS 0x07
+#define UPDI_ASI_RESET_REQ 0x08
+#define UPDI_ASI_CTRLA 0x09
+#define UPDI_ASI_SYS_STATUS 0x0b
+
+#define UPDI_CTRLA_IBDLY 0x80
+#define UPDI_CTRLA_RSD 0x08
+#define UPDI_CTRLB_UPDIDIS 0x04
+#define UPDI_CTRLB_CCDETDIS 0x08
+#define UPDI_RESET_REQ_SIGNATURE 0x59
+#define UPDI_KEY_STATUS_NVMPROG 0x10
+#define UPDI_SYS_STATUS_LOCKSTATUS 0x01
+#define UPDI_SYS_STATUS_NVMPROG 0x08
+#define UPDI_ASI_CTRLA_16MHZ 0x01
+
+// NVMCTRL registers and commands
+#define UPDI_NVMCTRL_CTRLA (UPDI_NVMCTRL + 0x00)
+#define UPDI_NVMCTRL_STATUS (UPDI_NVMCTRL + 0x02)
+#define UPDI_NVM_STATUS_BUSY 0x03
+#define UPDI_NVM_STATUS_WRERROR 0x04
+#define UPDI_NVM_ERASE_WRITE_PAGE 0x03
+#define UPDI_NVM_PAGE_BUFFER_CLEAR 0x04
+
+// "NVMProg ", sent least significant byte first
+static const char updiKeyNvmProg[] = {' ', 'g', 'o', 'r', 'P', 'M', 'V', 'N'};
+
+// In touch with the part since updiEnable()
+static int updiActive = 0;
+
+// UPDI is a single wire, everything sent comes back and is checked
+static int updiSend(const uint8_t *data, int count)
+{
+    uint8_t echo[64];
+
+    sendData(TAG_AVR_UPDI, (const char *)data, count);
+    while (count > 0)
+    {
+        const int chunk = MIN(count, sizeof(echo));
+        if (receiveData(echo, chunk, UPDI_TIMEOUT_MS) != chunk || memcmp(echo, data, chunk) != 0)
+        {
+            logE(TAG_AVR_UPDI, "%s", "Collision on the UPDI line");
+            return 0;
+        }
+        data += chunk;
+        count -= chunk;
+    }
+    return 1;
+}
+
+static int updiReceive(uint8_t *data, int count)
+{
+    if (receiveData(data, count, UPDI_TIMEOUT_MS) != count)
+    {
+        logE(TAG_AVR_UPDI, "%s", "UPDI Timeout");
+        return 0;
+    }
+    return 1;
+}
+
+static int updiAck(void)
+{
+    uint8_t ack;
+    return updiReceive(&ack, 1) && ack == UPDI_ACK;
+}
+
+static int updiStcs(uint8_t reg, uint8_t value)
+{
+    const uint8_t cmd[] = {UPDI_SYNCH, UPDI_STCS | reg, value};
+    return updiSend(cmd, sizeof(cmd));
+}
+
+// Returns the register, or -1
+static int updiLdcs(uint8_t reg)
+{
+    const uint8_t cmd[] = {UPDI_SYNCH, UPDI_LDCS | reg};
+    uint8_t value;
+
+    if (!updiSend(cmd, sizeof(cmd)) || !updiReceive(&value, 1))
+    {
+        return -1;
+    }
+    return value;
+}
+
+static int updiStoreByte(uint16_t address, uint8_t value)
+{
+    const uint8_t cmd[] = {UPDI_SYNCH, UPDI_STS_16, address & 0xff, address >> 8};
+    return updiSend(cmd, sizeof(cmd)) && updiAck() && updiSend(&value, 1) && updiAck();
+}
+
+// Returns the byte, or -1
+static int updiLoadByte(uint16_t address)
+{
+    const uint8_t cmd[] = {UPDI_SYNCH, UPDI_LDS_16, address & 0xff, address >> 8};
+    uint8_t value;
+
+    if (!updiSend(cmd, sizeof(cmd)) || !updiReceive(&value, 1))
+    {
+        return -1;
+    }
+    return value;
+}
+
+static int updiSetPointer(uint16_t address)
+{
+    const uint8_t cmd[] = {UPDI_SYNCH, UPDI_ST_PTR_16, address & 0xff, address >> 8};
+    return updiSend(cmd, sizeof(cmd)) && updiAck();
+}
+
+static int updiRepeat(int count)
+{
+    const uint8_t cmd[] = {UPDI_SYNCH, UPDI_REPEAT, count - 1};
+    return updiSend(cmd, sizeof(cmd));
+}
+
+// Wait for a status register to show or clear the given bits
+static int updiWaitCs(uint8_t reg, uint8_t mask, int set)
+{
+    const TickType_t start = xTaskGetTickCount();
+    int value;
+
+    do
+    {
+        value = updiLdcs(reg);
+        if (value >= 0 && !!(value & mask) == set)
+        {
+            return 1;
+        }
+    } while (xTaskGetTickCount() - start <= UPDI_BUSY_TIMEOUT_MS / portTICK_PERIOD_MS + 1);
+    return 0;
+}
+
+static int updiWaitNvm(void)
+{
+    const TickType_t start = xTaskGetTickCount();
+    int status;
+
+    do
+    {
+        status = updiLoadByte(UPDI_NVMCTRL_STATUS);
+        if (status >= 0 && !(status & UPDI_NVM_STATUS_BUSY))
+        {
+            return !(status & UPDI_NVM_STATUS_WRERROR);
+        }
+    } while (xTaskGetTickCount() - start <= UPDI_BUSY_TIMEOUT_MS / portTICK_PERIOD_MS + 1);
+
+    logE(TAG_AVR_UPDI, "%s", "NVM controller stays busy");
+    return 0;
+}
+
+// Two breaks reset the UPDI whatever state it was left in
+static void updiDoubleBreak(void)
+{
+    const char zero = 0x00;
+    uint8_t echo;
+
+    uart_set_baudrate(UART_NUM_1, UPDI_BREAK_BAUD);
+    for (int i = 0; i < 2; i++)
+    {
+        sendData(TAG_AVR_UPDI, &zero, 1);
+        receiveData(&echo, 1, 100);
+    }
+    uart_set_baudrate(UART_NUM_1, CONFIG_UPDI_BAUD);
+    uart_flush_input(UART_NUM_1);
+}
+
+int updiEnable(void)
+{
+    if (updiActive)
+    {
+        return updiLdcs(UPDI_CS_STATUSA) > 0;
+    }
+
+    uart_set_parity(UART_NUM_1, UART_PARITY_EVEN);
+    uart_set_stop_bits(UART_NUM_1, UART_STOP_BITS_2);
+    updiDoubleBreak();
+
+    // A short inter-byte delay, and no collision detection on our own echo
+    const int revision = updiStcs(UPDI_CS_CTRLB, UPDI_CTRLB_CCDETDIS) && updiStcs(UPDI_CS_CTRLA, UPDI_CTRLA_IBDLY)
+                             ? updiLdcs(UPDI_CS_STATUSA)
+                             : -1;
+    if (revision <= 0)
+    {
+        logE(TAG_AVR_UPDI, "%s", "No UPDI answering");
+        // Back to 8N1 for whatever uses the UART next
+        updiDisable();
+        return 0;
+    }
+
+    updiActive = 1;
+    logI(TAG_AVR_UPDI, "UPDI revision %d", revision >> 4);
+    return 1;
+}
+
+int updiEnterProgMode(void)
+{
+    uint8_t cmd[2 + sizeof(updiKeyNvmProg)] = {UPDI_SYNCH, UPDI_KEY};
+    memcpy(&cmd[2], updiKeyNvmProg, sizeof(updiKeyNvmProg));
+
+    if (!updiSend(cmd, sizeof(cmd)) || !updiWaitCs(UPDI_ASI_KEY_STATUS, UPDI_KEY_STATUS_NVMPROG, 1))
+    {
+        logE(TAG_AVR_UPDI, "%s", "NVMProg key not taken");
+        return 0;
+    }
+
+    // The key takes effect through a reset
+    if (!updiStcs(UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_SIGNATURE) || !updiStcs(UPDI_ASI_RESET_REQ, 0x00) ||
+        !updiWaitCs(UPDI_ASI_SYS_STATUS, UPDI_SYS_STATUS_NVMPROG, 1))
+    {
+        const int status = updiLdcs(UPDI_ASI_SYS_STATUS);
+        logE(TAG_AVR_UPDI, "%s", status >= 0 && (status & UPDI_SYS_STATUS_LOCKSTATUS) ? "Part is locked, erase it first"
+                                                                                       : "Failed to enter NVM programming");
+        return 0;
+    }
+
+    if (CONFIG_UPDI_FAST_BAUD)
+    {
+        // UPDI picks up the new rate from the next SYNCH character
+        if (!updiStcs(UPDI_ASI_CTRLA, UPDI_ASI_CTRLA_16MHZ))
+        {
+            return 0;
+        }
+        uart_wait_tx_done(UART_NUM_1, UPDI_TIMEOUT_MS / portTICK_PERIOD_MS + 1);
+        uart_set_baudrate(UART_NUM_1, CONFIG_UPDI_FAST_BAUD);
+        if (updiLdcs(UPDI_CS_STATUSA) <= 0)
+        {
+            logE(TAG_AVR_UPDI, "No answer at %d baud", CONFIG_UPDI_FAST_BAUD);
+            return 0;
+        }
+    }
+
+    logI(TAG_AVR_UPDI, "%s", "In NVM programming");
+    return 1;
+}
+
+void updiDisable(void)
+{
+    if (updiActive)
+    {
+        // Out of NVM programming, into the code, and leave the pin alone
+        updiStcs(UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_SIGNATURE);
+        updiStcs(UPDI_ASI_RESET_REQ, 0x00);
+        updiStcs(UPDI_CS_CTRLB, UPDI_CTRLB_UPDIDIS | UPDI_CTRLB_CCDETDIS);
+        uart_wait_tx_done(UART_NUM_1, UPDI_TIMEOUT_MS / portTICK_PERIOD_MS + 1);
+        updiActive = 0;
+    }
+
+    uart_set_parity(UART_NUM_1, UART_PARITY_DISABLE);
+    uart_set_stop_bits(UART_NUM_1, UART_STOP_BITS_1);
+    uart_set_baudrate(UART_NUM_1, UART_BAUD_RATE);
+    uart_flush_input(UART_NUM_1);
+}
+
+int updiReadSignature(uint8_t signature[3])
+{
+    return updiRead(UPDI_SIGROW, signature, 3);
+}
+
+int updiWritePage(uint32_t address, const uint8_t *data)
+{
+    const uint8_t burst[] = {UPDI_SYNCH, UPDI_ST_PTR_INC_16};
+
+    if (!updiWaitNvm() || !updiStoreByte(UPDI_NVMCTRL_CTRLA, UPDI_NVM_PAGE_BUFFER_CLEAR) || !updiWaitNvm() ||
+        !updiSetPointer(address))
+    {
+        return 0;
+    }
+
+    // Words stored back to back, with the ACKs turned off meanwhile
+    if (!updiStcs(UPDI_CS_CTRLA, UPDI_CTRLA_IBDLY | UPDI_CTRLA_RSD) || !updiRepeat(CONFIG_UPDI_PAGE_SIZE / 2) ||
+        !updiSend(burst, sizeof(burst)) || !updiSend(data, CONFIG_UPDI_PAGE_SIZE) ||
+        !updiStcs(UPDI_CS_CTRLA, UPDI_CTRLA_IBDLY))
+    {
+        return 0;
+    }
+
+    return updiStoreByte(UPDI_NVMCTRL_CTRLA, UPDI_NVM_ERASE_WRITE_PAGE) && updiWaitNvm();
+}
+
+int updiRead(uint32_t address, uint8_t *data, int size)
+{
+    const uint8_t burst[] = {UPDI_SYNCH, UPDI_LD_PTR_INC};
+
+    if (size > 256 || !updiSetPointer(address) || !updiRepeat(size))
+    {
+        return 0;
+    }
+    return updiSend(burst, sizeof(burst)) && updiReceive(data, size);
+}
@@ -0,0 +1,70 @@
+#ifndef _AVR_UPDI_H
+#define _AVR_UPDI_H
+
+#include "avr_pro_mode.h"
+
+// Baud rate at which a 0x00 is long enough for a UPDI break (> 24.6 ms)
+#define UPDI_BREAK_BAUD 300
+
+// Wait for an answer from the part, UPDI answers within a few characters
+#define UPDI_TIMEOUT_MS 50
+
+// Longest the part may take to reset or to erase and write a page
+#define UPDI_BUSY_TIMEOUT_MS 100
+
+// NVM controller and signature row of the tinyAVR 0/1/2 and megaAVR 0-series
+#define UPDI_NVMCTRL 0x1000
+#define UPDI_SIGROW 0x1100
+
+/**
+ * @brief Get in touch with the UPDI of the part, on the shared UART
+ *
+ * Switches the UART to 8E2 at CONFIG_UPDI_BAUD, sends a double break and
+ * sets the UPDI up. When already in touch, checks the part still answers.
+ * Undo with updiDisable(); on failure the UART is already back to 8N1.
+ *
+ * @return 1 - the part answers, 0 - no UPDI
+ */
+int updiEnable(void);
+
+/**
+ * @brief Enter NVM programming: the NVMProg key and a reset
+ *
+ * Raises the UPDI clock and the baud rate to CONFIG_UPDI_FAST_BAUD afterwards,
+ * if set.
+ *
+ * @return 1 - success, 0 - failed or the part is locked
+ */
+int updiEnterProgMode(void);
+
+//Reset the part into its code, disable UPDI and set the UART back to 8N1 at UART_BAUD_RATE
+void updiDisable(void);
+
+//Read the 3 signature bytes, returns 1 on success
+int updiReadSignature(uint8_t signature[3]);
+
+/**
+ * @brief Erase and write a page of flash
+ *
+ * The page is loaded into the page buffer with a single REPEAT'd burst of
+ * word stores, without a response per byte.
+ *
+ * @param address data space address of the page
+ * @param data the page, CONFIG_UPDI_PAGE_SIZE bytes
+ *
+ * @return 1 - success, 0 - failed
+ */
+int updiWritePage(uint32_t address, const uint8_t *data);
+
+/**
+ * @brief Read from the data space with a REPEAT'd burst of loads
+ *
+ * @param address data space address to read from
+ * @param data To store the bytes read
+ * @param size no. of bytes to read, at most 256
+ *
+ * @return 1 - success, 0 - failed
+ */
+int updiRead(uint32_t address, uint8_t *data, int size);
+
+#endif
@@ -0,0 +1,267 @@
+#include "file_meta.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "logger.h"
+
+static const char *TAG_FILE_META = "file_meta";
+
+#define FNV_PRIME_64 0x100000001b3ULL
+
+// "META", ahead of the version and the records
+#define FILE_META_MAGIC 0x4154454d
+#define FILE_META_VERSION 2
+
+// Records added to the index at a time
+#define FILE_META_GROW 8
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+} file_meta_header_t;
+
+static file_meta_t *metaRecords = NULL;
+static int metaCount = 0;
+static int metaCapacity = 0;
+static char metaIndexPath[FILE_META_PATH_MAX];
+static SemaphoreHandle_t metaLock = NULL;
+
+static int metaFind(const char *filepath)
+{
+    for (int i = 0; i < metaCount; i++)
+    {
+        if (strcmp(metaRecords[i].path, filepath) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Write the whole index out, it is a few dozen records at most. Lock held
+static esp_err_t metaSave(void)
+{
+    const file_meta_header_t header = {
+        .magic = FILE_META_MAGIC,
+        .version = FILE_META_VERSION,
+        .record_size = sizeof(file_meta_t),
+        .count = metaCount,
+    };
+
+    FILE *f = fopen(metaIndexPath, "w");
+    if (!f)
+    {
+        logE(TAG_FILE_META, "Failed to write %s", metaIndexPath);
+        return ESP_FAIL;
+    }
+    const int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                   fwrite(metaRecords, sizeof(file_meta_t), metaCount, f) == metaCount;
+    fclose(f);
+
+    // Lost metadata is recomputed on the next lookup, so this isn't fatal
+    return ok ? ESP_OK : ESP_FAIL;
+}
+
+// Record the metadata, replacing what was there for the file. Lock held
+static esp_err_t metaStore(const file_meta_t *meta)
+{
+    int i = metaFind(meta->path);
+
+    if (i < 0)
+    {
+        if (metaCount == metaCapacity)
+        {
+            file_meta_t *records = realloc(metaRecords, (metaCapacity + FILE_META_GROW) * sizeof(file_meta_t));
+            if (!records)
+            {
+                return ESP_ERR_NO_MEM;
+            }
+            metaRecords = records;
+            metaCapacity += FILE_META_GROW;
+        }
+        i = metaCount++;
+    }
+
+    metaRecords[i] = *meta;
+    return metaSave();
+}
+
+static esp_err_t metaHashFile(const char *filepath, file_meta_t *meta)
+{
+    uint8_t buf[512];
+    file_digest_t digest;
+    size_t count;
+
+    FILE *f = fopen(filepath, "r");
+    if (!f)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    fileDigestStart(&digest);
+    while ((count = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        fileDigestUpdate(&digest, buf, count);
+    }
+    const int failed = ferror(f);
+    fclose(f);
+
+    meta->hash = digest.hash;
+    fileDigestFinish(&digest, meta->sha256);
+    fileDigestFree(&digest);
+
+    return failed ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t fileMetaInit(const char *base_path)
+{
+    file_meta_header_t header;
+
+    snprintf(metaIndexPath, sizeof(metaIndexPath), "%s/%s", base_path, FILE_META_INDEX);
+    metaLock = xSemaphoreCreateMutex();
+    if (!metaLock)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    FILE *f = fopen(metaIndexPath, "r");
+    if (!f)
+    {
+        logI(TAG_FILE_META, "%s", "No metadata index yet");
+        return ESP_OK;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != FILE_META_MAGIC ||
+        header.version != FILE_META_VERSION || header.record_size != sizeof(file_meta_t))
+    {
+        // Start over, the metadata is recomputed as files are looked up
+        logW(TAG_FILE_META, "Discarding metadata index %s", metaIndexPath);
+        fclose(f);
+        return ESP_OK;
+    }
+
+    metaRecords = malloc(header.count * sizeof(file_meta_t));
+    if (header.count && !metaRecords)
+    {
+        fclose(f);
+        return ESP_ERR_NO_MEM;
+    }
+    metaCapacity = header.count;
+    metaCount = fread(metaRecords, sizeof(file_meta_t), header.count, f);
+    fclose(f);
+
+    logI(TAG_FILE_META, "Loaded metadata of %d files", metaCount);
+    return ESP_OK;
+}
+
+uint64_t fileMetaHash(uint64_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+
+    while (length--)
+    {
+        hash = (hash ^ *bytes++) * FNV_PRIME_64;
+    }
+    return hash;
+}
+
+void fileDigestStart(file_digest_t *digest)
+{
+    digest->hash = FILE_META_HASH_INIT;
+    mbedtls_sha256_init(&digest->sha256);
+    mbedtls_sha256_starts_ret(&digest->sha256, 0);
+}
+
+void fileDigestUpdate(file_digest_t *digest, const void *data, size_t length)
+{
+    digest->hash = fileMetaHash(digest->hash, data, length);
+    mbedtls_sha256_update_ret(&digest->sha256, data, length);
+}
+
+void fileDigestFinish(file_digest_t *digest, uint8_t sha256[FILE_META_SHA256_LEN])
+{
+    mbedtls_sha256_finish_ret(&digest->sha256, sha256);
+}
+
+void fileDigestFree(file_digest_t *digest)
+{
+    mbedtls_sha256_free(&digest->sha256);
+}
+
+esp_err_t fileMetaGet(const char *filepath, file_meta_t *meta)
+{
+    struct stat file_stat;
+    esp_err_t ret;
+
+    if (stat(filepath, &file_stat) == -1)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(metaLock, portMAX_DELAY);
+    const int i = metaFind(filepath);
+    if (i >= 0 && metaRecords[i].size == file_stat.st_size && metaRecords[i].mtime == file_stat.st_mtime)
+    {
+        *meta = metaRecords[i];
+        xSemaphoreGive(metaLock);
+        return ESP_OK;
+    }
+    xSemaphoreGive(metaLock);
+
+    logD(TAG_FILE_META, "Hashing %s", filepath);
+    strlcpy(meta->path, filepath, sizeof(meta->path));
+    meta->size = file_stat.st_size;
+    meta->mtime = file_stat.st_mtime;
+    ret = metaHashFile(filepath, meta);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    xSemaphoreTake(metaLock, portMAX_DELAY);
+    metaStore(meta);
+    xSemaphoreGive(metaLock);
+    return ESP_OK;
+}
+
+esp_err_t fileMetaSet(const char *filepath, uint64_t hash, const uint8_t sha256[FILE_META_SHA256_LEN])
+{
+    struct stat file_stat;
+    file_meta_t meta;
+    esp_err_t ret;
+
+    if (stat(filepath, &file_stat) == -1)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    strlcpy(meta.path, filepath, sizeof(meta.path));
+    meta.size = file_stat.st_size;
+    meta.mtime = file_stat.st_mtime;
+    meta.hash = hash;
+    memcpy(meta.sha256, sha256, sizeof(meta.sha256));
+
+    xSemaphoreTake(metaLock, portMAX_DELAY);
+    ret = metaStore(&meta);
+    xSemaphoreGive(metaLock);
+    return ret;
+}
+
+void fileMetaRemove(const char *filepath)
+{
+    xSemaphoreTake(metaLock, portMAX_DELAY);
+    const int i = metaFind(filepath);
+    if (i >= 0)
+    {
+        metaRecords[i] = metaRecords[--metaCount];
+        metaSave();
+    }
+    xSemaphoreGive(metaLock);
+}
@@ -0,0 +1,98 @@
+#ifndef _FILE_META_H
+#define _FILE_META_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "esp_err.h"
+#include "esp_vfs.h"
+#include "esp_spiffs.h"
+#include "mbedtls/sha256.h"
+
+// Max length a file path can have on storage
+#define FILE_META_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
+
+// Index of the metadata, in the storage's base directory. Names starting
+// with a '.' are kept out of the file listings
+#define FILE_META_INDEX ".meta"
+
+// 64-bit FNV-1a offset basis, to start a content hash
+#define FILE_META_HASH_INIT 0xcbf29ce484222325ULL
+
+#define FILE_META_SHA256_LEN 32
+
+/**
+ * @brief What is known about a stored file
+ *
+ * Valid while the file keeps the size and modification time recorded here.
+ */
+typedef struct
+{
+    char path[FILE_META_PATH_MAX];
+    uint32_t size;
+    int64_t mtime;
+
+    // FNV-1a hash over the stored content
+    uint64_t hash;
+
+    // SHA-256 digest of the stored content, for integrity checks
+    uint8_t sha256[FILE_META_SHA256_LEN];
+} file_meta_t;
+
+/**
+ * @brief Both hashes of content on its way to storage, taken as it passes
+ *
+ * The SHA-256 runs on the SHA accelerator through mbedTLS. Always end with
+ * fileDigestFree(), the accelerator may be held until then.
+ */
+typedef struct
+{
+    uint64_t hash;
+    mbedtls_sha256_context sha256;
+} file_digest_t;
+
+/**
+ * @brief Load the metadata index of the storage
+ *
+ * @param base_path base path of the storage, e.g. "/spiffs"
+ *
+ * @return ESP_OK - success, ESP_ERR_NO_MEM - failed
+ */
+esp_err_t fileMetaInit(const char *base_path);
+
+//Add data to a content hash started with FILE_META_HASH_INIT
+uint64_t fileMetaHash(uint64_t hash, const void *data, size_t length);
+
+/**
+ * @brief Get the metadata of a file
+ *
+ * Files without metadata, or changed since it was recorded, are hashed
+ * there and then and the result recorded, so any file can be looked up.
+ *
+ * @param filepath the file
+ * @param meta filled in with the metadata
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - no such file, ESP_FAIL - read error
+ */
+esp_err_t fileMetaGet(const char *filepath, file_meta_t *meta);
+
+//Start hashing content
+void fileDigestStart(file_digest_t *digest);
+
+//Add content to the hashes
+void fileDigestUpdate(file_digest_t *digest, const void *data, size_t length);
+
+//Finish the SHA-256 digest, digest->hash is final as it is
+void fileDigestFinish(file_digest_t *digest, uint8_t sha256[FILE_META_SHA256_LEN]);
+
+//Release the hashing, finished or not
+void fileDigestFree(file_digest_t *digest);
+
+//Record the hashes of a file just written, computed while writing it
+esp_err_t fileMetaSet(const char *filepath, uint64_t hash, const uint8_t sha256[FILE_META_SHA256_LEN]);
+
+//Forget the metadata of a deleted file
+void fileMetaRemove(const char *filepath);
+
+#endif
@@ -0,0 +1,311 @@
+/**
+ * Streaming gzip (RFC 1952) reader on top of the tinfl inflater in ROM
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_ESP32S3
+#include "esp32s3/rom/miniz.h"
+#elif CONFIG_IDF_TARGET_ESP32S2
+#include "esp32s2/rom/miniz.h"
+#else
+#include "esp32/rom/miniz.h"
+#endif
+
+#include "gz_stream.h"
+#include "logger.h"
+
+static const char *TAG_GZ_STREAM = "gz_stream";
+
+// Header flags
+#define GZ_FHCRC 0x02
+#define GZ_FEXTRA 0x04
+#define GZ_FNAME 0x08
+#define GZ_FCOMMENT 0x10
+
+#define GZ_METHOD_DEFLATE 8
+#define GZ_HEADER_SIZE 10
+#define GZ_TRAILER_SIZE 8
+
+// Compressed bytes read from the file at a time
+#define GZ_INPUT_SIZE 1024
+
+#ifdef __LARGE64_FILES
+typedef _off64_t gz_off_t;
+#else
+typedef off_t gz_off_t;
+#endif
+
+typedef struct
+{
+    FILE *f;
+
+    // Offset of the deflate data in the file, past the header
+    long data_start;
+
+    tinfl_decompressor inflator;
+    tinfl_status status;
+
+    uint8_t input[GZ_INPUT_SIZE];
+    size_t input_pos;
+    size_t input_len;
+
+    // Inflated data, TINFL_LZ_DICT_SIZE bytes used as a ring
+    uint8_t *window;
+    size_t window_pos;
+
+    // Inflated bytes not handed to the reader yet
+    size_t output_pos;
+    size_t output_len;
+
+    // Running CRC32 and size of the inflated data, checked against the trailer
+    uint32_t crc;
+    uint32_t size;
+} gz_stream_t;
+
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+static uint32_t readLE32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static esp_err_t gzSkipHeader(FILE *f)
+{
+    uint8_t header[GZ_HEADER_SIZE];
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        header[0] != GZ_MAGIC_0 || header[1] != GZ_MAGIC_1 || header[2] != GZ_METHOD_DEFLATE)
+    {
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    const uint8_t flags = header[3];
+    if (flags & GZ_FEXTRA)
+    {
+        uint8_t length[2];
+        if (fread(length, 1, sizeof(length), f) != sizeof(length))
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        fseek(f, length[0] | (length[1] << 8), SEEK_CUR);
+    }
+    if (flags & GZ_FNAME)
+    {
+        int c;
+        while ((c = fgetc(f)) != 0 && c != EOF);
+    }
+    if (flags & GZ_FCOMMENT)
+    {
+        int c;
+        while ((c = fgetc(f)) != 0 && c != EOF);
+    }
+    if (flags & GZ_FHCRC)
+    {
+        fseek(f, 2, SEEK_CUR);
+    }
+
+    return feof(f) ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+static void gzReset(gz_stream_t *gz)
+{
+    tinfl_init(&gz->inflator);
+    gz->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    gz->input_pos = 0;
+    gz->input_len = 0;
+    gz->window_pos = 0;
+    gz->output_pos = 0;
+    gz->output_len = 0;
+    gz->crc = 0;
+    gz->size = 0;
+}
+
+// The trailer is the last 8 bytes of the file. The inflater may have read
+// ahead into it, so it is fetched from there rather than after the data
+static esp_err_t gzCheckTrailer(gz_stream_t *gz)
+{
+    uint8_t trailer[GZ_TRAILER_SIZE];
+
+    if (fseek(gz->f, -GZ_TRAILER_SIZE, SEEK_END) != 0 ||
+        fread(trailer, 1, sizeof(trailer), gz->f) != sizeof(trailer))
+    {
+        logE(TAG_GZ_STREAM, "%s", "Missing gzip trailer");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (readLE32(trailer) != gz->crc || readLE32(&trailer[4]) != gz->size)
+    {
+        logE(TAG_GZ_STREAM, "CRC/size mismatch: 0x%08X/%u bytes, expected 0x%08X/%u bytes",
+             gz->crc, gz->size, readLE32(trailer), readLE32(&trailer[4]));
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    logD(TAG_GZ_STREAM, "Inflated %u bytes", gz->size);
+    return ESP_OK;
+}
+
+static esp_err_t gzInflate(gz_stream_t *gz)
+{
+    if (gz->input_pos == gz->input_len && !feof(gz->f))
+    {
+        gz->input_len = fread(gz->input, 1, GZ_INPUT_SIZE, gz->f);
+        gz->input_pos = 0;
+        if (ferror(gz->f))
+        {
+            return ESP_FAIL;
+        }
+    }
+
+    const int more_input = !feof(gz->f);
+    size_t in_bytes = gz->input_len - gz->input_pos;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - gz->window_pos;
+
+    gz->status = tinfl_decompress(&gz->inflator, &gz->input[gz->input_pos], &in_bytes,
+                                  gz->window, &gz->window[gz->window_pos], &out_bytes,
+                                  more_input ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+    gz->input_pos += in_bytes;
+
+    gz->output_pos = gz->window_pos;
+    gz->output_len = out_bytes;
+    gz->crc = crc32Update(gz->crc, &gz->window[gz->window_pos], out_bytes);
+    gz->size += out_bytes;
+    gz->window_pos = (gz->window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+    if (gz->status < 0 || (gz->status == TINFL_STATUS_NEEDS_MORE_INPUT && !more_input))
+    {
+        logE(TAG_GZ_STREAM, "Corrupt or truncated data, status %d", gz->status);
+        gz->status = TINFL_STATUS_FAILED;
+        return ESP_FAIL;
+    }
+    if (gz->status == TINFL_STATUS_DONE)
+    {
+        return gzCheckTrailer(gz);
+    }
+    return ESP_OK;
+}
+
+static ssize_t gzRead(void *cookie, char *buf, size_t count)
+{
+    gz_stream_t *gz = (gz_stream_t *)cookie;
+    size_t copied = 0;
+
+    while (copied < count)
+    {
+        if (gz->output_len)
+        {
+            const size_t n = MIN(count - copied, gz->output_len);
+            memcpy(&buf[copied], &gz->window[gz->output_pos], n);
+            gz->output_pos += n;
+            gz->output_len -= n;
+            copied += n;
+        }
+        else if (gz->status == TINFL_STATUS_DONE)
+        {
+            break;
+        }
+        else if (gz->status < 0 || gzInflate(gz) != ESP_OK)
+        {
+            // Don't hand out what was copied either, it can't be trusted
+            gz->status = TINFL_STATUS_FAILED;
+            return -1;
+        }
+    }
+
+    return copied;
+}
+
+static int gzSeek(void *cookie, gz_off_t *offset, int whence)
+{
+    gz_stream_t *gz = (gz_stream_t *)cookie;
+
+    // Only rewinding is supported
+    if (whence != SEEK_SET || *offset != 0 || fseek(gz->f, gz->data_start, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+    gzReset(gz);
+    return 0;
+}
+
+static int gzClose(void *cookie)
+{
+    gz_stream_t *gz = (gz_stream_t *)cookie;
+    int ret = fclose(gz->f);
+    free(gz->window);
+    free(gz);
+    return ret;
+}
+
+FILE *gzStreamOpen(const char *filepath)
+{
+    FILE *f = fopen(filepath, "r");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    const int magic0 = fgetc(f);
+    const int magic1 = fgetc(f);
+    rewind(f);
+    if (magic0 != GZ_MAGIC_0 || magic1 != GZ_MAGIC_1)
+    {
+        // Not compressed, read as is
+        return f;
+    }
+
+    gz_stream_t *gz = calloc(1, sizeof(gz_stream_t));
+    uint8_t *window = malloc(TINFL_LZ_DICT_SIZE);
+    if (!gz || !window)
+    {
+        logE(TAG_GZ_STREAM, "%s", "Failed to allocate inflate buffers");
+        goto fail;
+    }
+
+    if (gzSkipHeader(f) != ESP_OK)
+    {
+        logE(TAG_GZ_STREAM, "Unsupported gzip header in %s", filepath);
+        goto fail;
+    }
+
+    gz->f = f;
+    gz->window = window;
+    gz->data_start = ftell(f);
+    gzReset(gz);
+
+    cookie_io_functions_t io = {
+        .read = gzRead,
+        .write = NULL,
+        .seek = gzSeek,
+        .close = gzClose};
+    FILE *stream = fopencookie(gz, "r", io);
+    if (stream)
+    {
+        logD(TAG_GZ_STREAM, "Inflating %s", filepath);
+        return stream;
+    }
+
+fail:
+    free(window);
+    free(gz);
+    fclose(f);
+    return NULL;
+}
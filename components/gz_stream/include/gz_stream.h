@@ -0,0 +1,28 @@
+#ifndef _GZ_STREAM_H
+#define _GZ_STREAM_H
+
+#include <stdio.h>
+#include "esp_err.h"
+
+// First two bytes of every gzip member
+#define GZ_MAGIC_0 0x1f
+#define GZ_MAGIC_1 0x8b
+
+/**
+ * @brief Open a stored file, decompressing it on the fly if it is gzip'd
+ *
+ * A gzip file is inflated as it is read, through a 32 KB window, so the
+ * decompressed data never has to fit in RAM or on storage. Anything else is
+ * handed back as the plain file. Either way the caller reads it with the
+ * usual stdio calls, and can rewind() it to read it again.
+ *
+ * The gzip CRC32 and size are checked once the whole member has been read;
+ * a mismatch shows up as a read error (ferror()).
+ *
+ * @param filepath the file to open
+ *
+ * @return the stream - success, NULL - failed
+ */
+FILE *gzStreamOpen(const char *filepath);
+
+#endif
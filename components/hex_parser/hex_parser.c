@@ -1,97 +1,710 @@
 #include "hex_parser.h"
 
+#if CONFIG_HEX_PARSER_PARALLEL
+#include <stdatomic.h>
+
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#endif
+
 //Functions for custom adjustments
 
 static const char *TAG_HEX_PARSER = "hex_parser";
 
-char *extractData(char hex_buff[], char data[], int start, int end)
+// Record types
+#define HEX_DATA 0x00
+#define HEX_END_OF_FILE 0x01
+#define HEX_EXT_SEGMENT_ADDRESS 0x02
+#define HEX_EXT_LINEAR_ADDRESS 0x04
+
+// Bytes of a Record around the Data: length, address (2), type ... checksum
+#define HEX_RECORD_HEADER 4
+
+static int hexNibble(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Per byte lanes of a word
+#define HEX_LANES(b) (0x01010101u * (b))
+
+/**
+ * @brief Decode 4 hex characters into 2 bytes, a word at a time (SWAR)
+ *
+ * Every character is range checked and converted in parallel, without a
+ * branch per character. Only ASCII has the top bit clear in all lanes, and
+ * adding to such a lane never carries into the next, so the top bit of each
+ * sum tells whether the character was at or above a bound.
+ *
+ * @return 1 - success, 0 - a non-hex character
+ */
+static inline int hexDecodeWord(uint32_t word, uint8_t *bytes)
+{
+    const uint32_t high = HEX_LANES(0x80);
+    const uint32_t lower = word | HEX_LANES(0x20);
+
+    // '0'-'9', and 'a'-'f' once folded to lower case
+    const uint32_t digit = (word + HEX_LANES(0x80 - '0')) & ~(word + HEX_LANES(0x80 - '9' - 1)) & high;
+    const uint32_t alpha = (lower + HEX_LANES(0x80 - 'a')) & ~(lower + HEX_LANES(0x80 - 'f' - 1)) & high;
+
+    // Low nibble of the character, plus 9 for letters: 'a' & 0xF == 1
+    const uint32_t nibbles = (word & HEX_LANES(0x0F)) + (alpha >> 7) * 9;
+    const uint32_t packed = (nibbles << 4) | (nibbles >> 8);
+
+    bytes[0] = packed;
+    bytes[1] = packed >> 16;
+    return !(word & high) && (digit | alpha) == high;
+}
+
+int hexDecode(const char *text, uint8_t *bytes, int count)
+{
+    int i = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // 8 characters into 4 bytes per round, the first character in the lowest lane
+    uint32_t words[2];
+    int valid = 1;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        memcpy(words, &text[2 * i], sizeof(words));
+        valid &= hexDecodeWord(words[0], &bytes[i]);
+        valid &= hexDecodeWord(words[1], &bytes[i + 2]);
+    }
+    if (!valid)
+    {
+        return 0;
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        const int hi = hexNibble(text[2 * i]);
+        if (hi < 0)
+        {
+            return 0;
+        }
+        const int lo = hexNibble(text[2 * i + 1]);
+        if (lo < 0)
+        {
+            return 0;
+        }
+        bytes[i] = (hi << 4) | lo;
+    }
+    return 1;
+}
+
+/**
+ * @brief Decode and check the Record on a line
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - no Record on the line,
+ *         ESP_ERR_INVALID_CRC / ESP_ERR_INVALID_SIZE - malformed Record
+ */
+static esp_err_t hexDecodeRecord(const char *line, uint8_t *record)
 {
-    int c = 0;
-    int size = (end - start) + 1;
+    const char *start = strchr(line, ':');
+    if (!start)
+    {
+        // Blank line
+        return ESP_ERR_NOT_FOUND;
+    }
 
-    while (c < size)
+    // hexDecode() reads a word at a time, so it mustn't run past the line
+    const size_t digits = strcspn(start + 1, "\r\n");
+    if (digits < 2 || !hexDecode(start + 1, record, 1) || digits < 2 * (HEX_RECORD_HEADER + record[0] + 1) ||
+        !hexDecode(start + 1, record, HEX_RECORD_HEADER + record[0] + 1))
     {
-        data[c] = hex_buff[start + c];
-        c++;
+        logE(TAG_HEX_PARSER, "Malformed Record: %s", line);
+        return ESP_ERR_INVALID_SIZE;
     }
-    data[c] = '\0';
 
-    return data;
+    uint8_t checksum = 0;
+    for (int i = 0; i < HEX_RECORD_HEADER + record[0] + 1; i++)
+    {
+        checksum += record[i];
+    }
+    if (checksum != 0)
+    {
+        logE(TAG_HEX_PARSER, "Checksum mismatch in Record: %s", line);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
 }
 
-esp_err_t hexFileParser(char *filepath, uint8_t page[], int *block_count)
+// Base address set by an extended address Record, returns 0 for other Records
+static int hexRecordBase(const uint8_t *record, uint32_t *base)
 {
-    int idx = 0;
+    const uint16_t value = record[4] << 8 | record[5];
 
-    logD(TAG_HEX_PARSER, "Reading file: %s", filepath);
-    FILE *f = fopen(filepath, "r");
-    if (f == NULL)
+    switch (record[3])
     {
-        logE(TAG_HEX_PARSER, "%s",  "Failed to open file for reading");
-        return errno;
+    case HEX_EXT_SEGMENT_ADDRESS:
+        *base = (uint32_t)value << 4;
+        return 1;
+    case HEX_EXT_LINEAR_ADDRESS:
+        *base = (uint32_t)value << 16;
+        return 1;
+    default:
+        return 0;
     }
+}
+
+/**
+ * @brief Read Records up to the next Data Record
+ *
+ * Address Records on the way update the base address
+ *
+ * @return ESP_OK - got a Data Record, ESP_ERR_NOT_FOUND - end of file,
+ *         ESP_ERR_INVALID_CRC / ESP_ERR_INVALID_SIZE - malformed Record
+ */
+static esp_err_t hexReadRecord(hex_image_t *image)
+{
+    uint8_t *record = image->record;
+
+    while (fgets(image->line, sizeof(image->line), image->f))
+    {
+        const esp_err_t ret = hexDecodeRecord(image->line, record);
+        if (ret == ESP_ERR_NOT_FOUND)
+        {
+            continue;
+        }
+        if (ret != ESP_OK)
+        {
+            return ret;
+        }
+
+        switch (record[3])
+        {
+        case HEX_DATA:
+            image->address = image->base + (record[1] << 8 | record[2]);
+            image->length = record[0];
+            image->pos = 0;
+            return ESP_OK;
+        case HEX_END_OF_FILE:
+            return ESP_ERR_NOT_FOUND;
+        default:
+            // Start Address Records mean nothing to an AVR
+            hexRecordBase(record, &image->base);
+            break;
+        }
+    }
+
+    return ferror(image->f) ? ESP_FAIL : ESP_ERR_NOT_FOUND;
+}
+
+static esp_err_t hexImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    hex_image_t *image = (hex_image_t *)source;
+    uint32_t block_address = 0;
+    int have_block = 0;
 
     while (1)
     {
-        char curr_line[64], prev_line[64];
+        if (image->pos >= image->length)
+        {
+            if (image->eof)
+            {
+                break;
+            }
+            esp_err_t ret = hexReadRecord(image);
+            if (ret == ESP_ERR_NOT_FOUND)
+            {
+                image->eof = 1;
+                break;
+            }
+            if (ret != ESP_OK)
+            {
+                return ret;
+            }
+            continue;
+        }
 
-        fgets(curr_line, sizeof(curr_line), f);
-        char* pos = curr_line;
-        while ((*pos != '\r') && (*pos != '\n') && (*pos != '\0') && (pos - curr_line < 64))
+        const uint32_t current = image->address + image->pos;
+        if (!have_block)
         {
-            pos++;
+            block_address = current & ~(uint32_t)(BLOCK_SIZE - 1);
+            memset(image->block, 0xff, BLOCK_SIZE);
+            have_block = 1;
         }
 
-        if (strcmp(prev_line, curr_line) == 0)
+        if (current < block_address || block_address < image->next)
+        {
+            // Blocks already written can't be revisited
+            logE(TAG_HEX_PARSER, "Records out of address order at 0x%05X", current);
+            return ESP_ERR_INVALID_STATE;
+        }
+        if (current >= block_address + BLOCK_SIZE)
         {
+            // Belongs to a later block, keep it for the next call
             break;
         }
 
-        if (pos)
+        const int count = MIN(image->length - image->pos, (int)(block_address + BLOCK_SIZE - current));
+        memcpy(&image->block[current - block_address], &image->record[HEX_RECORD_HEADER + image->pos], count);
+        image->pos += count;
+    }
+
+    if (!have_block)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    image->next = block_address + BLOCK_SIZE;
+    *address = block_address;
+    *block = image->block;
+    return ESP_OK;
+}
+
+static esp_err_t hexImageRewind(avr_image_source_t *source)
+{
+    hex_image_t *image = (hex_image_t *)source;
+
+    image->base = 0;
+    image->address = 0;
+    image->length = 0;
+    image->pos = 0;
+    image->next = 0;
+    image->eof = 0;
+
+    return fseek(image->f, 0, SEEK_SET) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t hexImageInit(hex_image_t *image, FILE *f)
+{
+    image->f = f;
+    image->source.nextBlock = hexImageNextBlock;
+    image->source.rewind = hexImageRewind;
+    return hexImageRewind(&image->source);
+}
+
+esp_err_t hexImageOpen(hex_image_t *image, const char *filepath)
+{
+    logD(TAG_HEX_PARSER, "Reading file: %s", filepath);
+    FILE *f = gzStreamOpen(filepath);
+    if (f == NULL)
+    {
+        logE(TAG_HEX_PARSER, "%s", "Failed to open file for reading");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return hexImageInit(image, f);
+}
+
+void hexImageClose(hex_image_t *image)
+{
+    if (image->f)
+    {
+        fclose(image->f);
+        image->f = NULL;
+    }
+}
+
+#if CONFIG_HEX_PARSER_PARALLEL
+// Blocks added to a part's image at a time while decoding
+#define HEX_BLOCKS_GROW 16
+
+/**
+ * @brief Line aligned byte range of a .hex file, decoded by a task of its own
+ *
+ * The base address the part starts with is only known once the part before
+ * is done. Until its first extended address Record, a part decodes against
+ * base 0 and counts those blocks in relative; they are moved into place when
+ * the parts are joined.
+ */
+typedef struct
+{
+    FILE *f;
+    long pos;
+    long end;
+
+    // Blocks all parts have taken so far, shared by them, and how many they may take
+    atomic_uint *taken;
+    uint32_t max_blocks;
+
+    uint32_t base;
+    int based;
+    uint32_t relative;
+
+    // End of File Record seen, the parts after it don't count
+    int eof;
+
+    hex_blocks_t blocks;
+    esp_err_t ret;
+    SemaphoreHandle_t done;
+
+    char line[HEX_RECORD_LINE_MAX];
+    uint8_t record[5 + 255];
+} hex_part_t;
+
+// Prefer PSRAM like the image cache, which takes over the arrays
+static void *hexRealloc(void *ptr, size_t size)
+{
+    void *p = heap_caps_realloc(ptr, size, MALLOC_CAP_SPIRAM);
+    return p ? p : realloc(ptr, size);
+}
+
+// Make room for capacity blocks, returns 0 when out of memory
+static int hexBlocksReserve(hex_blocks_t *blocks, uint32_t capacity)
+{
+    if (capacity <= blocks->capacity)
+    {
+        return 1;
+    }
+
+    uint32_t *addresses = hexRealloc(blocks->addresses, capacity * sizeof(uint32_t));
+    if (addresses)
+    {
+        blocks->addresses = addresses;
+    }
+    uint8_t *data = hexRealloc(blocks->data, capacity * BLOCK_SIZE);
+    if (data)
+    {
+        blocks->data = data;
+    }
+    if (!addresses || !data)
+    {
+        return 0;
+    }
+    blocks->capacity = capacity;
+    return 1;
+}
+
+static void hexBlocksFree(hex_blocks_t *blocks)
+{
+    free(blocks->addresses);
+    free(blocks->data);
+    memset(blocks, 0, sizeof(*blocks));
+}
+
+static uint8_t *hexPartBlock(hex_part_t *part, uint32_t block_address)
+{
+    hex_blocks_t *blocks = &part->blocks;
+    // Relative blocks can't be compared with the ones after the base is known
+    const uint32_t first = part->based ? part->relative : 0;
+
+    if (blocks->block_count > first)
+    {
+        const uint32_t last = blocks->addresses[blocks->block_count - 1];
+        if (block_address == last)
+        {
+            return &blocks->data[(blocks->block_count - 1) * BLOCK_SIZE];
+        }
+        if (block_address < last)
+        {
+            logE(TAG_HEX_PARSER, "Records out of address order at 0x%05X", block_address);
+            part->ret = ESP_ERR_INVALID_STATE;
+            return NULL;
+        }
+    }
+
+    // Stop as soon as the parts together are over, not once each has done its range
+    if (atomic_fetch_add_explicit(part->taken, 1, memory_order_relaxed) >= part->max_blocks)
+    {
+        part->ret = ESP_ERR_INVALID_SIZE;
+        return NULL;
+    }
+    if (blocks->block_count == blocks->capacity && !hexBlocksReserve(blocks, blocks->capacity + HEX_BLOCKS_GROW))
+    {
+        part->ret = ESP_ERR_NO_MEM;
+        return NULL;
+    }
+
+    uint8_t *block = &blocks->data[blocks->block_count * BLOCK_SIZE];
+    memset(block, 0xff, BLOCK_SIZE);
+    blocks->addresses[blocks->block_count++] = block_address;
+    return block;
+}
+
+// Decode the Records of a part into its blocks, up to the end of its range
+static void hexPartDecode(hex_part_t *part)
+{
+    part->ret = ESP_OK;
+
+    while (part->pos < part->end && fgets(part->line, sizeof(part->line), part->f))
+    {
+        const uint8_t *record = part->record;
+        part->pos += strlen(part->line);
+        const esp_err_t ret = hexDecodeRecord(part->line, part->record);
+        if (ret == ESP_ERR_NOT_FOUND)
+        {
+            continue;
+        }
+        if (ret != ESP_OK)
+        {
+            part->ret = ret;
+            return;
+        }
+
+        if (record[3] == HEX_END_OF_FILE)
+        {
+            part->eof = 1;
+            return;
+        }
+        if (record[3] != HEX_DATA)
+        {
+            if (!part->based && hexRecordBase(record, &part->base))
+            {
+                part->based = 1;
+                part->relative = part->blocks.block_count;
+            }
+            else
+            {
+                hexRecordBase(record, &part->base);
+            }
+            continue;
+        }
+
+        uint32_t address = part->base + (record[1] << 8 | record[2]);
+        int pos = 0;
+        while (pos < record[0])
         {
-            *pos = '\0';
+            const uint32_t block_address = address & ~(uint32_t)(BLOCK_SIZE - 1);
+            uint8_t *block = hexPartBlock(part, block_address);
+            if (!block)
+            {
+                return;
+            }
+
+            const int count = MIN(record[0] - pos, (int)(block_address + BLOCK_SIZE - address));
+            memcpy(&block[address - block_address], &record[HEX_RECORD_HEADER + pos], count);
+            pos += count;
+            address += count;
         }
+    }
+
+    if (ferror(part->f))
+    {
+        part->ret = ESP_FAIL;
+    }
+}
 
-        char buff[strlen(curr_line)];
-        strcpy(buff, curr_line);
+static void hexPartTask(void *parameter)
+{
+    hex_part_t *part = (hex_part_t *)parameter;
 
-        if (strlen(buff) > 12)
+    hexPartDecode(part);
+    xSemaphoreGive(part->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Append the blocks of the parts, in order, moving relative blocks into place
+ *
+ * A block cut by a boundary is in both parts, filled with 0xFF where the
+ * other part has the data, so the two are ANDed together. The first part's
+ * arrays grow by one part at a time, which is freed right after, so no more
+ * than one part is ever held twice.
+ */
+static esp_err_t hexPartsJoin(hex_part_t *parts, int count, uint32_t max_blocks, hex_blocks_t *result)
+{
+    hex_blocks_t *blocks = &parts[0].blocks;
+    uint32_t base = parts[0].base;
+
+    for (int k = 0; k < count; k++)
+    {
+        if (parts[k].eof)
         {
-            int start = 9;
-            int end = strlen(buff) - 3;
-            int size = (end - start) + 1;
+            count = k + 1;
+            break;
+        }
+    }
 
-            char raw_data[size];
-            extractData(buff, raw_data, start, end);
+    for (int k = 1; k < count; k++)
+    {
+        hex_blocks_t *from = &parts[k].blocks;
+        const uint32_t relative = parts[k].based ? parts[k].relative : from->block_count;
+
+        if (relative && base % BLOCK_SIZE)
+        {
+            // Moving the blocks would cut them anew
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if (!hexBlocksReserve(blocks, blocks->block_count + from->block_count))
+        {
+            return ESP_ERR_NO_MEM;
+        }
+
+        for (uint32_t i = 0; i < from->block_count; i++)
+        {
+            const uint32_t address = from->addresses[i] + (i < relative ? base : 0);
+            const uint8_t *block = &from->data[i * BLOCK_SIZE];
+            const uint32_t last = blocks->block_count ? blocks->addresses[blocks->block_count - 1] : 0;
 
-            char byte_buff[3];
-            byte_buff[2] = '\0';
-            for (int i = 0; i < strlen(raw_data) - 1; i += 2)
+            if (blocks->block_count && address == last)
             {
-                byte_buff[0] = raw_data[i];
-                byte_buff[1] = raw_data[i + 1];
-                page[idx] = strtol(byte_buff, 0, 16);
-                idx++;
-                if (idx >= PAGE_SIZE_MAX)
+                uint8_t *into = &blocks->data[(blocks->block_count - 1) * BLOCK_SIZE];
+                for (int j = 0; j < BLOCK_SIZE; j++)
                 {
-                    fclose(f);
-                    return EMSGSIZE;
+                    into[j] &= block[j];
                 }
+                continue;
             }
+            if (blocks->block_count && address < last)
+            {
+                // Left to the serial decode to report
+                return ESP_ERR_NOT_SUPPORTED;
+            }
+
+            blocks->addresses[blocks->block_count] = address;
+            memcpy(&blocks->data[blocks->block_count * BLOCK_SIZE], block, BLOCK_SIZE);
+            blocks->block_count++;
+        }
+        hexBlocksFree(from);
+
+        if (parts[k].based)
+        {
+            base = parts[k].base;
         }
-        strcpy(prev_line, curr_line);
     }
 
-    while (idx % 128 != 0)
+    if (blocks->block_count > max_blocks)
     {
-        page[idx] = 0xff;
-        idx++;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!blocks->block_count && !hexBlocksReserve(blocks, 1))
+    {
+        return ESP_ERR_NO_MEM;
     }
 
-    //ESP_LOG_BUFFER_HEXDUMP("Page: ", page, sizeof(page), ESP_LOG_DEBUG);
-    *block_count = (idx) / 128;
-    logD(TAG_HEX_PARSER, "Block count: %d", *block_count);
-    fclose(f);
-
+    *result = *blocks;
+    memset(blocks, 0, sizeof(*blocks));
     return ESP_OK;
 }
+
+esp_err_t hexDecodeParallel(const char *filepath, int parts, uint32_t max_blocks, hex_blocks_t *blocks)
+{
+    if (parts < 1 || parts > HEX_PARTS_MAX)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    hex_part_t *part = calloc(parts, sizeof(hex_part_t));
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(parts, 0);
+    atomic_uint taken = 0;
+    int started = 0;
+    uint8_t magic[2] = {0};
+    long size = 0;
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    if (!part || !done)
+    {
+        goto cleanup;
+    }
+    for (int k = 0; k < parts; k++)
+    {
+        part[k].f = fopen(filepath, "r");
+        if (!part[k].f)
+        {
+            ret = ESP_ERR_NOT_FOUND;
+            goto cleanup;
+        }
+        // A part may take a block twice: one cut by its boundary with the part
+        // before, and one cut by its first extended address Record
+        part[k].taken = &taken;
+        part[k].max_blocks = max_blocks < UINT32_MAX / 2 - parts ? max_blocks + 2 * (parts - 1) : UINT32_MAX;
+        part[k].done = done;
+    }
+
+    // A gzip stream can only be read from the start
+    FILE *f = part[parts - 1].f;
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || (magic[0] == GZ_MAGIC_0 && magic[1] == GZ_MAGIC_1) ||
+        fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+    {
+        ret = ESP_ERR_NOT_SUPPORTED;
+        goto cleanup;
+    }
+
+    // Each part after the first starts on the line after its share of the file begins
+    for (int k = 0; k < parts; k++)
+    {
+        long end = size;
+        if (k + 1 < parts)
+        {
+            end = MAX(part[k].pos, size * (k + 1) / parts - 1);
+            if (fseek(f, end, SEEK_SET) != 0)
+            {
+                ret = ESP_FAIL;
+                goto cleanup;
+            }
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n')
+            {
+            }
+            end = ftell(f);
+            part[k + 1].pos = end;
+        }
+        part[k].end = end;
+    }
+    for (int k = 0; k < parts; k++)
+    {
+        if (fseek(part[k].f, part[k].pos, SEEK_SET) != 0)
+        {
+            ret = ESP_FAIL;
+            goto cleanup;
+        }
+    }
+
+    // The first part's base address is known, the caller decodes it
+    part[0].based = 1;
+    for (int k = 1; k < parts; k++)
+    {
+        if (xTaskCreatePinnedToCore(&hexPartTask, "Hex Parser", 4096, &part[k], uxTaskPriorityGet(NULL), NULL,
+                                    (xPortGetCoreID() + k) % portNUM_PROCESSORS) == pdPASS)
+        {
+            started++;
+        }
+        else
+        {
+            hexPartDecode(&part[k]);
+        }
+    }
+    hexPartDecode(&part[0]);
+    for (int k = 0; k < started; k++)
+    {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+
+    ret = ESP_OK;
+    for (int k = 0; k < parts && ret == ESP_OK; k++)
+    {
+        ret = part[k].ret;
+        if (part[k].eof)
+        {
+            break;
+        }
+    }
+    if (ret == ESP_OK)
+    {
+        ret = hexPartsJoin(part, parts, max_blocks, blocks);
+    }
+    logD(TAG_HEX_PARSER, "%s decoded in %d parts: %s", filepath, parts, esp_err_to_name(ret));
+
+cleanup:
+    for (int k = 0; part && k < parts; k++)
+    {
+        if (part[k].f)
+        {
+            fclose(part[k].f);
+        }
+        hexBlocksFree(&part[k].blocks);
+    }
+    if (done)
+    {
+        vSemaphoreDelete(done);
+    }
+    free(part);
+    return ret;
+}
+#endif
@@ -1,40 +1,115 @@
 #ifndef _HEX_PARSER_H
 #define _HEX_PARSER_H
 
-#include "avr_pro_mode.h"
+#include "avr_flash.h"
+#include "gz_stream.h"
+
+// Longest hex Record: ':', length, address, type, 255 bytes of Data and checksum as
+// hex characters, plus the line ending and termination
+#define HEX_RECORD_LINE_MAX (1 + (5 + 255) * 2 + 3)
+
+/**
+ * @brief .hex file read as an image source
+ *
+ * The .hex file is decoded one Record at a time as the blocks are asked for,
+ * so only a single Record and block are held in memory. Data Records (00)
+ * are placed at their address, Extended Segment (02) and Extended Linear (04)
+ * Address Records move the base address for images beyond 64 KB.
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    FILE *f;
+
+    // Base address from the last extended address Record
+    uint32_t base;
+
+    // Current Data Record: its address, length and bytes handed out so far
+    uint32_t address;
+    int length;
+    int pos;
+
+    // Address following the last block handed out
+    uint32_t next;
+
+    // End of File Record seen
+    int eof;
+
+    char line[HEX_RECORD_LINE_MAX];
+    uint8_t record[5 + 255];
+    uint8_t block[BLOCK_SIZE];
+} hex_image_t;
+
+/**
+ * @brief Decode hex characters into bytes
+ *
+ * @param text hex characters, two per byte
+ * @param bytes To store the decoded bytes
+ * @param count no. of bytes to decode
+ *
+ * @return 1 - success, 0 - text holds a non-hex character
+ */
+int hexDecode(const char *text, uint8_t *bytes, int count);
+
+/**
+ * @brief Open a .hex file as an image source
+ *
+ * gzip'd files are inflated as they are read, see gzStreamOpen()
+ *
+ * @param image the image source to set up
+ * @param filepath the .hex file
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - failed to open the file
+ */
+esp_err_t hexImageOpen(hex_image_t *image, const char *filepath);
+
+/**
+ * @brief Read an open stream of .hex Records as an image source
+ *
+ * @param image the image source to set up
+ * @param f the stream, owned by the image from here on
+ *
+ * @return ESP_OK - success, ESP_FAIL - the stream can't be rewound
+ */
+esp_err_t hexImageInit(hex_image_t *image, FILE *f);
+
+//Close the .hex file behind the image source
+void hexImageClose(hex_image_t *image);
+
+// Most parts hexDecodeParallel() splits a file into
+#define HEX_PARTS_MAX 8
 
 /**
- * @brief Parse the data from a hex Record
- *   For e.g. =>
- *   :100000000C9434000C9446000C9446000C9446006A
- *   : => Record start
- *   10 => Data length (16 bytes for most records)
- *   0000 => Start Address
- *   00 => Record Type (00 = Data Record)
- *   0C 94 34 00 0C 94 46 00 0C 94 46 00 0C 94 46 00 => Data; to be extracted
- *   6A => Checksum
- * 
- * @param buff Raw hex Record
- * @param data To store the parsed result
- * @param start Starting index of Data in Record
- * @param end Ending index of Data in Record  
- * 
- * @return data : parsed data from raw hex Record
+ * @brief Decoded image: its blocks, and their flash addresses, in address order
  */
-char *extractData(char buff[], char data[], int start, int end);
+typedef struct
+{
+    uint32_t block_count;
+    uint32_t capacity;
+    uint32_t *addresses;
+    uint8_t *data;
+} hex_blocks_t;
 
 /**
- * @brief Parse an entire .hex file for data
- * 
- * It gives out a 'page' of data, containing all the Data parsed from each of the hex Records 
- * from the .hex file
- * 
- * @param filepath the .hex file to be parsed
- * @param page To store the parsed result
- * @param block_count Total no. of blocks (128 bytes each)
- *   
- * @return ESP_OK - success, ESP_FAIL - failed
+ * @brief Decode a whole .hex file with its parts on several cores at once
+ *
+ * The file is cut into line aligned byte ranges of about the same size. The
+ * caller decodes the first one while a task per core decodes each of the
+ * others. A part only learns the base address it starts with once the part
+ * before is done, so the blocks it decodes ahead of its first extended address
+ * Record are moved into place as the parts are joined. The parts stop as
+ * soon as together they are over max_blocks. The arrays are taken from PSRAM
+ * when it is fitted.
+ *
+ * @param filepath the .hex file
+ * @param parts no. of parts, up to HEX_PARTS_MAX
+ * @param max_blocks most blocks the image may take
+ * @param blocks set to the image, free its arrays when done with it
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_SUPPORTED - can't be split, the file
+ *         is gzip'd or a part would start at a base address not on a block,
+ *         ESP_ERR_INVALID_SIZE - more than max_blocks, other - failed
  */
-esp_err_t hexFileParser(char *filepath, uint8_t page[], int *block_count);
+esp_err_t hexDecodeParallel(const char *filepath, int parts, uint32_t max_blocks, hex_blocks_t *blocks);
 
 #endif
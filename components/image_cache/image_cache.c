@@ -0,0 +1,399 @@
+#include "image_cache.h"
+
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+
+static const char *TAG_IMAGE_CACHE = "image_cache";
+
+#define IMAGE_CACHE_BYTES (CONFIG_IMAGE_CACHE_SIZE_KB * 1024)
+
+// Blocks added to an entry at a time while decoding
+#define IMAGE_CACHE_GROW 16
+
+// RAM taken by an entry holding count blocks
+#define ENTRY_BYTES(count) ((count) * (BLOCK_SIZE + sizeof(uint32_t)))
+
+// Fewest blocks a .hex file of the given size holds, written like avr-objcopy
+// does with 16 byte Records of 45 characters each, CRLF included. Denser files
+// hold more
+#define HEX_MIN_BLOCKS(size) ((size) / 45 * 16 / BLOCK_SIZE)
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static image_cache_entry_t *cache[CONFIG_IMAGE_CACHE_ENTRIES ? CONFIG_IMAGE_CACHE_ENTRIES : 1];
+static size_t cacheBytes = 0;
+static uint32_t cacheTick = 0;
+static SemaphoreHandle_t cacheLock = NULL;
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t *data, size_t length)
+{
+    while (length--)
+    {
+        hash = (hash ^ *data++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Prefer PSRAM, there is plenty of it when it is fitted
+static void *cacheRealloc(void *ptr, size_t size)
+{
+    void *p = heap_caps_realloc(ptr, size, MALLOC_CAP_SPIRAM);
+    return p ? p : realloc(ptr, size);
+}
+
+static void entryFree(image_cache_entry_t *entry)
+{
+    free(entry->addresses);
+    free(entry->data);
+    free(entry);
+}
+
+// Take the entry out of the cache, it goes once nobody uses it. Lock held
+static void cacheRemove(int i)
+{
+    image_cache_entry_t *entry = cache[i];
+
+    cache[i] = NULL;
+    cacheBytes -= ENTRY_BYTES(entry->capacity);
+    if (entry->refs == 0)
+    {
+        entryFree(entry);
+    }
+    else
+    {
+        entry->stale = 1;
+    }
+}
+
+// Put a new entry in the cache, making room by evicting the least recently
+// used ones. If it still doesn't fit, it stays private to its user. Lock held
+static void cacheInsert(image_cache_entry_t *entry)
+{
+    const size_t bytes = ENTRY_BYTES(entry->capacity);
+
+    for (int i = 0; i < CONFIG_IMAGE_CACHE_ENTRIES; i++)
+    {
+        if (cache[i] && strcmp(cache[i]->path, entry->path) == 0)
+        {
+            cacheRemove(i);
+        }
+    }
+
+    while (1)
+    {
+        int free_slot = -1, lru = -1;
+        for (int i = 0; i < CONFIG_IMAGE_CACHE_ENTRIES; i++)
+        {
+            if (!cache[i])
+            {
+                free_slot = i;
+            }
+            else if (cache[i]->refs == 0 && (lru < 0 || cache[i]->last_used < cache[lru]->last_used))
+            {
+                lru = i;
+            }
+        }
+
+        if (free_slot >= 0 && cacheBytes + bytes <= IMAGE_CACHE_BYTES)
+        {
+            cache[free_slot] = entry;
+            cacheBytes += bytes;
+            entry->last_used = ++cacheTick;
+            return;
+        }
+        if (lru < 0)
+        {
+            entry->stale = 1;
+            return;
+        }
+
+        logD(TAG_IMAGE_CACHE, "Evicting %s", cache[lru]->path);
+        cacheRemove(lru);
+    }
+}
+
+/**
+ * @brief Decode the whole image into a new entry
+ *
+ * @return ESP_OK - success, ESP_ERR_INVALID_SIZE - too big for the cache,
+ *         ESP_ERR_NO_MEM or image errors - failed
+ */
+static esp_err_t cacheDecode(avr_image_t *file, const file_meta_t *meta, image_cache_entry_t **result)
+{
+    image_cache_entry_t *entry;
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret;
+
+    // Not worth decoding only to find out it doesn't fit, it would be read twice
+    if (file->format == IMAGE_HEX && ENTRY_BYTES(HEX_MIN_BLOCKS(meta->size)) > IMAGE_CACHE_BYTES)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    entry = calloc(1, sizeof(image_cache_entry_t));
+    if (!entry)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    strlcpy(entry->path, meta->path, sizeof(entry->path));
+    entry->size = meta->size;
+    entry->mtime = meta->mtime;
+    entry->file_hash = meta->hash;
+    entry->hash = FNV_OFFSET_BASIS;
+
+    // Until decoded, ESP_ERR_NOT_FOUND once the whole image is in
+    ret = ESP_ERR_NOT_SUPPORTED;
+#if CONFIG_HEX_PARSER_PARALLEL
+    // Large .hex files are decoded a part on each core
+    if (file->format == IMAGE_HEX && meta->size >= CONFIG_HEX_PARSER_PARALLEL_MIN_KB * 1024)
+    {
+        hex_blocks_t blocks;
+        ret = hexDecodeParallel(meta->path, portNUM_PROCESSORS, IMAGE_CACHE_BYTES / ENTRY_BYTES(1), &blocks);
+        if (ret == ESP_OK)
+        {
+            entry->block_count = blocks.block_count;
+            entry->capacity = blocks.capacity;
+            entry->addresses = blocks.addresses;
+            entry->data = blocks.data;
+            ret = ESP_ERR_NOT_FOUND;
+        }
+        else if (ret != ESP_ERR_INVALID_SIZE)
+        {
+            // Left to the file's own decode, which reports any fault as ever
+            ret = ESP_ERR_NOT_SUPPORTED;
+        }
+    }
+#endif
+
+    if (ret == ESP_ERR_NOT_SUPPORTED)
+    {
+        while ((ret = file->source.nextBlock(&file->source, &address, &block)) == ESP_OK)
+        {
+            if (entry->block_count == entry->capacity)
+            {
+                const uint32_t capacity = entry->capacity + IMAGE_CACHE_GROW;
+                if (ENTRY_BYTES(capacity) > IMAGE_CACHE_BYTES)
+                {
+                    ret = ESP_ERR_INVALID_SIZE;
+                    break;
+                }
+
+                uint32_t *addresses = cacheRealloc(entry->addresses, capacity * sizeof(uint32_t));
+                if (addresses)
+                {
+                    entry->addresses = addresses;
+                }
+                uint8_t *data = cacheRealloc(entry->data, capacity * BLOCK_SIZE);
+                if (data)
+                {
+                    entry->data = data;
+                }
+                if (!addresses || !data)
+                {
+                    ret = ESP_ERR_NO_MEM;
+                    break;
+                }
+                entry->capacity = capacity;
+            }
+
+            entry->addresses[entry->block_count] = address;
+            memcpy(&entry->data[entry->block_count * BLOCK_SIZE], block, BLOCK_SIZE);
+            entry->block_count++;
+        }
+    }
+
+    if (ret != ESP_ERR_NOT_FOUND)
+    {
+        entryFree(entry);
+        return ret;
+    }
+
+    for (uint32_t i = 0; i < entry->block_count; i++)
+    {
+        entry->hash = fnv1a(entry->hash, (const uint8_t *)&entry->addresses[i], sizeof(uint32_t));
+        entry->hash = fnv1a(entry->hash, &entry->data[i * BLOCK_SIZE], BLOCK_SIZE);
+    }
+
+    logI(TAG_IMAGE_CACHE, "Decoded %s: %u blocks, hash 0x%08X", meta->path, entry->block_count, entry->hash);
+    *result = entry;
+    return ESP_OK;
+}
+
+static esp_err_t cachedImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    cached_image_t *image = (cached_image_t *)source;
+
+    if (!image->entry)
+    {
+        avr_image_source_t *from = image->in_slot ? &image->slot.source : &image->file.source;
+        return from->nextBlock(from, address, block);
+    }
+    if (image->next >= image->entry->block_count)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *address = image->entry->addresses[image->next];
+    *block = &image->entry->data[image->next * BLOCK_SIZE];
+    image->next++;
+    return ESP_OK;
+}
+
+static esp_err_t cachedImageRewind(avr_image_source_t *source)
+{
+    cached_image_t *image = (cached_image_t *)source;
+
+    if (!image->entry)
+    {
+        avr_image_source_t *from = image->in_slot ? &image->slot.source : &image->file.source;
+        return from->rewind(from);
+    }
+    image->next = 0;
+    return ESP_OK;
+}
+
+void imageCacheInit(void)
+{
+    cacheLock = xSemaphoreCreateMutex();
+    logI(TAG_IMAGE_CACHE, "Image cache: %d images, %d KB", CONFIG_IMAGE_CACHE_ENTRIES, CONFIG_IMAGE_CACHE_SIZE_KB);
+}
+
+esp_err_t imageCacheOpen(cached_image_t *image, const char *filepath)
+{
+    file_meta_t meta;
+    image_cache_entry_t *entry = NULL;
+    esp_err_t ret;
+
+    image->source.nextBlock = cachedImageNextBlock;
+    image->source.rewind = cachedImageRewind;
+    image->entry = NULL;
+    image->next = 0;
+    image->in_slot = 0;
+
+    if (imageSlotOpen(&image->slot, filepath) == ESP_OK)
+    {
+        image->in_slot = 1;
+        return ESP_OK;
+    }
+
+    if (!cacheLock || CONFIG_IMAGE_CACHE_ENTRIES == 0 || fileMetaGet(filepath, &meta) != ESP_OK)
+    {
+        return imageOpen(&image->file, filepath);
+    }
+
+    xSemaphoreTake(cacheLock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_IMAGE_CACHE_ENTRIES; i++)
+    {
+        if (cache[i] && strcmp(cache[i]->path, filepath) == 0 && cache[i]->size == meta.size &&
+            cache[i]->mtime == meta.mtime && cache[i]->file_hash == meta.hash)
+        {
+            entry = cache[i];
+            entry->refs++;
+            entry->last_used = ++cacheTick;
+            break;
+        }
+    }
+    xSemaphoreGive(cacheLock);
+
+    if (entry)
+    {
+        logI(TAG_IMAGE_CACHE, "Cache hit: %s", filepath);
+        image->entry = entry;
+        return ESP_OK;
+    }
+
+    ret = imageOpen(&image->file, filepath);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    ret = cacheDecode(&image->file, &meta, &entry);
+    if (ret == ESP_ERR_INVALID_SIZE)
+    {
+        logI(TAG_IMAGE_CACHE, "%s is too big for the cache, streaming it", filepath);
+        return image->file.source.rewind(&image->file.source);
+    }
+    imageClose(&image->file);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    entry->refs = 1;
+    xSemaphoreTake(cacheLock, portMAX_DELAY);
+    cacheInsert(entry);
+    xSemaphoreGive(cacheLock);
+
+    image->entry = entry;
+    return ESP_OK;
+}
+
+void imageCacheClose(cached_image_t *image)
+{
+    image_cache_entry_t *entry = image->entry;
+
+    if (image->in_slot)
+    {
+        imageSlotClose(&image->slot);
+        return;
+    }
+    if (!entry)
+    {
+        imageClose(&image->file);
+        return;
+    }
+
+    xSemaphoreTake(cacheLock, portMAX_DELAY);
+    if (--entry->refs == 0 && entry->stale)
+    {
+        entryFree(entry);
+    }
+    xSemaphoreGive(cacheLock);
+    image->entry = NULL;
+}
+
+int imageCacheStats(const char *filepath, uint32_t *block_count, uint32_t *hash)
+{
+    int found = 0;
+
+    if (!cacheLock)
+    {
+        return 0;
+    }
+
+    xSemaphoreTake(cacheLock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_IMAGE_CACHE_ENTRIES; i++)
+    {
+        if (cache[i] && strcmp(cache[i]->path, filepath) == 0)
+        {
+            *block_count = cache[i]->block_count;
+            *hash = cache[i]->hash;
+            found = 1;
+            break;
+        }
+    }
+    xSemaphoreGive(cacheLock);
+    return found;
+}
+
+void imageCacheInvalidate(const char *filepath)
+{
+    if (!cacheLock)
+    {
+        return;
+    }
+
+    xSemaphoreTake(cacheLock, portMAX_DELAY);
+    for (int i = 0; i < CONFIG_IMAGE_CACHE_ENTRIES; i++)
+    {
+        if (cache[i] && strcmp(cache[i]->path, filepath) == 0)
+        {
+            logD(TAG_IMAGE_CACHE, "Invalidating %s", filepath);
+            cacheRemove(i);
+        }
+    }
+    xSemaphoreGive(cacheLock);
+}
@@ -0,0 +1,85 @@
+#ifndef _IMAGE_CACHE_H
+#define _IMAGE_CACHE_H
+
+#include "image_slot.h"
+#include "file_meta.h"
+
+// Max length a cached file path can have
+#define IMAGE_CACHE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
+
+/**
+ * @brief Decoded image kept in RAM
+ *
+ * Identified by the path of its file together with the file's size,
+ * modification time and content hash from fileMetaGet(), so a changed file
+ * is never served from the cache, even when rewritten within the same
+ * second at the same size.
+ */
+typedef struct
+{
+    char path[IMAGE_CACHE_PATH_MAX];
+    uint32_t size;
+    int64_t mtime;
+    uint64_t file_hash;
+
+    // FNV-1a hash over the decoded blocks and their addresses
+    uint32_t hash;
+
+    // Blocks, and their flash addresses, in the order they are written
+    uint32_t block_count;
+    uint32_t *addresses;
+    uint8_t *data;
+    uint32_t capacity;
+
+    // Cache tick of the last use, for LRU eviction
+    uint32_t last_used;
+
+    // Images handed out, and whether the entry was dropped meanwhile
+    int refs;
+    int stale;
+} image_cache_entry_t;
+
+/**
+ * @brief Image from a firmware slot, the cache, or from its file when it
+ * can't be cached
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    image_cache_entry_t *entry;
+    uint32_t next;
+
+    // Used when entry is NULL, the slot if in_slot is set
+    int in_slot;
+    slot_image_t slot;
+    avr_image_t file;
+} cached_image_t;
+
+//Set up the cache, images are opened straight from their files until then
+void imageCacheInit(void);
+
+/**
+ * @brief Open an image through the cache
+ *
+ * An image stored in a firmware slot is read from there, mapped flash costs
+ * no RAM. A cached image is handed out straight away. Otherwise the file is decoded
+ * into the cache first, evicting the least recently used images as needed,
+ * and when it is too big for the cache it is read from the file as usual.
+ *
+ * @param image the image to open
+ * @param filepath the image file
+ *
+ * @return ESP_OK - success, see imageOpen() for the rest
+ */
+esp_err_t imageCacheOpen(cached_image_t *image, const char *filepath);
+
+//Release an image opened with imageCacheOpen()
+void imageCacheClose(cached_image_t *image);
+
+//Get the block count and hash of a file's cached image, returns 1 if it is cached
+int imageCacheStats(const char *filepath, uint32_t *block_count, uint32_t *hash);
+
+//Drop the cached image for a file which was changed or deleted
+void imageCacheInvalidate(const char *filepath);
+
+#endif
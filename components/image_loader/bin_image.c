@@ -0,0 +1,50 @@
+#include "image_loader.h"
+
+static const char *TAG_BIN_IMAGE = "bin_image";
+
+static esp_err_t binImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    bin_image_t *image = (bin_image_t *)source;
+
+    const uint32_t block_address = image->address & ~(uint32_t)(BLOCK_SIZE - 1);
+    const size_t lead = image->address - block_address;
+
+    memset(image->block, 0xff, BLOCK_SIZE);
+    const size_t count = fread(&image->block[lead], 1, BLOCK_SIZE - lead, image->f);
+    if (count == 0)
+    {
+        return ferror(image->f) ? ESP_FAIL : ESP_ERR_NOT_FOUND;
+    }
+
+    image->address += count;
+    *address = block_address;
+    *block = image->block;
+    return ESP_OK;
+}
+
+static esp_err_t binImageRewind(avr_image_source_t *source)
+{
+    bin_image_t *image = (bin_image_t *)source;
+
+    image->address = image->base;
+    return fseek(image->f, 0, SEEK_SET) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t binImageInit(bin_image_t *image, FILE *f, uint32_t base)
+{
+    logD(TAG_BIN_IMAGE, "Raw image at 0x%05X", base);
+
+    image->f = f;
+    image->base = base;
+    image->source.nextBlock = binImageNextBlock;
+    image->source.rewind = binImageRewind;
+    return binImageRewind(&image->source);
+}
+
+uint32_t binBaseAddress(const char *filepath)
+{
+    const char *name = strrchr(filepath, '/');
+    const char *at = strchr(name ? name : filepath, '@');
+
+    return at ? strtoul(at + 1, NULL, 16) : 0;
+}
@@ -0,0 +1,204 @@
+#include "image_loader.h"
+
+static const char *TAG_ELF_IMAGE = "elf_image";
+
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF_MACHINE_AVR 83
+#define ELF_PT_LOAD 1
+
+// ELF32 file header, the ESP32 is little endian like the file
+typedef struct
+{
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} elf_header_t;
+
+// ELF32 program header
+typedef struct
+{
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} elf_program_header_t;
+
+static int elfRead(elf_image_t *image, void *data, size_t count)
+{
+    if (fread(data, 1, count, image->f) != count)
+    {
+        return 0;
+    }
+    image->position += count;
+    return 1;
+}
+
+// The stream may be inflated on the fly, so skip forwards by reading
+static int elfSkipTo(elf_image_t *image, uint32_t offset)
+{
+    uint8_t scratch[64];
+
+    if (offset < image->position)
+    {
+        return 0;
+    }
+    while (image->position < offset)
+    {
+        if (!elfRead(image, scratch, MIN(sizeof(scratch), offset - image->position)))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static esp_err_t elfImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    elf_image_t *image = (elf_image_t *)source;
+
+    if (image->segment >= image->segment_count)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const uint32_t block_address = image->address & ~(uint32_t)(BLOCK_SIZE - 1);
+    const uint32_t block_end = block_address + BLOCK_SIZE;
+    memset(image->block, 0xff, BLOCK_SIZE);
+
+    // Take data from every segment overlapping the block
+    while (image->segment < image->segment_count)
+    {
+        const elf_segment_t *segment = &image->segments[image->segment];
+        if (image->address >= block_end)
+        {
+            break;
+        }
+
+        const uint32_t segment_end = segment->address + segment->size;
+        const uint32_t count = MIN(segment_end, block_end) - image->address;
+        if (!elfSkipTo(image, segment->offset + (image->address - segment->address)) ||
+            !elfRead(image, &image->block[image->address - block_address], count))
+        {
+            logE(TAG_ELF_IMAGE, "Failed to read segment at 0x%05X", segment->address);
+            return ESP_FAIL;
+        }
+        image->address += count;
+
+        if (image->address == segment_end && ++image->segment < image->segment_count)
+        {
+            image->address = image->segments[image->segment].address;
+        }
+    }
+
+    *address = block_address;
+    *block = image->block;
+    return ESP_OK;
+}
+
+static esp_err_t elfImageRewind(avr_image_source_t *source)
+{
+    elf_image_t *image = (elf_image_t *)source;
+
+    image->segment = 0;
+    image->address = image->segments[0].address;
+    image->position = 0;
+    return fseek(image->f, 0, SEEK_SET) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t elfImageInit(elf_image_t *image, FILE *f)
+{
+    elf_header_t header;
+    elf_program_header_t program_header;
+
+    image->f = f;
+    image->position = 0;
+    image->segment_count = 0;
+
+    if (!elfRead(image, &header, sizeof(header)) ||
+        memcmp(header.e_ident, "\x7f" "ELF", 4) != 0 ||
+        header.e_ident[4] != ELF_CLASS_32 || header.e_ident[5] != ELF_DATA_LSB ||
+        header.e_machine != ELF_MACHINE_AVR)
+    {
+        logE(TAG_ELF_IMAGE, "%s", "Not an AVR .elf file");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (header.e_phentsize != sizeof(program_header) || !elfSkipTo(image, header.e_phoff))
+    {
+        logE(TAG_ELF_IMAGE, "%s", "Failed to read program headers");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    for (int i = 0; i < header.e_phnum; i++)
+    {
+        if (!elfRead(image, &program_header, sizeof(program_header)))
+        {
+            logE(TAG_ELF_IMAGE, "%s", "Failed to read program headers");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (program_header.p_type != ELF_PT_LOAD || program_header.p_filesz == 0 ||
+            program_header.p_paddr >= ELF_AVR_DATA_START)
+        {
+            // Not loaded, or not flash (RAM, EEPROM, fuses)
+            continue;
+        }
+        if (image->segment_count == ELF_SEGMENTS_MAX)
+        {
+            logE(TAG_ELF_IMAGE, "More than %d segments", ELF_SEGMENTS_MAX);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        // Keep the segments sorted by address
+        int j = image->segment_count++;
+        while (j > 0 && image->segments[j - 1].address > program_header.p_paddr)
+        {
+            image->segments[j] = image->segments[j - 1];
+            j--;
+        }
+        image->segments[j].address = program_header.p_paddr;
+        image->segments[j].offset = program_header.p_offset;
+        image->segments[j].size = program_header.p_filesz;
+    }
+
+    if (image->segment_count == 0)
+    {
+        logE(TAG_ELF_IMAGE, "%s", "No flash segments");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Blocks go out in address order while the file is only read forwards,
+    // so the segments have to be laid out in the file in the same order
+    for (int i = 0; i < image->segment_count; i++)
+    {
+        const elf_segment_t *segment = &image->segments[i];
+        logD(TAG_ELF_IMAGE, "Segment at 0x%05X, %u bytes", segment->address, segment->size);
+
+        if (segment->offset < image->position ||
+            (i > 0 && (segment->address < image->segments[i - 1].address + image->segments[i - 1].size ||
+                       segment->offset < image->segments[i - 1].offset + image->segments[i - 1].size)))
+        {
+            logE(TAG_ELF_IMAGE, "Overlapping or out of order segment at 0x%05X", segment->address);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    image->source.nextBlock = elfImageNextBlock;
+    image->source.rewind = elfImageRewind;
+    return elfImageRewind(&image->source);
+}
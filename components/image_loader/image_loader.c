@@ -0,0 +1,71 @@
+#include "image_loader.h"
+
+static const char *TAG_IMAGE_LOADER = "image_loader";
+
+#define IS_FILE_EXT(filename, ext) \
+    (strlen(filename) >= sizeof(ext) - 1 && strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
+
+esp_err_t imageOpen(avr_image_t *image, const char *filepath)
+{
+    FILE *f = gzStreamOpen(filepath);
+    if (f == NULL)
+    {
+        logE(TAG_IMAGE_LOADER, "Failed to open %s", filepath);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return imageOpenStream(image, f, filepath);
+}
+
+esp_err_t imageOpenStream(avr_image_t *image, FILE *f, const char *filename)
+{
+    char magic[4] = {0};
+    esp_err_t ret;
+
+    // Tell the format from the first bytes, inflated if need be
+    fread(magic, 1, sizeof(magic), f);
+    rewind(f);
+
+    if (magic[0] == ':')
+    {
+        image->format = IMAGE_HEX;
+        ret = hexImageInit(&image->hex, f);
+    }
+    else if (memcmp(magic, "\x7f" "ELF", sizeof(magic)) == 0)
+    {
+        image->format = IMAGE_ELF;
+        ret = elfImageInit(&image->elf, f);
+    }
+    else if (IS_FILE_EXT(filename, ".bin") || IS_FILE_EXT(filename, ".bin.gz"))
+    {
+        image->format = IMAGE_BIN;
+        ret = binImageInit(&image->bin, f, binBaseAddress(filename));
+    }
+    else
+    {
+        logE(TAG_IMAGE_LOADER, "Unknown image format: %s", filename);
+        ret = ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (ret != ESP_OK)
+    {
+        fclose(f);
+    }
+    return ret;
+}
+
+void imageClose(avr_image_t *image)
+{
+    switch (image->format)
+    {
+    case IMAGE_HEX:
+        hexImageClose(&image->hex);
+        break;
+    case IMAGE_BIN:
+        fclose(image->bin.f);
+        break;
+    case IMAGE_ELF:
+        fclose(image->elf.f);
+        break;
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef _IMAGE_LOADER_H
+#define _IMAGE_LOADER_H
+
+#include "hex_parser.h"
+
+// Most PT_LOAD segments of an AVR .elf we handle, avr-gcc emits two or three
+#define ELF_SEGMENTS_MAX 8
+
+// AVR .elf files map data memory from here on, anything above isn't flash
+#define ELF_AVR_DATA_START 0x800000
+
+/**
+ * @brief Raw .bin image, written to flash from a base address
+ *
+ * The base address is taken from the file name, as hex after an '@',
+ * e.g. "bootloader@3E000.bin". Without one the image starts at 0.
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    FILE *f;
+    uint32_t base;
+
+    // Address of the next byte read from the file
+    uint32_t address;
+
+    uint8_t block[BLOCK_SIZE];
+} bin_image_t;
+
+/**
+ * @brief Segment of an .elf file to be written to flash
+ */
+typedef struct
+{
+    uint32_t address;
+    uint32_t offset;
+    uint32_t size;
+} elf_segment_t;
+
+/**
+ * @brief AVR .elf file read as an image source
+ *
+ * The PT_LOAD program headers are written to flash at their physical
+ * addresses, which places .data right behind .text like objcopy does. The file
+ * is only ever read forwards, so a gzip'd .elf works as well.
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    FILE *f;
+
+    elf_segment_t segments[ELF_SEGMENTS_MAX];
+    int segment_count;
+
+    // Current segment, the address of its next byte and the file position
+    int segment;
+    uint32_t address;
+    uint32_t position;
+
+    uint8_t block[BLOCK_SIZE];
+} elf_image_t;
+
+typedef enum
+{
+    IMAGE_HEX,
+    IMAGE_BIN,
+    IMAGE_ELF,
+} image_format_t;
+
+/**
+ * @brief Image file of any of the supported formats
+ *
+ * Each format starts with its avr_image_source_t, so 'source' can be handed to
+ * writeImage()/verifyImage() whichever format was opened.
+ */
+typedef struct
+{
+    union
+    {
+        avr_image_source_t source;
+        hex_image_t hex;
+        bin_image_t bin;
+        elf_image_t elf;
+    };
+    image_format_t format;
+} avr_image_t;
+
+/**
+ * @brief Open an image file: Intel .hex, AVR .elf or raw .bin
+ *
+ * The format is told from the content, .hex starts with ':' and .elf with its
+ * magic, anything else named .bin is raw. Files can be gzip'd.
+ *
+ * @param image the image to open
+ * @param filepath the image file
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - failed to open the file,
+ *         ESP_ERR_NOT_SUPPORTED - not a format we know
+ */
+esp_err_t imageOpen(avr_image_t *image, const char *filepath);
+
+/**
+ * @brief Read an open stream as an image of any of the supported formats
+ *
+ * As imageOpen(), for images which don't come from a stored file. The
+ * stream has to support rewinding to the start.
+ *
+ * @param image the image to set up
+ * @param f the stream, owned by the image from here on, closed on failure
+ * @param filename name the image goes by, for telling a .bin and its base address
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_SUPPORTED - not a format we know
+ */
+esp_err_t imageOpenStream(avr_image_t *image, FILE *f, const char *filename);
+
+//Close the image file
+void imageClose(avr_image_t *image);
+
+/**
+ * @brief Read an open stream as a raw image
+ *
+ * @param image the image source to set up
+ * @param f the stream, owned by the image from here on
+ * @param base flash address of the first byte
+ *
+ * @return ESP_OK - success, ESP_FAIL - the stream can't be rewound
+ */
+esp_err_t binImageInit(bin_image_t *image, FILE *f, uint32_t base);
+
+//Base address given in the name of a .bin file, 0 if there is none
+uint32_t binBaseAddress(const char *filepath);
+
+/**
+ * @brief Read an open stream as an AVR .elf file
+ *
+ * @param image the image source to set up
+ * @param f the stream, owned by the image from here on
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_SUPPORTED - not a 32 bit little endian
+ *         AVR .elf, ESP_ERR_INVALID_SIZE - malformed or unsupported layout
+ */
+esp_err_t elfImageInit(elf_image_t *image, FILE *f);
+
+#endif
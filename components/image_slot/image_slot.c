@@ -0,0 +1,347 @@
+#include "image_slot.h"
+
+#include "freertos/semphr.h"
+
+static const char *TAG_IMAGE_SLOT = "image_slot";
+
+// "SLOT"
+#define IMAGE_SLOT_MAGIC 0x544f4c53
+#define IMAGE_SLOT_VERSION 1
+
+#define IMAGE_SLOT_SECTOR_SIZE 4096
+
+typedef struct
+{
+    const esp_partition_t *partition;
+    image_slot_header_t header;
+    int valid;
+
+    // Images open from the slot, it can't be rewritten meanwhile
+    int refs;
+} image_slot_t;
+
+static image_slot_t slots[IMAGE_SLOTS_MAX];
+static int slotCount = 0;
+static uint32_t slotSequence = 0;
+static SemaphoreHandle_t slotLock = NULL;
+
+// Held for a whole store, the HTTP server and the pull task both store
+static SemaphoreHandle_t storeLock = NULL;
+// Image being stored, it is too large for the callers' stacks
+static avr_image_t storeImage;
+
+static int slotFind(const char *filepath)
+{
+    for (int i = 0; i < slotCount; i++)
+    {
+        if (slots[i].valid && strcmp(slots[i].header.path, filepath) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pick the slot to write the file into, and claim it. Lock held
+static int slotClaim(const char *filepath)
+{
+    int slot = slotFind(filepath);
+
+    if (slot >= 0)
+    {
+        return slots[slot].refs ? -1 : slot;
+    }
+
+    for (int i = 0; i < slotCount; i++)
+    {
+        if (slots[i].refs)
+        {
+            continue;
+        }
+        if (!slots[i].valid)
+        {
+            return i;
+        }
+        if (slot < 0 || slots[i].header.sequence < slots[slot].header.sequence)
+        {
+            slot = i;
+        }
+    }
+    return slot;
+}
+
+// Zero the magic, flash bits can be cleared without an erase
+static esp_err_t slotErase(image_slot_t *slot)
+{
+    const uint32_t magic = 0;
+
+    slot->valid = 0;
+    return esp_partition_write(slot->partition, 0, &magic, sizeof(magic));
+}
+
+static esp_err_t slotImageNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    slot_image_t *image = (slot_image_t *)source;
+
+    if (image->next >= image->block_count)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *address = image->addresses[image->next];
+    *block = &image->data[image->next * BLOCK_SIZE];
+    image->next++;
+    return ESP_OK;
+}
+
+static esp_err_t slotImageRewind(avr_image_source_t *source)
+{
+    ((slot_image_t *)source)->next = 0;
+    return ESP_OK;
+}
+
+/**
+ * @brief Decode the image into the slot, the header is left to the caller
+ *
+ * Sectors are erased just ahead of the data, and the address table is
+ * gathered in RAM and written at the end, so the slot is written once,
+ * front to back.
+ */
+static esp_err_t slotWrite(image_slot_t *slot, avr_image_source_t *image, uint32_t *block_count)
+{
+    const uint32_t capacity = MIN(IMAGE_SLOT_BLOCKS_MAX, (slot->partition->size - IMAGE_SLOT_DATA_OFFSET) / BLOCK_SIZE);
+    uint32_t *addresses = malloc(capacity * sizeof(uint32_t));
+    uint32_t offset = IMAGE_SLOT_DATA_OFFSET;
+    uint32_t erased = IMAGE_SLOT_DATA_OFFSET;
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret;
+
+    if (!addresses)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Header and address table
+    ret = esp_partition_erase_range(slot->partition, 0, IMAGE_SLOT_DATA_OFFSET);
+    *block_count = 0;
+
+    while (ret == ESP_OK && (ret = image->nextBlock(image, &address, &block)) == ESP_OK)
+    {
+        if (*block_count == capacity)
+        {
+            ret = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        if (offset + BLOCK_SIZE > erased)
+        {
+            ret = esp_partition_erase_range(slot->partition, erased, IMAGE_SLOT_SECTOR_SIZE);
+            erased += IMAGE_SLOT_SECTOR_SIZE;
+        }
+        if (ret == ESP_OK)
+        {
+            ret = esp_partition_write(slot->partition, offset, block, BLOCK_SIZE);
+        }
+        addresses[(*block_count)++] = address;
+        offset += BLOCK_SIZE;
+    }
+
+    if (ret == ESP_ERR_NOT_FOUND)
+    {
+        ret = esp_partition_write(slot->partition, IMAGE_SLOT_TABLE_OFFSET, addresses, *block_count * sizeof(uint32_t));
+    }
+    free(addresses);
+    return ret;
+}
+
+void imageSlotInit(void)
+{
+    char label[sizeof(IMAGE_SLOT_LABEL) + 2];
+
+    slotLock = xSemaphoreCreateMutex();
+    storeLock = xSemaphoreCreateMutex();
+
+    for (int i = 0; i < IMAGE_SLOTS_MAX; i++)
+    {
+        snprintf(label, sizeof(label), IMAGE_SLOT_LABEL "%d", i);
+        const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, IMAGE_SLOT_SUBTYPE, label);
+        if (!partition)
+        {
+            break;
+        }
+
+        image_slot_t *slot = &slots[slotCount++];
+        slot->partition = partition;
+        slot->refs = 0;
+        slot->valid = esp_partition_read(partition, 0, &slot->header, sizeof(slot->header)) == ESP_OK &&
+                      slot->header.magic == IMAGE_SLOT_MAGIC && slot->header.version == IMAGE_SLOT_VERSION &&
+                      slot->header.block_size == BLOCK_SIZE;
+
+        if (slot->valid)
+        {
+            slotSequence = MAX(slotSequence, slot->header.sequence);
+            logI(TAG_IMAGE_SLOT, "%s: %s, %u blocks", label, slot->header.path, slot->header.block_count);
+        }
+    }
+
+    logI(TAG_IMAGE_SLOT, "Firmware slots: %d", slotCount);
+}
+
+static esp_err_t slotStore(const char *filepath, avr_image_t *image)
+{
+    file_meta_t meta;
+    uint32_t block_count;
+    esp_err_t ret;
+
+    ret = fileMetaGet(filepath, &meta);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+    ret = imageOpen(image, filepath);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    xSemaphoreTake(slotLock, portMAX_DELAY);
+    const int index = slotClaim(filepath);
+    if (index < 0)
+    {
+        xSemaphoreGive(slotLock);
+        imageClose(image);
+        logW(TAG_IMAGE_SLOT, "No free slot for %s", filepath);
+        return ESP_ERR_NOT_FOUND;
+    }
+    image_slot_t *slot = &slots[index];
+
+    // Claimed until the header is written, so nothing opens it meanwhile
+    slotErase(slot);
+    slot->refs++;
+    xSemaphoreGive(slotLock);
+
+    ret = slotWrite(slot, &image->source, &block_count);
+    imageClose(image);
+
+    xSemaphoreTake(slotLock, portMAX_DELAY);
+    if (ret == ESP_OK)
+    {
+        image_slot_header_t *header = &slot->header;
+        memset(header, 0, sizeof(*header));
+        header->magic = IMAGE_SLOT_MAGIC;
+        header->version = IMAGE_SLOT_VERSION;
+        header->block_size = BLOCK_SIZE;
+        header->sequence = ++slotSequence;
+        header->block_count = block_count;
+        header->file_hash = meta.hash;
+        strlcpy(header->path, filepath, sizeof(header->path));
+
+        ret = esp_partition_write(slot->partition, 0, header, sizeof(*header));
+        slot->valid = (ret == ESP_OK);
+    }
+    slot->refs--;
+    xSemaphoreGive(slotLock);
+
+    if (ret == ESP_OK)
+    {
+        logI(TAG_IMAGE_SLOT, "%s stored in %s, %u blocks", filepath, slot->partition->label, block_count);
+    }
+    else
+    {
+        logE(TAG_IMAGE_SLOT, "Failed to store %s: %s", filepath, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t imageSlotStore(const char *filepath)
+{
+    esp_err_t ret;
+
+    if (!slotLock || !storeLock || slotCount == 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(storeLock, portMAX_DELAY);
+    ret = slotStore(filepath, &storeImage);
+    xSemaphoreGive(storeLock);
+    return ret;
+}
+
+esp_err_t imageSlotOpen(slot_image_t *image, const char *filepath)
+{
+    file_meta_t meta;
+    const void *mapped;
+    esp_err_t ret;
+
+    if (!slotLock || slotCount == 0)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(slotLock, portMAX_DELAY);
+    const int index = slotFind(filepath);
+    if (index < 0)
+    {
+        xSemaphoreGive(slotLock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    image_slot_t *slot = &slots[index];
+    slot->refs++;
+    xSemaphoreGive(slotLock);
+
+    // The file may have been replaced since, by other means than an upload
+    ret = fileMetaGet(filepath, &meta);
+    if (ret == ESP_OK && meta.hash != slot->header.file_hash)
+    {
+        ret = ESP_ERR_NOT_FOUND;
+    }
+    if (ret == ESP_OK)
+    {
+        ret = esp_partition_mmap(slot->partition, 0, IMAGE_SLOT_DATA_OFFSET + slot->header.block_count * BLOCK_SIZE,
+                                 SPI_FLASH_MMAP_DATA, &mapped, &image->handle);
+    }
+    if (ret != ESP_OK)
+    {
+        xSemaphoreTake(slotLock, portMAX_DELAY);
+        slot->refs--;
+        xSemaphoreGive(slotLock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    image->source.nextBlock = slotImageNextBlock;
+    image->source.rewind = slotImageRewind;
+    image->slot = index;
+    image->addresses = (const uint32_t *)((const uint8_t *)mapped + IMAGE_SLOT_TABLE_OFFSET);
+    image->data = (const uint8_t *)mapped + IMAGE_SLOT_DATA_OFFSET;
+    image->block_count = slot->header.block_count;
+    image->next = 0;
+
+    logI(TAG_IMAGE_SLOT, "%s mapped from %s", filepath, slot->partition->label);
+    return ESP_OK;
+}
+
+void imageSlotClose(slot_image_t *image)
+{
+    spi_flash_munmap(image->handle);
+
+    xSemaphoreTake(slotLock, portMAX_DELAY);
+    slots[image->slot].refs--;
+    xSemaphoreGive(slotLock);
+}
+
+void imageSlotInvalidate(const char *filepath)
+{
+    if (!slotLock)
+    {
+        return;
+    }
+
+    xSemaphoreTake(slotLock, portMAX_DELAY);
+    const int index = slotFind(filepath);
+    if (index >= 0 && !slots[index].refs)
+    {
+        slotErase(&slots[index]);
+    }
+    xSemaphoreGive(slotLock);
+}
@@ -0,0 +1,91 @@
+#ifndef _IMAGE_SLOT_H
+#define _IMAGE_SLOT_H
+
+#include "image_loader.h"
+#include "file_meta.h"
+#include "esp_partition.h"
+
+// Firmware slots are data partitions of this subtype, labelled avr_slot0,
+// avr_slot1, ... (see partitions_example.csv)
+#define IMAGE_SLOT_SUBTYPE 0x40
+#define IMAGE_SLOT_LABEL "avr_slot"
+#define IMAGE_SLOTS_MAX 4
+
+// Slot layout: header, block address table, then the blocks themselves
+#define IMAGE_SLOT_TABLE_OFFSET 0x100
+#define IMAGE_SLOT_DATA_OFFSET 0x2000
+#define IMAGE_SLOT_BLOCKS_MAX ((IMAGE_SLOT_DATA_OFFSET - IMAGE_SLOT_TABLE_OFFSET) / sizeof(uint32_t))
+
+/**
+ * @brief Header at the start of a slot
+ *
+ * Written last, so a slot only looks valid once its image is complete.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_size;
+
+    // Slots written later have a higher sequence, the oldest is reused first
+    uint32_t sequence;
+    uint32_t block_count;
+
+    // File the image was decoded from, and the hash of its content
+    uint64_t file_hash;
+    char path[FILE_META_PATH_MAX];
+} image_slot_header_t;
+
+/**
+ * @brief Image read straight from a memory mapped slot
+ */
+typedef struct
+{
+    avr_image_source_t source;
+    int slot;
+    spi_flash_mmap_handle_t handle;
+    const uint32_t *addresses;
+    const uint8_t *data;
+    uint32_t block_count;
+    uint32_t next;
+} slot_image_t;
+
+//Find the slot partitions and read their headers
+void imageSlotInit(void);
+
+/**
+ * @brief Decode an image file into a slot
+ *
+ * The slot already holding the file is reused, else an empty one, else the
+ * one written longest ago. Slots in use by an open image are left alone.
+ * The slot is erased and written before returning, up to a whole partition,
+ * and stores from other tasks wait for it.
+ *
+ * @param filepath the image file
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - no slot available,
+ *         ESP_ERR_INVALID_SIZE - image too big for a slot, see imageOpen()
+ *         for the rest
+ */
+esp_err_t imageSlotStore(const char *filepath);
+
+/**
+ * @brief Open the image of a file from its slot
+ *
+ * The blocks are handed out from memory mapped flash, without copying them.
+ *
+ * @param image the image to open
+ * @param filepath the image file
+ *
+ * @return ESP_OK - success, ESP_ERR_NOT_FOUND - no slot holds the current
+ *         content of the file
+ */
+esp_err_t imageSlotOpen(slot_image_t *image, const char *filepath);
+
+//Release an image opened with imageSlotOpen()
+void imageSlotClose(slot_image_t *image);
+
+//Drop the slot of a file which was deleted
+void imageSlotInvalidate(const char *filepath);
+
+#endif
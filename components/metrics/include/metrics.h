@@ -0,0 +1,92 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Tasks whose stack watermark is reported, live and exited ones together
+#define METRICS_TASKS_MAX 12
+
+// Upper bounds of the histogram buckets in us, the last one is +Inf. Pages
+// take milliseconds, while a session phase or an upload of a 256 KB image
+// over a slow bootloader or link can take minutes
+#define METRICS_BUCKETS_US {100, 300, 1000, 3000, 10000, 30000, 100000, 300000, 1000000, 3000000, 10000000, 30000000, 60000000, 120000000}
+#define METRICS_BUCKETS 14
+
+// Counters, see metricsCounters in metrics.c for their names
+typedef enum
+{
+    METRIC_JOBS_OK,
+    METRIC_JOBS_SYNC_FAILED,
+    METRIC_JOBS_WRITE_FAILED,
+    METRIC_JOBS_VERIFY_FAILED,
+    METRIC_UART_TX_BYTES,
+    METRIC_UART_RX_BYTES,
+    METRIC_SYNC_RETRIES,
+    METRIC_STK500V2_CHECKSUM_ERRORS,
+    METRIC_STK500V2_SEQUENCE_ERRORS,
+    METRIC_UPLOAD_BYTES,
+    METRIC_COUNTERS,
+} metric_counter_t;
+
+// Histograms of durations, see metricsHistograms in metrics.c
+typedef enum
+{
+    METRIC_PHASE_SYNC,
+    METRIC_PHASE_WRITE,
+    METRIC_PHASE_VERIFY,
+    METRIC_PAGE_WRITE,
+    METRIC_PAGE_READ,
+    METRIC_UPLOAD,
+    METRIC_HISTOGRAMS,
+} metric_histogram_t;
+
+// Points of the startup, timed from boot
+typedef enum
+{
+    METRIC_BOOT_READY,
+    METRIC_BOOT_FIRST_PAGE,
+    METRIC_BOOT_MARKS,
+} metric_boot_t;
+
+//Receives the exposition text a piece at a time
+typedef void (*metrics_emit_t)(void *ctx, const char *data, size_t len);
+
+//Add n to a counter, lock free so it may be called from any task
+void metricsCount(metric_counter_t counter, uint32_t n);
+
+//Record a duration in us, lock free so it may be called from any task
+void metricsObserve(metric_histogram_t histogram, uint32_t us);
+
+//Record the time since boot the first time a point of the startup is reached, later calls are ignored
+void metricsMarkBoot(metric_boot_t mark);
+
+/**
+ * @brief Report the stack watermark of a task which runs for good
+ *
+ * The handle is kept, so the task must never be deleted. Tasks which end
+ * call metricsTaskExit() instead.
+ *
+ * @param task the task to watch
+ */
+void metricsWatchTask(TaskHandle_t task);
+
+//Record the stack watermark of the calling task under its name, call just before it deletes itself
+void metricsTaskExit(void);
+
+/**
+ * @brief Write all metrics in the Prometheus text exposition format
+ *
+ * Besides the counters and histograms: the free heap, its low-water mark,
+ * the least free stack seen of each task reported and the startup points
+ * reached.
+ *
+ * @param emit receives the text
+ * @param ctx passed to emit
+ */
+void metricsRender(metrics_emit_t emit, void *ctx);
+
+#endif
@@ -0,0 +1,250 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/param.h>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+
+typedef struct
+{
+    const char *name;
+    // Label pair inside the braces, or NULL
+    const char *labels;
+    const char *help;
+} metric_desc_t;
+
+// Entries of a family follow each other, HELP and TYPE are written once per family
+static const metric_desc_t metricsCounters[METRIC_COUNTERS] = {
+    [METRIC_JOBS_OK] = {"avr_jobs_total", "result=\"ok\"", "Sessions with the client MCU by result"},
+    [METRIC_JOBS_SYNC_FAILED] = {"avr_jobs_total", "result=\"sync_failed\"", NULL},
+    [METRIC_JOBS_WRITE_FAILED] = {"avr_jobs_total", "result=\"write_failed\"", NULL},
+    [METRIC_JOBS_VERIFY_FAILED] = {"avr_jobs_total", "result=\"verify_failed\"", NULL},
+    [METRIC_UART_TX_BYTES] = {"avr_uart_bytes_total", "direction=\"out\"", "Bytes through the UART to the client MCU"},
+    [METRIC_UART_RX_BYTES] = {"avr_uart_bytes_total", "direction=\"in\"", NULL},
+    [METRIC_SYNC_RETRIES] = {"avr_sync_retries_total", NULL, "Sync attempts after the first one"},
+    [METRIC_STK500V2_CHECKSUM_ERRORS] = {"avr_stk500v2_errors_total", "error=\"checksum\"", "Bad STK500v2 responses"},
+    [METRIC_STK500V2_SEQUENCE_ERRORS] = {"avr_stk500v2_errors_total", "error=\"sequence\"", NULL},
+    [METRIC_UPLOAD_BYTES] = {"http_upload_bytes_total", NULL, "Bytes of files uploaded"},
+};
+
+static const metric_desc_t metricsHistograms[METRIC_HISTOGRAMS] = {
+    [METRIC_PHASE_SYNC] = {"avr_phase_seconds", "phase=\"sync\"", "Duration of each phase of a flashing session"},
+    [METRIC_PHASE_WRITE] = {"avr_phase_seconds", "phase=\"write\"", NULL},
+    [METRIC_PHASE_VERIFY] = {"avr_phase_seconds", "phase=\"verify\"", NULL},
+    [METRIC_PAGE_WRITE] = {"avr_page_seconds", "op=\"write\"", "Latency of a page write or read"},
+    [METRIC_PAGE_READ] = {"avr_page_seconds", "op=\"read\"", NULL},
+    [METRIC_UPLOAD] = {"http_upload_seconds", NULL, "Duration of file uploads"},
+};
+
+static const char *const metricsBootMarks[METRIC_BOOT_MARKS] = {
+    [METRIC_BOOT_READY] = "ready",
+    [METRIC_BOOT_FIRST_PAGE] = "first_page",
+};
+
+static const uint32_t metricsBucketsUs[METRICS_BUCKETS] = METRICS_BUCKETS_US;
+
+typedef struct
+{
+    // Not cumulative, the last one counts what is over all bounds
+    atomic_uint buckets[METRICS_BUCKETS + 1];
+    // Sum in us, wraps is bumped each time it wraps around
+    atomic_uint sum;
+    atomic_uint wraps;
+} metric_hist_t;
+
+typedef struct
+{
+    char name[configMAX_TASK_NAME_LEN];
+    // Live task, or NULL when the slot holds the watermark of exited ones
+    TaskHandle_t handle;
+    atomic_uint minFree;
+} metric_task_t;
+
+static atomic_uint counters[METRIC_COUNTERS];
+static metric_hist_t histograms[METRIC_HISTOGRAMS];
+
+// ms since boot, 0 until reached. In us 32 bits would wrap after 71 minutes
+static atomic_uint bootMarks[METRIC_BOOT_MARKS];
+
+// Slots are filled in before taskCount covers them, and never change after
+static metric_task_t tasks[METRICS_TASKS_MAX];
+static atomic_int taskCount;
+static portMUX_TYPE taskLock = portMUX_INITIALIZER_UNLOCKED;
+
+void metricsCount(metric_counter_t counter, uint32_t n)
+{
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void metricsObserve(metric_histogram_t histogram, uint32_t us)
+{
+    metric_hist_t *hist = &histograms[histogram];
+    int bucket = 0;
+
+    while (bucket < METRICS_BUCKETS && us > metricsBucketsUs[bucket])
+    {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&hist->buckets[bucket], 1, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&hist->sum, us, memory_order_relaxed) > UINT32_MAX - us)
+    {
+        atomic_fetch_add_explicit(&hist->wraps, 1, memory_order_relaxed);
+    }
+}
+
+void metricsMarkBoot(metric_boot_t mark)
+{
+    unsigned int unset = 0;
+
+    if (!atomic_load_explicit(&bootMarks[mark], memory_order_relaxed))
+    {
+        // 0 stands for not reached
+        const unsigned int ms = esp_timer_get_time() / 1000;
+        atomic_compare_exchange_strong(&bootMarks[mark], &unset, ms ? ms : 1);
+    }
+}
+
+// Slot for a task, NULL when the table is full
+static metric_task_t *metricsTaskSlot(const char *name, TaskHandle_t handle)
+{
+    metric_task_t *slot = NULL;
+
+    portENTER_CRITICAL(&taskLock);
+    const int count = atomic_load(&taskCount);
+    for (int i = 0; i < count && !slot; i++)
+    {
+        if (!handle && !tasks[i].handle && !strcmp(tasks[i].name, name))
+        {
+            slot = &tasks[i];
+        }
+    }
+    if (!slot && count < METRICS_TASKS_MAX)
+    {
+        slot = &tasks[count];
+        strlcpy(slot->name, name, sizeof(slot->name));
+        slot->handle = handle;
+        atomic_init(&slot->minFree, UINT32_MAX);
+        atomic_store(&taskCount, count + 1);
+    }
+    portEXIT_CRITICAL(&taskLock);
+    return slot;
+}
+
+void metricsWatchTask(TaskHandle_t task)
+{
+    metricsTaskSlot(pcTaskGetName(task), task);
+}
+
+void metricsTaskExit(void)
+{
+    metric_task_t *slot = metricsTaskSlot(pcTaskGetName(NULL), NULL);
+    const unsigned int free = uxTaskGetStackHighWaterMark(NULL);
+
+    if (slot)
+    {
+        unsigned int seen = atomic_load_explicit(&slot->minFree, memory_order_relaxed);
+        while (free < seen &&
+               !atomic_compare_exchange_weak_explicit(&slot->minFree, &seen, free, memory_order_relaxed, memory_order_relaxed))
+        {
+        }
+    }
+}
+
+static void metricsPrintf(metrics_emit_t emit, void *ctx, const char *format, ...)
+{
+    char line[160];
+    va_list args;
+
+    va_start(args, format);
+    const int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0)
+    {
+        emit(ctx, line, MIN(len, sizeof(line) - 1));
+    }
+}
+
+static void metricsHeader(metrics_emit_t emit, void *ctx, const metric_desc_t *desc, const char *type)
+{
+    if (desc->help)
+    {
+        metricsPrintf(emit, ctx, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name, type);
+    }
+}
+
+static void metricsRenderHistogram(metrics_emit_t emit, void *ctx, const metric_desc_t *desc, metric_hist_t *hist)
+{
+    const char *sep = desc->labels ? "," : "";
+    const char *labels = desc->labels ? desc->labels : "";
+    uint32_t count = 0;
+
+    for (int i = 0; i <= METRICS_BUCKETS; i++)
+    {
+        count += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        if (i < METRICS_BUCKETS)
+        {
+            metricsPrintf(emit, ctx, "%s_bucket{%s%sle=\"%u.%06u\"} %u\n", desc->name, labels, sep,
+                          metricsBucketsUs[i] / 1000000, metricsBucketsUs[i] % 1000000, count);
+        }
+        else
+        {
+            metricsPrintf(emit, ctx, "%s_bucket{%s%sle=\"+Inf\"} %u\n", desc->name, labels, sep, count);
+        }
+    }
+
+    const uint64_t sum = (uint64_t)atomic_load_explicit(&hist->wraps, memory_order_relaxed) << 32 |
+                         atomic_load_explicit(&hist->sum, memory_order_relaxed);
+    metricsPrintf(emit, ctx, "%s_sum{%s} %llu.%06u\n", desc->name, labels, sum / 1000000, (unsigned int)(sum % 1000000));
+    metricsPrintf(emit, ctx, "%s_count{%s} %u\n", desc->name, labels, count);
+}
+
+void metricsRender(metrics_emit_t emit, void *ctx)
+{
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+    {
+        const metric_desc_t *desc = &metricsCounters[i];
+        metricsHeader(emit, ctx, desc, "counter");
+        metricsPrintf(emit, ctx, "%s%s%s%s %u\n", desc->name, desc->labels ? "{" : "", desc->labels ? desc->labels : "",
+                      desc->labels ? "}" : "", atomic_load_explicit(&counters[i], memory_order_relaxed));
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+    {
+        metricsHeader(emit, ctx, &metricsHistograms[i], "histogram");
+        metricsRenderHistogram(emit, ctx, &metricsHistograms[i], &histograms[i]);
+    }
+
+    metricsPrintf(emit, ctx, "# HELP heap_free_bytes Free heap\n# TYPE heap_free_bytes gauge\nheap_free_bytes %u\n",
+                  esp_get_free_heap_size());
+    metricsPrintf(emit, ctx, "# HELP heap_free_min_bytes Least free heap since boot\n# TYPE heap_free_min_bytes gauge\n"
+                  "heap_free_min_bytes %u\n", esp_get_minimum_free_heap_size());
+
+    metricsPrintf(emit, ctx, "# HELP boot_seconds Time from boot to each point of the startup reached\n"
+                  "# TYPE boot_seconds gauge\n");
+    for (int i = 0; i < METRIC_BOOT_MARKS; i++)
+    {
+        const unsigned int ms = atomic_load_explicit(&bootMarks[i], memory_order_relaxed);
+        if (ms)
+        {
+            metricsPrintf(emit, ctx, "boot_seconds{stage=\"%s\"} %u.%03u\n", metricsBootMarks[i], ms / 1000, ms % 1000);
+        }
+    }
+
+    const int count = atomic_load(&taskCount);
+    if (count)
+    {
+        metricsPrintf(emit, ctx, "# HELP task_stack_free_min_bytes Least free stack seen of a task\n"
+                      "# TYPE task_stack_free_min_bytes gauge\n");
+    }
+    for (int i = 0; i < count; i++)
+    {
+        const metric_task_t *task = &tasks[i];
+        const unsigned int free = task->handle ? uxTaskGetStackHighWaterMark(task->handle)
+                                               : atomic_load_explicit(&task->minFree, memory_order_relaxed);
+        metricsPrintf(emit, ctx, "task_stack_free_min_bytes{task=\"%s\"} %u\n", task->name, free);
+    }
+}
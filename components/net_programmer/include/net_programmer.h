@@ -0,0 +1,25 @@
+#ifndef _NET_PROGRAMMER_H
+#define _NET_PROGRAMMER_H
+
+#include "avr_pro_mode.h"
+#include "avr_delta.h"
+
+// Bytes moved at a time between the socket and the UART, more than the
+// largest STK500 message avrdude sends
+#define NET_PROGRAMMER_BUF_SIZE 1024
+
+// Longest wait for the client MCU before checking the connection is still up
+#define NET_PROGRAMMER_READ_MS 20
+
+/**
+ * @brief Start listening for avrdude on CONFIG_NET_PROGRAMMER_PORT
+ *
+ * One connection is served at a time. The UART to the client MCU is held
+ * for the whole connection, the client MCU is reset into its bootloader
+ * when it opens, and bytes are passed through untouched both ways.
+ *
+ * @return ESP_OK - success (or disabled), ESP_FAIL - no listening socket, ESP_ERR_NO_MEM - no task
+ */
+esp_err_t netProgrammerInit(void);
+
+#endif
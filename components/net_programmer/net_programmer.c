@@ -0,0 +1,208 @@
+#include "net_programmer.h"
+
+#include <errno.h>
+
+#include "esp_timer.h"
+#include "metrics.h"
+#include "lwip/sockets.h"
+
+static const char *TAG_NET_PROGRAMMER = "net_programmer";
+
+typedef struct
+{
+    int sock;
+    volatile int active;
+    SemaphoreHandle_t done;
+
+    // Bytes passed on, host to MCU and MCU to host
+    uint32_t to_mcu;
+    uint32_t to_host;
+} net_session_t;
+
+static net_session_t netSession;
+
+static int sendAll(int sock, const uint8_t *data, int length)
+{
+    while (length > 0)
+    {
+        const int sent = send(sock, data, length, 0);
+        if (sent < 0)
+        {
+            return 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+/**
+ * @brief Client MCU to host
+ *
+ * Waits for the first byte of a response, then sends it along with whatever
+ * else the UART driver has already received. The driver hands bytes over
+ * once the line goes idle, so a whole STK500 response usually leaves in a
+ * single segment, without waiting on a timer.
+ */
+static void netUartTask(void *parameter)
+{
+    net_session_t *session = parameter;
+    static uint8_t buf[NET_PROGRAMMER_BUF_SIZE];
+    size_t buffered;
+
+    while (session->active)
+    {
+        int count = uart_read_bytes(UART_NUM_1, buf, 1, NET_PROGRAMMER_READ_MS / portTICK_PERIOD_MS);
+        if (count <= 0)
+        {
+            continue;
+        }
+
+        if (uart_get_buffered_data_len(UART_NUM_1, &buffered) == ESP_OK && buffered > 0)
+        {
+            const int more = uart_read_bytes(UART_NUM_1, &buf[1], MIN(buffered, sizeof(buf) - 1), 0);
+            count += MAX(more, 0);
+        }
+
+        if (!sendAll(session->sock, buf, count))
+        {
+            // The other task sees the connection close as well
+            break;
+        }
+        session->to_host += count;
+        metricsCount(METRIC_UART_RX_BYTES, count);
+    }
+
+    xSemaphoreGive(session->done);
+    metricsTaskExit();
+    vTaskDelete(NULL);
+}
+
+static void netServe(net_session_t *session)
+{
+    static uint8_t buf[NET_PROGRAMMER_BUF_SIZE];
+    const int nodelay = 1;
+    const struct timeval idle = {.tv_sec = CONFIG_NET_PROGRAMMER_IDLE_S};
+    const int64_t start = esp_timer_get_time();
+    int count;
+
+    // Every STK500 command is a round trip, none of it may sit in Nagle's buffer
+    setsockopt(session->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    setsockopt(session->sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+    takeUART();
+    uart_set_baudrate(UART_NUM_1, UART_BAUD_RATE);
+    uart_flush_input(UART_NUM_1);
+
+    // Whatever avrdude writes, patches can't be made against it
+    deltaForgetFlashed();
+
+    // What a USB serial adapter does on DTR, avrdude's first syncs queue up in the socket meanwhile
+    resetMCU();
+
+    session->to_mcu = 0;
+    session->to_host = 0;
+    session->active = 1;
+    if (xTaskCreate(&netUartTask, "Net Programmer", 3072, session, 6, NULL) != pdPASS)
+    {
+        logE(TAG_NET_PROGRAMMER, "%s", "Failed to start the UART task");
+        session->active = 0;
+        giveUART();
+        return;
+    }
+
+    // Host to client MCU, each command goes out as it arrives
+    while ((count = recv(session->sock, buf, sizeof(buf), 0)) > 0)
+    {
+        uart_write_bytes(UART_NUM_1, (const char *)buf, count);
+        session->to_mcu += count;
+        metricsCount(METRIC_UART_TX_BYTES, count);
+    }
+    if (count < 0)
+    {
+        logW(TAG_NET_PROGRAMMER, "Connection dropped, errno %d", errno);
+    }
+
+    // Unblocks a send in progress, then wait for the UART task to stop using the socket
+    shutdown(session->sock, SHUT_RDWR);
+    session->active = 0;
+    xSemaphoreTake(session->done, portMAX_DELAY);
+    giveUART();
+
+    logI(TAG_NET_PROGRAMMER, "Session over after %lld ms, %u bytes sent, %u received",
+         (esp_timer_get_time() - start) / 1000, session->to_mcu, session->to_host);
+}
+
+static void netProgrammerTask(void *parameter)
+{
+    const int listener = (intptr_t)parameter;
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    char host[16];
+
+    while (1)
+    {
+        addr_len = sizeof(addr);
+        netSession.sock = accept(listener, (struct sockaddr *)&addr, &addr_len);
+        if (netSession.sock < 0)
+        {
+            logE(TAG_NET_PROGRAMMER, "Accept failed, errno %d", errno);
+            vTaskDelay(1000 / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        inet_ntoa_r(addr.sin_addr, host, sizeof(host));
+        logI(TAG_NET_PROGRAMMER, "avrdude connected from %s", host);
+
+        netServe(&netSession);
+        close(netSession.sock);
+    }
+}
+
+esp_err_t netProgrammerInit(void)
+{
+    const int reuse = 1;
+    const struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_NET_PROGRAMMER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    if (CONFIG_NET_PROGRAMMER_PORT == 0)
+    {
+        return ESP_OK;
+    }
+
+    netSession.done = xSemaphoreCreateBinary();
+    if (!netSession.done)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener < 0)
+    {
+        logE(TAG_NET_PROGRAMMER, "Failed to create socket, errno %d", errno);
+        return ESP_FAIL;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // A single session at a time, a second avrdude waits in the backlog
+    if (bind(listener, (const struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0)
+    {
+        logE(TAG_NET_PROGRAMMER, "Failed to listen on port %d, errno %d", CONFIG_NET_PROGRAMMER_PORT, errno);
+        close(listener);
+        return ESP_FAIL;
+    }
+
+    TaskHandle_t task;
+    if (xTaskCreate(&netProgrammerTask, "Net Listener", 3072, (void *)(intptr_t)listener, 5, &task) != pdPASS)
+    {
+        close(listener);
+        return ESP_ERR_NO_MEM;
+    }
+    metricsWatchTask(task);
+
+    logI(TAG_NET_PROGRAMMER, "Listening for avrdude on port %d", CONFIG_NET_PROGRAMMER_PORT);
+    return ESP_OK;
+}
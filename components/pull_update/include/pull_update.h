@@ -0,0 +1,38 @@
+#ifndef _PULL_UPDATE_H
+#define _PULL_UPDATE_H
+
+#include "avr_batch.h"
+#include "file_meta.h"
+#include "avr_delta.h"
+
+// Validators of the image last flashed, in the storage's base directory
+#define PULL_UPDATE_STATE ".pull"
+
+// The image while it downloads, renamed to CONFIG_PULL_UPDATE_FILE once flashed
+#define PULL_UPDATE_TEMP_PREFIX ".pull-"
+
+// Longest ETag or Last-Modified kept
+#define PULL_UPDATE_VALIDATOR_MAX 96
+
+#define PULL_UPDATE_TIMEOUT_MS 10000
+
+//Called once a pulled image has been stored, so file listings can be refreshed
+typedef void (*pull_update_stored_t)(const char *filepath);
+
+/**
+ * @brief Start polling CONFIG_PULL_UPDATE_URL for a new image
+ *
+ * Polls are skipped while a batch runs. A new image is decoded and flashed
+ * while it downloads, with a copy written to storage alongside, which is
+ * what the verification reads back from. Only a flashed and verified image
+ * replaces the last known good one, a failed update is retried on the
+ * next poll.
+ *
+ * @param base_path base path of the storage, e.g. "/spiffs"
+ * @param stored called after a new image is stored, can be NULL
+ *
+ * @return ESP_OK - success (or no URL configured), ESP_ERR_NO_MEM - no task
+ */
+esp_err_t pullUpdateInit(const char *base_path, pull_update_stored_t stored);
+
+#endif
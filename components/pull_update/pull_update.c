@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include "pull_update.h"
+
+#include <sys/types.h>
+
+#include "esp_http_client.h"
+#include "metrics.h"
+
+static const char *TAG_PULL_UPDATE = "pull_update";
+
+#ifdef __LARGE64_FILES
+typedef _off64_t pull_off_t;
+#else
+typedef off_t pull_off_t;
+#endif
+
+/**
+ * @brief Response body read as a stdio stream
+ *
+ * Every byte fetched is appended to a file as well, which is where reads
+ * come from after a rewind until they catch up with the download again. So
+ * the image can be verified, and kept, without downloading it twice.
+ */
+typedef struct
+{
+    esp_http_client_handle_t client;
+    FILE *tee;
+
+    // Bytes fetched so far, and the position of the next read
+    long fetched;
+    long pos;
+
+    // Hashes of what was fetched, for the file's metadata
+    file_digest_t digest;
+} pull_stream_t;
+
+// Validators of a response, or of the image last flashed
+typedef struct
+{
+    char etag[PULL_UPDATE_VALIDATOR_MAX];
+    char modified[PULL_UPDATE_VALIDATOR_MAX];
+} pull_validators_t;
+
+static char pullBase[ESP_VFS_PATH_MAX + 1];
+static pull_update_stored_t pullStored = NULL;
+
+// Only the pull task uses these, they are too large for its stack
+static pull_validators_t pullCurrent;
+static pull_validators_t pullReceived;
+static avr_image_t pullImage;
+
+static ssize_t pullStreamRead(void *cookie, char *buf, size_t count)
+{
+    pull_stream_t *stream = (pull_stream_t *)cookie;
+    int n;
+
+    if (stream->pos < stream->fetched)
+    {
+        if (fseek(stream->tee, stream->pos, SEEK_SET) != 0)
+        {
+            return -1;
+        }
+        n = fread(buf, 1, MIN(count, stream->fetched - stream->pos), stream->tee);
+        if (n <= 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        n = esp_http_client_read(stream->client, buf, count);
+        if (n <= 0)
+        {
+            // End of the body, or the connection failed
+            return n;
+        }
+        if (fseek(stream->tee, 0, SEEK_END) != 0 || fwrite(buf, 1, n, stream->tee) != n)
+        {
+            logE(TAG_PULL_UPDATE, "%s", "Failed to store the image");
+            return -1;
+        }
+        fileDigestUpdate(&stream->digest, buf, n);
+        stream->fetched += n;
+    }
+
+    stream->pos += n;
+    return n;
+}
+
+static int pullStreamSeek(void *cookie, pull_off_t *offset, int whence)
+{
+    pull_stream_t *stream = (pull_stream_t *)cookie;
+
+    // Only back into what was fetched already
+    if (whence != SEEK_SET || *offset < 0 || *offset > stream->fetched)
+    {
+        return -1;
+    }
+    stream->pos = *offset;
+    return 0;
+}
+
+static int pullStreamClose(void *cookie)
+{
+    pull_stream_t *stream = (pull_stream_t *)cookie;
+    const int ret = fclose(stream->tee);
+    fileDigestFree(&stream->digest);
+    free(stream);
+    return ret;
+}
+
+// Read the rest of the body, so the stored copy is complete, and finish its hashes
+static int pullStreamDrain(FILE *f, pull_stream_t *stream, uint64_t *hash, uint8_t *sha256)
+{
+    char buf[256];
+
+    while (fread(buf, 1, sizeof(buf), f) == sizeof(buf))
+    {
+    }
+    if (ferror(f))
+    {
+        return 0;
+    }
+
+    *hash = stream->digest.hash;
+    fileDigestFinish(&stream->digest, sha256);
+    return 1;
+}
+
+static esp_err_t pullHttpEvent(esp_http_client_event_t *evt)
+{
+    pull_validators_t *received = evt->user_data;
+
+    if (evt->event_id == HTTP_EVENT_ON_HEADER)
+    {
+        if (strcasecmp(evt->header_key, "ETag") == 0)
+        {
+            strlcpy(received->etag, evt->header_value, sizeof(received->etag));
+        }
+        else if (strcasecmp(evt->header_key, "Last-Modified") == 0)
+        {
+            strlcpy(received->modified, evt->header_value, sizeof(received->modified));
+        }
+    }
+    return ESP_OK;
+}
+
+static void pullLoadValidators(void)
+{
+    char path[FILE_META_PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", pullBase, PULL_UPDATE_STATE);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return;
+    }
+    if (!fgets(pullCurrent.etag, sizeof(pullCurrent.etag), f) ||
+        !fgets(pullCurrent.modified, sizeof(pullCurrent.modified), f))
+    {
+        memset(&pullCurrent, 0, sizeof(pullCurrent));
+    }
+    fclose(f);
+
+    pullCurrent.etag[strcspn(pullCurrent.etag, "\n")] = '\0';
+    pullCurrent.modified[strcspn(pullCurrent.modified, "\n")] = '\0';
+}
+
+static void pullSaveValidators(void)
+{
+    char path[FILE_META_PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", pullBase, PULL_UPDATE_STATE);
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        logE(TAG_PULL_UPDATE, "Failed to write %s", path);
+        return;
+    }
+    fprintf(f, "%s\n%s\n", pullCurrent.etag, pullCurrent.modified);
+    fclose(f);
+}
+
+// Wrap the response body in a stream, storing it into tmppath as it is read
+static FILE *pullStreamOpen(esp_http_client_handle_t client, const char *tmppath, pull_stream_t **out)
+{
+    pull_stream_t *stream = calloc(1, sizeof(pull_stream_t));
+    if (!stream)
+    {
+        return NULL;
+    }
+
+    stream->client = client;
+    stream->tee = fopen(tmppath, "w+");
+    if (!stream->tee)
+    {
+        logE(TAG_PULL_UPDATE, "Failed to create %s", tmppath);
+        free(stream);
+        return NULL;
+    }
+    fileDigestStart(&stream->digest);
+
+    cookie_io_functions_t io = {
+        .read = pullStreamRead,
+        .write = NULL,
+        .seek = pullStreamSeek,
+        .close = pullStreamClose};
+    FILE *f = fopencookie(stream, "r", io);
+    if (!f)
+    {
+        pullStreamClose(stream);
+    }
+    *out = stream;
+    return f;
+}
+
+/**
+ * @brief Flash the image as it downloads
+ *
+ * gzip'd images are the exception: inflating needs the gzip trailer at the
+ * end of the file, so they are downloaded first and flashed from storage.
+ *
+ * @return ESP_OK - flashed and verified, other - failed
+ */
+static esp_err_t pullFlash(FILE *f, pull_stream_t *stream, const char *tmppath, uint64_t *hash, uint8_t *sha256)
+{
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    uint8_t magic[2] = {0};
+    esp_err_t ret;
+
+    fread(magic, 1, sizeof(magic), f);
+    rewind(f);
+    const int gzipped = magic[0] == GZ_MAGIC_0 && magic[1] == GZ_MAGIC_1;
+
+    if (gzipped)
+    {
+        const int ok = pullStreamDrain(f, stream, hash, sha256);
+        fclose(f);
+        ret = ok ? imageOpen(&pullImage, tmppath) : ESP_FAIL;
+    }
+    else
+    {
+        ret = imageOpenStream(&pullImage, f, CONFIG_PULL_UPDATE_FILE);
+    }
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    logI(TAG_PULL_UPDATE, "Writing code to AVR memory using %s", protocol->name);
+    ret = writeImage(protocol, &pullImage.source);
+    if (ret == ESP_OK)
+    {
+        ret = verifyImage(protocol, &pullImage.source);
+    }
+    endSession(protocol);
+
+    if (ret == ESP_OK && !gzipped)
+    {
+        // Verification stops at the end of the image, the stored copy needs the rest
+        ret = pullStreamDrain(f, stream, hash, sha256) ? ESP_OK : ESP_FAIL;
+    }
+    imageClose(&pullImage);
+    return ret;
+}
+
+// Keep the image just flashed as the last known good one
+static void pullStore(const char *tmppath, uint64_t hash, const uint8_t *sha256)
+{
+#if CONFIG_PULL_UPDATE_KEEP
+    char filepath[FILE_META_PATH_MAX];
+
+    snprintf(filepath, sizeof(filepath), "%s/%s", pullBase, CONFIG_PULL_UPDATE_FILE);
+    unlink(filepath);
+    if (rename(tmppath, filepath) != 0)
+    {
+        logE(TAG_PULL_UPDATE, "Failed to store %s", filepath);
+        unlink(tmppath);
+        return;
+    }
+
+    fileMetaSet(filepath, hash, sha256);
+    imageCacheInvalidate(filepath);
+    imageSlotStore(filepath);
+    deltaRecordFlashed(filepath);
+    if (pullStored)
+    {
+        pullStored(filepath);
+    }
+#else
+    unlink(tmppath);
+    deltaForgetFlashed();
+#endif
+}
+
+static esp_err_t pullCheck(void)
+{
+    char tmppath[FILE_META_PATH_MAX];
+    uint64_t hash = FILE_META_HASH_INIT;
+    uint8_t sha256[FILE_META_SHA256_LEN];
+    esp_err_t ret;
+
+    memset(&pullReceived, 0, sizeof(pullReceived));
+    const esp_http_client_config_t config = {
+        .url = CONFIG_PULL_UPDATE_URL,
+        .timeout_ms = PULL_UPDATE_TIMEOUT_MS,
+        .event_handler = pullHttpEvent,
+        .user_data = &pullReceived,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (!client)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Only the status line and headers come back while nothing changed
+    if (pullCurrent.etag[0])
+    {
+        esp_http_client_set_header(client, "If-None-Match", pullCurrent.etag);
+    }
+    if (pullCurrent.modified[0])
+    {
+        esp_http_client_set_header(client, "If-Modified-Since", pullCurrent.modified);
+    }
+
+    ret = esp_http_client_open(client, 0);
+    if (ret != ESP_OK)
+    {
+        logW(TAG_PULL_UPDATE, "Failed to reach %s: %s", CONFIG_PULL_UPDATE_URL, esp_err_to_name(ret));
+        esp_http_client_cleanup(client);
+        return ret;
+    }
+    esp_http_client_fetch_headers(client);
+
+    const int status = esp_http_client_get_status_code(client);
+    if (status == 304)
+    {
+        logD(TAG_PULL_UPDATE, "%s", "Image not modified");
+        esp_http_client_cleanup(client);
+        return ESP_OK;
+    }
+    if (status != 200)
+    {
+        logW(TAG_PULL_UPDATE, "Poll answered with status %d", status);
+        esp_http_client_cleanup(client);
+        return ESP_FAIL;
+    }
+
+    logI(TAG_PULL_UPDATE, "New image at %s, %d bytes", CONFIG_PULL_UPDATE_URL,
+         esp_http_client_get_content_length(client));
+
+    snprintf(tmppath, sizeof(tmppath), "%s/%s%s", pullBase, PULL_UPDATE_TEMP_PREFIX, CONFIG_PULL_UPDATE_FILE);
+    pull_stream_t *stream;
+    FILE *f = pullStreamOpen(client, tmppath, &stream);
+    ret = f ? pullFlash(f, stream, tmppath, &hash, sha256) : ESP_ERR_NO_MEM;
+
+    if (ret == ESP_OK && !esp_http_client_is_complete_data_received(client))
+    {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    esp_http_client_cleanup(client);
+
+    if (ret != ESP_OK)
+    {
+        logE(TAG_PULL_UPDATE, "Update failed (%d), retrying on the next poll", ret);
+        deltaForgetFlashed();
+        unlink(tmppath);
+        return ret;
+    }
+
+    logI(TAG_PULL_UPDATE, "%s", "Update flashed and verified");
+    pullStore(tmppath, hash, sha256);
+    pullCurrent = pullReceived;
+    pullSaveValidators();
+    return ESP_OK;
+}
+
+static void pullUpdateTask(void *parameter)
+{
+    while (1)
+    {
+        if (batchRunning())
+        {
+            logD(TAG_PULL_UPDATE, "%s", "Batch running, poll skipped");
+        }
+        else
+        {
+            pullCheck();
+        }
+
+        // Uniform over interval +- jitter
+        const int jitter = CONFIG_PULL_UPDATE_JITTER_S;
+        const int wait_s = MAX(1, CONFIG_PULL_UPDATE_INTERVAL_S - jitter + (int)(esp_random() % (2 * jitter + 1)));
+        vTaskDelay(wait_s * 1000 / portTICK_PERIOD_MS);
+    }
+}
+
+esp_err_t pullUpdateInit(const char *base_path, pull_update_stored_t stored)
+{
+    if (strlen(CONFIG_PULL_UPDATE_URL) == 0)
+    {
+        return ESP_OK;
+    }
+
+    strlcpy(pullBase, base_path, sizeof(pullBase));
+    pullStored = stored;
+    pullLoadValidators();
+
+    TaskHandle_t task;
+    if (xTaskCreate(&pullUpdateTask, "Pull Update", 8192, NULL, 2, &task) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    metricsWatchTask(task);
+
+    logI(TAG_PULL_UPDATE, "Polling %s every %d s", CONFIG_PULL_UPDATE_URL, CONFIG_PULL_UPDATE_INTERVAL_S);
+    return ESP_OK;
+}
@@ -0,0 +1,56 @@
+#ifndef _SERIAL_BRIDGE_H
+#define _SERIAL_BRIDGE_H
+
+#include "avr_pro_mode.h"
+
+// Remote ends the UART to the client MCU can be bridged to at once
+#define SERIAL_BRIDGE_CLIENTS_MAX 4
+
+// Bytes from the client MCU waiting to be sent on
+#define SERIAL_BRIDGE_RING_SIZE 4096
+
+// Bytes are sent on in frames of up to FRAME_MAX bytes, as soon as a frame
+// is full or its first byte has waited FRAME_MS
+#define SERIAL_BRIDGE_FRAME_MAX 1024
+#define SERIAL_BRIDGE_FRAME_MS 10
+
+// Wait between reads of the UART, and so the longest a flashing session waits for it
+#define SERIAL_BRIDGE_READ_MS 10
+
+// Bytes taken from the UART per read, the size of the driver's RX buffer so
+// none are lost waiting between reads
+#define SERIAL_BRIDGE_READ_MAX 2048
+
+/**
+ * @brief Send bytes from the client MCU to a remote end
+ *
+ * Called with length 0 to check the remote end is still there.
+ *
+ * @return 1 - sent, 0 - the remote end is gone and is dropped
+ */
+typedef int (*serial_bridge_send_t)(void *ctx, int fd, const uint8_t *data, size_t length);
+
+//Start the bridge tasks, the UART is only read while a remote end is connected
+esp_err_t serialBridgeInit(void);
+
+/**
+ * @brief Bridge the UART to a remote end
+ *
+ * @param send sends to the remote end, from the bridge's task
+ * @param ctx passed to send
+ * @param fd identifies the remote end, passed to send
+ *
+ * @return 1 - added, 0 - too many remote ends
+ */
+int serialBridgeAddClient(serial_bridge_send_t send, void *ctx, int fd);
+
+//Stop bridging to a remote end
+void serialBridgeRemoveClient(int fd);
+
+//Send bytes from a remote end to the client MCU, blocks while the UART is busy
+int serialBridgeWrite(const uint8_t *data, size_t length);
+
+//Baud rate of the sketch, the bootloader's is restored for flashing
+void serialBridgeSetBaud(uint32_t baud);
+
+#endif
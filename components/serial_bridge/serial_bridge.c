@@ -0,0 +1,213 @@
+#include "serial_bridge.h"
+
+#include "freertos/ringbuf.h"
+
+#include "metrics.h"
+
+static const char *TAG_SERIAL_BRIDGE = "serial_bridge";
+
+// Wait between checks for a remote end while none is connected
+#define SERIAL_BRIDGE_IDLE_MS 100
+
+typedef struct
+{
+    serial_bridge_send_t send;
+    void *ctx;
+    int fd;
+} serial_bridge_client_t;
+
+static serial_bridge_client_t bridgeClients[SERIAL_BRIDGE_CLIENTS_MAX];
+static int bridgeClientCount = 0;
+static portMUX_TYPE bridgeLock = portMUX_INITIALIZER_UNLOCKED;
+
+static RingbufHandle_t bridgeRing = NULL;
+static volatile uint32_t bridgeBaud = UART_BAUD_RATE;
+
+// At least a tick, a zero timeout would spin
+static TickType_t msToTicks(int ms)
+{
+    const TickType_t ticks = ms / portTICK_PERIOD_MS;
+    return ticks ? ticks : 1;
+}
+
+// Make sure the UART runs at the sketch's baud rate, flashing may have changed it. UART held
+static void bridgeApplyBaud(void)
+{
+    uint32_t baud;
+
+    if (uart_get_baudrate(UART_NUM_1, &baud) == ESP_OK && baud != bridgeBaud)
+    {
+        uart_set_baudrate(UART_NUM_1, bridgeBaud);
+    }
+}
+
+// Drop the remote ends which are gone
+static void bridgePurgeClients(void)
+{
+    for (int i = 0; i < SERIAL_BRIDGE_CLIENTS_MAX; i++)
+    {
+        serial_bridge_client_t client = bridgeClients[i];
+        if (client.send && !client.send(client.ctx, client.fd, NULL, 0))
+        {
+            serialBridgeRemoveClient(client.fd);
+        }
+    }
+}
+
+// UART to ring buffer. Blocks when the ring is full, leaving the bytes in the
+// UART driver's buffer until the remote ends catch up. The UART is only held
+// to copy out what the driver has buffered and the wait for more is spent
+// without it, else the flashing tasks of lower priority would never get it
+static void bridgeReaderTask(void *parameter)
+{
+    static uint8_t buf[SERIAL_BRIDGE_READ_MAX];
+
+    while (1)
+    {
+        if (!bridgeClientCount)
+        {
+            vTaskDelay(msToTicks(SERIAL_BRIDGE_IDLE_MS));
+            continue;
+        }
+
+        takeUART();
+        bridgeApplyBaud();
+        const int count = uart_read_bytes(UART_NUM_1, buf, sizeof(buf), 0);
+        giveUART();
+
+        if (count > 0)
+        {
+            metricsCount(METRIC_UART_RX_BYTES, count);
+            xRingbufferSend(bridgeRing, buf, count, portMAX_DELAY);
+        }
+        vTaskDelay(msToTicks(SERIAL_BRIDGE_READ_MS));
+    }
+}
+
+// Ring buffer to the remote ends, a frame at a time
+static void bridgeSenderTask(void *parameter)
+{
+    static uint8_t frame[SERIAL_BRIDGE_FRAME_MAX];
+    serial_bridge_client_t clients[SERIAL_BRIDGE_CLIENTS_MAX];
+    size_t length, size;
+    uint8_t *data;
+
+    while (1)
+    {
+        // Wait for the first byte, then fill the frame until it is due
+        data = xRingbufferReceiveUpTo(bridgeRing, &size, portMAX_DELAY, sizeof(frame));
+        memcpy(frame, data, size);
+        vRingbufferReturnItem(bridgeRing, data);
+        length = size;
+
+        const TickType_t due = xTaskGetTickCount() + msToTicks(SERIAL_BRIDGE_FRAME_MS);
+        while (length < sizeof(frame))
+        {
+            const TickType_t now = xTaskGetTickCount();
+            if ((int32_t)(due - now) <= 0)
+            {
+                break;
+            }
+            data = xRingbufferReceiveUpTo(bridgeRing, &size, due - now, sizeof(frame) - length);
+            if (!data)
+            {
+                break;
+            }
+            memcpy(&frame[length], data, size);
+            vRingbufferReturnItem(bridgeRing, data);
+            length += size;
+        }
+
+        portENTER_CRITICAL(&bridgeLock);
+        memcpy(clients, bridgeClients, sizeof(clients));
+        portEXIT_CRITICAL(&bridgeLock);
+
+        for (int i = 0; i < SERIAL_BRIDGE_CLIENTS_MAX; i++)
+        {
+            if (clients[i].send && !clients[i].send(clients[i].ctx, clients[i].fd, frame, length))
+            {
+                logI(TAG_SERIAL_BRIDGE, "Client %d gone", clients[i].fd);
+                serialBridgeRemoveClient(clients[i].fd);
+            }
+        }
+    }
+}
+
+esp_err_t serialBridgeInit(void)
+{
+    bridgeRing = xRingbufferCreate(SERIAL_BRIDGE_RING_SIZE, RINGBUF_TYPE_BYTEBUF);
+    if (!bridgeRing)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    TaskHandle_t reader, sender;
+    if (xTaskCreate(&bridgeReaderTask, "Bridge Reader", 3072, NULL, 6, &reader) != pdPASS ||
+        xTaskCreate(&bridgeSenderTask, "Bridge Sender", 4096, NULL, 5, &sender) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    metricsWatchTask(reader);
+    metricsWatchTask(sender);
+    return ESP_OK;
+}
+
+int serialBridgeAddClient(serial_bridge_send_t send, void *ctx, int fd)
+{
+    if (bridgeClientCount == SERIAL_BRIDGE_CLIENTS_MAX)
+    {
+        bridgePurgeClients();
+    }
+
+    portENTER_CRITICAL(&bridgeLock);
+    for (int i = 0; i < SERIAL_BRIDGE_CLIENTS_MAX; i++)
+    {
+        if (!bridgeClients[i].send)
+        {
+            bridgeClients[i].send = send;
+            bridgeClients[i].ctx = ctx;
+            bridgeClients[i].fd = fd;
+            bridgeClientCount++;
+            portEXIT_CRITICAL(&bridgeLock);
+
+            logI(TAG_SERIAL_BRIDGE, "Client %d connected at %u baud", fd, bridgeBaud);
+            return 1;
+        }
+    }
+    portEXIT_CRITICAL(&bridgeLock);
+
+    logE(TAG_SERIAL_BRIDGE, "%s", "Too many clients");
+    return 0;
+}
+
+void serialBridgeRemoveClient(int fd)
+{
+    portENTER_CRITICAL(&bridgeLock);
+    for (int i = 0; i < SERIAL_BRIDGE_CLIENTS_MAX; i++)
+    {
+        if (bridgeClients[i].send && bridgeClients[i].fd == fd)
+        {
+            bridgeClients[i].send = NULL;
+            bridgeClientCount--;
+        }
+    }
+    portEXIT_CRITICAL(&bridgeLock);
+}
+
+int serialBridgeWrite(const uint8_t *data, size_t length)
+{
+    takeUART();
+    bridgeApplyBaud();
+    const int count = uart_write_bytes(UART_NUM_1, (const char *)data, length);
+    giveUART();
+    if (count > 0)
+    {
+        metricsCount(METRIC_UART_TX_BYTES, count);
+    }
+    return count;
+}
+
+void serialBridgeSetBaud(uint32_t baud)
+{
+    bridgeBaud = baud;
+}
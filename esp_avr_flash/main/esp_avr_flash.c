@@ -1,35 +1,37 @@
-#include "hex_parser.h"
+#include "image_loader.h"
 #include "avr_flash.h"
+#include "metrics.h"
 
 static const char *TAG = "esp_avr_flash";
 
-uint8_t page[PAGE_SIZE_MAX];
-int block_count = 0;
-
 void flashTask(void)
 {
     //Hard coding the file name to be flashed
     char *filepath = "/spiffs/blink.hex"; 
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    static avr_image_t image;
 
-    logI(TAG, "%s", "Writing file to page");
-    ESP_ERROR_CHECK(hexFileParser(filepath, page, &block_count));
+    logI(TAG, "%s", "Opening image");
+    ESP_ERROR_CHECK(imageOpen(&image, filepath));
 
     logI(TAG, "%s", "Writing code to AVR memory");
-    ESP_ERROR_CHECK(writeTask(page, block_count));
+    ESP_ERROR_CHECK(writeImage(protocol, &image.source));
 
     logI(TAG, "%s", "Reading Memory");
-    ESP_ERROR_CHECK(readTask(page, block_count));
+    ESP_ERROR_CHECK(verifyImage(protocol, &image.source));
+    imageClose(&image);
 
     logI(TAG, "%s", "Ending Connection");
-    endConn();
+    endSession(protocol);
 }
 
+// The client is reset and synced once, by the flashing session itself
 void initTask(void)
 {
     initUART();
     initGPIO();
     initSPIFFS();
-    setupDevice();
+    metricsMarkBoot(METRIC_BOOT_READY);
 }
 
 void app_main(void)
@@ -7,8 +7,22 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 
-#include "hex_parser.h"
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+#include "avr_batch.h"
+#include "avr_delta.h"
+#include "file_meta.h"
+#include "serial_bridge.h"
 #include "avr_flash.h"
+#include "metrics.h"
+#include "http_range.h"
 
 /* Max length a file path can have on storage */
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
@@ -21,31 +35,151 @@
 /* Scratch buffer size */
 #define SCRATCH_BUFSIZE 8192
 
-static const char *TAG = "FILE_SERVER";
+/* Upload buffers, one being received while the other is written */
+#define UPLOAD_BUFFERS 2
+
+/* Embedded files only change with the firmware, so browsers may keep
+ * them for a while before revalidating them with their ETag */
+#define EMBEDDED_CACHE_CONTROL "public, max-age=3600"
+
+/* Stored files can be replaced at any time, revalidate on every use */
+#define FILE_CACHE_CONTROL "no-cache"
+
+/* Quoted 64-bit hash, e.g. "\"0123456789abcdef\"" */
+#define ETAG_LEN (16 + 2 + 1)
+
+/* How long an upload being flashed may stall before the bootloader is
+ * pinged, optiboot's watchdog leaves it after a second of silence */
+#define UPLOAD_FLASH_KEEPALIVE_MS 500
+
+/* Target flash dumps, read a block at a time while the block before is sent */
+#define DUMP_BUFFERS 2
+
+/* Flash dumped when the request gives no size: the ATmega328P's for
+ * optiboot, the ATmega2560's for STK500v2 */
+#if CONFIG_AVR_PROTOCOL_STK500V2
+#define DUMP_SIZE_DEFAULT FLASH_SIZE_MAX
+#else
+#define DUMP_SIZE_DEFAULT (32 * 1024)
+#endif
+
+/* Data bytes per Record of a .hex dump, as avr-objcopy writes them */
+#define DUMP_HEX_RECORD 16
 
-uint8_t page[PAGE_SIZE_MAX];
-int block_count = 0;
+#ifdef __LARGE64_FILES
+typedef _off64_t upload_off_t;
+#else
+typedef off_t upload_off_t;
+#endif
 
-void flashFile(void *parameter)
+static const char *TAG = "FILE_SERVER";
+
+/* Flashing jobs are run one after the other by a single worker task, so
+ * their memory is set aside once rather than per job. Worst case while
+ * flashing, besides the images the cache holds:
+ * - the worker's stack, FLASH_TASK_STACK_SIZE
+ * - flash_image, a file being decoded: a .hex line, Record and block, ~1.1 KB
+ * - the session's page buffers in avr_flash, ~0.5 KB
+ * - FLASH_JOBS_MAX queued jobs
+ * - the 32 KB inflate window on the heap while a .gz file is decoded */
+#define FLASH_JOBS_MAX 4
+
+struct flash_job
 {
-    char *temp = (char *)parameter;
-    char filepath[FILE_PATH_MAX] = "\0";
-    strcat(filepath, temp);
+    /* Flash only the blocks a patch changed, see patch_post_handler() */
+    bool patch;
+    char filepath[FILE_PATH_MAX];
+};
 
-    logI(TAG, "%s", "Writing file to page");
-    ESP_ERROR_CHECK(hexFileParser(filepath, page, &block_count));
+static QueueHandle_t flash_jobs;
 
-    logI(TAG, "%s", "Writing code to AVR memory");
-    ESP_ERROR_CHECK(writeTask(page, block_count));
+/* Only used by the worker */
+static cached_image_t flash_image;
+
+static void flash_file(const char *filepath)
+{
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+
+    logI(TAG, "%s", "Opening image");
+    esp_err_t ret = imageCacheOpen(&flash_image, filepath);
+    if (ret != ESP_OK)
+    {
+        logE(TAG, "Failed to open %s: %s", filepath, esp_err_to_name(ret));
+        return;
+    }
 
-    logI(TAG, "%s", "Reading Memory");
-    ESP_ERROR_CHECK(readTask(page, block_count));
+    logI(TAG, "Writing code to AVR memory using %s", protocol->name);
+    ret = writeImage(protocol, &flash_image.source);
+    if (ret == ESP_OK)
+    {
+        logI(TAG, "%s", "Reading Memory");
+        ret = verifyImage(protocol, &flash_image.source);
+    }
+    imageCacheClose(&flash_image);
 
     logI(TAG, "%s", "Ending Connection");
-    endConn();
+    endSession(protocol);
 
-    logI(TAG, "%s", "Done Flashing. Deleting Task...");
-    vTaskDelete(NULL);
+    if (ret == ESP_OK)
+    {
+        /* The base of the next patch */
+        deltaRecordFlashed(filepath);
+        logI(TAG, "%s", "Done Flashing");
+    }
+    else
+    {
+        /* Part of the image may have been written */
+        deltaForgetFlashed();
+        logE(TAG, "Flashing failed: %d", ret);
+    }
+}
+
+static void flash_worker_task(void *parameter)
+{
+    struct flash_job job;
+
+    while (1)
+    {
+        xQueueReceive(flash_jobs, &job, portMAX_DELAY);
+        if (!job.patch)
+        {
+            flash_file(job.filepath);
+        }
+        else if (deltaFlash(job.filepath) == ESP_OK)
+        {
+            logI(TAG, "%s", "Done Flashing Patch");
+        }
+        else
+        {
+            logE(TAG, "%s", "Flashing Patch Failed");
+        }
+
+        logI(TAG, "Least free: %u bytes of stack, %u bytes of heap", uxTaskGetStackHighWaterMark(NULL),
+             esp_get_minimum_free_heap_size());
+    }
+}
+
+static esp_err_t flash_worker_init(void)
+{
+    TaskHandle_t worker;
+
+    flash_jobs = xQueueCreate(FLASH_JOBS_MAX, sizeof(struct flash_job));
+    if (!flash_jobs ||
+        xTaskCreate(&flash_worker_task, "Flash Worker", FLASH_TASK_STACK_SIZE, NULL, 1, &worker) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    metricsWatchTask(worker);
+    return ESP_OK;
+}
+
+/* Queue a file to be flashed, returns false when the queue is full */
+static bool flash_job_queue(const char *filepath, bool patch)
+{
+    struct flash_job job = {.patch = patch};
+
+    strlcpy(job.filepath, filepath, sizeof(job.filepath));
+    return xQueueSend(flash_jobs, &job, 0) == pdTRUE;
 }
 
 struct file_server_data
@@ -55,8 +189,79 @@ struct file_server_data
 
     /* Scratch buffer for temporary storage during file transfer */
     char scratch[SCRATCH_BUFSIZE];
+
+    /* Buffers passed between the upload handler and the storage writer */
+    char upload_buffers[UPLOAD_BUFFERS][SCRATCH_BUFSIZE];
+};
+
+/* Filled upload buffer on its way to storage, a NULL buf ends the file */
+struct upload_chunk
+{
+    char *buf;
+    int len;
+};
+
+/* Uploads are received by the HTTP server task while a writer task stores
+ * them, so the socket keeps being read while SPIFFS erases a sector. The
+ * server runs one handler at a time, so one pipeline serves every upload */
+static struct
+{
+    /* Empty buffers for the receiver, filled ones for the writer */
+    QueueHandle_t free;
+    QueueHandle_t full;
+
+    /* Given by the writer once it has handled the end of the file */
+    SemaphoreHandle_t done;
+
+    FILE *fd;
+    volatile bool failed;
+
+    /* Hashed by the writer too, see upload_post_handler() */
+    file_digest_t *digest;
+
+    /* Flushed chunk by chunk, for the upload_flash task to read */
+    volatile bool follow;
+} upload;
+
+/* Upload flashed while it is still being received: the target is reset
+ * and brought into programming mode as soon as the upload starts, and
+ * reads the stored part of the file as it grows. The server runs one
+ * handler at a time, so there is at most one of these */
+static struct
+{
+    /* A task is flashing an upload, the next upload can't be flashed */
+    volatile bool busy;
+
+    /* Bytes of the file stored so far */
+    volatile long stored;
+
+    /* Upload stored and checked, or given up */
+    volatile bool complete;
+    volatile bool failed;
+
+    /* Given whenever one of the above changes */
+    SemaphoreHandle_t progress;
+
+    char filepath[FILE_PATH_MAX];
+    avr_image_t image;
+} upload_flash;
+
+/* Reader of the part of an upload stored so far */
+struct upload_follow
+{
+    int fd;
+    long pos;
 };
 
+/* Throughput of the uploads, published at /api/stats */
+static struct
+{
+    uint32_t count;
+    uint64_t bytes;
+    uint32_t last_bytes_per_s;
+    uint32_t best_bytes_per_s;
+} upload_stats;
+
 /* Handler to redirect incoming GET request for /index.html to /
  * This can be overridden by uploading file with same name */
 static esp_err_t index_html_get_handler(httpd_req_t *req)
@@ -67,6 +272,68 @@ static esp_err_t index_html_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Parse a SHA-256 digest given as hex, false if it isn't one */
+static bool sha256_from_hex(const char *hex, uint8_t *digest)
+{
+    return strlen(hex) == 2 * FILE_META_SHA256_LEN && hexDecode(hex, digest, FILE_META_SHA256_LEN);
+}
+
+static void sha256_to_hex(char *hex, const uint8_t *digest)
+{
+    for (int i = 0; i < FILE_META_SHA256_LEN; i++)
+    {
+        sprintf(&hex[2 * i], "%02x", digest[i]);
+    }
+}
+
+/* Format the strong ETag of content with the given hash */
+static void etag_from_hash(char *etag, uint64_t hash)
+{
+    snprintf(etag, ETAG_LEN, "\"%016llx\"", (unsigned long long)hash);
+}
+
+/* Whether the request's If-None-Match matches the ETag, i.e. the client
+ * already holds this very content */
+static bool etag_matches(httpd_req_t *req, const char *etag)
+{
+    char value[128];
+
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", value, sizeof(value)) != ESP_OK)
+    {
+        return false;
+    }
+    /* A list of ETags, possibly weak, or "*" */
+    return strstr(value, etag) != NULL || strcmp(value, "*") == 0;
+}
+
+/* Respond with 304 Not Modified, no body */
+static esp_err_t http_resp_not_modified(httpd_req_t *req)
+{
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+}
+
+/* Send a file embedded in flash, with an ETag over its content */
+static esp_err_t http_resp_embedded(httpd_req_t *req, const char *type,
+                                    const unsigned char *start, const unsigned char *end, char *etag)
+{
+    /* Hash the content on first use */
+    if (!etag[0])
+    {
+        etag_from_hash(etag, fileMetaHash(FILE_META_HASH_INIT, start, end - start));
+    }
+
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", EMBEDDED_CACHE_CONTROL);
+    if (etag_matches(req, etag))
+    {
+        return http_resp_not_modified(req);
+    }
+
+    httpd_resp_set_type(req, type);
+    return httpd_resp_send(req, (const char *)start, end - start);
+}
+
 /* Handler to respond with an icon file embedded in flash.
  * Browsers expect to GET website icon at URI /favicon.ico.
  * This can be overridden by uploading file with same name */
@@ -74,41 +341,246 @@ static esp_err_t favicon_get_handler(httpd_req_t *req)
 {
     extern const unsigned char favicon_ico_start[] asm("_binary_favicon_ico_start");
     extern const unsigned char favicon_ico_end[] asm("_binary_favicon_ico_end");
-    const size_t favicon_ico_size = (favicon_ico_end - favicon_ico_start);
-    httpd_resp_set_type(req, "image/x-icon");
-    httpd_resp_send(req, (const char *)favicon_ico_start, favicon_ico_size);
-    return ESP_OK;
+    static char etag[ETAG_LEN];
+    return http_resp_embedded(req, "image/x-icon", favicon_ico_start, favicon_ico_end, etag);
 }
 
-/* Send HTTP response with a run-time generated html consisting of
- * a list of all files and folders under the requested path.
- * In case of SPIFFS this returns empty list when path is any
- * string other than '/', since SPIFFS doesn't support directories */
-static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
+/* Handler to respond with the upload script embedded in flash, kept out
+ * of the directory page so browsers can cache it.
+ * This can be overridden by uploading file with same name */
+static esp_err_t upload_script_get_handler(httpd_req_t *req)
 {
-    char entrypath[FILE_PATH_MAX];
-    char entrysize[16];
-    const char *entrytype;
+    extern const unsigned char upload_script_js_start[] asm("_binary_upload_script_js_start");
+    extern const unsigned char upload_script_js_end[] asm("_binary_upload_script_js_end");
+    static char etag[ETAG_LEN];
+    return http_resp_embedded(req, "application/javascript", upload_script_js_start, upload_script_js_end, etag);
+}
+
+/* Response body assembled in the scratch buffer and sent in a few large
+ * chunks, rather than a chunk (and TCP segment) per string */
+struct resp_buffer
+{
+    httpd_req_t *req;
+    char *buf;
+    size_t len;
+    esp_err_t err;
+};
+
+static void resp_buffer_init(struct resp_buffer *rb, httpd_req_t *req)
+{
+    rb->req = req;
+    rb->buf = ((struct file_server_data *)req->user_ctx)->scratch;
+    rb->len = 0;
+    rb->err = ESP_OK;
+}
+
+static void resp_buffer_flush(struct resp_buffer *rb)
+{
+    if (rb->len && rb->err == ESP_OK)
+    {
+        rb->err = httpd_resp_send_chunk(rb->req, rb->buf, rb->len);
+    }
+    rb->len = 0;
+}
+
+static void resp_buffer_append(struct resp_buffer *rb, const char *data, size_t len)
+{
+    while (len)
+    {
+        const size_t count = MIN(len, SCRATCH_BUFSIZE - rb->len);
+        memcpy(rb->buf + rb->len, data, count);
+        rb->len += count;
+        data += count;
+        len -= count;
+
+        if (rb->len == SCRATCH_BUFSIZE)
+        {
+            resp_buffer_flush(rb);
+        }
+    }
+}
 
+static void resp_buffer_str(struct resp_buffer *rb, const char *str)
+{
+    resp_buffer_append(rb, str, strlen(str));
+}
+
+static void resp_buffer_printf(struct resp_buffer *rb, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+
+    va_start(args, format);
+    const int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    resp_buffer_append(rb, line, MIN(len, sizeof(line) - 1));
+}
+
+/* Add a string as a JSON string literal */
+static void resp_buffer_json_str(struct resp_buffer *rb, const char *str)
+{
+    resp_buffer_str(rb, "\"");
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+        {
+            resp_buffer_printf(rb, "\\%c", *str);
+        }
+        else if ((unsigned char)*str < 0x20)
+        {
+            resp_buffer_printf(rb, "\\u%04x", *str);
+        }
+        else
+        {
+            resp_buffer_append(rb, str, 1);
+        }
+    }
+    resp_buffer_str(rb, "\"");
+}
+
+/* Send the rest of the buffer and end the chunked response */
+static esp_err_t resp_buffer_finish(struct resp_buffer *rb)
+{
+    resp_buffer_flush(rb);
+    if (rb->err == ESP_OK)
+    {
+        rb->err = httpd_resp_send_chunk(rb->req, NULL, 0);
+    }
+    return rb->err;
+}
+
+/* Directory entry kept in the listing cache */
+struct dir_listing_entry
+{
+    char name[CONFIG_SPIFFS_OBJ_NAME_LEN + 1];
+    long size;
+    bool is_dir;
+};
+
+/* Listing of the last directory read, kept until a file is uploaded or
+ * deleted. Only used from the HTTP server task, so needs no locking */
+static struct
+{
+    char dirpath[FILE_PATH_MAX];
+    struct dir_listing_entry *entries;
+    int count;
+    int capacity;
+    bool valid;
+} dir_listing;
+
+static void dir_listing_invalidate(void)
+{
+    dir_listing.valid = false;
+}
+
+/* Read the directory into the listing cache, unless it is there already */
+static esp_err_t dir_listing_load(const char *dirpath)
+{
+    char entrypath[FILE_PATH_MAX];
     struct dirent *entry;
     struct stat entry_stat;
 
+    if (dir_listing.valid && strcmp(dir_listing.dirpath, dirpath) == 0)
+    {
+        return ESP_OK;
+    }
+
     DIR *dir = opendir(dirpath);
-    const size_t dirpath_len = strlen(dirpath);
+    if (!dir)
+    {
+        ESP_LOGE(TAG, "Failed to stat dir : %s", dirpath);
+        return ESP_FAIL;
+    }
 
     /* Retrieve the base path of file storage to construct the full path */
-    strlcpy(entrypath, dirpath, sizeof(entrypath));
+    const size_t dirpath_len = strlcpy(entrypath, dirpath, sizeof(entrypath));
+    dir_listing.count = 0;
 
-    if (!dir)
+    /* Iterate over all files / folders and fetch their names and sizes */
+    while ((entry = readdir(dir)) != NULL)
+    {
+        /* Keep the metadata index and such out of the listing */
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        strlcpy(entrypath + dirpath_len, entry->d_name, sizeof(entrypath) - dirpath_len);
+        if (stat(entrypath, &entry_stat) == -1)
+        {
+            ESP_LOGE(TAG, "Failed to stat %s", entry->d_name);
+            continue;
+        }
+
+        if (dir_listing.count == dir_listing.capacity)
+        {
+            struct dir_listing_entry *entries = realloc(dir_listing.entries,
+                                                        (dir_listing.capacity + 16) * sizeof(*entries));
+            if (!entries)
+            {
+                closedir(dir);
+                return ESP_ERR_NO_MEM;
+            }
+            dir_listing.entries = entries;
+            dir_listing.capacity += 16;
+        }
+
+        struct dir_listing_entry *listed = &dir_listing.entries[dir_listing.count++];
+        strlcpy(listed->name, entry->d_name, sizeof(listed->name));
+        listed->size = entry_stat.st_size;
+        listed->is_dir = (entry->d_type == DT_DIR);
+        ESP_LOGD(TAG, "Found %s : %s (%ld bytes)", listed->is_dir ? "directory" : "file", listed->name, listed->size);
+    }
+    closedir(dir);
+
+    strlcpy(dir_listing.dirpath, dirpath, sizeof(dir_listing.dirpath));
+    dir_listing.valid = true;
+    return ESP_OK;
+}
+
+/* Add a paragraph reporting the progress of the batch run, with a button
+ * to stop it while it is in progress. Nothing before the first run */
+static void http_resp_batch_html(struct resp_buffer *rb)
+{
+    batch_status_t status;
+
+    batchGetStatus(&status);
+    if (status.started_us == 0)
+    {
+        return;
+    }
+
+    resp_buffer_printf(rb, "<p>Batch %s: ", status.path);
+    resp_buffer_printf(rb, "%s, %d/%d passed, %d failed, last %u ms, average %u ms, %u boards/hour</p>",
+                       batchStateName(status.state), status.passed, status.target, status.failed,
+                       status.last_ms, status.passed ? status.total_ms / status.passed : 0, batchBoardsPerHour(&status));
+
+    if (status.state != BATCH_IDLE)
+    {
+        resp_buffer_str(rb, "<form method=\"post\" action=\"/stop\"><button type=\"submit\">Stop batch</button></form>");
+    }
+}
+
+/* Send HTTP response with a run-time generated html consisting of
+ * a list of all files and folders under the requested path.
+ * In case of SPIFFS this returns empty list when path is any
+ * string other than '/', since SPIFFS doesn't support directories */
+static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
+{
+    struct resp_buffer rb;
+
+    if (dir_listing_load(dirpath) != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to stat dir : %s", dirpath);
         /* Respond with 404 Not Found */
         httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Directory does not exist");
         return ESP_FAIL;
     }
 
-    /* Send HTML file header */
-    httpd_resp_sendstr_chunk(req, "<!DOCTYPE html><html><body>");
+    resp_buffer_init(&rb, req);
+
+    /* Add HTML file header */
+    resp_buffer_str(&rb, "<!DOCTYPE html><html><body>");
 
     /* Get handle to embedded file upload script */
     extern const unsigned char upload_script_start[] asm("_binary_upload_script_html_start");
@@ -116,68 +588,43 @@ static esp_err_t http_resp_dir_html(httpd_req_t *req, const char *dirpath)
     const size_t upload_script_size = (upload_script_end - upload_script_start);
 
     /* Add file upload form and script which on execution sends a POST request to /upload */
-    httpd_resp_send_chunk(req, (const char *)upload_script_start, upload_script_size);
+    resp_buffer_append(&rb, (const char *)upload_script_start, upload_script_size);
 
-    /* Send file-list table definition and column labels */
-    httpd_resp_sendstr_chunk(req,
-                             "<table class=\"fixed\" border=\"1\">"
-                             "<col width=\"800px\"/> <col width=\"300px\"/> <col width=\"300px\"/> <col width=\"75px\"/> <col width=\"100px\"/>"
-                             "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Flash</th><th>Delete</th></tr></thead>"
-                             "<tbody>");
+    /* Report the batch run in progress, or the last one */
+    http_resp_batch_html(&rb);
 
-    /* Iterate over all files / folders and fetch their names and sizes */
-    while ((entry = readdir(dir)) != NULL)
-    {
-        entrytype = (entry->d_type == DT_DIR ? "directory" : "file");
+    /* Add file-list table definition and column labels */
+    resp_buffer_str(&rb,
+                    "<table class=\"fixed\" border=\"1\">"
+                    "<col width=\"800px\"/> <col width=\"300px\"/> <col width=\"300px\"/> <col width=\"75px\"/> <col width=\"200px\"/> <col width=\"100px\"/>"
+                    "<thead><tr><th>Name</th><th>Type</th><th>Size (Bytes)</th><th>Flash</th><th>Batch</th><th>Delete</th></tr></thead>"
+                    "<tbody>");
 
-        strlcpy(entrypath + dirpath_len, entry->d_name, sizeof(entrypath) - dirpath_len);
-        if (stat(entrypath, &entry_stat) == -1)
-        {
-            ESP_LOGE(TAG, "Failed to stat %s : %s", entrytype, entry->d_name);
-            continue;
-        }
-        sprintf(entrysize, "%ld", entry_stat.st_size);
-        ESP_LOGI(TAG, "Found %s : %s (%s bytes)", entrytype, entry->d_name, entrysize);
-
-        /* Send chunk of HTML file containing table entries with file name and size */
-        httpd_resp_sendstr_chunk(req, "<tr><td><a href=\"");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        if (entry->d_type == DT_DIR)
-        {
-            httpd_resp_sendstr_chunk(req, "/");
-        }
-        httpd_resp_sendstr_chunk(req, "\">");
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "</a></td><td>");
-        httpd_resp_sendstr_chunk(req, entrytype);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-        httpd_resp_sendstr_chunk(req, entrysize);
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-
-        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/flash");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Flash</button></form>");
-        httpd_resp_sendstr_chunk(req, "</td><td>");
-
-        httpd_resp_sendstr_chunk(req, "<form method=\"post\" action=\"/delete");
-        httpd_resp_sendstr_chunk(req, req->uri);
-        httpd_resp_sendstr_chunk(req, entry->d_name);
-        httpd_resp_sendstr_chunk(req, "\"><button type=\"submit\">Delete</button></form>");
-        httpd_resp_sendstr_chunk(req, "</td></tr>\n");
+    /* Add table entries with file name and size, and the actions on it */
+    for (int i = 0; i < dir_listing.count; i++)
+    {
+        const struct dir_listing_entry *entry = &dir_listing.entries[i];
+
+        resp_buffer_printf(&rb, "<tr><td><a href=\"%s%s%s\">%s</a></td>",
+                           req->uri, entry->name, entry->is_dir ? "/" : "", entry->name);
+        resp_buffer_printf(&rb, "<td>%s</td><td>%ld</td>", entry->is_dir ? "directory" : "file", entry->size);
+        resp_buffer_printf(&rb, "<td><form method=\"post\" action=\"/flash%s%s\">"
+                                "<button type=\"submit\">Flash</button></form></td>",
+                           req->uri, entry->name);
+        resp_buffer_printf(&rb, "<td><form method=\"post\" action=\"/batch%s%s\">"
+                                "<input type=\"number\" name=\"count\" value=\"10\" min=\"1\" style=\"width:60px\">"
+                                "<button type=\"submit\">Start</button></form></td>",
+                           req->uri, entry->name);
+        resp_buffer_printf(&rb, "<td><form method=\"post\" action=\"/delete%s%s\">"
+                                "<button type=\"submit\">Delete</button></form></td></tr>\n",
+                           req->uri, entry->name);
     }
-    closedir(dir);
-
-    /* Finish the file list table */
-    httpd_resp_sendstr_chunk(req, "</tbody></table>");
 
-    /* Send remaining chunk of HTML file to complete it */
-    httpd_resp_sendstr_chunk(req, "</body></html>");
+    /* Finish the file list table and the HTML file */
+    resp_buffer_str(&rb, "</tbody></table></body></html>");
 
-    /* Send empty chunk to signal HTTP response completion */
-    httpd_resp_sendstr_chunk(req, NULL);
-    return ESP_OK;
+    /* Flush the rest and signal HTTP response completion */
+    return resp_buffer_finish(&rb);
 }
 
 #define IS_FILE_EXT(filename, ext) \
@@ -202,44 +649,131 @@ static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filena
     {
         return httpd_resp_set_type(req, "image/x-icon");
     }
+    else if (IS_FILE_EXT(filename, ".gz"))
+    {
+        return httpd_resp_set_type(req, "application/gzip");
+    }
+    else if (IS_FILE_EXT(filename, ".elf") || IS_FILE_EXT(filename, ".bin"))
+    {
+        return httpd_resp_set_type(req, "application/octet-stream");
+    }
     /* This is a limited set only */
     /* For any other type always set as plain text */
     return httpd_resp_set_type(req, "text/plain");
 }
 
-/* Copies the full path into destination buffer and returns
- * pointer to path (skipping the preceding base path) */
-static const char *get_path_from_uri(char *dest, const char *base_path, const char *uri, size_t destsize)
+/* Name of the image format a file holds, going by its extension */
+static const char *image_format_from_file(const char *filename)
 {
-    const size_t base_pathlen = strlen(base_path);
-    size_t pathlen = strlen(uri);
+    char name[CONFIG_SPIFFS_OBJ_NAME_LEN + 1];
 
-    const char *quest = strchr(uri, '?');
-    if (quest)
+    /* Look through a trailing .gz */
+    const size_t len = strlcpy(name, filename, sizeof(name));
+    if (len > 3 && len < sizeof(name) && strcasecmp(&name[len - 3], ".gz") == 0)
     {
-        pathlen = MIN(pathlen, quest - uri);
+        name[len - 3] = '\0';
     }
-    const char *hash = strchr(uri, '#');
-    if (hash)
+    const char *ext = strrchr(name, '.');
+    if (!ext)
     {
-        pathlen = MIN(pathlen, hash - uri);
+        return NULL;
     }
 
-    if (base_pathlen + pathlen + 1 > destsize)
+    if (strcasecmp(ext, ".hex") == 0)
     {
-        /* Full path string won't fit into destination buffer */
-        return NULL;
+        return "hex";
     }
-
-    /* Construct full path (base + path) */
-    strcpy(dest, base_path);
-    strlcpy(dest + base_pathlen, uri, pathlen + 1);
-
-    /* Return pointer to path, skipping the base */
-    return dest + base_pathlen;
+    else if (strcasecmp(ext, ".elf") == 0)
+    {
+        return "elf";
+    }
+    else if (strcasecmp(ext, ".bin") == 0)
+    {
+        return "bin";
+    }
+    return NULL;
 }
 
-/* Handler to download a file kept on the server */
+/* Handler to list the files as JSON, for scripting */
+static esp_err_t api_files_get_handler(httpd_req_t *req)
+{
+    const char *base_path = ((struct file_server_data *)req->user_ctx)->base_path;
+    char dirpath[FILE_PATH_MAX];
+    char filepath[FILE_PATH_MAX];
+    struct resp_buffer rb;
+
+    snprintf(dirpath, sizeof(dirpath), "%s/", base_path);
+    if (dir_listing_load(dirpath) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to list files");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    resp_buffer_init(&rb, req);
+    resp_buffer_str(&rb, "{\"files\":[");
+
+    for (int i = 0; i < dir_listing.count; i++)
+    {
+        const struct dir_listing_entry *entry = &dir_listing.entries[i];
+        const char *format = image_format_from_file(entry->name);
+        uint32_t block_count, hash;
+
+        resp_buffer_str(&rb, i ? ",{\"name\":" : "{\"name\":");
+        resp_buffer_json_str(&rb, entry->name);
+        resp_buffer_printf(&rb, ",\"size\":%ld,\"type\":\"%s\"", entry->size, entry->is_dir ? "directory" : "file");
+        if (format)
+        {
+            resp_buffer_printf(&rb, ",\"format\":\"%s\"", format);
+        }
+
+        /* Stats of the decoded image, known once it was flashed */
+        snprintf(filepath, sizeof(filepath), "%s%s", dirpath, entry->name);
+        if (imageCacheStats(filepath, &block_count, &hash))
+        {
+            resp_buffer_printf(&rb, ",\"cached\":true,\"blocks\":%u,\"flash_bytes\":%u,\"hash\":\"%08x\"",
+                               block_count, block_count * BLOCK_SIZE, hash);
+        }
+        resp_buffer_str(&rb, "}");
+    }
+
+    resp_buffer_str(&rb, "]}");
+    return resp_buffer_finish(&rb);
+}
+
+/* Copies the full path into destination buffer and returns
+ * pointer to path (skipping the preceding base path) */
+static const char *get_path_from_uri(char *dest, const char *base_path, const char *uri, size_t destsize)
+{
+    const size_t base_pathlen = strlen(base_path);
+    size_t pathlen = strlen(uri);
+
+    const char *quest = strchr(uri, '?');
+    if (quest)
+    {
+        pathlen = MIN(pathlen, quest - uri);
+    }
+    const char *hash = strchr(uri, '#');
+    if (hash)
+    {
+        pathlen = MIN(pathlen, hash - uri);
+    }
+
+    if (base_pathlen + pathlen + 1 > destsize)
+    {
+        /* Full path string won't fit into destination buffer */
+        return NULL;
+    }
+
+    /* Construct full path (base + path) */
+    strcpy(dest, base_path);
+    strlcpy(dest + base_pathlen, uri, pathlen + 1);
+
+    /* Return pointer to path, skipping the base */
+    return dest + base_pathlen;
+}
+
+/* Handler to download a file kept on the server */
 static esp_err_t download_get_handler(httpd_req_t *req)
 {
     char filepath[FILE_PATH_MAX];
@@ -262,6 +796,13 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         return http_resp_dir_html(req, filepath);
     }
 
+    /* Dot files hold the server's own data, like the metadata index */
+    if (filename[1] == '.')
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
+        return ESP_FAIL;
+    }
+
     if (stat(filepath, &file_stat) == -1)
     {
         /* If file not present on SPIFFS check if URI
@@ -274,31 +815,84 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         {
             return favicon_get_handler(req);
         }
+        else if (strcmp(filename, "/upload_script.js") == 0)
+        {
+            return upload_script_get_handler(req);
+        }
         ESP_LOGE(TAG, "Failed to stat file : %s", filepath);
         /* Respond with 404 Not Found */
         httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
         return ESP_FAIL;
     }
 
+    /* Strong ETag from the content hash kept with the file, so a client
+     * holding the same content only gets the headers back */
+    file_meta_t meta;
+    char etag[ETAG_LEN];
+    char digest_hex[2 * FILE_META_SHA256_LEN + 1];
+    if (fileMetaGet(filepath, &meta) == ESP_OK)
+    {
+        etag_from_hash(etag, meta.hash);
+        httpd_resp_set_hdr(req, "ETag", etag);
+        sha256_to_hex(digest_hex, meta.sha256);
+        httpd_resp_set_hdr(req, "X-Content-SHA256", digest_hex);
+        httpd_resp_set_hdr(req, "Cache-Control", FILE_CACHE_CONTROL);
+        if (etag_matches(req, etag))
+        {
+            ESP_LOGD(TAG, "Not modified : %s", filename);
+            return http_resp_not_modified(req);
+        }
+    }
+
+    /* Send only the requested part of the file, if a range is asked for */
+    long start = 0;
+    long end = file_stat.st_size - 1;
+    char range[64];
+    char content_range[64];
+    httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+    const http_range_t ranged = httpd_req_get_hdr_value_str(req, "Range", range, sizeof(range)) == ESP_OK
+                                   ? parse_range(range, file_stat.st_size, &start, &end)
+                                   : HTTP_RANGE_IGNORE;
+    if (ranged != HTTP_RANGE_IGNORE)
+    {
+        if (ranged == HTTP_RANGE_UNSATISFIABLE)
+        {
+            snprintf(content_range, sizeof(content_range), "bytes */%ld", file_stat.st_size);
+            httpd_resp_set_hdr(req, "Content-Range", content_range);
+            httpd_resp_set_status(req, "416 Range Not Satisfiable");
+            return httpd_resp_send(req, NULL, 0);
+        }
+
+        snprintf(content_range, sizeof(content_range), "bytes %ld-%ld/%ld", start, end, file_stat.st_size);
+        httpd_resp_set_hdr(req, "Content-Range", content_range);
+        httpd_resp_set_status(req, "206 Partial Content");
+    }
+
     fd = fopen(filepath, "r");
-    if (!fd)
+    if (!fd || fseek(fd, start, SEEK_SET) != 0)
     {
         ESP_LOGE(TAG, "Failed to read existing file : %s", filepath);
+        if (fd)
+        {
+            fclose(fd);
+        }
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
+    ESP_LOGI(TAG, "Sending file : %s (bytes %ld-%ld of %ld)...", filename, start, end, file_stat.st_size);
     set_content_type_from_file(req, filename);
 
     /* Retrieve the pointer to scratch buffer for temporary storage */
     char *chunk = ((struct file_server_data *)req->user_ctx)->scratch;
     size_t chunksize;
+    long remaining = end - start + 1;
     do
     {
         /* Read file in chunks into the scratch buffer */
-        chunksize = fread(chunk, 1, SCRATCH_BUFSIZE, fd);
+        chunksize = fread(chunk, 1, MIN(remaining, SCRATCH_BUFSIZE), fd);
+        remaining -= chunksize;
 
         /* Send the buffer contents as HTTP response chunk */
         if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK)
@@ -315,13 +909,657 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         /* Keep looping till the whole file is sent */
     } while (chunksize != 0);
 
-    /* Close file after sending complete */
-    fclose(fd);
-    ESP_LOGI(TAG, "File sending complete");
+    /* Close file after sending complete */
+    fclose(fd);
+    ESP_LOGI(TAG, "File sending complete");
+
+    /* Respond with an empty chunk to signal HTTP response completion */
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+/* Storage writer, writing the filled buffers in the order they were
+ * received and handing them back to the receiver */
+static void upload_writer_task(void *parameter)
+{
+    struct upload_chunk chunk;
+
+    while (1)
+    {
+        xQueueReceive(upload.full, &chunk, portMAX_DELAY);
+        if (!chunk.buf)
+        {
+            xSemaphoreGive(upload.done);
+            continue;
+        }
+
+        fileDigestUpdate(upload.digest, chunk.buf, chunk.len);
+        if (!upload.failed && fwrite(chunk.buf, 1, chunk.len, upload.fd) != chunk.len)
+        {
+            /* Storage may be full? Drain the rest without writing */
+            upload.failed = true;
+        }
+
+        /* Get the chunk onto storage for the task flashing it */
+        if (upload.follow && !upload.failed)
+        {
+            if (fflush(upload.fd) == 0 && fsync(fileno(upload.fd)) == 0)
+            {
+                upload_flash.stored += chunk.len;
+            }
+            else
+            {
+                upload.failed = true;
+            }
+            xSemaphoreGive(upload_flash.progress);
+        }
+        xQueueSend(upload.free, &chunk.buf, portMAX_DELAY);
+    }
+}
+
+/* Set up the upload pipeline and its writer task */
+static esp_err_t upload_pipeline_init(struct file_server_data *server_data)
+{
+    upload.free = xQueueCreate(UPLOAD_BUFFERS, sizeof(char *));
+    upload.full = xQueueCreate(UPLOAD_BUFFERS + 1, sizeof(struct upload_chunk));
+    upload.done = xSemaphoreCreateBinary();
+    upload_flash.progress = xSemaphoreCreateBinary();
+    if (!upload.free || !upload.full || !upload.done || !upload_flash.progress)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < UPLOAD_BUFFERS; i++)
+    {
+        char *buf = server_data->upload_buffers[i];
+        xQueueSend(upload.free, &buf, 0);
+    }
+
+    TaskHandle_t writer;
+    if (xTaskCreate(&upload_writer_task, "Upload Writer", 4096, NULL, 5, &writer) != pdPASS)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    metricsWatchTask(writer);
+    return ESP_OK;
+}
+
+/* Wait for the writer to store everything queued, returns false if
+ * writing failed */
+static bool upload_pipeline_finish(void)
+{
+    const struct upload_chunk end = {.buf = NULL, .len = 0};
+
+    xQueueSend(upload.full, &end, portMAX_DELAY);
+    xSemaphoreTake(upload.done, portMAX_DELAY);
+    return !upload.failed;
+}
+
+/* Wait until the upload is stored beyond pos, keeping the bootloader in
+ * programming mode meanwhile. Returns 1 once it is, 0 if the upload was
+ * complete before and -1 if it failed */
+static int upload_flash_wait(long pos)
+{
+    while (!upload_flash.failed)
+    {
+        if (pos < upload_flash.stored)
+        {
+            return 1;
+        }
+        if (upload_flash.complete)
+        {
+            return 0;
+        }
+        if (xSemaphoreTake(upload_flash.progress, pdMS_TO_TICKS(UPLOAD_FLASH_KEEPALIVE_MS)) != pdTRUE &&
+            !keepSession(AVR_DEFAULT_PROTOCOL))
+        {
+            ESP_LOGE(TAG, "Target left programming mode while waiting for the upload");
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static ssize_t upload_follow_read(void *cookie, char *buf, size_t count)
+{
+    struct upload_follow *follow = (struct upload_follow *)cookie;
+
+    const int ready = upload_flash_wait(follow->pos);
+    if (ready <= 0)
+    {
+        return ready;
+    }
+
+    if (lseek(follow->fd, follow->pos, SEEK_SET) != follow->pos)
+    {
+        return -1;
+    }
+    const int n = read(follow->fd, buf, MIN(count, upload_flash.stored - follow->pos));
+    if (n > 0)
+    {
+        follow->pos += n;
+    }
+    return n;
+}
+
+static int upload_follow_seek(void *cookie, upload_off_t *offset, int whence)
+{
+    struct upload_follow *follow = (struct upload_follow *)cookie;
+
+    /* Only back into what was stored already */
+    if (whence != SEEK_SET || *offset < 0 || *offset > upload_flash.stored)
+    {
+        return -1;
+    }
+    follow->pos = *offset;
+    return 0;
+}
+
+static int upload_follow_close(void *cookie)
+{
+    struct upload_follow *follow = (struct upload_follow *)cookie;
+    const int ret = close(follow->fd);
+    free(follow);
+    return ret;
+}
+
+/* Open the upload as an image. Plain images are read as they arrive, a
+ * gzip'd one only inflates from storage once it is complete */
+static esp_err_t upload_flash_open(avr_image_t *image, const char *filepath)
+{
+    static const cookie_io_functions_t follow_io = {
+        .read = upload_follow_read,
+        .write = NULL,
+        .seek = upload_follow_seek,
+        .close = upload_follow_close,
+    };
+
+    if (IS_FILE_EXT(filepath, ".gz"))
+    {
+        return upload_flash_wait(LONG_MAX) == 0 ? imageOpen(image, filepath) : ESP_FAIL;
+    }
+
+    struct upload_follow *follow = calloc(1, sizeof(struct upload_follow));
+    if (!follow)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    follow->fd = open(filepath, O_RDONLY);
+    if (follow->fd < 0)
+    {
+        free(follow);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    FILE *f = fopencookie(follow, "r", follow_io);
+    if (!f)
+    {
+        close(follow->fd);
+        free(follow);
+        return ESP_ERR_NO_MEM;
+    }
+    return imageOpenStream(image, f, filepath);
+}
+
+/* Flash an upload as it is received, see upload_flash */
+static void upload_flash_task(void *parameter)
+{
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    const char *filepath = upload_flash.filepath;
+
+    ESP_LOGI(TAG, "Getting in sync with the target while receiving %s", filepath);
+    esp_err_t ret = startSession(protocol);
+
+    if (ret == ESP_OK)
+    {
+        ret = upload_flash_open(&upload_flash.image, filepath);
+        if (ret == ESP_OK)
+        {
+            ret = writeSessionImage(protocol, &upload_flash.image.source);
+            if (ret == ESP_OK)
+            {
+                ret = verifyImage(protocol, &upload_flash.image.source);
+            }
+            imageClose(&upload_flash.image);
+        }
+    }
+    endSession(protocol);
+
+    if (ret == ESP_OK)
+    {
+        /* The base of the next patch */
+        deltaRecordFlashed(filepath);
+        ESP_LOGI(TAG, "Done Flashing %s", filepath);
+    }
+    else
+    {
+        /* What the target holds now is anyone's guess */
+        deltaForgetFlashed();
+        ESP_LOGE(TAG, "Flashing %s failed", filepath);
+    }
+
+    upload_flash.busy = false;
+    metricsTaskExit();
+    vTaskDelete(NULL);
+}
+
+/* Start flashing the upload being stored into filepath */
+static void upload_flash_start(const char *filepath)
+{
+    strlcpy(upload_flash.filepath, filepath, sizeof(upload_flash.filepath));
+    upload_flash.stored = 0;
+    upload_flash.complete = false;
+    upload_flash.failed = false;
+    xSemaphoreTake(upload_flash.progress, 0);
+
+    upload_flash.busy = true;
+    upload.follow = true;
+    if (xTaskCreate(&upload_flash_task, "Upload Flash", FLASH_TASK_STACK_SIZE, NULL, 1, NULL) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start flashing %s", filepath);
+        upload.follow = false;
+        upload_flash.busy = false;
+    }
+}
+
+/* Let the task flashing the upload know how it ended. Call before a failed
+ * upload is deleted */
+static void upload_flash_end(bool complete)
+{
+    if (!upload.follow)
+    {
+        return;
+    }
+    upload.follow = false;
+
+    if (complete)
+    {
+        upload_flash.complete = true;
+    }
+    else
+    {
+        upload_flash.failed = true;
+    }
+    xSemaphoreGive(upload_flash.progress);
+}
+
+/* Record the throughput of an upload of the given size and duration */
+static void upload_stats_record(size_t bytes, int64_t elapsed_us)
+{
+    const uint32_t bytes_per_s = elapsed_us > 0 ? (uint64_t)bytes * 1000000 / elapsed_us : 0;
+
+    upload_stats.count++;
+    upload_stats.bytes += bytes;
+    upload_stats.last_bytes_per_s = bytes_per_s;
+    upload_stats.best_bytes_per_s = MAX(upload_stats.best_bytes_per_s, bytes_per_s);
+    metricsCount(METRIC_UPLOAD_BYTES, bytes);
+    metricsObserve(METRIC_UPLOAD, elapsed_us);
+
+    ESP_LOGI(TAG, "Upload: %u bytes in %lld ms, %u.%02u MB/s", bytes, elapsed_us / 1000,
+             bytes_per_s / 1000000, (bytes_per_s / 10000) % 100);
+}
+
+/* Handler to report server statistics as JSON */
+static esp_err_t api_stats_get_handler(httpd_req_t *req)
+{
+    char json[192];
+
+    snprintf(json, sizeof(json),
+             "{\"upload\":{\"count\":%u,\"bytes\":%llu,\"last_bytes_per_s\":%u,\"best_bytes_per_s\":%u}}",
+             upload_stats.count, (unsigned long long)upload_stats.bytes,
+             upload_stats.last_bytes_per_s, upload_stats.best_bytes_per_s);
+
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, json);
+}
+
+static void metrics_emit(void *ctx, const char *data, size_t len)
+{
+    resp_buffer_append((struct resp_buffer *)ctx, data, len);
+}
+
+/* Handler to report the metrics for Prometheus to scrape */
+static esp_err_t metrics_get_handler(httpd_req_t *req)
+{
+    struct resp_buffer rb;
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    resp_buffer_init(&rb, req);
+    metricsRender(metrics_emit, &rb);
+    return resp_buffer_finish(&rb);
+}
+
+/* Block read from the target, a NULL buf ends the dump */
+struct dump_block
+{
+    uint8_t *buf;
+    esp_err_t ret;
+};
+
+/* Target flash being dumped: a reader task reads the blocks into the
+ * buffers while the handler sends them */
+struct dump
+{
+    /* Empty buffers for the reader, filled ones for the handler */
+    QueueHandle_t free;
+    QueueHandle_t full;
+
+    uint32_t size;
+    volatile bool cancelled;
+
+    uint8_t buffers[DUMP_BUFFERS][BLOCK_SIZE];
+};
+
+/* Encoder of a dump into the response */
+struct dump_writer
+{
+    struct resp_buffer rb;
+    bool hex;
+    bool trim;
+
+    /* Address of the next byte sent */
+    uint32_t next;
+
+    /* 0xFF bytes held back, dropped if nothing else follows them */
+    uint32_t pending;
+
+    /* Upper 16 bits of the address in the last Extended Linear Address Record */
+    uint16_t ext;
+};
+
+/* Read the target's flash into the dump's buffers */
+static void dump_reader_task(void *parameter)
+{
+    struct dump *dump = (struct dump *)parameter;
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    struct dump_block block = {.buf = NULL};
+
+    block.ret = startSession(protocol);
+    for (uint32_t address = 0; block.ret == ESP_OK && address < dump->size && !dump->cancelled; address += BLOCK_SIZE)
+    {
+        xQueueReceive(dump->free, &block.buf, portMAX_DELAY);
+        block.ret = readSessionBlock(protocol, address, block.buf);
+        xQueueSend(dump->full, &block, portMAX_DELAY);
+    }
+
+    /* Back to running its sketch */
+    endSession(protocol);
+
+    /* The end, with the error if there was one */
+    block.buf = NULL;
+    xQueueSend(dump->full, &block, portMAX_DELAY);
+    metricsTaskExit();
+    vTaskDelete(NULL);
+}
+
+/* Add an Intel HEX Record */
+static void dump_hex_record(struct resp_buffer *rb, uint8_t type, uint16_t address, const uint8_t *data, int len)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    const uint8_t header[] = {len, address >> 8, address & 0xff, type};
+    char line[1 + (4 + DUMP_HEX_RECORD + 1) * 2 + 1];
+    uint8_t checksum = 0;
+    int n = 0;
+
+    line[n++] = ':';
+    for (int i = 0; i < sizeof(header) + len; i++)
+    {
+        const uint8_t byte = i < sizeof(header) ? header[i] : data[i - sizeof(header)];
+        line[n++] = digits[byte >> 4];
+        line[n++] = digits[byte & 0xf];
+        checksum += byte;
+    }
+    checksum = -checksum;
+    line[n++] = digits[checksum >> 4];
+    line[n++] = digits[checksum & 0xf];
+    line[n++] = '\n';
+
+    resp_buffer_append(rb, line, n);
+}
+
+/* Add bytes following the ones sent so far */
+static void dump_emit(struct dump_writer *w, const uint8_t *data, uint32_t len)
+{
+    if (!w->hex)
+    {
+        resp_buffer_append(&w->rb, (const char *)data, len);
+        w->next += len;
+        return;
+    }
+
+    while (len)
+    {
+        /* Records don't cross a 64 KB boundary */
+        const uint32_t count = MIN(len, MIN(DUMP_HEX_RECORD, 0x10000 - (w->next & 0xffff)));
+
+        if (w->next >> 16 != w->ext)
+        {
+            const uint8_t ext[] = {w->next >> 24, (w->next >> 16) & 0xff};
+            w->ext = w->next >> 16;
+            dump_hex_record(&w->rb, 0x04, 0, ext, sizeof(ext));
+        }
+        dump_hex_record(&w->rb, 0x00, w->next & 0xffff, data, count);
+
+        w->next += count;
+        data += count;
+        len -= count;
+    }
+}
+
+/* Add the next block of the dump, holding back trailing 0xFF bytes if trimming */
+static void dump_write_block(struct dump_writer *w, const uint8_t *block)
+{
+    int last = BLOCK_SIZE - 1;
+
+    if (w->trim)
+    {
+        while (last >= 0 && block[last] == 0xff)
+        {
+            last--;
+        }
+        if (last < 0)
+        {
+            w->pending += BLOCK_SIZE;
+            return;
+        }
+
+        /* Not trailing after all */
+        uint8_t erased[DUMP_HEX_RECORD];
+        memset(erased, 0xff, sizeof(erased));
+        while (w->pending)
+        {
+            const uint32_t count = MIN(w->pending, sizeof(erased));
+            dump_emit(w, erased, count);
+            w->pending -= count;
+        }
+    }
+
+    dump_emit(w, block, last + 1);
+    w->pending = BLOCK_SIZE - 1 - last;
+}
+
+#if CONFIG_AVR_PROTOCOL_ISP
+/* Respond with the signature and fuses of the target, read over ISP */
+static esp_err_t api_target_fuses(httpd_req_t *req)
+{
+    const avr_protocol_t *protocol = AVR_DEFAULT_PROTOCOL;
+    uint8_t signature[3];
+    uint8_t fuses[4];
+    char json[128];
+
+    if (batchRunning() || upload_flash.busy)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Flashing in progress");
+        return ESP_FAIL;
+    }
+
+    int ok = startSession(protocol) == ESP_OK && ispReadSignature(signature);
+    for (int fuse = ISP_FUSE_LOW; ok && fuse <= ISP_FUSE_LOCK; fuse++)
+    {
+        ok = ispReadFuse(fuse, &fuses[fuse]);
+    }
+    endSession(protocol);
+
+    if (!ok)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Target not responding");
+        return ESP_FAIL;
+    }
+
+    snprintf(json, sizeof(json),
+             "{\"signature\":\"%02x%02x%02x\",\"low\":%u,\"high\":%u,\"extended\":%u,\"lock\":%u}",
+             signature[0], signature[1], signature[2], fuses[ISP_FUSE_LOW], fuses[ISP_FUSE_HIGH],
+             fuses[ISP_FUSE_EXTENDED], fuses[ISP_FUSE_LOCK]);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_sendstr(req, json);
+}
+#endif
+
+/* Handler to dump the flash of the target, GET /api/targets/0/flash.hex or
+ * flash.bin. Takes "size" in bytes and "trim=1" to drop trailing 0xFF bytes */
+static esp_err_t api_targets_get_handler(httpd_req_t *req)
+{
+    const char *path = req->uri + sizeof("/api/targets/") - 1;
+    const size_t path_len = strcspn(path, "?#");
+    struct dump_writer writer = {0};
+
+#if CONFIG_AVR_PROTOCOL_ISP
+    if (path_len == sizeof("0/fuses") - 1 && strncmp(path, "0/fuses", path_len) == 0)
+    {
+        return api_target_fuses(req);
+    }
+#endif
+
+    /* There is the one target on the UART */
+    if (path_len == sizeof("0/flash.hex") - 1 && strncmp(path, "0/flash.hex", path_len) == 0)
+    {
+        writer.hex = true;
+    }
+    else if (path_len != sizeof("0/flash.bin") - 1 || strncmp(path, "0/flash.bin", path_len) != 0)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Target 0 has flash.hex and flash.bin");
+        return ESP_FAIL;
+    }
+
+    char query[64];
+    char value[16];
+    uint32_t size = DUMP_SIZE_DEFAULT;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        if (httpd_query_key_value(query, "size", value, sizeof(value)) == ESP_OK)
+        {
+            size = strtoul(value, NULL, 0);
+        }
+        if (httpd_query_key_value(query, "trim", value, sizeof(value)) == ESP_OK)
+        {
+            writer.trim = strcmp(value, "0") != 0;
+        }
+    }
+    if (size == 0 || size > FLASH_SIZE_MAX)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Size must be 1 byte to 256 KB");
+        return ESP_FAIL;
+    }
+
+    if (batchRunning() || upload_flash.busy)
+    {
+        ESP_LOGE(TAG, "Target busy, can't dump its flash");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Flashing in progress");
+        return ESP_FAIL;
+    }
+
+    struct dump *dump = calloc(1, sizeof(struct dump));
+    if (dump)
+    {
+        dump->size = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        dump->free = xQueueCreate(DUMP_BUFFERS, sizeof(uint8_t *));
+        dump->full = xQueueCreate(DUMP_BUFFERS + 1, sizeof(struct dump_block));
+    }
+    if (!dump || !dump->free || !dump->full)
+    {
+        if (dump && dump->free)
+        {
+            vQueueDelete(dump->free);
+        }
+        if (dump && dump->full)
+        {
+            vQueueDelete(dump->full);
+        }
+        free(dump);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    for (int i = 0; i < DUMP_BUFFERS; i++)
+    {
+        uint8_t *buf = dump->buffers[i];
+        xQueueSend(dump->free, &buf, 0);
+    }
+
+    const int64_t started = esp_timer_get_time();
+    if (xTaskCreate(&dump_reader_task, "Flash Dump", 4096, dump, 5, NULL) != pdPASS)
+    {
+        vQueueDelete(dump->free);
+        vQueueDelete(dump->full);
+        free(dump);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to start reading");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, writer.hex ? "text/plain" : "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition",
+                       writer.hex ? "attachment; filename=\"flash.hex\"" : "attachment; filename=\"flash.bin\"");
+    resp_buffer_init(&writer.rb, req);
+
+    /* Send each block as soon as it is read, the reader goes on meanwhile */
+    struct dump_block block;
+    esp_err_t ret = ESP_OK;
+    int blocks = 0;
+    while (xQueueReceive(dump->full, &block, portMAX_DELAY) == pdTRUE && block.buf)
+    {
+        if (ret == ESP_OK && block.ret == ESP_OK)
+        {
+            dump_write_block(&writer, block.buf);
+            resp_buffer_flush(&writer.rb);
+            ret = writer.rb.err;
+            blocks++;
+        }
+        else if (ret == ESP_OK)
+        {
+            ret = block.ret;
+        }
+        if (ret != ESP_OK)
+        {
+            /* Let the reader end the session, and drain what it still sends */
+            dump->cancelled = true;
+        }
+        xQueueSend(dump->free, &block.buf, 0);
+    }
+    if (ret == ESP_OK)
+    {
+        ret = block.ret;
+    }
+
+    vQueueDelete(dump->free);
+    vQueueDelete(dump->full);
+    free(dump);
 
-    /* Respond with an empty chunk to signal HTTP response completion */
-    httpd_resp_send_chunk(req, NULL, 0);
-    return ESP_OK;
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Flash dump failed after %d blocks", blocks);
+        if (blocks == 0)
+        {
+            /* Nothing sent yet, so the status can still tell */
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Target not responding");
+        }
+        return ESP_FAIL;
+    }
+
+    if (writer.hex)
+    {
+        dump_hex_record(&writer.rb, 0x01, 0, NULL, 0);
+    }
+    ESP_LOGI(TAG, "Flash dump: %u bytes read in %lld ms", size, (esp_timer_get_time() - started) / 1000);
+    return resp_buffer_finish(&writer.rb);
 }
 
 /* Handler to upload a file onto the server */
@@ -370,6 +1608,37 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    /* "?flash=1" flashes the file while it is being received */
+    char query[32];
+    char flash_value[8];
+    const bool flash = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+                       httpd_query_key_value(query, "flash", flash_value, sizeof(flash_value)) == ESP_OK &&
+                       strcmp(flash_value, "0") != 0;
+    if (flash && !image_format_from_file(filename))
+    {
+        ESP_LOGE(TAG, "Not an image : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Only images can be flashed");
+        return ESP_FAIL;
+    }
+    if (flash && (batchRunning() || upload_flash.busy))
+    {
+        ESP_LOGE(TAG, "Target busy, can't flash : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Flashing in progress");
+        return ESP_FAIL;
+    }
+
+    /* Digest the sender computed, if any, checked once the file is in */
+    uint8_t expected[FILE_META_SHA256_LEN];
+    char digest_hex[2 * FILE_META_SHA256_LEN + 2];
+    const bool check_digest = httpd_req_get_hdr_value_str(req, "X-Content-SHA256", digest_hex,
+                                                          sizeof(digest_hex)) != ESP_ERR_NOT_FOUND;
+    if (check_digest && !sha256_from_hex(digest_hex, expected))
+    {
+        ESP_LOGE(TAG, "Invalid X-Content-SHA256 : %s", digest_hex);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "X-Content-SHA256 must be 64 hex characters");
+        return ESP_FAIL;
+    }
+
     fd = fopen(filepath, "w");
     if (!fd)
     {
@@ -379,10 +1648,28 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG, "Receiving file : %s...", filename);
+    /* Fewer, larger writes to SPIFFS */
+    setvbuf(fd, NULL, _IOFBF, CONFIG_UPLOAD_STDIO_BUFFER_SIZE);
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+    ESP_LOGI(TAG, "Receiving file : %s (%d bytes)...", filename, req->content_len);
+    const int64_t started = esp_timer_get_time();
+
+    upload.fd = fd;
+    upload.failed = false;
+
+    /* Reset and sync the target while the content is on its way */
+    if (flash)
+    {
+        upload_flash_start(filepath);
+    }
+
+    /* Hash the content on its way to storage, for its ETag and integrity.
+     * The writer task hashes each buffer before storing it, so the SHA-256
+     * runs while this task reads the socket */
+    file_digest_t digest;
+    uint8_t sha256[FILE_META_SHA256_LEN];
+    fileDigestStart(&digest);
+    upload.digest = &digest;
     int received;
 
     /* Content length of the request gives
@@ -391,11 +1678,14 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
 
     while (remaining > 0)
     {
+        /* Take an empty buffer, waiting for the writer if both are queued */
+        char *buf;
+        xQueueReceive(upload.free, &buf, portMAX_DELAY);
 
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
         /* Receive the file part by part into a buffer */
         if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0)
         {
+            xQueueSend(upload.free, &buf, portMAX_DELAY);
             if (received == HTTPD_SOCK_ERR_TIMEOUT)
             {
                 /* Retry if timeout occurred */
@@ -403,7 +1693,10 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
             }
 
             /* In case of unrecoverable error,
-             * close and flash the unfinished file*/
+             * close and delete the unfinished file*/
+            upload_pipeline_finish();
+            upload_flash_end(false);
+            fileDigestFree(&digest);
             fclose(fd);
             unlink(filepath);
 
@@ -413,33 +1706,214 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
             return ESP_FAIL;
         }
 
-        /* Write buffer content to file on storage */
-        if (received && (received != fwrite(buf, 1, received, fd)))
+        /* Compressed images are stored as they are and inflated while
+         * flashing, so make sure a .gz really holds gzip data */
+        if (remaining == req->content_len && IS_FILE_EXT(filename, ".gz") &&
+            (received < 2 || buf[0] != (char)GZ_MAGIC_0 || buf[1] != (char)GZ_MAGIC_1))
         {
-            /* Couldn't write everything to file!
-             * Storage may be full? */
+            xQueueSend(upload.free, &buf, portMAX_DELAY);
+            upload_pipeline_finish();
+            upload_flash_end(false);
+            fileDigestFree(&digest);
             fclose(fd);
             unlink(filepath);
 
-            ESP_LOGE(TAG, "File write failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
+            ESP_LOGE(TAG, "Not a gzip file : %s", filename);
+            /* Respond with 400 Bad Request */
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not a gzip file");
             return ESP_FAIL;
         }
 
+        /* Hand the buffer to the writer and go on receiving */
+        const struct upload_chunk chunk = {.buf = buf, .len = received};
+        xQueueSend(upload.full, &chunk, portMAX_DELAY);
+
         /* Keep track of remaining size of
          * the file left to be uploaded */
         remaining -= received;
+
+        if (upload.failed)
+        {
+            break;
+        }
     }
 
-    /* Close file upon upload completion */
-    fclose(fd);
+    /* Close file upon upload completion, the writer has hashed it all then */
+    const bool written = upload_pipeline_finish();
+    fileDigestFinish(&digest, sha256);
+    fileDigestFree(&digest);
+    if (fclose(fd) != 0 || !written)
+    {
+        /* Couldn't write everything to file!
+         * Storage may be full? */
+        upload_flash_end(false);
+        unlink(filepath);
+
+        ESP_LOGE(TAG, "File write failed!");
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage");
+        return ESP_FAIL;
+    }
+    upload_stats_record(req->content_len, esp_timer_get_time() - started);
+
+    /* Corrupted on the way, don't keep it around to be flashed */
+    if (check_digest && memcmp(sha256, expected, sizeof(sha256)) != 0)
+    {
+        upload_flash_end(false);
+        unlink(filepath);
+
+        ESP_LOGE(TAG, "SHA-256 mismatch : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Content does not match X-Content-SHA256");
+        return ESP_FAIL;
+    }
+
+    fileMetaSet(filepath, digest.hash, sha256);
+    imageCacheInvalidate(filepath);
+    dir_listing_invalidate();
+
+    /* The flashing task reads up to the end of the file only now that it
+     * is known to be intact */
+    upload_flash_end(true);
+
+    /* Decode images into a firmware slot now, so flashing reads them
+     * straight from mapped flash. Erasing and writing the slot, up to
+     * 264 KB, runs on this task and holds up the whole HTTP server until
+     * it is done */
+    if (image_format_from_file(filename))
+    {
+        imageSlotStore(filepath);
+    }
     ESP_LOGI(TAG, "File reception complete");
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "303 See Other");
     httpd_resp_set_hdr(req, "Location", "/");
-    httpd_resp_sendstr(req, "File uploaded successfully");
+    httpd_resp_sendstr(req, flash ? "File uploaded, flashing" : "File uploaded successfully");
+    return ESP_OK;
+}
+
+/* Handler to receive a patch against the image last flashed, store the
+ * patched image and flash the blocks it changed */
+static esp_err_t patch_post_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    struct stat file_stat;
+    /* Kept off the server task's stack, it runs one handler at a time */
+    static delta_patch_t patch;
+    uint64_t hash;
+    uint8_t sha256[FILE_META_SHA256_LEN];
+    esp_err_t ret;
+    int received;
+
+    /* Skip leading "/patch" from URI to get filename */
+    /* Note sizeof() counts NULL termination hence the -1 */
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
+                                             req->uri + sizeof("/patch") - 1, sizeof(filepath));
+    if (!filename)
+    {
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return ESP_FAIL;
+    }
+
+    /* Patches produce flat images, raw from address 0 */
+    if (!IS_FILE_EXT(filename, ".bin"))
+    {
+        ESP_LOGE(TAG, "Invalid filename : %s", filename);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Patched images must be named .bin");
+        return ESP_FAIL;
+    }
+
+    if (stat(filepath, &file_stat) == 0)
+    {
+        ESP_LOGE(TAG, "File already exists : %s", filepath);
+        /* Respond with 400 Bad Request */
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File already exists");
+        return ESP_FAIL;
+    }
+
+    if (batchRunning())
+    {
+        ESP_LOGE(TAG, "Batch run in progress");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Batch run in progress");
+        return ESP_FAIL;
+    }
+
+    /* Checked up front, a patch applied but never flashed would block the next one */
+    if (!uxQueueSpacesAvailable(flash_jobs))
+    {
+        ESP_LOGE(TAG, "Flashing queue full");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many files waiting to be flashed");
+        return ESP_FAIL;
+    }
+
+    ret = deltaPatchBegin(&patch, filepath);
+    if (ret != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                            ret == ESP_ERR_INVALID_STATE ? "Last patch still flashing" : "Failed to create file");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Receiving patch : %s (%d bytes)...", filename, req->content_len);
+
+    /* Patches are small, so they are applied straight from the scratch buffer */
+    char *buf = ((struct file_server_data *)req->user_ctx)->scratch;
+    int remaining = req->content_len;
+
+    while (remaining > 0)
+    {
+        if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0)
+        {
+            if (received == HTTPD_SOCK_ERR_TIMEOUT)
+            {
+                /* Retry if timeout occurred */
+                continue;
+            }
+            deltaPatchAbort(&patch);
+            ESP_LOGE(TAG, "Patch reception failed!");
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive patch");
+            return ESP_FAIL;
+        }
+
+        ret = deltaPatchWrite(&patch, (const uint8_t *)buf, received);
+        if (ret != ESP_OK)
+        {
+            deltaPatchAbort(&patch);
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                                ret == ESP_ERR_NOT_FOUND ? "Patch is not against the image on the board" :
+                                ret == ESP_ERR_INVALID_ARG ? "Invalid patch" : "Failed to write file to storage");
+            /* Close the connection, the rest of the patch is unread */
+            return ESP_FAIL;
+        }
+        remaining -= received;
+    }
+
+    ret = deltaPatchEnd(&patch, &hash, sha256);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Patched image rejected : %s", esp_err_to_name(ret));
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Patched image is incomplete or corrupt");
+        return ESP_FAIL;
+    }
+
+    fileMetaSet(filepath, hash, sha256);
+    imageCacheInvalidate(filepath);
+    dir_listing_invalidate();
+    /* Holds up the HTTP server while the slot is erased and written, like
+     * in upload_post_handler() */
+    imageSlotStore(filepath);
+
+    if (!flash_job_queue(filepath, true))
+    {
+        ESP_LOGE(TAG, "Flashing queue full, patch of %s not flashed", filepath);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many files waiting to be flashed");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_status(req, "303 See Other");
+    httpd_resp_set_hdr(req, "Location", "/");
+    httpd_resp_sendstr(req, "Patch flashing");
     return ESP_OK;
 }
 
@@ -476,9 +1950,21 @@ static esp_err_t flash_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    if (batchRunning())
+    {
+        ESP_LOGE(TAG, "Batch run in progress");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Batch run in progress");
+        return ESP_FAIL;
+    }
+
     logD(TAG, "Flashing file : %s", filepath);
 
-    xTaskCreate(&flashFile, "Flash File", 32768, (void *)filepath, 1, NULL);
+    if (!flash_job_queue(filepath, false))
+    {
+        ESP_LOGE(TAG, "Flashing queue full");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many files waiting to be flashed");
+        return ESP_FAIL;
+    }
 
     httpd_resp_set_status(req, "303 See Other");
     httpd_resp_set_hdr(req, "Location", "/");
@@ -487,6 +1973,153 @@ static esp_err_t flash_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Handler to start flashing a file onto a batch of boards */
+static esp_err_t batch_post_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    char query[32] = {0};
+    char count[8];
+    struct stat file_stat;
+
+    /* Skip leading "/batch" from URI to get filename */
+    /* Note sizeof() counts NULL termination hence the -1 */
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
+                                             req->uri + sizeof("/batch") - 1, sizeof(filepath));
+    if (!filename)
+    {
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return ESP_FAIL;
+    }
+
+    if (stat(filepath, &file_stat) == -1)
+    {
+        ESP_LOGE(TAG, "File does not exist : %s", filename);
+        /* Respond with 400 Bad Request */
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File does not exist");
+        return ESP_FAIL;
+    }
+
+    /* The form posts the number of boards as "count=N" */
+    if (req->content_len >= sizeof(query) ||
+        httpd_req_recv(req, query, req->content_len) <= 0 ||
+        httpd_query_key_value(query, "count", count, sizeof(count)) != ESP_OK ||
+        atoi(count) <= 0)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid board count");
+        return ESP_FAIL;
+    }
+
+    /* Boards are swapped all through the run, so no patch base is known after it */
+    deltaForgetFlashed();
+
+    esp_err_t ret = batchStart(filepath, atoi(count));
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start batch : %s", esp_err_to_name(ret));
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                            ret == ESP_ERR_INVALID_STATE ? "Batch run in progress" : "Failed to open image");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_status(req, "303 See Other");
+    httpd_resp_set_hdr(req, "Location", "/");
+    httpd_resp_sendstr(req, "Batch started");
+    return ESP_OK;
+}
+
+/* Handler to stop the batch run */
+static esp_err_t stop_post_handler(httpd_req_t *req)
+{
+    batchStop();
+
+    httpd_resp_set_status(req, "303 See Other");
+    httpd_resp_set_hdr(req, "Location", "/");
+    httpd_resp_sendstr(req, "Batch stopping");
+    return ESP_OK;
+}
+
+/* Handler to report the batch run as JSON, for polling by line tools */
+static esp_err_t batch_get_handler(httpd_req_t *req)
+{
+    batch_status_t status;
+    char json[IMAGE_CACHE_PATH_MAX + 256];
+
+    batchGetStatus(&status);
+    snprintf(json, sizeof(json),
+             "{\"state\":\"%s\",\"file\":\"%s\",\"target\":%d,\"passed\":%d,\"failed\":%d,"
+             "\"last_ms\":%u,\"min_ms\":%u,\"max_ms\":%u,\"avg_ms\":%u,\"boards_per_hour\":%u}",
+             batchStateName(status.state), status.path, status.target, status.passed, status.failed,
+             status.last_ms, status.min_ms, status.max_ms, status.passed ? status.total_ms / status.passed : 0,
+             batchBoardsPerHour(&status));
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json);
+    return ESP_OK;
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+/* Send bytes from the client MCU to a serial WebSocket, as binary frames
+ * since sketches needn't print valid UTF-8. Called from the bridge's task */
+static int ws_serial_send(void *ctx, int fd, const uint8_t *data, size_t length)
+{
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = (uint8_t *)data,
+        .len = length,
+    };
+
+    if (httpd_ws_get_fd_info(ctx, fd) != HTTPD_WS_CLIENT_WEBSOCKET)
+    {
+        return 0;
+    }
+    return length == 0 || httpd_ws_send_frame_async(ctx, fd, &frame) == ESP_OK;
+}
+
+/* Handler bridging a WebSocket to the UART of the client MCU, e.g.
+ * ws://<ip>/ws/serial?baud=9600 to watch the sketch just flashed */
+static esp_err_t ws_serial_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET)
+    {
+        /* Handshake done, start bridging */
+        char query[32];
+        char baud[12];
+        if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+            httpd_query_key_value(query, "baud", baud, sizeof(baud)) == ESP_OK && atoi(baud) > 0)
+        {
+            serialBridgeSetBaud(atoi(baud));
+        }
+        return serialBridgeAddClient(ws_serial_send, req->handle, httpd_req_to_sockfd(req)) ? ESP_OK : ESP_FAIL;
+    }
+
+    /* Get the frame length first, then the payload into the scratch buffer */
+    httpd_ws_frame_t frame = {0};
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ret != ESP_OK || frame.len > SCRATCH_BUFSIZE)
+    {
+        return ESP_FAIL;
+    }
+    frame.payload = (uint8_t *)((struct file_server_data *)req->user_ctx)->scratch;
+    if (frame.len && (ret = httpd_ws_recv_frame(req, &frame, frame.len)) != ESP_OK)
+    {
+        return ret;
+    }
+
+    if (frame.type == HTTPD_WS_TYPE_TEXT || frame.type == HTTPD_WS_TYPE_BINARY)
+    {
+        /* Blocks while the UART is busy, holding back the socket */
+        serialBridgeWrite(frame.payload, frame.len);
+    }
+    else if (frame.type == HTTPD_WS_TYPE_CLOSE)
+    {
+        serialBridgeRemoveClient(httpd_req_to_sockfd(req));
+    }
+    return ESP_OK;
+}
+#endif
+
 /* Handler to delete a file from the server */
 static esp_err_t delete_post_handler(httpd_req_t *req)
 {
@@ -523,6 +2156,10 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Deleting file : %s", filename);
     /* Delete file */
     unlink(filepath);
+    fileMetaRemove(filepath);
+    imageSlotInvalidate(filepath);
+    imageCacheInvalidate(filepath);
+    dir_listing_invalidate();
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "303 See Other");
@@ -531,6 +2168,14 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Called when a file was stored other than by an upload, e.g. a pulled
+ * update. Only clears a flag, so it is fine from another task */
+void file_server_file_stored(const char *filepath)
+{
+    ESP_LOGI(TAG, "File stored : %s", filepath);
+    dir_listing_invalidate();
+}
+
 /* Function to start the file server */
 esp_err_t start_file_server(const char *base_path)
 {
@@ -559,6 +2204,18 @@ esp_err_t start_file_server(const char *base_path)
     strlcpy(server_data->base_path, base_path,
             sizeof(server_data->base_path));
 
+    if (upload_pipeline_init(server_data) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start upload writer");
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (flash_worker_init() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start flash worker");
+        return ESP_ERR_NO_MEM;
+    }
+
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
@@ -567,6 +2224,9 @@ esp_err_t start_file_server(const char *base_path)
      * target URIs which match the wildcard scheme */
     config.uri_match_fn = httpd_uri_match_wildcard;
 
+    /* More handlers than the default 8 */
+    config.max_uri_handlers = 16;
+
     ESP_LOGI(TAG, "Starting HTTP Server");
     if (httpd_start(&server, &config) != ESP_OK)
     {
@@ -574,6 +2234,63 @@ esp_err_t start_file_server(const char *base_path)
         return ESP_FAIL;
     }
 
+    /* URI handler for the batch report, ahead of the catch-all below */
+    httpd_uri_t batch_report = {
+        .uri = "/batch",
+        .method = HTTP_GET,
+        .handler = batch_get_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &batch_report);
+
+    /* URI handler for the JSON file list, ahead of the catch-all below */
+    httpd_uri_t api_files = {
+        .uri = "/api/files",
+        .method = HTTP_GET,
+        .handler = api_files_get_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &api_files);
+
+    /* URI handler for the server statistics, ahead of the catch-all below */
+    httpd_uri_t api_stats = {
+        .uri = "/api/stats",
+        .method = HTTP_GET,
+        .handler = api_stats_get_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &api_stats);
+
+    /* URI handler for the Prometheus metrics, ahead of the catch-all below */
+    httpd_uri_t metrics = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_get_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &metrics);
+
+    /* URI handler for dumping the target's flash, ahead of the catch-all below */
+    httpd_uri_t api_targets = {
+        .uri = "/api/targets/*",
+        .method = HTTP_GET,
+        .handler = api_targets_get_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &api_targets);
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    /* URI handler for the serial WebSocket, ahead of the catch-all below */
+    httpd_uri_t ws_serial = {
+        .uri = "/ws/serial",
+        .method = HTTP_GET,
+        .handler = ws_serial_handler,
+        .user_ctx = server_data, // Pass server data as context
+        .is_websocket = true
+    };
+    httpd_register_uri_handler(server, &ws_serial);
+#endif
+
     /* URI handler for getting uploaded files */
     httpd_uri_t file_download = {
         .uri = "/*", // Match all URIs of type /path/to/file
@@ -601,6 +2318,33 @@ esp_err_t start_file_server(const char *base_path)
     };
     httpd_register_uri_handler(server, &file_flash);
 
+    /* URI handler for patching the image last flashed */
+    httpd_uri_t file_patch = {
+        .uri = "/patch/*", // Match all URIs of type /patch/path/to/file
+        .method = HTTP_POST,
+        .handler = patch_post_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_patch);
+
+    /* URI handler for flashing files onto a batch of boards */
+    httpd_uri_t file_batch = {
+        .uri = "/batch/*", // Match all URIs of type /batch/path/to/file
+        .method = HTTP_POST,
+        .handler = batch_post_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &file_batch);
+
+    /* URI handler for stopping the batch run */
+    httpd_uri_t batch_stop = {
+        .uri = "/stop",
+        .method = HTTP_POST,
+        .handler = stop_post_handler,
+        .user_ctx = server_data // Pass server data as context
+    };
+    httpd_register_uri_handler(server, &batch_stop);
+
     /* URI handler for deleting files from server */
     httpd_uri_t file_delete = {
         .uri = "/delete/*", // Match all URIs of type /delete/path/to/file
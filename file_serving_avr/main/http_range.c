@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "http_range.h"
+
+http_range_t parse_range(const char *value, long size, long *start, long *end)
+{
+    char *last;
+
+    /* Only a single range is served */
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ','))
+    {
+        return HTTP_RANGE_IGNORE;
+    }
+    value += 6;
+
+    if (*value == '-')
+    {
+        /* Suffix range: the last N bytes */
+        const long suffix = strtol(value + 1, &last, 10);
+        if (last == value + 1 || suffix <= 0 || size == 0)
+        {
+            return HTTP_RANGE_UNSATISFIABLE;
+        }
+        *start = MAX(size - suffix, 0);
+        *end = size - 1;
+        return HTTP_RANGE_PARTIAL;
+    }
+
+    const long first = strtol(value, &last, 10);
+    if (last == value || *last != '-' || first < 0 || first >= size)
+    {
+        return HTTP_RANGE_UNSATISFIABLE;
+    }
+    value = last + 1;
+
+    long final = size - 1;
+    if (*value)
+    {
+        final = strtol(value, &last, 10);
+        if (last == value || final < first)
+        {
+            return HTTP_RANGE_UNSATISFIABLE;
+        }
+    }
+    *start = first;
+    *end = MIN(final, size - 1);
+    return HTTP_RANGE_PARTIAL;
+}
@@ -0,0 +1,21 @@
+#ifndef _HTTP_RANGE_H
+#define _HTTP_RANGE_H
+
+#include <stdbool.h>
+
+/* Outcome of a Range header */
+typedef enum
+{
+    /* Not a single "bytes=" range: send the whole file with 200, as allowed by RFC 9110 */
+    HTTP_RANGE_IGNORE,
+    /* Send the given bytes with 206 */
+    HTTP_RANGE_PARTIAL,
+    /* Answer 416 */
+    HTTP_RANGE_UNSATISFIABLE,
+} http_range_t;
+
+/* Parse a Range header value into the first and last byte to send of a
+ * file of the given size, start and end are only set for HTTP_RANGE_PARTIAL */
+http_range_t parse_range(const char *value, long size, long *start, long *end);
+
+#endif
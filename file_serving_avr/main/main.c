@@ -1,10 +1,32 @@
-#include "hex_parser.h"
+#include "image_cache.h"
+#include "file_meta.h"
+#include "avr_delta.h"
+#include "serial_bridge.h"
+#include "net_programmer.h"
+#include "pull_update.h"
 #include "avr_flash.h"
+#include "metrics.h"
 
 #include "esp_netif.h"
 #include "protocol_examples_common.h"
+#include "esp_timer.h"
+
+static const char *TAG = "main";
 
 esp_err_t start_file_server(const char *base_path);
+void file_server_file_stored(const char *filepath);
+
+/* Given once Wi-Fi is up and has an address */
+static SemaphoreHandle_t connected;
+
+/* Network bring-up takes seconds, it runs while the rest starts */
+static void connect_task(void *parameter)
+{
+    ESP_ERROR_CHECK(example_connect());
+    xSemaphoreGive(connected);
+    metricsTaskExit();
+    vTaskDelete(NULL);
+}
 
 void app_main(void)
 {
@@ -12,14 +34,32 @@ void app_main(void)
     esp_netif_init();
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
-    ESP_ERROR_CHECK(example_connect());
+    connected = xSemaphoreCreateBinary();
+    if (!connected || xTaskCreate(&connect_task, "Connect", 4096, NULL, 5, NULL) != pdPASS)
+    {
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+
+    /* The UART has to be up before the server can flash or bridge it */
+    initUART();
+    initGPIO();
+    ESP_ERROR_CHECK(serialBridgeInit());
 
     /* Initialize file storage */
     initSPIFFS();
+    ESP_ERROR_CHECK(fileMetaInit("/spiffs"));
+    deltaInit("/spiffs");
+    imageSlotInit();
+    imageCacheInit();
 
-    /* Start the file server */
+    /* Both listen on any address, so they don't wait for one */
+    ESP_ERROR_CHECK(netProgrammerInit());
     ESP_ERROR_CHECK(start_file_server("/spiffs"));
-    
-    initUART();
-    initGPIO();
+
+    xSemaphoreTake(connected, portMAX_DELAY);
+    metricsMarkBoot(METRIC_BOOT_READY);
+    ESP_LOGI(TAG, "Ready %lld ms after boot", esp_timer_get_time() / 1000);
+
+    /* Poll for updates, if a URL is configured */
+    ESP_ERROR_CHECK(pullUpdateInit("/spiffs", file_server_file_stored));
 }
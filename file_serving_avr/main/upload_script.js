@@ -0,0 +1,106 @@
+function setpath() {
+    var default_path = document.getElementById("newfile").files[0].name;
+    document.getElementById("filepath").value = default_path;
+}
+function upload() {
+    var filePath = document.getElementById("filepath").value;
+    var upload_path = "/upload/" + filePath;
+    var fileInput = document.getElementById("newfile").files;
+
+    /* Max size of an individual file. Make sure this
+     * value is same as that set in file_server.c */
+    var MAX_FILE_SIZE = 200 * 1024;
+    var MAX_FILE_SIZE_STR = "200KB";
+
+    if (fileInput.length == 0) {
+        alert("No file selected!");
+    }
+    else if (filePath.length == 0) {
+        alert("File path on server is not set!");
+    }
+    else if (filePath.indexOf(' ') >= 0) {
+        alert("File path on server cannot have spaces!");
+    }
+    else if (filePath[filePath.length - 1] == '/') {
+        alert("File name not specified after path!");
+    }
+    else {
+        document.getElementById("newfile").disabled = true;
+        document.getElementById("filepath").disabled = true;
+        document.getElementById("upload").disabled = true;
+        document.getElementById("compress").disabled = true;
+        document.getElementById("flash").disabled = true;
+
+        var file = fileInput[0];
+        var flash = document.getElementById("flash").checked;
+
+        /* A plain image is flashed as it arrives, a gzip'd one only once
+         * it is complete, so don't compress one to be flashed */
+        var compress = document.getElementById("compress").checked && !flash &&
+            window.CompressionStream && !filePath.endsWith(".gz");
+
+        if (compress) {
+            /* Images are stored gzip'd and inflated while flashing */
+            new Response(file.stream().pipeThrough(new CompressionStream("gzip"))).blob()
+                .then(function (blob) { send(upload_path + ".gz", blob); });
+        }
+        else {
+            send(upload_path, file);
+        }
+    }
+
+    function send(path, data) {
+        if (data.size > MAX_FILE_SIZE) {
+            alert("File size must be less than " + MAX_FILE_SIZE_STR + "!");
+            location.reload();
+            return;
+        }
+
+        /* The server rejects the file if it doesn't arrive as hashed here.
+         * Browsers only offer SubtleCrypto over https or on localhost */
+        if (window.crypto && crypto.subtle) {
+            data.arrayBuffer()
+                .then(function (buf) { return crypto.subtle.digest("SHA-256", buf); })
+                .then(function (digest) {
+                    var hex = Array.from(new Uint8Array(digest), function (b) {
+                        return ("0" + b.toString(16)).slice(-2);
+                    }).join("");
+                    post(path, data, hex);
+                });
+        }
+        else {
+            post(path, data, null);
+        }
+    }
+
+    function post(path, data, digest) {
+        var xhttp = new XMLHttpRequest();
+        xhttp.onreadystatechange = function () 
+        {
+            if (xhttp.readyState == 4) 
+            {
+                if (xhttp.status == 200)
+                {
+                    document.open();
+                    document.write(xhttp.responseText);
+                    document.close();
+                }
+                else if (xhttp.status == 0) 
+                {
+                    alert("Server closed the connection abruptly!");
+                    location.reload()
+                }
+                else 
+                {
+                    alert(xhttp.status + " Error!\n" + xhttp.responseText);
+                    location.reload()
+                }
+            }
+        };
+        xhttp.open("POST", flash ? path + "?flash=1" : path, true);
+        if (digest) {
+            xhttp.setRequestHeader("X-Content-SHA256", digest);
+        }
+        xhttp.send(data);
+    }
+}
@@ -0,0 +1,296 @@
+/* ESP-IDF and FreeRTOS calls the components make, for running them on a PC.
+ * Tasks are POSIX threads, semaphores a count under a mutex. */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "gz_stream.h"
+#include "host_test.h"
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t count;
+    UBaseType_t max;
+} host_semaphore_t;
+
+typedef struct
+{
+    TaskFunction_t code;
+    void *parameter;
+} host_task_t;
+
+static pthread_mutex_t criticalLock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    static char name[16];
+
+    switch (code)
+    {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_INVALID_CRC:
+        return "ESP_ERR_INVALID_CRC";
+    default:
+        snprintf(name, sizeof(name), "0x%x", code);
+        return name;
+    }
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    const size_t length = strlen(src);
+
+    if (size)
+    {
+        const size_t n = length < size - 1 ? length : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return length;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    const char *env = getenv("HOST_LOG_LEVEL");
+    va_list args;
+
+    if (level > (env ? atoi(env) : ESP_LOG_NONE))
+    {
+        return;
+    }
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+FILE *gzStreamOpen(const char *filepath)
+{
+    // Only plain files on the host
+    return fopen(filepath, "r");
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    pthread_mutex_lock(&criticalLock);
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    pthread_mutex_unlock(&criticalLock);
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+static void *hostTaskRun(void *parameter)
+{
+    host_task_t task = *(host_task_t *)parameter;
+
+    free(parameter);
+    task.code(task.parameter);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stack, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    host_task_t *task = malloc(sizeof(host_task_t));
+    pthread_t thread;
+
+    if (!task)
+    {
+        return pdFALSE;
+    }
+    task->code = code;
+    task->parameter = parameter;
+    if (pthread_create(&thread, NULL, hostTaskRun, task) != 0)
+    {
+        free(task);
+        return pdFALSE;
+    }
+    pthread_detach(thread);
+    if (handle)
+    {
+        *handle = (TaskHandle_t)thread;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack, void *parameter, UBaseType_t priority,
+                       TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(code, name, stack, parameter, priority, handle, 0);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (!task)
+    {
+        pthread_exit(NULL);
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t esp_random(void)
+{
+    return rand();
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    const struct timespec delay = {ticks / 1000, (ticks % 1000) * 1000000L};
+
+    nanosleep(&delay, NULL);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    return 1;
+}
+
+static SemaphoreHandle_t hostSemaphoreCreate(UBaseType_t max, UBaseType_t initial)
+{
+    host_semaphore_t *semaphore = calloc(1, sizeof(host_semaphore_t));
+
+    if (semaphore)
+    {
+        pthread_mutex_init(&semaphore->lock, NULL);
+        pthread_cond_init(&semaphore->changed, NULL);
+        semaphore->count = initial;
+        semaphore->max = max;
+    }
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    return hostSemaphoreCreate(max, initial);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return hostSemaphoreCreate(1, 0);
+}
+
+// Not owned, nor recursive, which the single threaded tests don't need
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return hostSemaphoreCreate(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+    return hostSemaphoreCreate(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks)
+{
+    host_semaphore_t *semaphore = handle;
+    const TickType_t start = xTaskGetTickCount();
+    BaseType_t taken = pdFALSE;
+
+    pthread_mutex_lock(&semaphore->lock);
+    while (!semaphore->count && (ticks == portMAX_DELAY || xTaskGetTickCount() - start < ticks))
+    {
+        if (ticks == portMAX_DELAY)
+        {
+            pthread_cond_wait(&semaphore->changed, &semaphore->lock);
+        }
+        else
+        {
+            pthread_mutex_unlock(&semaphore->lock);
+            vTaskDelay(1);
+            pthread_mutex_lock(&semaphore->lock);
+        }
+    }
+    if (semaphore->count)
+    {
+        semaphore->count--;
+        taken = pdTRUE;
+    }
+    pthread_mutex_unlock(&semaphore->lock);
+    return taken;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle)
+{
+    host_semaphore_t *semaphore = handle;
+    BaseType_t given = pdFALSE;
+
+    pthread_mutex_lock(&semaphore->lock);
+    if (semaphore->count < semaphore->max)
+    {
+        semaphore->count++;
+        given = pdTRUE;
+        pthread_cond_signal(&semaphore->changed);
+    }
+    pthread_mutex_unlock(&semaphore->lock);
+    return given;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle)
+{
+    host_semaphore_t *semaphore = handle;
+
+    pthread_mutex_destroy(&semaphore->lock);
+    pthread_cond_destroy(&semaphore->changed);
+    free(semaphore);
+}
+
+int hostChecks = 0;
+int hostFailures = 0;
+
+int hostTestDone(const char *name)
+{
+    printf("%s: %d checks, %d failed\n", name, hostChecks, hostFailures);
+    return hostFailures ? 1 : 0;
+}
+
+double hostSeconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,28 @@
+#ifndef _HOST_TEST_H
+#define _HOST_TEST_H
+
+#include <stdio.h>
+#include <time.h>
+
+// Checks counted by CHECK(), and how many failed
+extern int hostChecks;
+extern int hostFailures;
+
+#define CHECK(cond)                                                             \
+    do                                                                          \
+    {                                                                           \
+        hostChecks++;                                                           \
+        if (!(cond))                                                            \
+        {                                                                       \
+            hostFailures++;                                                     \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                       \
+    } while (0)
+
+// Print the tally, returns the exit code of the test
+int hostTestDone(const char *name);
+
+// Wall time in seconds, for the benchmarks
+double hostSeconds(void);
+
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+#define GPIO_NUM_2 2
+#define GPIO_NUM_43 43
+#define GPIO_NUM_44 44
+
+typedef enum
+{
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2,
+} gpio_mode_t;
+
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode);
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level);
+esp_err_t gpio_reset_pin(gpio_num_t gpio);
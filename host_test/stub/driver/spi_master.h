@@ -0,0 +1,43 @@
+#pragma once
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef int spi_host_device_t;
+#define SPI2_HOST 1
+#define SPI_DMA_CH_AUTO 3
+
+typedef struct
+{
+    int mosi_io_num;
+    int miso_io_num;
+    int sclk_io_num;
+    int quadwp_io_num;
+    int quadhd_io_num;
+    int max_transfer_sz;
+} spi_bus_config_t;
+
+typedef struct
+{
+    uint8_t mode;
+    int clock_speed_hz;
+    int spics_io_num;
+    int queue_size;
+} spi_device_interface_config_t;
+
+typedef struct spi_device_t *spi_device_handle_t;
+
+typedef struct
+{
+    uint32_t flags;
+    size_t length;
+    size_t rxlength;
+    const void *tx_buffer;
+    void *rx_buffer;
+} spi_transaction_t;
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus, int dma);
+esp_err_t spi_bus_free(spi_host_device_t host);
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *device,
+                             spi_device_handle_t *handle);
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle);
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *transaction);
@@ -0,0 +1,54 @@
+#pragma once
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef int uart_port_t;
+#define UART_NUM_1 1
+
+#define UART_PIN_NO_CHANGE (-1)
+
+typedef enum
+{
+    UART_DATA_8_BITS = 3,
+} uart_word_length_t;
+
+typedef enum
+{
+    UART_HW_FLOWCTRL_DISABLE = 0,
+} uart_hw_flowcontrol_t;
+
+typedef enum
+{
+    UART_PARITY_DISABLE = 0,
+    UART_PARITY_EVEN = 2,
+} uart_parity_t;
+
+typedef enum
+{
+    UART_STOP_BITS_1 = 1,
+    UART_STOP_BITS_2 = 3,
+} uart_stop_bits_t;
+
+typedef struct
+{
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+} uart_config_t;
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config);
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts);
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              void *queue, int intr_alloc_flags);
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks);
+int uart_write_bytes(uart_port_t port, const void *data, size_t size);
+esp_err_t uart_flush(uart_port_t port);
+esp_err_t uart_flush_input(uart_port_t port);
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size);
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks);
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud);
+esp_err_t uart_get_baudrate(uart_port_t port, uint32_t *baud);
+esp_err_t uart_set_parity(uart_port_t port, uart_parity_t parity);
+esp_err_t uart_set_stop_bits(uart_port_t port, uart_stop_bits_t stop_bits);
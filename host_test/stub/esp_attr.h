@@ -0,0 +1,3 @@
+#pragma once
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
+#define IRAM_ATTR
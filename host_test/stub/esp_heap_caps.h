@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+// No PSRAM on the host
+static inline void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps)
+{
+    return NULL;
+}
@@ -0,0 +1,5 @@
+#pragma once
+// Only the types image_slot.h refers to
+#include <stdint.h>
+
+typedef uint32_t spi_flash_mmap_handle_t;
@@ -0,0 +1,4 @@
+#pragma once
+#include "esp_err.h"
+
+uint32_t esp_random(void);
@@ -0,0 +1,4 @@
+#pragma once
+#include "sdkconfig.h"
+
+#define ESP_VFS_PATH_MAX 15
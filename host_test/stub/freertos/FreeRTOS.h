@@ -0,0 +1,30 @@
+#pragma once
+// FreeRTOS on top of POSIX threads, see host_stub.c
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY 0xffffffffu
+#define portNUM_PROCESSORS 2
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define configMAX_TASK_NAME_LEN 16
+
+typedef struct
+{
+    int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+
+BaseType_t xPortGetCoreID(void);
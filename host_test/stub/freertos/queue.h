@@ -0,0 +1,4 @@
+#pragma once
+#include "FreeRTOS.h"
+
+typedef void *QueueHandle_t;
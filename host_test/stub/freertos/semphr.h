@@ -0,0 +1,14 @@
+#pragma once
+#include "queue.h"
+
+typedef void *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+#define xSemaphoreTakeRecursive(semaphore, ticks) xSemaphoreTake(semaphore, ticks)
+#define xSemaphoreGiveRecursive(semaphore) xSemaphoreGive(semaphore)
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
@@ -0,0 +1,14 @@
+#pragma once
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stack, void *parameter, UBaseType_t priority,
+                       TaskHandle_t *task);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stack, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *task, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
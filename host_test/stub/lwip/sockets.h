@@ -0,0 +1,10 @@
+#pragma once
+// lwIP offers the BSD socket API, the host's own is used instead
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define inet_ntoa_r(addr, buf, size) inet_ntop(AF_INET, &(addr), (buf), (size))
@@ -0,0 +1,35 @@
+#pragma once
+// No SHA-256 on the host: the digest comes out as zeros, the FNV-1a hash is real
+#include <stddef.h>
+#include <string.h>
+
+typedef struct
+{
+    int started;
+} mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+    ctx->started = 0;
+}
+
+static inline int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224)
+{
+    ctx->started = 1;
+    return 0;
+}
+
+static inline int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+    return 0;
+}
+
+static inline int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+    memset(output, 0, 32);
+    return 0;
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+}
@@ -0,0 +1,24 @@
+#pragma once
+// What the components under test are built with on the host
+#define CONFIG_HEX_PARSER_PARALLEL 1
+#define CONFIG_HEX_PARSER_PARALLEL_MIN_KB 64
+#define CONFIG_AVR_PROTOCOL_STK500V1 1
+#define CONFIG_ISP_MOSI_GPIO 11
+#define CONFIG_ISP_MISO_GPIO 13
+#define CONFIG_ISP_SCK_GPIO 12
+#define CONFIG_ISP_CLOCK_HZ 2000000
+#define CONFIG_ISP_PAGE_SIZE 128
+#define CONFIG_ISP_EEPROM_PAGE_SIZE 4
+#define CONFIG_UPDI_BAUD 115200
+#define CONFIG_UPDI_FAST_BAUD 0
+#define CONFIG_UPDI_FLASH_BASE 0x8000
+#define CONFIG_UPDI_PAGE_SIZE 64
+#define CONFIG_SPIFFS_OBJ_NAME_LEN 32
+#define CONFIG_NET_PROGRAMMER_PORT 2323
+#define CONFIG_NET_PROGRAMMER_IDLE_S 1
+#define CONFIG_PULL_UPDATE_URL "http://updates.local/blink.hex"
+#define CONFIG_PULL_UPDATE_FILE "pulled.hex"
+#define CONFIG_PULL_UPDATE_KEEP 1
+// Shorter than menuconfig allows, a poll a second keeps the test quick
+#define CONFIG_PULL_UPDATE_INTERVAL_S 1
+#define CONFIG_PULL_UPDATE_JITTER_S 0
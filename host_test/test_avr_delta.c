@@ -0,0 +1,377 @@
+/* avr_delta: applying patches, and flashing only the blocks they changed */
+
+#include "avr_delta.h"
+#include "host_test.h"
+
+#include <unistd.h>
+
+#define BASE_BLOCKS 20
+// Blocks of the base left out of its .hex, read as erased flash
+#define BASE_GAP 10
+#define NEW_BLOCKS 24
+
+static char dir[] = "/tmp/deltaXXXXXX";
+static char basePath[FILE_META_PATH_MAX];
+static char newPath[FILE_META_PATH_MAX];
+static char nextPath[FILE_META_PATH_MAX];
+
+static uint8_t base[BASE_BLOCKS * BLOCK_SIZE];
+static uint8_t image[NEW_BLOCKS * BLOCK_SIZE];
+
+// Simulated client flash, and the blocks the last writeImage() wrote to it
+static uint8_t flash[FLASH_SIZE_MAX];
+static int flashWrites;
+
+const avr_protocol_t stk500v1Protocol = {.name = "sim", .block_size = BLOCK_SIZE};
+
+/* The image cache, opening the file straight away */
+
+static esp_err_t cacheNextBlock(avr_image_source_t *source, uint32_t *address, const uint8_t **block)
+{
+    cached_image_t *image = (cached_image_t *)source;
+    return image->file.source.nextBlock(&image->file.source, address, block);
+}
+
+static esp_err_t cacheRewind(avr_image_source_t *source)
+{
+    cached_image_t *image = (cached_image_t *)source;
+    return image->file.source.rewind(&image->file.source);
+}
+
+esp_err_t imageCacheOpen(cached_image_t *image, const char *filepath)
+{
+    image->entry = NULL;
+    image->in_slot = 0;
+    image->source.nextBlock = cacheNextBlock;
+    image->source.rewind = cacheRewind;
+    return imageOpen(&image->file, filepath);
+}
+
+void imageCacheClose(cached_image_t *image)
+{
+    imageClose(&image->file);
+}
+
+/* The flashing, into the simulated flash */
+
+esp_err_t writeImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret;
+
+    flashWrites = 0;
+    image->rewind(image);
+    while ((ret = image->nextBlock(image, &address, &block)) == ESP_OK)
+    {
+        memcpy(&flash[address], block, BLOCK_SIZE);
+        flashWrites++;
+    }
+    return ret == ESP_ERR_NOT_FOUND ? ESP_OK : ret;
+}
+
+esp_err_t verifyImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret;
+
+    image->rewind(image);
+    while ((ret = image->nextBlock(image, &address, &block)) == ESP_OK)
+    {
+        if (memcmp(&flash[address], block, BLOCK_SIZE))
+        {
+            return -EVERIFY_FAIL;
+        }
+    }
+    return ret == ESP_ERR_NOT_FOUND ? ESP_OK : ret;
+}
+
+void endSession(const avr_protocol_t *protocol)
+{
+}
+
+/* Patches */
+
+static uint8_t patch[4 * FLASH_SIZE_MAX];
+static size_t patchLength;
+
+static void put32(uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        patch[patchLength++] = value >> (8 * i);
+    }
+}
+
+static void patchStart(const uint8_t *from, uint32_t from_length, const uint8_t *to, uint32_t to_length)
+{
+    const delta_header_t header = {
+        .magic = DELTA_MAGIC,
+        .version = DELTA_VERSION,
+        .base_length = from_length,
+        .base_hash = fileMetaHash(FILE_META_HASH_INIT, from, from_length),
+        .length = to_length,
+        .hash = fileMetaHash(FILE_META_HASH_INIT, to, to_length),
+    };
+
+    memcpy(patch, &header, sizeof(header));
+    patchLength = sizeof(header);
+}
+
+static void patchCopy(uint32_t offset, uint32_t length)
+{
+    patch[patchLength++] = DELTA_OP_COPY;
+    put32(offset);
+    put32(length);
+}
+
+static void patchInsert(const uint8_t *data, uint32_t length)
+{
+    patch[patchLength++] = DELTA_OP_INSERT;
+    put32(length);
+    memcpy(&patch[patchLength], data, length);
+    patchLength += length;
+}
+
+// Feed the patch in pieces of random size, as it comes off the network
+static esp_err_t patchApply(delta_patch_t *delta, const char *path, uint64_t *hash)
+{
+    uint8_t sha256[FILE_META_SHA256_LEN];
+    esp_err_t ret = deltaPatchBegin(delta, path);
+
+    for (size_t at = 0; ret == ESP_OK && at < patchLength;)
+    {
+        const size_t piece = 1 + rand() % 700;
+        const size_t count = MIN(patchLength - at, piece);
+        ret = deltaPatchWrite(delta, &patch[at], count);
+        at += count;
+    }
+    if (ret != ESP_OK)
+    {
+        deltaPatchAbort(delta);
+        return ret;
+    }
+    return deltaPatchEnd(delta, hash, sha256);
+}
+
+static int fileEquals(const char *path, const uint8_t *data, size_t length)
+{
+    static uint8_t buf[FLASH_SIZE_MAX + 1];
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return 0;
+    }
+    const size_t count = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return count == length && !memcmp(buf, data, length);
+}
+
+// The base as a .hex, leaving out the gap block
+static void writeBaseHex(void)
+{
+    FILE *f = fopen(basePath, "w");
+
+    for (uint32_t address = 0; address < sizeof(base); address += 16)
+    {
+        if (address / BLOCK_SIZE == BASE_GAP)
+        {
+            continue;
+        }
+        uint8_t sum = 16 + (address >> 8) + address;
+        fprintf(f, ":10%04X00", address);
+        for (int i = 0; i < 16; i++)
+        {
+            fprintf(f, "%02X", base[address + i]);
+            sum += base[address + i];
+        }
+        fprintf(f, "%02X\n", (uint8_t)-sum);
+    }
+    fprintf(f, ":00000001FF\n");
+    fclose(f);
+}
+
+static void setUp(void)
+{
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(basePath, sizeof(basePath), "%s/base.hex", dir);
+    snprintf(newPath, sizeof(newPath), "%s/new.bin", dir);
+    snprintf(nextPath, sizeof(nextPath), "%s/next.bin", dir);
+    CHECK(fileMetaInit(dir) == ESP_OK);
+    deltaInit(dir);
+
+    srand(5);
+    for (int i = 0; i < sizeof(base); i++)
+    {
+        base[i] = rand();
+    }
+    memset(&base[BASE_GAP * BLOCK_SIZE], 0xff, BLOCK_SIZE);
+    writeBaseHex();
+
+    // The client holds the base
+    memcpy(flash, base, sizeof(base));
+    deltaRecordFlashed(basePath);
+
+    // Two blocks changed, one moved, and some added at the end
+    memcpy(image, base, sizeof(base));
+    image[3 * BLOCK_SIZE + 17] ^= 0x01;
+    memset(&image[BASE_GAP * BLOCK_SIZE + 100], 0x42, 10);
+    memcpy(&image[15 * BLOCK_SIZE], &base[5 * BLOCK_SIZE], BLOCK_SIZE);
+    for (int i = sizeof(base); i < sizeof(image); i++)
+    {
+        image[i] = rand();
+    }
+}
+
+static void buildPatch(void)
+{
+    patchStart(base, sizeof(base), image, sizeof(image));
+    patchCopy(0, 3 * BLOCK_SIZE + 17);
+    patchInsert(&image[3 * BLOCK_SIZE + 17], 1);
+    patchCopy(3 * BLOCK_SIZE + 18, (BASE_GAP - 3) * BLOCK_SIZE + 100 - 18);
+    patchInsert(&image[BASE_GAP * BLOCK_SIZE + 100], 10);
+    patchCopy(BASE_GAP * BLOCK_SIZE + 110, (15 - BASE_GAP) * BLOCK_SIZE - 110);
+    patchCopy(5 * BLOCK_SIZE, BLOCK_SIZE);
+    patchCopy(16 * BLOCK_SIZE, sizeof(base) - 16 * BLOCK_SIZE);
+    patchInsert(&image[sizeof(base)], sizeof(image) - sizeof(base));
+}
+
+static void testApplyAndFlash(void)
+{
+    static delta_patch_t delta;
+    uint64_t hash;
+
+    buildPatch();
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_OK);
+    CHECK(hash == fileMetaHash(FILE_META_HASH_INIT, image, sizeof(image)));
+    CHECK(fileEquals(newPath, image, sizeof(image)));
+
+    // The base copy is in use until the patched image is flashed
+    CHECK(deltaPatchBegin(&delta, newPath) == ESP_ERR_INVALID_STATE);
+
+    // Blocks 3, 10 and 15, and the 4 new ones
+    CHECK(deltaFlash(newPath) == ESP_OK);
+    CHECK(flashWrites == 3 + NEW_BLOCKS - BASE_BLOCKS);
+    CHECK(!memcmp(flash, image, sizeof(image)));
+
+    // What the client holds is recorded, the old base no longer patches
+    CHECK(patchApply(&delta, nextPath, &hash) == ESP_ERR_NOT_FOUND);
+    CHECK(access(nextPath, F_OK) != 0);
+}
+
+// The client MCU holds the base, a patch is applied and waits to be flashed
+static void patchPending(delta_patch_t *delta)
+{
+    uint64_t hash;
+
+    memcpy(flash, base, sizeof(base));
+    deltaRecordFlashed(basePath);
+    buildPatch();
+    CHECK(patchApply(delta, newPath, &hash) == ESP_OK);
+}
+
+static void testBaseReplaced(void)
+{
+    static delta_patch_t delta;
+    static uint8_t other[NEW_BLOCKS * BLOCK_SIZE];
+    char otherPath[FILE_META_PATH_MAX];
+
+    // Another job flashes a different image before the patch job runs
+    snprintf(otherPath, sizeof(otherPath), "%s/other.bin", dir);
+    memset(other, 0x33, sizeof(other));
+    FILE *f = fopen(otherPath, "w");
+    fwrite(other, 1, sizeof(other), f);
+    fclose(f);
+
+    patchPending(&delta);
+    memcpy(flash, other, sizeof(other));
+    deltaRecordFlashed(otherPath);
+    CHECK(deltaFlash(newPath) == ESP_OK);
+    CHECK(flashWrites == NEW_BLOCKS && !memcmp(flash, image, sizeof(image)));
+
+    // avrdude wrote it through the net programmer, nothing is known of it
+    patchPending(&delta);
+    memcpy(flash, other, sizeof(other));
+    deltaForgetFlashed();
+    CHECK(deltaFlash(newPath) == ESP_OK);
+    CHECK(flashWrites == NEW_BLOCKS && !memcmp(flash, image, sizeof(image)));
+
+    // Still on the base, only the changed blocks
+    patchPending(&delta);
+    CHECK(deltaFlash(newPath) == ESP_OK);
+    CHECK(flashWrites == 3 + NEW_BLOCKS - BASE_BLOCKS && !memcmp(flash, image, sizeof(image)));
+}
+
+static void testMalformed(void)
+{
+    static delta_patch_t delta;
+    uint64_t hash;
+
+    deltaRecordFlashed(basePath);
+    buildPatch();
+
+    // Not a patch
+    patch[0] ^= 0xff;
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_INVALID_ARG);
+    patch[0] ^= 0xff;
+
+    // Unknown op
+    patch[sizeof(delta_header_t)] = 'X';
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_INVALID_ARG);
+    patch[sizeof(delta_header_t)] = DELTA_OP_COPY;
+
+    // Truncated
+    patchLength -= 5;
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_INVALID_SIZE);
+    CHECK(access(newPath, F_OK) != 0);
+
+    // Copy out of the base
+    patchStart(base, sizeof(base), image, sizeof(image));
+    patchCopy(sizeof(base) - 10, 11);
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_INVALID_ARG);
+
+    // More output than the header says
+    patchStart(base, sizeof(base), image, BLOCK_SIZE);
+    patchCopy(0, BLOCK_SIZE + 1);
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_INVALID_ARG);
+
+    // Right length, wrong content
+    patchStart(base, sizeof(base), image, BLOCK_SIZE);
+    patchCopy(1, BLOCK_SIZE);
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_INVALID_CRC);
+    CHECK(access(newPath, F_OK) != 0);
+
+    // Made against another base
+    patchStart(image, sizeof(base), image, BLOCK_SIZE);
+    patchCopy(0, BLOCK_SIZE);
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_NOT_FOUND);
+
+    // The base was deleted and uploaded again, changed, since it was flashed
+    base[0] ^= 0x80;
+    fileMetaRemove(basePath);
+    writeBaseHex();
+    patchStart(base, sizeof(base), base, BLOCK_SIZE);
+    patchCopy(0, BLOCK_SIZE);
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_NOT_FOUND);
+
+    // Nothing recorded
+    deltaRecordFlashed(basePath);
+    deltaForgetFlashed();
+    CHECK(patchApply(&delta, newPath, &hash) == ESP_ERR_NOT_FOUND);
+}
+
+int main(void)
+{
+    char command[64];
+
+    setUp();
+    testApplyAndFlash();
+    testBaseReplaced();
+    testMalformed();
+
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    system(command);
+    return hostTestDone("avr_delta");
+}
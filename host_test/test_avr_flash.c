@@ -0,0 +1,759 @@
+/* avr_flash: writeImage()/verifyImage() through each protocol policy, against
+ * a simulated target answering on the UART (or SPI for ISP) as it goes.
+ * Prints what a page costs: host time through the core and the policy, and
+ * the bytes on the wire. */
+
+#include "avr_flash.h"
+#include "metrics.h"
+#include "host_test.h"
+
+// Flash of the simulated part, as much as the core addresses
+#define SIM_FLASH_SIZE FLASH_SIZE_MAX
+
+// Image written by each policy, UPDI reaches 32 KB of flash at 0x8000
+#define IMAGE_SIZE (32 * 1024)
+
+// Block size the AVR109 bootloader reports, so blocks go in two
+#define SIM_AVR109_BLOCK 128
+
+#define STK_OK 0x10
+#define STK_INSYNC 0x14
+
+#define UPDI_SYNCH 0x55
+#define UPDI_ACK 0x40
+
+typedef enum
+{
+    SIM_STK500V1,
+    SIM_STK500V2,
+    SIM_AVR109,
+    SIM_ISP,
+    SIM_UPDI,
+} sim_target_t;
+
+static const uint8_t simSignature[3] = {0x1e, 0x95, 0x0f};
+
+static int bench = 0;
+
+static struct
+{
+    sim_target_t target;
+    uint8_t flash[SIM_FLASH_SIZE];
+
+    // Command being received, and the bytes sent back not read yet
+    uint8_t cmd[16 + BLOCK_SIZE];
+    size_t cmd_length;
+    uint8_t rx[4096];
+    size_t rx_head;
+    size_t rx_tail;
+    uint32_t baud;
+
+    // Byte address the next page operation works on
+    uint32_t address;
+    // STK500v1 extended address byte
+    uint8_t ext;
+
+    // ISP: RESET level, in serial programming
+    int reset;
+    int enabled;
+
+    // UPDI: data bytes following an instruction, and the page buffer
+    int updi_key;
+    int updi_nvmprog;
+    int updi_rsd;
+    int updi_repeat;
+    int updi_data;
+    uint16_t updi_sts;
+    uint16_t updi_pointer;
+    uint8_t updi_page[CONFIG_UPDI_PAGE_SIZE];
+    uint16_t updi_page_address;
+
+    // Bytes each way, and the flash bytes the target programmed
+    uint32_t tx_bytes;
+    uint32_t rx_bytes;
+    uint32_t written;
+} sim;
+
+static void simPowerUp(sim_target_t target)
+{
+    memset(&sim, 0, sizeof(sim));
+    sim.target = target;
+    sim.reset = 1;
+    memset(sim.flash, 0x5a, sizeof(sim.flash));
+}
+
+/* The rest of the firmware */
+
+void metricsCount(metric_counter_t counter, uint32_t n)
+{
+    if (counter == METRIC_UART_TX_BYTES)
+    {
+        sim.tx_bytes += n;
+    }
+    else if (counter == METRIC_UART_RX_BYTES)
+    {
+        sim.rx_bytes += n;
+    }
+}
+
+void metricsObserve(metric_histogram_t histogram, uint32_t us)
+{
+}
+
+void metricsMarkBoot(metric_boot_t mark)
+{
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total, size_t *used)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level)
+{
+    if (gpio == RESET_PIN)
+    {
+        if (!sim.reset && level)
+        {
+            // Leaving reset ends serial programming
+            sim.enabled = 0;
+        }
+        if (!level)
+        {
+            // RAMPZ, and the extended address with it, are cleared
+            sim.ext = 0;
+        }
+        sim.reset = level;
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio)
+{
+    return ESP_OK;
+}
+
+/* The part on the other end of the UART */
+
+static void simAnswer(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        sim.rx[sim.rx_head++ % sizeof(sim.rx)] = data[i];
+    }
+}
+
+static void simAnswerByte(uint8_t byte)
+{
+    simAnswer(&byte, 1);
+}
+
+static void simWrite(const uint8_t *data, size_t size)
+{
+    memcpy(&sim.flash[sim.address % SIM_FLASH_SIZE], data, size);
+    sim.written += size;
+}
+
+// Optiboot: bytes the command in sim.cmd takes, as far as it is known yet
+static size_t simStk500v1Length(void)
+{
+    switch (sim.cmd[0])
+    {
+    case 0x42:
+        return 22;
+    case 0x45:
+        return 7;
+    case 0x55:
+        return 4;
+    case 0x56:
+        return 6;
+    case 0x64:
+        return sim.cmd_length < 3 ? 3 : 5 + (sim.cmd[1] << 8 | sim.cmd[2]);
+    case 0x74:
+        return 5;
+    default:
+        return 2;
+    }
+}
+
+static void simStk500v1(void)
+{
+    const size_t size = sim.cmd[1] << 8 | sim.cmd[2];
+
+    simAnswerByte(STK_INSYNC);
+    switch (sim.cmd[0])
+    {
+    case 0x55:
+        sim.address = 2 * ((uint32_t)sim.ext << 16 | sim.cmd[2] << 8 | sim.cmd[1]);
+        break;
+    case 0x56:
+        if (sim.cmd[1] == 0x4d)
+        {
+            sim.ext = sim.cmd[3];
+        }
+        simAnswerByte(0x00);
+        break;
+    case 0x64:
+        simWrite(&sim.cmd[4], size);
+        break;
+    case 0x74:
+        simAnswer(&sim.flash[sim.address % SIM_FLASH_SIZE], size);
+        break;
+    }
+    simAnswerByte(STK_OK);
+}
+
+// STK500v2 (wiring): bytes of the framed message, as far as it is known yet
+static size_t simStk500v2Length(void)
+{
+    return sim.cmd_length < 5 ? 5 : 6 + (sim.cmd[2] << 8 | sim.cmd[3]);
+}
+
+static void simStk500v2(void)
+{
+    const uint8_t *body = &sim.cmd[5];
+    const size_t size = body[1] << 8 | body[2];
+    uint8_t answer[6 + BLOCK_SIZE + 3] = {0x1b, sim.cmd[1], 0, 0, 0x0e, body[0], 0x00};
+    size_t length = 2;
+
+    switch (body[0])
+    {
+    case 0x01:
+        memcpy(&answer[7], "\x08" "AVRISP_2", 9);
+        length += 9;
+        break;
+    case 0x06:
+        sim.address = 2 * ((uint32_t)body[1] << 24 | body[2] << 16 | body[3] << 8 | body[4]) & (SIM_FLASH_SIZE - 1);
+        break;
+    case 0x13:
+        simWrite(&body[10], size);
+        sim.address += size;
+        break;
+    case 0x14:
+        memcpy(&answer[7], &sim.flash[sim.address % SIM_FLASH_SIZE], size);
+        answer[7 + size] = 0x00;
+        sim.address += size;
+        length += size + 1;
+        break;
+    }
+    answer[2] = length >> 8;
+    answer[3] = length & 0xff;
+
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < 5 + length; i++)
+    {
+        checksum ^= answer[i];
+    }
+    answer[5 + length] = checksum;
+    simAnswer(answer, 6 + length);
+}
+
+// Caterina: bytes the command in sim.cmd takes, as far as it is known yet
+static size_t simAvr109Length(void)
+{
+    switch (sim.cmd[0])
+    {
+    case 'A':
+        return 3;
+    case 'H':
+        return 4;
+    case 'B':
+        return sim.cmd_length < 3 ? 3 : 4 + (sim.cmd[1] << 8 | sim.cmd[2]);
+    case 'g':
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+static void simAvr109(void)
+{
+    const size_t size = sim.cmd[1] << 8 | sim.cmd[2];
+    const uint8_t block[] = {'Y', SIM_AVR109_BLOCK >> 8, SIM_AVR109_BLOCK & 0xff};
+
+    switch (sim.cmd[0])
+    {
+    case 'S':
+        simAnswer((const uint8_t *)"CATERIN", 7);
+        return;
+    case 'b':
+        simAnswer(block, sizeof(block));
+        return;
+    case 'A':
+        sim.address = 2 * (sim.cmd[1] << 8 | sim.cmd[2]);
+        break;
+    case 'H':
+        sim.address = 2 * ((uint32_t)sim.cmd[1] << 16 | sim.cmd[2] << 8 | sim.cmd[3]);
+        break;
+    case 'B':
+        simWrite(&sim.cmd[4], size);
+        sim.address += size;
+        break;
+    case 'g':
+        simAnswer(&sim.flash[sim.address % SIM_FLASH_SIZE], size);
+        sim.address += size;
+        return;
+    }
+    simAnswerByte('\r');
+}
+
+// UPDI: bytes of the instruction after the SYNCH, as far as it is known yet
+static size_t simUpdiLength(void)
+{
+    if (sim.cmd_length < 2)
+    {
+        return 2;
+    }
+    switch (sim.cmd[1] & 0xe0)
+    {
+    case 0xc0:
+    case 0xa0:
+        return 3;
+    case 0xe0:
+        return 10;
+    default:
+        return (sim.cmd[1] == 0x44 || sim.cmd[1] == 0x04 || sim.cmd[1] == 0x69) ? 4 : 2;
+    }
+}
+
+static uint8_t simUpdiLoad(uint16_t address)
+{
+    if (address >= CONFIG_UPDI_FLASH_BASE)
+    {
+        return sim.flash[address - CONFIG_UPDI_FLASH_BASE];
+    }
+    if (address >= UPDI_SIGROW && address < UPDI_SIGROW + 3)
+    {
+        return simSignature[address - UPDI_SIGROW];
+    }
+    // NVMCTRL.STATUS never busy
+    return 0x00;
+}
+
+static void simUpdiStore(uint16_t address, uint8_t value)
+{
+    if (address >= CONFIG_UPDI_FLASH_BASE)
+    {
+        sim.updi_page_address = address & ~(CONFIG_UPDI_PAGE_SIZE - 1);
+        sim.updi_page[address % CONFIG_UPDI_PAGE_SIZE] = value;
+    }
+    else if (address == UPDI_NVMCTRL && value == 0x04)
+    {
+        memset(sim.updi_page, 0xff, sizeof(sim.updi_page));
+    }
+    else if (address == UPDI_NVMCTRL && value == 0x03)
+    {
+        sim.address = sim.updi_page_address - CONFIG_UPDI_FLASH_BASE;
+        simWrite(sim.updi_page, CONFIG_UPDI_PAGE_SIZE);
+    }
+}
+
+static void simUpdi(void)
+{
+    const uint8_t op = sim.cmd[1];
+    const uint16_t address = sim.cmd[2] | sim.cmd[3] << 8;
+    const int repeat = sim.updi_repeat ? sim.updi_repeat : 1;
+
+    sim.updi_repeat = 0;
+    if ((op & 0xe0) == 0xc0)
+    {
+        if ((op & 0x0f) == 0x02)
+        {
+            sim.updi_rsd = !!(sim.cmd[2] & 0x08);
+        }
+        else if ((op & 0x0f) == 0x08 && sim.cmd[2] == 0x59 && sim.updi_key)
+        {
+            sim.updi_nvmprog = 1;
+        }
+    }
+    else if ((op & 0xe0) == 0x80)
+    {
+        const uint8_t cs[16] = {[0x00] = 0x30, [0x07] = sim.updi_key ? 0x10 : 0, [0x0b] = sim.updi_nvmprog ? 0x08 : 0};
+        simAnswerByte(cs[op & 0x0f]);
+    }
+    else if (op == 0xe0)
+    {
+        sim.updi_key = !memcmp(&sim.cmd[2], " gorPMVN", 8);
+    }
+    else if (op == 0xa0)
+    {
+        sim.updi_repeat = sim.cmd[2] + 1;
+    }
+    else if (op == 0x44)
+    {
+        sim.updi_sts = address;
+        sim.updi_data = -1;
+        simAnswerByte(UPDI_ACK);
+    }
+    else if (op == 0x04)
+    {
+        simAnswerByte(simUpdiLoad(address));
+    }
+    else if (op == 0x69)
+    {
+        sim.updi_pointer = address;
+        simAnswerByte(UPDI_ACK);
+    }
+    else if (op == 0x65)
+    {
+        sim.updi_data = 2 * repeat;
+    }
+    else if (op == 0x24)
+    {
+        for (int i = 0; i < repeat; i++)
+        {
+            simAnswerByte(simUpdiLoad(sim.updi_pointer++));
+        }
+    }
+}
+
+// Single wire: every byte comes back, ahead of any answer
+static void simUpdiByte(uint8_t byte)
+{
+    simAnswerByte(byte);
+    if (sim.baud == UPDI_BREAK_BAUD)
+    {
+        // A break, the UPDI starts over
+        sim.cmd_length = 0;
+        sim.updi_data = 0;
+        return;
+    }
+    if (sim.updi_data < 0)
+    {
+        simUpdiStore(sim.updi_sts, byte);
+        sim.updi_data = 0;
+        simAnswerByte(UPDI_ACK);
+        return;
+    }
+    if (sim.updi_data > 0)
+    {
+        simUpdiStore(sim.updi_pointer++, byte);
+        if (--sim.updi_data % 2 == 0 && !sim.updi_rsd)
+        {
+            simAnswerByte(UPDI_ACK);
+        }
+        return;
+    }
+    if (!sim.cmd_length && byte != UPDI_SYNCH)
+    {
+        return;
+    }
+    sim.cmd[sim.cmd_length++] = byte;
+    if (sim.cmd_length >= simUpdiLength())
+    {
+        simUpdi();
+        sim.cmd_length = 0;
+    }
+}
+
+int uart_write_bytes(uart_port_t port, const void *data, size_t size)
+{
+    static size_t (*const lengths[])(void) = {
+        [SIM_STK500V1] = simStk500v1Length,
+        [SIM_STK500V2] = simStk500v2Length,
+        [SIM_AVR109] = simAvr109Length,
+    };
+    static void (*const commands[])(void) = {
+        [SIM_STK500V1] = simStk500v1,
+        [SIM_STK500V2] = simStk500v2,
+        [SIM_AVR109] = simAvr109,
+    };
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (sim.target == SIM_UPDI)
+        {
+            simUpdiByte(bytes[i]);
+            continue;
+        }
+        if (sim.target == SIM_ISP)
+        {
+            continue;
+        }
+        if (sim.cmd_length < sizeof(sim.cmd))
+        {
+            sim.cmd[sim.cmd_length++] = bytes[i];
+        }
+        if (sim.cmd_length >= lengths[sim.target]())
+        {
+            commands[sim.target]();
+            sim.cmd_length = 0;
+        }
+    }
+    return size;
+}
+
+// Answers are there as soon as the command is, so nothing to wait for
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks)
+{
+    uint8_t *bytes = buf;
+    uint32_t count = 0;
+
+    while (count < length && sim.rx_tail != sim.rx_head)
+    {
+        bytes[count++] = sim.rx[sim.rx_tail++ % sizeof(sim.rx)];
+    }
+    return count;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size)
+{
+    *size = sim.rx_head - sim.rx_tail;
+    return ESP_OK;
+}
+
+esp_err_t uart_flush(uart_port_t port)
+{
+    return uart_flush_input(port);
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+    sim.rx_tail = sim.rx_head;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud)
+{
+    sim.baud = baud;
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              void *queue, int intr_alloc_flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_parity(uart_port_t port, uart_parity_t parity)
+{
+    return ESP_OK;
+}
+
+esp_err_t uart_set_stop_bits(uart_port_t port, uart_stop_bits_t stop_bits)
+{
+    return ESP_OK;
+}
+
+/* The part on the other end of the SPI bus */
+
+static uint16_t simIspPage[CONFIG_ISP_PAGE_SIZE / 2];
+
+static uint8_t simIspInstruction(const uint8_t *tx)
+{
+    const uint32_t word = (uint32_t)sim.ext << 16 | tx[1] << 8 | tx[2];
+    const int words = CONFIG_ISP_PAGE_SIZE / 2;
+
+    if (tx[0] == 0xac && tx[1] == 0x53)
+    {
+        sim.enabled = 1;
+        return 0x00;
+    }
+    if (!sim.enabled)
+    {
+        return 0xff;
+    }
+
+    switch (tx[0])
+    {
+    case 0xac:
+        if (tx[1] == 0x80)
+        {
+            memset(sim.flash, 0xff, sizeof(sim.flash));
+        }
+        return 0x00;
+    case 0x4d:
+        sim.ext = tx[2];
+        return 0x00;
+    case 0x40:
+        simIspPage[word % words] = (simIspPage[word % words] & 0xff00) | tx[3];
+        return 0x00;
+    case 0x48:
+        simIspPage[word % words] = (simIspPage[word % words] & 0x00ff) | tx[3] << 8;
+        return 0x00;
+    case 0x4c:
+        for (int i = 0; i < words; i++)
+        {
+            // Programming only clears bits
+            const uint32_t at = 2 * ((word & ~(words - 1)) + i);
+            sim.flash[at] &= simIspPage[i];
+            sim.flash[at + 1] &= simIspPage[i] >> 8;
+            simIspPage[i] = 0xffff;
+        }
+        sim.written += CONFIG_ISP_PAGE_SIZE;
+        return 0x00;
+    case 0x20:
+        return sim.flash[2 * word];
+    case 0x28:
+        return sim.flash[2 * word + 1];
+    case 0x30:
+        return simSignature[tx[2] % 3];
+    default:
+        // RDY/BSY and the rest: never busy
+        return 0x00;
+    }
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus, int dma)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *device,
+                             spi_device_handle_t *handle)
+{
+    *handle = (spi_device_handle_t)&sim;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *t)
+{
+    const uint8_t *tx = t->tx_buffer;
+    uint8_t *rx = t->rx_buffer;
+
+    for (size_t i = 0; i < t->length / 8; i += 4)
+    {
+        const int listening = sim.target == SIM_ISP && !sim.reset;
+        rx[i] = 0xff;
+        rx[i + 1] = listening ? tx[i] : 0xff;
+        rx[i + 2] = listening ? tx[i + 1] : 0xff;
+        rx[i + 3] = listening ? simIspInstruction(&tx[i]) : 0xff;
+        sim.tx_bytes += 4;
+        sim.rx_bytes += 4;
+    }
+    return ESP_OK;
+}
+
+/* The tests */
+
+static uint8_t image[IMAGE_SIZE];
+
+static void testPolicy(const avr_protocol_t *protocol, sim_target_t target)
+{
+    const int rounds = bench ? 200 : 5;
+    const int pages = IMAGE_SIZE / protocol->block_size;
+    avr_memory_image_t memory;
+
+    simPowerUp(target);
+    avr_image_source_t *source = memoryImageInit(&memory, image, sizeof(image));
+
+    CHECK(writeImage(protocol, source) == ESP_OK);
+    CHECK(verifyImage(protocol, source) == ESP_OK);
+    CHECK(!memcmp(sim.flash, image, sizeof(image)));
+    // ISP leaves out the erased block, the flash reads 0xFF there anyway
+    CHECK(sim.written == IMAGE_SIZE - (target == SIM_ISP) * BLOCK_SIZE);
+
+    // A byte the part got wrong is found
+    sim.flash[IMAGE_SIZE / 2 + 3] ^= 0x01;
+    CHECK(verifyImage(protocol, source) == -EVERIFY_FAIL);
+    sim.flash[IMAGE_SIZE / 2 + 3] ^= 0x01;
+    endSession(protocol);
+
+    // What a page costs, past the reset and sync of the session
+    CHECK(startSession(protocol) == ESP_OK);
+    sim.tx_bytes = sim.rx_bytes = 0;
+    double start = hostSeconds();
+    for (int i = 0; i < rounds; i++)
+    {
+        CHECK(memoryImageInit(&memory, image, sizeof(image)) == source);
+        CHECK(writeSessionImage(protocol, source) == ESP_OK);
+    }
+    const double write_us = (hostSeconds() - start) / (rounds * pages) * 1e6;
+    const uint32_t write_tx = sim.tx_bytes / (rounds * pages);
+
+    sim.tx_bytes = sim.rx_bytes = 0;
+    start = hostSeconds();
+    for (int i = 0; i < rounds; i++)
+    {
+        CHECK(verifyImage(protocol, source) == ESP_OK);
+    }
+    const double verify_us = (hostSeconds() - start) / (rounds * pages) * 1e6;
+    const uint32_t verify_rx = sim.rx_bytes / (rounds * pages);
+    endSession(protocol);
+
+    printf("%-8s %3d byte pages: write %5.2f us, %3u bytes sent; verify %5.2f us, %3u bytes received\n",
+           protocol->name, protocol->block_size, write_us, write_tx, verify_us, verify_rx);
+}
+
+static void testKeepSession(void)
+{
+    uint8_t block[BLOCK_SIZE];
+
+    // Blocks telling the 64 KB word banks apart
+    simPowerUp(SIM_STK500V1);
+    memset(sim.flash, 0x00, 128 * 1024);
+    memset(&sim.flash[128 * 1024], 0x01, 128 * 1024);
+
+    CHECK(startSession(&stk500v1Protocol) == ESP_OK);
+    CHECK(readSessionBlock(&stk500v1Protocol, 128 * 1024, block) == ESP_OK && block[0] == 0x01);
+
+    // No reset, so the bootloader keeps the extended address it was given
+    CHECK(keepSession(&stk500v1Protocol));
+    CHECK(sim.ext == 1);
+    CHECK(readSessionBlock(&stk500v1Protocol, 0, block) == ESP_OK && block[0] == 0x00);
+    CHECK(sim.ext == 0);
+    endSession(&stk500v1Protocol);
+
+    // After a reset the first block above 128 KB loads it again
+    CHECK(startSession(&stk500v1Protocol) == ESP_OK);
+    CHECK(readSessionBlock(&stk500v1Protocol, 128 * 1024, block) == ESP_OK && block[0] == 0x01);
+    endSession(&stk500v1Protocol);
+}
+
+int main(int argc, char **argv)
+{
+    bench = argc > 1 && !strcmp(argv[1], "--bench");
+
+    srand(11);
+    for (int i = 0; i < IMAGE_SIZE; i++)
+    {
+        image[i] = rand();
+    }
+    // An erased block, which ISP needn't program
+    memset(&image[5 * BLOCK_SIZE], 0xff, BLOCK_SIZE);
+
+    initUART();
+    testPolicy(&stk500v1Protocol, SIM_STK500V1);
+    testPolicy(&stk500v2Protocol, SIM_STK500V2);
+    testPolicy(&avr109Protocol, SIM_AVR109);
+    testPolicy(&ispProtocol, SIM_ISP);
+    testPolicy(&updiProtocol, SIM_UPDI);
+    testKeepSession();
+    return hostTestDone("avr_flash");
+}
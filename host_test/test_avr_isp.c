@@ -0,0 +1,342 @@
+/* avr_isp: the instruction framing, against a simulated AVR in serial programming */
+
+#include "avr_isp.h"
+#include "host_test.h"
+
+// Simulated part: 256 KB of flash, so the extended address is needed
+#define SIM_FLASH_SIZE (256 * 1024)
+#define SIM_EEPROM_SIZE 4096
+#define SIM_PAGE_WORDS (CONFIG_ISP_PAGE_SIZE / 2)
+
+// Polls RDY/BSY answers busy after a write or erase
+#define SIM_BUSY_POLLS 3
+
+static struct
+{
+    // Bus set up, device added, RESET level
+    int bus;
+    int device;
+    int reset;
+
+    // Programming Enable instructions ignored before the part gets in step
+    int out_of_step;
+    // No part at all
+    int absent;
+    int enabled;
+
+    int busy;
+    int ext;
+    uint8_t flash[SIM_FLASH_SIZE];
+    uint16_t page[SIM_PAGE_WORDS];
+    uint8_t eeprom[SIM_EEPROM_SIZE];
+    int eeprom_page[CONFIG_ISP_EEPROM_PAGE_SIZE];
+    uint8_t fuses[4];
+
+    // Instructions by their first byte, and the ones sent while busy
+    int count[256];
+    int while_busy;
+    int reset_pulses;
+} sim;
+
+static const uint8_t simSignature[3] = {0x1e, 0x98, 0x01};
+
+static void simPowerUp(void)
+{
+    memset(&sim, 0, sizeof(sim));
+    sim.reset = 1;
+    memset(sim.flash, 0x5a, sizeof(sim.flash));
+    memset(sim.page, 0xff, sizeof(sim.page));
+    memset(sim.eeprom, 0xff, sizeof(sim.eeprom));
+    for (int i = 0; i < CONFIG_ISP_EEPROM_PAGE_SIZE; i++)
+    {
+        sim.eeprom_page[i] = -1;
+    }
+    sim.fuses[0] = 0xff;
+    sim.fuses[1] = 0xd8;
+    sim.fuses[2] = 0xfd;
+    sim.fuses[3] = 0xff;
+}
+
+// One 4 byte instruction, the byte read back during the last one is returned
+static uint8_t simInstruction(const uint8_t *tx, uint8_t *rx)
+{
+    const uint32_t word = (uint32_t)sim.ext << 16 | tx[1] << 8 | tx[2];
+
+    sim.count[tx[0]]++;
+    if (tx[0] == 0xac && tx[1] == 0x53)
+    {
+        if (sim.out_of_step)
+        {
+            // Bits shifted against the frame, no echo
+            sim.out_of_step--;
+            rx[2] = 0xff;
+            return 0xff;
+        }
+        sim.enabled = 1;
+        return 0x00;
+    }
+    if (!sim.enabled)
+    {
+        return 0xff;
+    }
+    if (tx[0] == 0xf0)
+    {
+        if (sim.busy)
+        {
+            sim.busy--;
+            return 0x01;
+        }
+        return 0x00;
+    }
+    if (sim.busy)
+    {
+        sim.while_busy++;
+        return 0xff;
+    }
+
+    switch (tx[0])
+    {
+    case 0xac:
+        if (tx[1] == 0x80)
+        {
+            memset(sim.flash, 0xff, sizeof(sim.flash));
+            memset(sim.eeprom, 0xff, sizeof(sim.eeprom));
+        }
+        else
+        {
+            const uint8_t writes[] = {0xa0, 0xa8, 0xa4, 0xe0};
+            for (int i = 0; i < 4; i++)
+            {
+                if (tx[1] == writes[i])
+                {
+                    sim.fuses[i] = tx[3];
+                }
+            }
+        }
+        sim.busy = SIM_BUSY_POLLS;
+        return 0x00;
+    case 0x4d:
+        sim.ext = tx[2];
+        return 0x00;
+    case 0x40:
+        sim.page[word % SIM_PAGE_WORDS] = (sim.page[word % SIM_PAGE_WORDS] & 0xff00) | tx[3];
+        return 0x00;
+    case 0x48:
+        sim.page[word % SIM_PAGE_WORDS] = (sim.page[word % SIM_PAGE_WORDS] & 0x00ff) | tx[3] << 8;
+        return 0x00;
+    case 0x4c:
+        for (int i = 0; i < SIM_PAGE_WORDS; i++)
+        {
+            // Programming only clears bits, the page has to be erased first
+            const uint32_t at = 2 * ((word & ~(SIM_PAGE_WORDS - 1)) + i);
+            sim.flash[at] &= sim.page[i];
+            sim.flash[at + 1] &= sim.page[i] >> 8;
+            sim.page[i] = 0xffff;
+        }
+        sim.busy = SIM_BUSY_POLLS;
+        return 0x00;
+    case 0x20:
+        return sim.flash[2 * word];
+    case 0x28:
+        return sim.flash[2 * word + 1];
+    case 0xc1:
+        sim.eeprom_page[tx[2] % CONFIG_ISP_EEPROM_PAGE_SIZE] = tx[3];
+        return 0x00;
+    case 0xc2:
+        for (int i = 0; i < CONFIG_ISP_EEPROM_PAGE_SIZE; i++)
+        {
+            if (sim.eeprom_page[i] >= 0)
+            {
+                sim.eeprom[((tx[1] << 8 | tx[2]) & ~(CONFIG_ISP_EEPROM_PAGE_SIZE - 1)) + i] = sim.eeprom_page[i];
+                sim.eeprom_page[i] = -1;
+            }
+        }
+        sim.busy = SIM_BUSY_POLLS;
+        return 0x00;
+    case 0xa0:
+        return sim.eeprom[(tx[1] << 8 | tx[2]) % SIM_EEPROM_SIZE];
+    case 0x30:
+        return simSignature[tx[2] % 3];
+    case 0x50:
+        return sim.fuses[tx[1] == 0x08 ? 2 : 0];
+    case 0x58:
+        return sim.fuses[tx[1] == 0x08 ? 1 : 3];
+    default:
+        return 0xff;
+    }
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus, int dma)
+{
+    CHECK(!sim.bus);
+    sim.bus = 1;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host)
+{
+    CHECK(sim.bus && !sim.device);
+    sim.bus = 0;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t *device,
+                             spi_device_handle_t *handle)
+{
+    CHECK(sim.bus && !sim.device);
+    sim.device = 1;
+    *handle = (spi_device_handle_t)&sim;
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_remove_device(spi_device_handle_t handle)
+{
+    CHECK(sim.device);
+    sim.device = 0;
+    return ESP_OK;
+}
+
+// The part echoes each byte while the next goes out, and answers in the last
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t *t)
+{
+    const uint8_t *tx = t->tx_buffer;
+    uint8_t *rx = t->rx_buffer;
+
+    CHECK(sim.device && t->length % 32 == 0 && t->length / 8 <= ISP_TRANSFER_MAX);
+    for (size_t i = 0; i < t->length / 8; i += 4)
+    {
+        const int listening = !sim.absent && !sim.reset;
+        rx[i] = 0xff;
+        rx[i + 1] = listening ? tx[i] : 0xff;
+        rx[i + 2] = listening ? tx[i + 1] : 0xff;
+        rx[i + 3] = listening ? simInstruction(&tx[i], &rx[i]) : 0xff;
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level)
+{
+    if (gpio == RESET_PIN)
+    {
+        if (sim.reset == 0 && level)
+        {
+            // Leaving reset ends serial programming
+            sim.reset_pulses++;
+            sim.enabled = 0;
+        }
+        sim.reset = level;
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio)
+{
+    return ESP_OK;
+}
+
+static void testEnable(void)
+{
+    uint8_t signature[3];
+
+    // In step straight away
+    simPowerUp();
+    CHECK(ispEnable());
+    CHECK(sim.bus && sim.device && !sim.reset && sim.enabled);
+    CHECK(ispReadSignature(signature) && !memcmp(signature, simSignature, 3));
+
+    // Already enabled: only checks the part still answers
+    CHECK(ispEnable());
+    CHECK(sim.count[0xac] == 2 && sim.reset_pulses == 0);
+
+    ispDisable();
+    CHECK(!sim.bus && !sim.device && sim.reset);
+
+    // Out of step: a reset pulse between tries
+    simPowerUp();
+    sim.out_of_step = 2;
+    CHECK(ispEnable());
+    CHECK(sim.reset_pulses == 2 && !sim.reset);
+    ispDisable();
+
+    // Nothing there: every try at both clocks, then the bus and the reset let go
+    simPowerUp();
+    sim.absent = 1;
+    CHECK(!ispEnable());
+    CHECK(sim.count[0xac] == 0 && !sim.bus && !sim.device && sim.reset);
+    CHECK(sim.reset_pulses == 2 * ISP_ENABLE_TRIES + 1);
+}
+
+static void testFlash(void)
+{
+    static uint8_t image[SIM_FLASH_SIZE];
+    uint8_t block[BLOCK_SIZE];
+
+    simPowerUp();
+    srand(7);
+    for (int i = 0; i < SIM_FLASH_SIZE; i++)
+    {
+        image[i] = rand();
+    }
+    // A blank page is skipped, not programmed
+    memset(&image[3 * CONFIG_ISP_PAGE_SIZE], 0xff, CONFIG_ISP_PAGE_SIZE);
+
+    CHECK(ispEnable());
+    CHECK(ispChipErase());
+    for (uint32_t address = 0; address < SIM_FLASH_SIZE; address += CONFIG_ISP_PAGE_SIZE)
+    {
+        CHECK(ispWriteFlashPage(address / 2, &image[address]));
+    }
+    CHECK(sim.count[0x4c] == SIM_FLASH_SIZE / CONFIG_ISP_PAGE_SIZE - 1);
+    CHECK(!memcmp(sim.flash, image, SIM_FLASH_SIZE));
+
+    // Load Extended Address only when it changes: 0 then 1 on the way up
+    CHECK(sim.count[0x4d] == 2);
+
+    for (uint32_t address = 0; address < SIM_FLASH_SIZE; address += BLOCK_SIZE)
+    {
+        CHECK(ispReadFlash(address / 2, block, BLOCK_SIZE) && !memcmp(block, &image[address], BLOCK_SIZE));
+    }
+    CHECK(sim.count[0x4d] == 4);
+    CHECK(!ispReadFlash(0, block, BLOCK_SIZE + 2));
+
+    // Every write and erase waited for RDY/BSY before the next instruction
+    CHECK(sim.while_busy == 0);
+    ispDisable();
+}
+
+static void testEepromAndFuses(void)
+{
+    uint8_t data[100], back[100];
+    uint8_t value;
+
+    simPowerUp();
+    CHECK(ispEnable());
+
+    // Starts and ends part way through a page, bytes around it are kept
+    for (int i = 0; i < sizeof(data); i++)
+    {
+        data[i] = i * 7;
+    }
+    sim.eeprom[9] = 0x11;
+    sim.eeprom[110] = 0x22;
+    CHECK(ispWriteEeprom(10, data, sizeof(data)));
+    CHECK(!memcmp(&sim.eeprom[10], data, sizeof(data)) && sim.eeprom[9] == 0x11 && sim.eeprom[110] == 0x22);
+    CHECK(ispReadEeprom(10, back, sizeof(back)) && !memcmp(back, data, sizeof(data)));
+
+    CHECK(ispReadFuse(ISP_FUSE_HIGH, &value) && value == 0xd8);
+    CHECK(ispWriteFuse(ISP_FUSE_HIGH, 0xde));
+    CHECK(ispReadFuse(ISP_FUSE_HIGH, &value) && value == 0xde);
+    CHECK(ispWriteFuse(ISP_FUSE_LOCK, 0xfc));
+    CHECK(ispReadFuse(ISP_FUSE_LOCK, &value) && value == 0xfc);
+    CHECK(ispReadFuse(ISP_FUSE_EXTENDED, &value) && value == 0xfd);
+    CHECK(sim.while_busy == 0);
+    ispDisable();
+}
+
+int main(void)
+{
+    testEnable();
+    testFlash();
+    testEepromAndFuses();
+    return hostTestDone("avr_isp");
+}
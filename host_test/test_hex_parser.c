@@ -0,0 +1,392 @@
+/* hex_parser: hexDecode() against strtol(), and the parallel decode against
+ * the one Record at a time decode */
+
+#include <unistd.h>
+
+#include "hex_parser.h"
+#include "host_test.h"
+
+static int bench = 0;
+
+// The per byte decode hexDecode() replaced, strtol() on a 3 byte temporary
+static int hexDecodeStrtol(const char *text, uint8_t *bytes, int count)
+{
+    char byte_buff[3] = {0};
+
+    for (int i = 0; i < count; i++)
+    {
+        byte_buff[0] = text[2 * i];
+        byte_buff[1] = text[2 * i + 1];
+        bytes[i] = strtol(byte_buff, 0, 16);
+    }
+    return 1;
+}
+
+// hexDecode() before it went a word at a time, a branch per character
+static int hexDecodeNibbles(const char *text, uint8_t *bytes, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int nibbles[2];
+        for (int j = 0; j < 2; j++)
+        {
+            const char c = text[2 * i + j];
+            if (c >= '0' && c <= '9')
+            {
+                nibbles[j] = c - '0';
+            }
+            else if (c >= 'A' && c <= 'F')
+            {
+                nibbles[j] = c - 'A' + 10;
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                nibbles[j] = c - 'a' + 10;
+            }
+            else
+            {
+                return 0;
+            }
+        }
+        bytes[i] = nibbles[0] << 4 | nibbles[1];
+    }
+    return 1;
+}
+
+static void testDecode(void)
+{
+    const char *digits[] = {"0123456789ABCDEF", "0123456789abcdef"};
+    char text[2 * 64 + 1];
+    uint8_t bytes[64], expected[64];
+
+    // Every byte, upper and lower case, at every lane of a word
+    for (int c = 0; c < 2; c++)
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            for (int lane = 0; lane < 8; lane++)
+            {
+                memset(text, '0', sizeof(text));
+                text[2 * lane] = digits[c][value >> 4];
+                text[2 * lane + 1] = digits[c][value & 0xf];
+                CHECK(hexDecode(text, bytes, 8) && bytes[lane] == value);
+            }
+        }
+    }
+
+    // Every other character is refused, in a word and in the tail
+    for (int ch = 1; ch < 256; ch++)
+    {
+        if (strchr("0123456789ABCDEFabcdef", ch))
+        {
+            continue;
+        }
+        for (int pos = 0; pos < 2 * 5; pos++)
+        {
+            memset(text, 'a', sizeof(text));
+            text[pos] = ch;
+            CHECK(!hexDecode(text, bytes, 5));
+        }
+    }
+
+    // Random text of any length agrees with strtol()
+    srand(5);
+    for (int round = 0; round < 10000; round++)
+    {
+        const int count = rand() % 64;
+        for (int i = 0; i < 2 * count; i++)
+        {
+            text[i] = digits[rand() & 1][rand() & 0xf];
+        }
+        hexDecodeStrtol(text, expected, count);
+        CHECK(hexDecode(text, bytes, count) && !memcmp(bytes, expected, count));
+    }
+}
+
+typedef int (*hex_decode_t)(const char *text, uint8_t *bytes, int count);
+
+// Decoded MB/s of hexDecode() and of the loops before it, over the Data of 16 byte Records
+static void benchDecode(void)
+{
+    const hex_decode_t decoders[] = {hexDecodeStrtol, hexDecodeNibbles, hexDecode};
+    const char *names[] = {"strtol", "per character", "hexDecode"};
+    const int rounds = bench ? 2000 : 50;
+    const size_t size = 64 * 1024;
+    char *text = malloc(2 * size);
+    uint8_t *bytes = malloc(size);
+    double mb_s[3];
+
+    for (size_t i = 0; i < 2 * size; i++)
+    {
+        text[i] = "0123456789ABCDEF"[rand() & 0xf];
+    }
+
+    for (int d = 0; d < 3; d++)
+    {
+        // Through a volatile pointer, so the decoders aren't inlined into the loop
+        volatile hex_decode_t decode = decoders[d];
+        const double start = hostSeconds();
+        for (int r = 0; r < rounds; r++)
+        {
+            for (size_t i = 0; i < size; i += 16)
+            {
+                decode(&text[2 * i], &bytes[i], 16);
+            }
+        }
+        mb_s[d] = (double)size * rounds / (hostSeconds() - start) / 1e6;
+        printf("Decode, %s: %.1f MB/s, %.1fx strtol\n", names[d], mb_s[d], mb_s[d] / mb_s[0]);
+    }
+
+    free(text);
+    free(bytes);
+}
+
+// Flash image to write out as .hex, BLOCK_SIZE aligned, 0xFF where nothing is
+static uint8_t flash[FLASH_SIZE_MAX];
+
+// Line of a Record, with its checksum
+static void hexWriteRecord(FILE *f, int type, uint16_t address, const uint8_t *data, int length)
+{
+    uint8_t sum = length + (address >> 8) + address + type;
+
+    fprintf(f, ":%02X%04X%02X", length, address, type);
+    for (int i = 0; i < length; i++)
+    {
+        fprintf(f, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(f, "%02X\r\n", (uint8_t)-sum);
+}
+
+/**
+ * @brief Write flash[0, size) as a .hex file, skipping all 0xFF Records
+ *
+ * @param segment use Extended Segment Address Records rather than Extended Linear
+ */
+static void hexWriteFile(const char *path, uint32_t size, int record_length, int segment)
+{
+    FILE *f = fopen(path, "w");
+    uint32_t base = 0;
+
+    for (uint32_t address = 0; address < size; address += record_length)
+    {
+        const int length = MIN(record_length, (int)(size - address));
+        int blank = 1;
+        for (int i = 0; i < length; i++)
+        {
+            blank &= flash[address + i] == 0xff;
+        }
+        if (blank)
+        {
+            continue;
+        }
+
+        if ((address & 0xffff0000) != base)
+        {
+            base = address & 0xffff0000;
+            const uint8_t value[] = {base >> (segment ? 12 : 24), base >> (segment ? 4 : 16)};
+            hexWriteRecord(f, segment ? 0x02 : 0x04, 0, value, 2);
+        }
+        hexWriteRecord(f, 0x00, address & 0xffff, &flash[address], length);
+    }
+    hexWriteRecord(f, 0x01, 0, NULL, 0);
+    fclose(f);
+}
+
+// Random code, with a gap of blank flash and an odd blank block or two
+static void flashFill(uint32_t size, unsigned int seed)
+{
+    srand(seed);
+    memset(flash, 0xff, sizeof(flash));
+    for (uint32_t i = 0; i < size; i++)
+    {
+        flash[i] = rand();
+    }
+    memset(&flash[size / 3], 0xff, size / 8);
+    memset(&flash[size / 2 & ~(BLOCK_SIZE - 1)], 0xff, BLOCK_SIZE);
+}
+
+// The reference: one Record at a time through the image source
+static esp_err_t hexDecodeSerial(const char *path, hex_blocks_t *blocks)
+{
+    hex_image_t *image = calloc(1, sizeof(hex_image_t));
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret = hexImageOpen(image, path);
+
+    memset(blocks, 0, sizeof(*blocks));
+    while (ret == ESP_OK && (ret = image->source.nextBlock(&image->source, &address, &block)) == ESP_OK)
+    {
+        if (blocks->block_count == blocks->capacity)
+        {
+            blocks->capacity = MAX(2 * blocks->capacity, 16);
+            blocks->addresses = realloc(blocks->addresses, blocks->capacity * sizeof(uint32_t));
+            blocks->data = realloc(blocks->data, blocks->capacity * BLOCK_SIZE);
+        }
+        blocks->addresses[blocks->block_count] = address;
+        memcpy(&blocks->data[blocks->block_count * BLOCK_SIZE], block, BLOCK_SIZE);
+        blocks->block_count++;
+    }
+    hexImageClose(image);
+    free(image);
+    return ret == ESP_ERR_NOT_FOUND ? ESP_OK : ret;
+}
+
+static int hexBlocksEqual(const hex_blocks_t *a, const hex_blocks_t *b)
+{
+    return a->block_count == b->block_count &&
+           !memcmp(a->addresses, b->addresses, a->block_count * sizeof(uint32_t)) &&
+           !memcmp(a->data, b->data, a->block_count * BLOCK_SIZE);
+}
+
+static void hexBlocksFree(hex_blocks_t *blocks)
+{
+    free(blocks->addresses);
+    free(blocks->data);
+    memset(blocks, 0, sizeof(*blocks));
+}
+
+// Every split of the file decodes to what the serial decode gives
+static void testParallelMatches(const char *path, uint32_t size, int record_length, int segment)
+{
+    hex_blocks_t serial, parallel;
+
+    hexWriteFile(path, size, record_length, segment);
+    CHECK(hexDecodeSerial(path, &serial) == ESP_OK);
+    for (int parts = 1; parts <= HEX_PARTS_MAX; parts++)
+    {
+        const esp_err_t ret = hexDecodeParallel(path, parts, UINT32_MAX, &parallel);
+        CHECK(ret == ESP_OK);
+        if (ret == ESP_OK)
+        {
+            CHECK(hexBlocksEqual(&serial, &parallel));
+            hexBlocksFree(&parallel);
+        }
+
+        // Just fits, and one block short, blocks decoded twice by the parts counted once
+        CHECK(hexDecodeParallel(path, parts, serial.block_count, &parallel) == ESP_OK);
+        hexBlocksFree(&parallel);
+        CHECK(hexDecodeParallel(path, parts, serial.block_count - 1, &parallel) == ESP_ERR_INVALID_SIZE);
+    }
+    hexBlocksFree(&serial);
+}
+
+static void testParallel(const char *path)
+{
+    // A Mega image, blocks cut by the boundaries and parts starting well
+    // before the next Extended Linear Address Record
+    flashFill(FLASH_SIZE_MAX, 1);
+    testParallelMatches(path, FLASH_SIZE_MAX, 16, 0);
+    testParallelMatches(path, FLASH_SIZE_MAX, 32, 1);
+    testParallelMatches(path, FLASH_SIZE_MAX - 1000, 255, 0);
+
+    // Under 64 KB there are no address Records at all
+    flashFill(32 * 1024, 2);
+    testParallelMatches(path, 32 * 1024, 16, 0);
+
+    hex_blocks_t blocks;
+
+    // Too big
+    CHECK(hexDecodeParallel(path, 2, 16, &blocks) == ESP_ERR_INVALID_SIZE);
+
+    // Blocks out of address order are left to the serial decode to report
+    FILE *f = fopen(path, "w");
+    hexWriteRecord(f, 0x00, 0x1000, flash, 16);
+    for (int i = 0; i < 400; i++)
+    {
+        hexWriteRecord(f, 0x00, 0x2000 + 16 * i, flash, 16);
+    }
+    hexWriteRecord(f, 0x00, 0x0000, flash, 16);
+    hexWriteRecord(f, 0x01, 0, NULL, 0);
+    fclose(f);
+    CHECK(hexDecodeSerial(path, &blocks) == ESP_ERR_INVALID_STATE);
+    hexBlocksFree(&blocks);
+    CHECK(hexDecodeParallel(path, 2, UINT32_MAX, &blocks) != ESP_OK);
+
+    // Nothing counts after the End of File Record, whichever part it is in
+    f = fopen(path, "w");
+    for (int i = 0; i < 400; i++)
+    {
+        hexWriteRecord(f, 0x00, 16 * i, &flash[16 * i], 16);
+    }
+    hexWriteRecord(f, 0x01, 0, NULL, 0);
+    for (int i = 0; i < 400; i++)
+    {
+        hexWriteRecord(f, 0x00, 0x8000 + 16 * i, flash, 16);
+    }
+    fclose(f);
+    hex_blocks_t serial;
+    CHECK(hexDecodeSerial(path, &serial) == ESP_OK);
+    CHECK(serial.block_count == 400 * 16 / BLOCK_SIZE);
+    for (int parts = 2; parts <= 4; parts++)
+    {
+        CHECK(hexDecodeParallel(path, parts, UINT32_MAX, &blocks) == ESP_OK && hexBlocksEqual(&serial, &blocks));
+        hexBlocksFree(&blocks);
+    }
+    hexBlocksFree(&serial);
+
+    // A bad checksum fails the part it is in
+    flashFill(FLASH_SIZE_MAX, 3);
+    hexWriteFile(path, FLASH_SIZE_MAX, 16, 0);
+    f = fopen(path, "r+");
+    fseek(f, -200, SEEK_END);
+    while (fgetc(f) != ':')
+    {
+    }
+    // First Data digit
+    fseek(f, 8, SEEK_CUR);
+    const int digit = fgetc(f);
+    fseek(f, -1, SEEK_CUR);
+    fputc(digit == '0' ? '1' : '0', f);
+    fclose(f);
+    CHECK(hexDecodeParallel(path, 2, UINT32_MAX, &blocks) == ESP_ERR_INVALID_CRC);
+}
+
+// Wall time of decoding a Mega image with 1 to HEX_PARTS_MAX threads
+static void benchParallel(const char *path)
+{
+    const int rounds = bench ? 20 : 2;
+    hex_blocks_t blocks;
+
+    flashFill(FLASH_SIZE_MAX, 4);
+    hexWriteFile(path, FLASH_SIZE_MAX, 16, 0);
+
+    double start = hostSeconds();
+    for (int r = 0; r < rounds; r++)
+    {
+        hexDecodeSerial(path, &blocks);
+        hexBlocksFree(&blocks);
+    }
+    const double serial = (hostSeconds() - start) / rounds;
+    printf("256 KB image, one Record at a time: %.2f ms\n", serial * 1e3);
+
+    for (int parts = 1; parts <= HEX_PARTS_MAX; parts *= 2)
+    {
+        start = hostSeconds();
+        for (int r = 0; r < rounds; r++)
+        {
+            hexDecodeParallel(path, parts, UINT32_MAX, &blocks);
+            hexBlocksFree(&blocks);
+        }
+        const double t = (hostSeconds() - start) / rounds;
+        printf("256 KB image, %d parts: %.2f ms, %.2fx (%ld CPUs)\n", parts, t * 1e3, serial / t,
+               sysconf(_SC_NPROCESSORS_ONLN));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char path[] = "/tmp/test_hex_parserXXXXXX";
+    const int fd = mkstemp(path);
+
+    bench = argc > 1 && !strcmp(argv[1], "--bench");
+    close(fd);
+
+    testDecode();
+    testParallel(path);
+    benchDecode();
+    benchParallel(path);
+
+    unlink(path);
+    return hostTestDone("hex_parser");
+}
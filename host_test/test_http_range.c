@@ -0,0 +1,57 @@
+/* http_range: parse_range() on the Range values a download may get */
+
+#include <stdio.h>
+
+#include "http_range.h"
+#include "host_test.h"
+
+// Check a value parses to the outcome, and for HTTP_RANGE_PARTIAL to the bytes given
+static void checkRange(const char *value, long size, http_range_t expected, long first, long last)
+{
+    long start = -1, end = -1;
+    const http_range_t ranged = parse_range(value, size, &start, &end);
+
+    CHECK(ranged == expected);
+    if (ranged != expected)
+    {
+        fprintf(stderr, "  \"%s\" of %ld bytes: %d, not %d\n", value, size, ranged, expected);
+    }
+    if (expected == HTTP_RANGE_PARTIAL)
+    {
+        CHECK(start == first && end == last);
+    }
+}
+
+int main(void)
+{
+    // Single byte ranges
+    checkRange("bytes=0-99", 1000, HTTP_RANGE_PARTIAL, 0, 99);
+    checkRange("bytes=100-", 1000, HTTP_RANGE_PARTIAL, 100, 999);
+    checkRange("bytes=999-999", 1000, HTTP_RANGE_PARTIAL, 999, 999);
+    checkRange("bytes=500-5000", 1000, HTTP_RANGE_PARTIAL, 500, 999);
+    checkRange("bytes=-100", 1000, HTTP_RANGE_PARTIAL, 900, 999);
+    checkRange("bytes=-5000", 1000, HTTP_RANGE_PARTIAL, 0, 999);
+
+    // Not satisfiable: 416
+    checkRange("bytes=1000-", 1000, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=200-100", 1000, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=-0", 1000, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=-10", 0, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=0-", 0, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=abc", 1000, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=-", 1000, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+    checkRange("bytes=10-x", 1000, HTTP_RANGE_UNSATISFIABLE, 0, 0);
+
+    // Other units and several ranges are ignored: the whole file with 200
+    checkRange("items=0-99", 1000, HTTP_RANGE_IGNORE, 0, 0);
+    checkRange("bytes=0-99,200-299", 1000, HTTP_RANGE_IGNORE, 0, 0);
+    checkRange("", 1000, HTTP_RANGE_IGNORE, 0, 0);
+
+    // Ignored and unsatisfiable values leave start and end as they were
+    long start = 7, end = 9;
+    parse_range("bytes=0-1,2-3", 1000, &start, &end);
+    parse_range("bytes=5000-", 1000, &start, &end);
+    CHECK(start == 7 && end == 9);
+
+    return hostTestDone("http_range");
+}
@@ -0,0 +1,352 @@
+/* net_programmer: avrdude's net: port, against a simulated STK500v1 bootloader */
+
+#include "net_programmer.h"
+#include "metrics.h"
+#include "host_test.h"
+
+#include <pthread.h>
+#include "lwip/sockets.h"
+
+#define STK_OK 0x10
+#define STK_INSYNC 0x14
+#define STK_NOSYNC 0x15
+#define CRC_EOP 0x20
+
+#define SIM_FLASH_SIZE (32 * 1024)
+#define SIM_PAGE_SIZE 128
+
+// Round trips timed, like avrdude's GET_SYNC at the start of a session
+#define ROUND_TRIPS 500
+
+static const uint8_t simSignature[3] = {0x1e, 0x95, 0x0f};
+
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simReceived = PTHREAD_COND_INITIALIZER;
+
+static struct
+{
+    // Command being received, and the bytes sent back not read yet
+    uint8_t cmd[4 + SIM_PAGE_SIZE + 1];
+    size_t cmd_length;
+    uint8_t rx[4096];
+    size_t rx_head;
+    size_t rx_tail;
+
+    uint32_t address;
+    uint8_t flash[SIM_FLASH_SIZE];
+
+    int resets;
+    int uart_held;
+    int forgot_flashed;
+} sim;
+
+/* The rest of the firmware */
+
+void takeUART(void)
+{
+    pthread_mutex_lock(&simLock);
+    sim.uart_held++;
+    pthread_mutex_unlock(&simLock);
+}
+
+void giveUART(void)
+{
+    pthread_mutex_lock(&simLock);
+    sim.uart_held--;
+    pthread_mutex_unlock(&simLock);
+}
+
+void resetMCU(void)
+{
+    pthread_mutex_lock(&simLock);
+    sim.resets++;
+    sim.cmd_length = 0;
+    pthread_mutex_unlock(&simLock);
+}
+
+void deltaForgetFlashed(void)
+{
+    sim.forgot_flashed++;
+}
+
+void metricsCount(metric_counter_t counter, uint32_t n)
+{
+}
+
+void metricsWatchTask(TaskHandle_t task)
+{
+}
+
+void metricsTaskExit(void)
+{
+}
+
+/* The client MCU on the other end of the UART, lock held */
+
+static void simAnswer(const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        sim.rx[sim.rx_head++ % sizeof(sim.rx)] = data[i];
+    }
+    pthread_cond_broadcast(&simReceived);
+}
+
+// Bytes the command in sim.cmd takes, as far as it is known yet
+static size_t simCommandLength(void)
+{
+    switch (sim.cmd[0])
+    {
+    case 0x55:
+        return 4;
+    case 0x64:
+    case 0x74:
+        return sim.cmd_length < 3 ? 3 : (sim.cmd[0] == 0x64 ? 5 + (sim.cmd[1] << 8 | sim.cmd[2]) : 5);
+    default:
+        return 2;
+    }
+}
+
+static void simCommand(void)
+{
+    const size_t size = sim.cmd[1] << 8 | sim.cmd[2];
+    uint8_t answer[2 + SIM_PAGE_SIZE] = {STK_INSYNC};
+    size_t length = 1;
+
+    if (sim.cmd[sim.cmd_length - 1] != CRC_EOP)
+    {
+        answer[0] = STK_NOSYNC;
+        simAnswer(answer, 1);
+        return;
+    }
+
+    switch (sim.cmd[0])
+    {
+    case 0x55:
+        sim.address = 2 * (sim.cmd[1] | sim.cmd[2] << 8);
+        break;
+    case 0x64:
+        memcpy(&sim.flash[sim.address % SIM_FLASH_SIZE], &sim.cmd[4], size);
+        break;
+    case 0x74:
+        memcpy(&answer[1], &sim.flash[sim.address % SIM_FLASH_SIZE], size);
+        length += size;
+        break;
+    case 0x75:
+        memcpy(&answer[1], simSignature, 3);
+        length += 3;
+        break;
+    }
+    answer[length++] = STK_OK;
+    simAnswer(answer, length);
+}
+
+int uart_write_bytes(uart_port_t port, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    pthread_mutex_lock(&simLock);
+    for (size_t i = 0; i < size; i++)
+    {
+        if (sim.cmd_length < sizeof(sim.cmd))
+        {
+            sim.cmd[sim.cmd_length++] = bytes[i];
+        }
+        if (sim.cmd_length >= simCommandLength())
+        {
+            simCommand();
+            sim.cmd_length = 0;
+        }
+    }
+    pthread_mutex_unlock(&simLock);
+    return size;
+}
+
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t length, TickType_t ticks)
+{
+    struct timespec until;
+    uint8_t *bytes = buf;
+    uint32_t count = 0;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ticks / 1000;
+    until.tv_nsec += (ticks % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&simLock);
+    while (count < length)
+    {
+        if (sim.rx_tail != sim.rx_head)
+        {
+            bytes[count++] = sim.rx[sim.rx_tail++ % sizeof(sim.rx)];
+        }
+        else if (pthread_cond_timedwait(&simReceived, &simLock, &until))
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&simLock);
+    return count;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size)
+{
+    pthread_mutex_lock(&simLock);
+    *size = sim.rx_head - sim.rx_tail;
+    pthread_mutex_unlock(&simLock);
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+    pthread_mutex_lock(&simLock);
+    sim.rx_tail = sim.rx_head;
+    pthread_mutex_unlock(&simLock);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud)
+{
+    return ESP_OK;
+}
+
+/* avrdude's end */
+
+static int hostConnect(void)
+{
+    const struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_NET_PROGRAMMER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    const int nodelay = 1;
+
+    const int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0 || connect(sock, (const struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+// Send a command and read back an answer of the given length, returns 1 if it all came
+static int hostCommand(int sock, const uint8_t *cmd, size_t length, uint8_t *answer, size_t answer_length)
+{
+    const struct timeval wait = {.tv_sec = 2};
+    size_t got = 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    if (send(sock, cmd, length, 0) != length)
+    {
+        return 0;
+    }
+    while (got < answer_length)
+    {
+        const ssize_t count = recv(sock, &answer[got], answer_length - got, 0);
+        if (count <= 0)
+        {
+            return 0;
+        }
+        got += count;
+    }
+    return 1;
+}
+
+// Wait for the session to hand the UART back
+static int hostSessionOver(void)
+{
+    for (int i = 0; i < 200; i++)
+    {
+        pthread_mutex_lock(&simLock);
+        const int held = sim.uart_held;
+        pthread_mutex_unlock(&simLock);
+        if (!held)
+        {
+            return 1;
+        }
+        vTaskDelay(10);
+    }
+    return 0;
+}
+
+static void testSession(void)
+{
+    const uint8_t sync[] = {0x30, CRC_EOP};
+    const uint8_t signature[] = {0x75, CRC_EOP};
+    uint8_t program[4 + SIM_PAGE_SIZE + 1] = {0x64, 0x00, SIM_PAGE_SIZE, 'F'};
+    const uint8_t read[] = {0x74, 0x00, SIM_PAGE_SIZE, 'F', CRC_EOP};
+    const uint8_t address[] = {0x55, 0x40, 0x00, CRC_EOP};
+    uint8_t answer[2 + SIM_PAGE_SIZE];
+
+    // What the sketch printed before the connection is not passed on
+    simAnswer((const uint8_t *)"hello", 5);
+
+    const int sock = hostConnect();
+    CHECK(sock >= 0);
+    CHECK(hostCommand(sock, sync, sizeof(sync), answer, 2) && answer[0] == STK_INSYNC && answer[1] == STK_OK);
+    CHECK(sim.resets == 1 && sim.uart_held == 1 && sim.forgot_flashed == 1);
+
+    CHECK(hostCommand(sock, signature, sizeof(signature), answer, 5));
+    CHECK(answer[0] == STK_INSYNC && !memcmp(&answer[1], simSignature, 3) && answer[4] == STK_OK);
+
+    // A page written and read back at word address 0x40
+    for (int i = 0; i < SIM_PAGE_SIZE; i++)
+    {
+        program[4 + i] = i * 3;
+    }
+    program[sizeof(program) - 1] = CRC_EOP;
+    CHECK(hostCommand(sock, address, sizeof(address), answer, 2) && answer[1] == STK_OK);
+    CHECK(hostCommand(sock, program, sizeof(program), answer, 2) && answer[1] == STK_OK);
+    CHECK(!memcmp(&sim.flash[0x80], &program[4], SIM_PAGE_SIZE));
+    CHECK(hostCommand(sock, read, sizeof(read), answer, 2 + SIM_PAGE_SIZE));
+    CHECK(answer[0] == STK_INSYNC && !memcmp(&answer[1], &program[4], SIM_PAGE_SIZE) &&
+          answer[1 + SIM_PAGE_SIZE] == STK_OK);
+
+    // Round trip time, what bounds a session of small STK500 commands
+    const double start = hostSeconds();
+    int ok = 1;
+    for (int i = 0; i < ROUND_TRIPS; i++)
+    {
+        ok &= hostCommand(sock, sync, sizeof(sync), answer, 2);
+    }
+    CHECK(ok);
+    printf("STK500 round trip over the net programmer: %.0f us\n", (hostSeconds() - start) / ROUND_TRIPS * 1e6);
+
+    close(sock);
+    CHECK(hostSessionOver());
+
+    // The next avrdude gets a fresh reset
+    const int again = hostConnect();
+    CHECK(again >= 0);
+    CHECK(hostCommand(again, sync, sizeof(sync), answer, 2) && answer[1] == STK_OK);
+    CHECK(sim.resets == 2);
+    close(again);
+    CHECK(hostSessionOver());
+}
+
+static void testIdle(void)
+{
+    uint8_t byte;
+
+    // A host which goes quiet is dropped, and the UART freed
+    const int sock = hostConnect();
+    CHECK(sock >= 0);
+    const double start = hostSeconds();
+    CHECK(recv(sock, &byte, 1, 0) == 0);
+    CHECK(hostSeconds() - start >= CONFIG_NET_PROGRAMMER_IDLE_S * 0.9);
+    CHECK(hostSessionOver());
+    close(sock);
+}
+
+int main(void)
+{
+    CHECK(netProgrammerInit() == ESP_OK);
+    testSession();
+    testIdle();
+    return hostTestDone("net_programmer");
+}
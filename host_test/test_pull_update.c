@@ -0,0 +1,345 @@
+/* pull_update: conditional polls, and images flashed while they download */
+
+#include "pull_update.h"
+#include "metrics.h"
+#include "esp_http_client.h"
+#include "host_test.h"
+
+#include <unistd.h>
+
+#define IMAGE_SIZE (6 * BLOCK_SIZE + 40)
+
+static char dir[] = "/tmp/pullXXXXXX";
+static char storedPath[FILE_META_PATH_MAX];
+
+/* The server, scripted one poll at a time */
+
+static struct
+{
+    int status;
+    const char *etag;
+    const char *modified;
+    const char *body;
+    size_t length;
+    // Bytes of the body sent before the connection drops
+    size_t sent;
+} response;
+
+static struct
+{
+    // Conditional headers of the last poll, "" when not sent
+    char if_none_match[PULL_UPDATE_VALIDATOR_MAX];
+    char if_modified_since[PULL_UPDATE_VALIDATOR_MAX];
+    size_t read;
+    int open;
+} request;
+
+// The pull task waits in esp_http_client_init() until the test scripts its next poll
+static SemaphoreHandle_t pollReady;
+static SemaphoreHandle_t pollGo;
+
+struct esp_http_client
+{
+    esp_http_client_config_t config;
+};
+
+static struct esp_http_client client;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+    xSemaphoreGive(pollReady);
+    xSemaphoreTake(pollGo, portMAX_DELAY);
+
+    CHECK(!request.open && !strcmp(config->url, CONFIG_PULL_UPDATE_URL));
+    memset(&request, 0, sizeof(request));
+    request.open = 1;
+    client.config = *config;
+    return &client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t handle, const char *key, const char *value)
+{
+    if (!strcmp(key, "If-None-Match"))
+    {
+        strlcpy(request.if_none_match, value, sizeof(request.if_none_match));
+    }
+    else if (!strcmp(key, "If-Modified-Since"))
+    {
+        strlcpy(request.if_modified_since, value, sizeof(request.if_modified_since));
+    }
+    return ESP_OK;
+}
+
+static void clientHeader(const char *key, const char *value)
+{
+    esp_http_client_event_t evt = {
+        .event_id = HTTP_EVENT_ON_HEADER,
+        .client = &client,
+        .user_data = client.config.user_data,
+        .header_key = (char *)key,
+        .header_value = (char *)value,
+    };
+
+    if (value)
+    {
+        client.config.event_handler(&evt);
+    }
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t handle, int write_len)
+{
+    return response.status ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t handle)
+{
+    clientHeader("etag", response.etag);
+    clientHeader("Last-Modified", response.modified);
+    return response.length;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t handle)
+{
+    return response.status;
+}
+
+int esp_http_client_get_content_length(esp_http_client_handle_t handle)
+{
+    return response.length;
+}
+
+// Bytes come in pieces of whatever size the network hands over
+int esp_http_client_read(esp_http_client_handle_t handle, char *buffer, int len)
+{
+    const size_t piece = 1 + rand() % 300;
+    const size_t count = MIN(MIN(len, response.sent - request.read), piece);
+
+    memcpy(buffer, &response.body[request.read], count);
+    request.read += count;
+    return count;
+}
+
+int esp_http_client_is_complete_data_received(esp_http_client_handle_t handle)
+{
+    return request.read == response.length;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t handle)
+{
+    request.open = 0;
+    return ESP_OK;
+}
+
+/* The rest of the firmware */
+
+static uint8_t flash[FLASH_SIZE_MAX];
+static int flashWrites;
+static int recorded;
+static int forgotten;
+
+const avr_protocol_t stk500v1Protocol = {.name = "sim", .block_size = BLOCK_SIZE};
+
+esp_err_t writeImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret;
+
+    image->rewind(image);
+    while ((ret = image->nextBlock(image, &address, &block)) == ESP_OK)
+    {
+        memcpy(&flash[address], block, BLOCK_SIZE);
+        flashWrites++;
+    }
+    return ret == ESP_ERR_NOT_FOUND ? ESP_OK : ret;
+}
+
+esp_err_t verifyImage(const avr_protocol_t *protocol, avr_image_source_t *image)
+{
+    uint32_t address;
+    const uint8_t *block;
+    esp_err_t ret;
+
+    image->rewind(image);
+    while ((ret = image->nextBlock(image, &address, &block)) == ESP_OK)
+    {
+        if (memcmp(&flash[address], block, BLOCK_SIZE))
+        {
+            return -EVERIFY_FAIL;
+        }
+    }
+    return ret == ESP_ERR_NOT_FOUND ? ESP_OK : ret;
+}
+
+void endSession(const avr_protocol_t *protocol)
+{
+}
+
+int batchRunning(void)
+{
+    return 0;
+}
+
+void imageCacheInvalidate(const char *filepath)
+{
+}
+
+esp_err_t imageSlotStore(const char *filepath)
+{
+    return ESP_OK;
+}
+
+void deltaRecordFlashed(const char *filepath)
+{
+    CHECK(!strcmp(filepath, storedPath));
+    recorded++;
+}
+
+void deltaForgetFlashed(void)
+{
+    forgotten++;
+}
+
+void metricsWatchTask(TaskHandle_t task)
+{
+}
+
+/* Images */
+
+static uint8_t image[IMAGE_SIZE];
+static char hex[4 * IMAGE_SIZE];
+
+static size_t hexText(const uint8_t *data, size_t length)
+{
+    size_t at = 0;
+
+    for (uint32_t address = 0; address < length; address += 16)
+    {
+        const int count = MIN(16, length - address);
+        uint8_t sum = count + (address >> 8) + address;
+        at += sprintf(&hex[at], ":%02X%04X00", count, address);
+        for (int i = 0; i < count; i++)
+        {
+            at += sprintf(&hex[at], "%02X", data[address + i]);
+            sum += data[address + i];
+        }
+        at += sprintf(&hex[at], "%02X\r\n", (uint8_t)-sum);
+    }
+    return at + sprintf(&hex[at], ":00000001FF\r\n");
+}
+
+static void newImage(int seed)
+{
+    srand(seed);
+    for (int i = 0; i < IMAGE_SIZE; i++)
+    {
+        image[i] = rand();
+    }
+    response.body = hex;
+    response.length = hexText(image, IMAGE_SIZE);
+    response.sent = response.length;
+}
+
+static int fileEquals(const char *path, const char *data, size_t length)
+{
+    static char buf[sizeof(hex)];
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return 0;
+    }
+    const size_t count = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return count == length && !memcmp(buf, data, length);
+}
+
+// Let the pull task run the poll scripted in response, returns once it is all done
+static void poll(void)
+{
+    xSemaphoreGive(pollGo);
+    xSemaphoreTake(pollReady, portMAX_DELAY);
+}
+
+// Hash recorded for the stored copy
+static uint64_t storedHash(void)
+{
+    file_meta_t meta;
+
+    return fileMetaGet(storedPath, &meta) == ESP_OK ? meta.hash : 0;
+}
+
+static void testPolls(void)
+{
+    char path[FILE_META_PATH_MAX];
+    char tmppath[FILE_META_PATH_MAX];
+
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(storedPath, sizeof(storedPath), "%s/%s", dir, CONFIG_PULL_UPDATE_FILE);
+    snprintf(tmppath, sizeof(tmppath), "%s/%s%s", dir, PULL_UPDATE_TEMP_PREFIX, CONFIG_PULL_UPDATE_FILE);
+
+    // Validators left from before a reboot are used for the first poll
+    snprintf(path, sizeof(path), "%s/%s", dir, PULL_UPDATE_STATE);
+    FILE *f = fopen(path, "w");
+    fprintf(f, "\"v0\"\n\n");
+    fclose(f);
+
+    CHECK(fileMetaInit(dir) == ESP_OK);
+    pollReady = xSemaphoreCreateBinary();
+    pollGo = xSemaphoreCreateBinary();
+    CHECK(pullUpdateInit(dir, NULL) == ESP_OK);
+    xSemaphoreTake(pollReady, portMAX_DELAY);
+
+    // A new image, flashed while it downloads and verified from the stored copy
+    response = (typeof(response)){.status = 200, .etag = "\"v1\"", .modified = "Mon, 19 Oct 2026 06:00:00 GMT"};
+    newImage(1);
+    poll();
+    CHECK(!strcmp(request.if_none_match, "\"v0\"") && !request.if_modified_since[0]);
+    CHECK(request.read == response.length && !memcmp(flash, image, IMAGE_SIZE));
+    CHECK(flashWrites == (IMAGE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    CHECK(fileEquals(storedPath, hex, response.length) && access(tmppath, F_OK) != 0);
+    CHECK(storedHash() == fileMetaHash(FILE_META_HASH_INIT, hex, response.length) && recorded == 1);
+    CHECK(fileEquals(path, "\"v1\"\nMon, 19 Oct 2026 06:00:00 GMT\n", 35));
+
+    // Unchanged, costs a 304 and nothing is flashed
+    response = (typeof(response)){.status = 304};
+    poll();
+    CHECK(!strcmp(request.if_none_match, "\"v1\"") &&
+          !strcmp(request.if_modified_since, "Mon, 19 Oct 2026 06:00:00 GMT"));
+    CHECK(request.read == 0 && flashWrites == 7);
+
+    // Server trouble, the same
+    response = (typeof(response)){.status = 500};
+    poll();
+    response = (typeof(response)){.status = 0};
+    poll();
+    CHECK(flashWrites == 7 && recorded == 1 && forgotten == 0);
+
+    // The connection drops halfway: the last known good copy stays, and is asked for again
+    response = (typeof(response)){.status = 200, .etag = "\"v2\""};
+    newImage(2);
+    response.sent = response.length / 2;
+    poll();
+    CHECK(forgotten == 1 && recorded == 1 && access(tmppath, F_OK) != 0);
+    CHECK(fileEquals(path, "\"v1\"\nMon, 19 Oct 2026 06:00:00 GMT\n", 35));
+    CHECK(storedHash() != fileMetaHash(FILE_META_HASH_INIT, hex, response.length));
+
+    // And comes in whole on the next poll
+    response.sent = response.length;
+    poll();
+    CHECK(!strcmp(request.if_none_match, "\"v1\""));
+    CHECK(!memcmp(flash, image, IMAGE_SIZE) && fileEquals(storedPath, hex, response.length) && recorded == 2);
+    CHECK(storedHash() == fileMetaHash(FILE_META_HASH_INIT, hex, response.length));
+    CHECK(fileEquals(path, "\"v2\"\n\n", 6));
+}
+
+int main(void)
+{
+    char command[64];
+
+    testPolls();
+
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    system(command);
+    return hostTestDone("pull_update");
+}
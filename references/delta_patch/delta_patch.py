@@ -0,0 +1,105 @@
+# Make a patch for POST /patch/<name>.bin, turning the image last flashed
+# into a new one. Either image can be a .hex or a flat .bin (from address 0).
+#
+#   python delta_patch.py old.hex new.hex new.patch
+#   curl --data-binary @new.patch http://192.168.43.82/patch/new.bin
+
+import struct
+import sys
+
+BLOCK_SIZE = 256
+MAGIC = 0x44525641  # "AVRD"
+VERSION = 1
+
+# Shortest run of base bytes worth a copy op, anything shorter is inserted
+MATCH_MIN = 16
+
+
+def fnv1a64(data):
+	h = 0xcbf29ce484222325
+	for b in data:
+		h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+	return h
+
+
+def read_hex(path):
+	image = {}
+	base = 0
+	with open(path, "r") as fp:
+		for line in fp.read().splitlines():
+			if not line.startswith(":"):
+				continue
+			record = bytes.fromhex(line[1:])
+			length, addr, rtype = record[0], (record[1] << 8) | record[2], record[3]
+			data = record[4:4 + length]
+			if rtype == 0:
+				for i, b in enumerate(data):
+					image[base + addr + i] = b
+			elif rtype == 2:
+				base = ((data[0] << 8) | data[1]) << 4
+			elif rtype == 4:
+				base = ((data[0] << 8) | data[1]) << 16
+			elif rtype == 1:
+				break
+	return image
+
+
+def flatten(path):
+	"""Flash content from 0 up to the end of the last block with data, gaps as 0xFF"""
+	if path.lower().endswith(".hex"):
+		image = read_hex(path)
+		end = max(image) + 1 if image else 0
+		flat = bytearray(b"\xff" * end)
+		for addr, b in image.items():
+			flat[addr] = b
+	else:
+		flat = bytearray(open(path, "rb").read())
+	pad = -len(flat) % BLOCK_SIZE
+	return bytes(flat + b"\xff" * pad)
+
+
+def diff(old, new):
+	"""Greedy copy/insert ops, longest base match at each position"""
+	index = {}
+	for i in range(len(old) - MATCH_MIN + 1):
+		index.setdefault(old[i:i + MATCH_MIN], []).append(i)
+
+	ops, pending, pos = [], bytearray(), 0
+	while pos < len(new):
+		best_off, best_len = 0, 0
+		for off in index.get(new[pos:pos + MATCH_MIN], [])[:64]:
+			n = MATCH_MIN
+			while pos + n < len(new) and off + n < len(old) and new[pos + n] == old[off + n]:
+				n += 1
+			if n > best_len:
+				best_off, best_len = off, n
+		if best_len:
+			if pending:
+				ops.append(b"I" + struct.pack("<I", len(pending)) + bytes(pending))
+				pending = bytearray()
+			ops.append(b"C" + struct.pack("<II", best_off, best_len))
+			pos += best_len
+		else:
+			pending.append(new[pos])
+			pos += 1
+	if pending:
+		ops.append(b"I" + struct.pack("<I", len(pending)) + bytes(pending))
+	return b"".join(ops)
+
+
+def main():
+	if len(sys.argv) != 4:
+		print("usage: delta_patch.py <flashed image> <new image> <patch>")
+		sys.exit(1)
+
+	old, new = flatten(sys.argv[1]), flatten(sys.argv[2])
+	header = struct.pack("<IHHIQIQ", MAGIC, VERSION, 0, len(old), fnv1a64(old), len(new), fnv1a64(new))
+	patch = header + diff(old, new)
+
+	with open(sys.argv[3], "wb") as fp:
+		fp.write(patch)
+	print("%d byte image, %d byte patch" % (len(new), len(patch)))
+
+
+if __name__ == "__main__":
+	main()